@@ -0,0 +1,89 @@
+/*
+ * CPU cost of the voltage fluctuation index in main/flicker.c.
+ *
+ *   flicker_bench [-n samples]
+ *
+ * Feeds a synthetic 230 V signal with a slow drift, noise at the meter's
+ * 0.1 V resolution and a periodic 2 V load step through flicker_add_sample(),
+ * reading the index after each sample like the aggregator does. Reports the
+ * time per sample for both calls, which must not grow with
+ * CONFIG_FLICKER_WINDOW_SAMPLES, and checks the running sums against a direct
+ * computation over the last window.
+ */
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "flicker.h"
+#include "esp_timer.h"
+
+static float signalAt(int i)
+{
+    const float drift = 3.0f * sinf(i * 1e-4f);
+    const float step = (i / 25) % 2 ? 2.0f : 0.0f;    // A load switching every 5 s at 200 ms
+    const float noise = (float)(rand() % 5 - 2) * 0.1f;
+
+    return roundf((230.0f + drift + step + noise) * 10.0f) / 10.0f;
+}
+
+int main(int argc, char **argv)
+{
+    static float history[FLICKER_WINDOW_SAMPLES + 1];
+    int samples = 10000000;
+    int opt;
+    flicker_index_t index = { 0 };
+    double sink = 0;
+
+    while ((opt = getopt(argc, argv, "n:")) != -1) {
+        if (opt == 'n' && atoi(optarg) > FLICKER_WINDOW_SAMPLES) {
+            samples = atoi(optarg);
+        } else {
+            fprintf(stderr, "usage: %s [-n samples > %d]\n", argv[0], FLICKER_WINDOW_SAMPLES);
+            return 1;
+        }
+    }
+
+    // Generate the input first, so only the estimator is timed
+    float *input = malloc(sizeof(float) * samples);
+    if (input == NULL) {
+        return 1;
+    }
+    srand(1);
+    for (int i = 0; i < samples; i++) {
+        input[i] = signalAt(i);
+    }
+
+    const int64_t start = esp_timer_get_time();
+    for (int i = 0; i < samples; i++) {
+        flicker_add_sample(input[i]);
+        if (flicker_get_index(&index)) {
+            sink += index.sdPct;
+        }
+    }
+    const int64_t elapsed = esp_timer_get_time() - start;
+
+    // Reference over the last window: two-pass mean and variance, in double
+    double mean = 0, var = 0, stepSq = 0;
+    for (int i = 0; i <= FLICKER_WINDOW_SAMPLES; i++) {
+        history[i] = input[samples - FLICKER_WINDOW_SAMPLES - 1 + i];
+    }
+    for (int i = 1; i <= FLICKER_WINDOW_SAMPLES; i++) {
+        mean += history[i];
+        stepSq += (history[i] - history[i - 1]) * (history[i] - history[i - 1]);
+    }
+    mean /= FLICKER_WINDOW_SAMPLES;
+    for (int i = 1; i <= FLICKER_WINDOW_SAMPLES; i++) {
+        var += (history[i] - mean) * (history[i] - mean);
+    }
+    var /= FLICKER_WINDOW_SAMPLES;
+
+    printf("window         %d samples\n", FLICKER_WINDOW_SAMPLES);
+    printf("cost           %.1f ns per sample (add + index), %d samples in %.1f ms\n",
+           elapsed * 1000.0 / samples, samples, elapsed / 1000.0);
+    printf("index          mean %.2f V, sd %.4f %%, dv %.4f %%\n", index.meanV, index.sdPct, index.dvPct);
+    printf("reference      mean %.2f V, sd %.4f %%, dv %.4f %%\n", mean,
+           100.0 * sqrt(var) / mean, 100.0 * sqrt(stepSq / FLICKER_WINDOW_SAMPLES) / mean);
+    free(input);
+    return sink < 0;    // Keeps the index calls from being optimised out
+}
@@ -0,0 +1,186 @@
+/*
+ * OTA signature verification with libraries/corePKCS11/port/iot_crypto.c on
+ * the software mbedTLS path, the one the device falls back to while another
+ * context holds the SHA or RSA engine.
+ *
+ *   iot_crypto_bench [-n runs] cert.pem key.pem [image.bin]
+ *
+ * Signs the SHA-256 of the image, 1 MiB of pseudo random bytes without one,
+ * with the key, then hashes it through CRYPTO_SignatureVerificationUpdate()
+ * in 1 KiB file blocks as the OTA PAL does and verifies the signature against
+ * the certificate, first parsing the certificate for every verification as
+ * before CRYPTO_Init() sets up the cache, then with it cached. A tampered
+ * signature must fail both ways. A P-256 code signing pair to try it with:
+ *
+ *   openssl req -x509 -newkey ec -pkeyopt ec_paramgen_curve:P-256 -nodes \
+ *       -keyout key.pem -out cert.pem -days 365 -subj /CN=ota
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "mbedtls/ctr_drbg.h"
+#include "mbedtls/entropy.h"
+#include "mbedtls/pk.h"
+#include "mbedtls/sha256.h"
+#include "mbedtls/x509_crt.h"
+
+#include "iot_crypto.h"
+#include "esp_timer.h"
+
+#define BLOCK_SIZE          1024
+#define SYNTHETIC_SIZE      (1024 * 1024)
+
+typedef struct {
+    int64_t finalUs;            // Finishing the hash and verifying, summed
+    int failed;                 // Good signatures rejected
+    int accepted;               // Tampered signatures accepted
+} verify_totals_t;
+
+/* The file with a zero after it, PEM is parsed with its terminator. */
+static int readFile(const char *path, uint8_t **data, size_t *length)
+{
+    FILE *f = fopen(path, "rb");
+
+    if (f == NULL || fseek(f, 0, SEEK_END) != 0) {
+        perror(path);
+        return -1;
+    }
+    *length = ftell(f);
+    rewind(f);
+    *data = malloc(*length + 1);
+    if (*data == NULL || fread(*data, 1, *length, f) != *length) {
+        perror(path);
+        fclose(f);
+        return -1;
+    }
+    (*data)[*length] = '\0';
+    fclose(f);
+    return 0;
+}
+
+/* Hash the image in file blocks and time what is left for the PAL's close. */
+static void verifyOnce(const uint8_t *image, size_t length, uint8_t *cert, size_t certLength, uint8_t *sig,
+                       size_t sigLength, int expect, verify_totals_t *totals)
+{
+    void *ctx;
+
+    if (CRYPTO_SignatureVerificationStart(&ctx, cryptoASYMMETRIC_ALGORITHM_ECDSA,
+                                          cryptoHASH_ALGORITHM_SHA256) == pdFALSE) {
+        totals->failed++;
+        return;
+    }
+    for (size_t pos = 0; pos < length; pos += BLOCK_SIZE)
+        CRYPTO_SignatureVerificationUpdate(ctx, image + pos, length - pos < BLOCK_SIZE ? length - pos : BLOCK_SIZE);
+
+    const int64_t start = esp_timer_get_time();
+    const BaseType_t ok = CRYPTO_SignatureVerificationFinal(ctx, (char *)cert, certLength, sig, sigLength);
+    totals->finalUs += esp_timer_get_time() - start;
+
+    if (expect && ok != pdTRUE)
+        totals->failed++;
+    if (!expect && ok != pdFALSE)
+        totals->accepted++;
+}
+
+static void verifyRuns(const char *label, int runs, const uint8_t *image, size_t length, uint8_t *cert,
+                       size_t certLength, uint8_t *sig, size_t sigLength, int *failed)
+{
+    verify_totals_t totals = { 0 };
+
+    for (int i = 0; i < runs; i++)
+        verifyOnce(image, length, cert, certLength, sig, sigLength, 1, &totals);
+    const int64_t goodUs = totals.finalUs;
+
+    sig[sigLength / 2] ^= 0x01;
+    verifyOnce(image, length, cert, certLength, sig, sigLength, 0, &totals);
+    sig[sigLength / 2] ^= 0x01;
+
+    printf("verify, %s: %.2f ms, %s\n", label, goodUs / 1000.0 / runs,
+           totals.failed ? "good signature rejected" : totals.accepted ? "bad signature accepted" : "ok");
+    *failed |= totals.failed || totals.accepted;
+}
+
+int main(int argc, char **argv)
+{
+    mbedtls_entropy_context entropy;
+    mbedtls_ctr_drbg_context drbg;
+    mbedtls_pk_context key;
+    uint8_t *cert, *keyPem, *image, hash[32], sig[MBEDTLS_PK_SIGNATURE_MAX_SIZE];
+    size_t certLength, keyLength, length, sigLength;
+    int runs = 20, opt, failed = 0;
+
+    while ((opt = getopt(argc, argv, "n:")) != -1) {
+        if (opt == 'n') {
+            runs = atoi(optarg);
+        } else {
+            optind = argc + 1;
+            break;
+        }
+    }
+    if (argc - optind < 2 || argc - optind > 3 || runs < 1) {
+        fprintf(stderr, "usage: %s [-n runs] cert.pem key.pem [image.bin]\n", argv[0]);
+        return 1;
+    }
+    if (readFile(argv[optind], &cert, &certLength) != 0 || readFile(argv[optind + 1], &keyPem, &keyLength) != 0)
+        return 1;
+    if (optind + 2 < argc) {
+        if (readFile(argv[optind + 2], &image, &length) != 0)
+            return 1;
+    } else {
+        length = SYNTHETIC_SIZE;
+        image = malloc(length);
+        srand(1);
+        for (size_t i = 0; i < length; i++)
+            image[i] = rand();
+    }
+
+    mbedtls_entropy_init(&entropy);
+    mbedtls_ctr_drbg_init(&drbg);
+    mbedtls_pk_init(&key);
+    if (mbedtls_ctr_drbg_seed(&drbg, mbedtls_entropy_func, &entropy, NULL, 0) != 0 ||
+        mbedtls_pk_parse_key(&key, keyPem, keyLength + 1, NULL, 0) != 0) {
+        fprintf(stderr, "%s: cannot parse the key\n", argv[optind + 1]);
+        return 1;
+    }
+    mbedtls_sha256_ret(image, length, hash, 0);
+    if (mbedtls_pk_sign(&key, MBEDTLS_MD_SHA256, hash, sizeof(hash), sig, &sigLength,
+                        mbedtls_ctr_drbg_random, &drbg) != 0) {
+        fprintf(stderr, "signing failed\n");
+        return 1;
+    }
+
+    /* The certificate on its own, what the cache saves per verification. */
+    mbedtls_x509_crt crt;
+    int64_t start = esp_timer_get_time();
+    for (int i = 0; i < runs; i++) {
+        mbedtls_x509_crt_init(&crt);
+        failed |= mbedtls_x509_crt_parse(&crt, cert, certLength + 1) != 0;
+        mbedtls_x509_crt_free(&crt);
+    }
+    printf("certificate parse: %.2f ms\n", (esp_timer_get_time() - start) / 1000.0 / runs);
+
+    start = esp_timer_get_time();
+    void *ctx;
+    CRYPTO_SignatureVerificationStart(&ctx, cryptoASYMMETRIC_ALGORITHM_ECDSA, cryptoHASH_ALGORITHM_SHA256);
+    for (size_t pos = 0; pos < length; pos += BLOCK_SIZE)
+        CRYPTO_SignatureVerificationUpdate(ctx, image + pos, length - pos < BLOCK_SIZE ? length - pos : BLOCK_SIZE);
+    CRYPTO_SignatureVerificationFinal(ctx, NULL, 0, NULL, 0);
+    const int64_t hashUs = esp_timer_get_time() - start;
+    printf("hash: %zu bytes in %d byte updates, %.1f MB/s\n", length, BLOCK_SIZE,
+           hashUs > 0 ? length / (double)hashUs : 0);
+
+    verifyRuns("parsing the certificate each time", runs, image, length, cert, certLength + 1, sig, sigLength,
+               &failed);
+    CRYPTO_Init();
+    verifyRuns("certificate cached", runs, image, length, cert, certLength + 1, sig, sigLength, &failed);
+
+    mbedtls_pk_free(&key);
+    mbedtls_ctr_drbg_free(&drbg);
+    mbedtls_entropy_free(&entropy);
+    free(cert);
+    free(keyPem);
+    free(image);
+    return failed;
+}
@@ -0,0 +1,186 @@
+/*
+ * How many file blocks of one OTA request the agent takes in without
+ * dropping any, for sizing CONFIG_MAX_NUM_BLOCKS_REQUEST against
+ * CONFIG_MAX_NUM_OTA_DATA_BUFFERS.
+ *
+ *   ota_buffer_bench [-b buffers] [-l link KiB/s] [-a agent us] [-w write us]
+ *                    [-e erase us] [-k rate KiB/s] [-r requests] [-n blocks]
+ *
+ * The OTA library is not part of the host build, so this steps a model of
+ * the hand-off in 10 us ticks instead of running it: blocks arrive at the
+ * link rate and take one of the agent's data buffers, as
+ * ota_agent_handle_publish() does, or are dropped when none is free. The
+ * agent decodes one block at a time (-a) and copies it into the PAL's two
+ * 4 KiB write buffers, waiting when both are with the writer task. The
+ * writer programs a buffer (-w), erasing its sector first (-e) unless it got
+ * there while idle, up to 4 sectors ahead as ota_pal.c does. Requests follow
+ * each other as fast as the rate limit (-k) lets them. Prints the blocks
+ * dropped per request for requests of 4 to 32 blocks, or of -n only.
+ */
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#define TICK_US             10
+#define BLOCK_BYTES         1024
+#define BLOCKS_PER_BUFFER   4       // otapalconfigWRITE_BUFFER_SIZE / block
+#define WRITE_BUFFERS       2       // WRITE_BUFFER_COUNT in ota_pal.c
+#define ERASE_AHEAD         4       // otapalconfigERASE_AHEAD_SECTORS
+#define REQUEST_GAP_US      50000   // Request to first block, at the least
+
+typedef struct {
+    int buffers;
+    int linkKiBs;
+    int agentUs;
+    int writeUs;
+    int eraseUs;
+    int rateKiBs;
+    int requests;
+} model_t;
+
+typedef struct {
+    int64_t t;
+    int dropped;
+    // Agent data buffers holding blocks not processed yet
+    int queued;
+    // Agent: busy decoding a block until agentUntil, or blocked on the PAL
+    bool agentBusy;
+    bool agentBlocked;
+    int64_t agentUntil;
+    // PAL: blocks in the buffer being filled, buffers queued for or with the writer
+    bool haveFill;
+    int fillBlocks;
+    int freeBuffers;
+    int fullBuffers;
+    // Writer: writing or erasing until writerUntil; sectors erased ahead of the blocks
+    bool writing;
+    bool erasing;
+    int64_t writerUntil;
+    int erasedAhead;
+} sim_t;
+
+static void stepWriter(const model_t *m, sim_t *s)
+{
+    if ((s->writing || s->erasing) && s->t < s->writerUntil) {
+        return;
+    }
+    if (s->writing) {
+        s->writing = false;
+        s->freeBuffers++;
+    }
+    if (s->erasing) {
+        s->erasing = false;
+        s->erasedAhead++;
+    }
+    if (s->fullBuffers > 0) {
+        s->fullBuffers--;
+        s->writing = true;
+        s->writerUntil = s->t + m->writeUs + (s->erasedAhead > 0 ? 0 : m->eraseUs);
+        if (s->erasedAhead > 0) {
+            s->erasedAhead--;
+        }
+    } else if (s->erasedAhead < ERASE_AHEAD) {
+        s->erasing = true;
+        s->writerUntil = s->t + m->eraseUs;
+    }
+}
+
+static void stepAgent(const model_t *m, sim_t *s)
+{
+    if (s->agentBusy && s->t >= s->agentUntil) {
+        s->agentBusy = false;
+        s->agentBlocked = true;
+    }
+    if (s->agentBlocked) {
+        if (!s->haveFill) {
+            if (s->freeBuffers == 0) {
+                return;     // Both buffers are with the writer
+            }
+            s->freeBuffers--;
+            s->haveFill = true;
+            s->fillBlocks = 0;
+        }
+        if (++s->fillBlocks == BLOCKS_PER_BUFFER) {
+            s->haveFill = false;
+            s->fullBuffers++;
+        }
+        s->agentBlocked = false;
+        s->queued--;        // The block's data buffer goes back
+    }
+    if (!s->agentBusy && s->queued > 0) {
+        s->agentBusy = true;
+        s->agentUntil = s->t + m->agentUs;
+    }
+}
+
+/* Dropped blocks over all requests of n blocks each. */
+static int run(const model_t *m, int n)
+{
+    sim_t s = { .freeBuffers = WRITE_BUFFERS, .erasedAhead = ERASE_AHEAD };
+    const int64_t blockUs = (int64_t)BLOCK_BYTES * 1000000 / (m->linkKiBs * 1024);
+    int64_t rateUs = m->rateKiBs > 0 ? (int64_t)n * 1000000 / m->rateKiBs : 0;
+
+    if (rateUs < REQUEST_GAP_US) {
+        rateUs = REQUEST_GAP_US;
+    }
+    for (int r = 0; r < m->requests; r++) {
+        const int64_t start = s.t + REQUEST_GAP_US;
+        const int64_t next = s.t + rateUs;
+        int arrived = 0;
+
+        while (arrived < n || s.queued > 0 || s.t < next) {
+            while (arrived < n && s.t >= start + arrived * blockUs) {
+                if (s.queued < m->buffers) {
+                    s.queued++;
+                } else {
+                    s.dropped++;
+                }
+                arrived++;
+            }
+            stepWriter(m, &s);
+            stepAgent(m, &s);
+            s.t += TICK_US;
+        }
+    }
+    return s.dropped;
+}
+
+int main(int argc, char **argv)
+{
+    model_t m = {
+        .buffers = 4, .linkKiBs = 200, .agentUs = 500, .writeUs = 12000, .eraseUs = 45000,
+        .rateKiBs = 16, .requests = 20,
+    };
+    int only = 0, opt;
+
+    while ((opt = getopt(argc, argv, "b:l:a:w:e:k:r:n:")) != -1) {
+        switch (opt) {
+        case 'b': m.buffers = atoi(optarg); break;
+        case 'l': m.linkKiBs = atoi(optarg); break;
+        case 'a': m.agentUs = atoi(optarg); break;
+        case 'w': m.writeUs = atoi(optarg); break;
+        case 'e': m.eraseUs = atoi(optarg); break;
+        case 'k': m.rateKiBs = atoi(optarg); break;
+        case 'r': m.requests = atoi(optarg); break;
+        case 'n': only = atoi(optarg); break;
+        default:
+            fprintf(stderr, "usage: %s [-b buffers] [-l link KiB/s] [-a agent us] [-w write us] "
+                    "[-e erase us] [-k rate KiB/s] [-r requests] [-n blocks]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (m.buffers < 1 || m.linkKiBs < 1 || m.requests < 1 || m.rateKiBs < 0 || only < 0) {
+        fprintf(stderr, "%s: invalid argument\n", argv[0]);
+        return 1;
+    }
+
+    printf("%d buffers, link %d KiB/s, agent %d us/block, flash %d us/4 KiB + %d us erase, rate %d KiB/s\n",
+           m.buffers, m.linkKiBs, m.agentUs, m.writeUs, m.eraseUs, m.rateKiBs);
+    for (int n = only > 0 ? only : 4; n <= (only > 0 ? only : 32); n += 4) {
+        const int dropped = run(&m, n);
+        printf("%2d blocks per request: %.2f dropped per request\n", n, (double)dropped / m.requests);
+    }
+    return 0;
+}
@@ -0,0 +1,226 @@
+/*
+ * Compression of OTA images for the heatshrink decoder in
+ * libraries/ota-for-aws-iot-embedded-sdk/port/ota_heatshrink.c.
+ *
+ *   ota_compress_bench [-o out.hs] image.bin...
+ *
+ * Compresses each image with a heatshrink compatible encoder using the
+ * device's window and lookahead, which like heatshrink's refers into the
+ * zeros the window starts with, decodes it again with the device's decoder
+ * fed in 1 KiB file blocks, and checks the result against the image.
+ * Reports the size saved and the encode and decode speed. With -o the
+ * compressed image, ready for an OTA job with the compressed file type, is
+ * written out; there must be one image then.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "ota_heatshrink.h"
+#include "esp_timer.h"
+
+#define BLOCK_SIZE          1024
+#define MAX_MATCH           (1 << OTA_HEATSHRINK_LOOKAHEAD_BITS)
+#define MAX_CHAIN           128
+
+typedef struct {
+    uint8_t *data;
+    size_t length;
+    uint32_t acc;
+    int bits;
+} bit_writer_t;
+
+static void putBits(bit_writer_t *w, uint32_t value, int count)
+{
+    while (count-- > 0) {
+        w->acc = (w->acc << 1) | ((value >> count) & 1);
+        if (++w->bits == 8) {
+            w->data[w->length++] = w->acc;
+            w->acc = 0;
+            w->bits = 0;
+        }
+    }
+}
+
+/* Greedy LZSS over hash chains of two byte prefixes; a back reference of two
+ * bytes already beats two literals. Like heatshrink's encoder, the window
+ * starts out as zeros that references may point into. Returns the compressed
+ * length. */
+static size_t compress(const uint8_t *image, size_t imageLength, uint8_t *out)
+{
+    const size_t length = OTA_HEATSHRINK_WINDOW_SIZE + imageLength;
+    uint8_t *in = calloc(length, 1);
+    int32_t *head = malloc(sizeof(int32_t) * 65536);
+    int32_t *prev = malloc(sizeof(int32_t) * (length + 1));
+    bit_writer_t w = { .data = out };
+
+    memcpy(in + OTA_HEATSHRINK_WINDOW_SIZE, image, imageLength);
+    memset(head, 0xFF, sizeof(int32_t) * 65536);
+    for (size_t pos = 0; pos + 1 < OTA_HEATSHRINK_WINDOW_SIZE; pos++) {
+        prev[pos] = head[0];
+        head[0] = pos;
+    }
+    for (size_t pos = OTA_HEATSHRINK_WINDOW_SIZE; pos < length;) {
+        size_t best = 0, distance = 0;
+
+        if (pos + 1 < length) {
+            int chain = 0;
+
+            for (int32_t cand = head[in[pos] << 8 | in[pos + 1]];
+                 cand >= 0 && pos - cand <= OTA_HEATSHRINK_WINDOW_SIZE && chain < MAX_CHAIN;
+                 cand = prev[cand], chain++) {
+                size_t n = 0;
+
+                while (n < MAX_MATCH && pos + n < length && in[cand + n] == in[pos + n])
+                    n++;
+                if (n > best) {
+                    best = n;
+                    distance = pos - cand;
+                    if (n == MAX_MATCH)
+                        break;
+                }
+            }
+        }
+        if (best >= 2) {
+            putBits(&w, 0, 1);
+            putBits(&w, distance - 1, OTA_HEATSHRINK_WINDOW_BITS);
+            putBits(&w, best - 1, OTA_HEATSHRINK_LOOKAHEAD_BITS);
+        } else {
+            best = 1;
+            putBits(&w, 1, 1);
+            putBits(&w, in[pos], 8);
+        }
+        for (size_t end = pos + best; pos < end; pos++) {
+            if (pos + 1 < length) {
+                const int h = in[pos] << 8 | in[pos + 1];
+
+                prev[pos] = head[h];
+                head[h] = pos;
+            }
+        }
+    }
+    if (w.bits > 0)
+        w.data[w.length++] = w.acc << (8 - w.bits);
+    free(in);
+    free(head);
+    free(prev);
+    return w.length;
+}
+
+typedef struct {
+    uint8_t *data;
+    size_t capacity;
+    size_t length;
+} output_t;
+
+static int takeDecoded(void *ctx, uint32_t offset, const uint8_t *buf, size_t len)
+{
+    output_t *out = ctx;
+
+    if (offset != out->length || out->length + len > out->capacity)
+        return -1;
+    memcpy(out->data + offset, buf, len);
+    out->length += len;
+    return 0;
+}
+
+static int readImage(const char *path, uint8_t **data, size_t *length)
+{
+    FILE *f = fopen(path, "rb");
+
+    if (f == NULL || fseek(f, 0, SEEK_END) != 0) {
+        perror(path);
+        return -1;
+    }
+    *length = ftell(f);
+    rewind(f);
+    *data = malloc(*length + 1);
+    if (*data == NULL || fread(*data, 1, *length, f) != *length) {
+        perror(path);
+        fclose(f);
+        return -1;
+    }
+    fclose(f);
+    return 0;
+}
+
+static double mbps(size_t bytes, int64_t us)
+{
+    return us > 0 ? bytes / (double)us : 0;
+}
+
+int main(int argc, char **argv)
+{
+    static ota_heatshrink_t decoder;
+    const char *outPath = NULL;
+    size_t totalIn = 0, totalOut = 0;
+    int opt, failed = 0;
+
+    while ((opt = getopt(argc, argv, "o:")) != -1) {
+        if (opt == 'o') {
+            outPath = optarg;
+        } else {
+            optind = argc + 1;
+            break;
+        }
+    }
+    if (optind >= argc || (outPath != NULL && argc - optind != 1)) {
+        fprintf(stderr, "usage: %s [-o out.hs] image.bin...\n", argv[0]);
+        return 1;
+    }
+    printf("window %u bytes, lookahead %u bytes\n", OTA_HEATSHRINK_WINDOW_SIZE, MAX_MATCH);
+
+    for (int i = optind; i < argc; i++) {
+        uint8_t *image, *packed;
+        size_t length;
+
+        if (readImage(argv[i], &image, &length) != 0)
+            return 1;
+        // Worst case 9 bits per byte
+        packed = malloc(length + length / 8 + 2);
+        output_t decoded = { .data = malloc(length + 1), .capacity = length };
+
+        int64_t start = esp_timer_get_time();
+        const size_t packedLength = compress(image, length, packed);
+        const int64_t encodeUs = esp_timer_get_time() - start;
+
+        start = esp_timer_get_time();
+        ota_heatshrink_begin(&decoder, takeDecoded, &decoded);
+        for (size_t pos = 0; pos < packedLength; pos += BLOCK_SIZE) {
+            const size_t n = packedLength - pos < BLOCK_SIZE ? packedLength - pos : BLOCK_SIZE;
+
+            if (ota_heatshrink_feed(&decoder, packed + pos, n) != OTA_HEATSHRINK_OK)
+                break;
+        }
+        const ota_heatshrink_status_t status = ota_heatshrink_end(&decoder);
+        const int64_t decodeUs = esp_timer_get_time() - start;
+
+        const int ok = status == OTA_HEATSHRINK_OK && decoded.length == length &&
+                       memcmp(decoded.data, image, length) == 0;
+        printf("%s: %zu -> %zu bytes, %.1f%% saved, encode %.1f MB/s, decode %.1f MB/s, %s\n", argv[i], length,
+               packedLength, length ? 100.0 * (1.0 - (double)packedLength / length) : 0, mbps(length, encodeUs),
+               mbps(length, decodeUs), ok ? "ok" : ota_heatshrink_strerror(status));
+        failed |= !ok;
+        totalIn += length;
+        totalOut += packedLength;
+
+        if (outPath != NULL) {
+            FILE *f = fopen(outPath, "wb");
+
+            if (f == NULL || fwrite(packed, 1, packedLength, f) != packedLength) {
+                perror(outPath);
+                failed = 1;
+            }
+            if (f != NULL)
+                fclose(f);
+        }
+        free(image);
+        free(packed);
+        free(decoded.data);
+    }
+    if (argc - optind > 1)
+        printf("total: %zu -> %zu bytes, %.1f%% saved\n", totalIn, totalOut,
+               totalIn ? 100.0 * (1.0 - (double)totalOut / totalIn) : 0);
+    return failed;
+}
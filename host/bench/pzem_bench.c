@@ -0,0 +1,130 @@
+/*
+ * Poll-rate and error-recovery benchmark for the PZEM driver in main/pzem.c,
+ * run against host/sim/pzem_sim (or a real meter on a USB serial adapter).
+ *
+ *   pzem_bench [-t seconds] [-p period_ms] [-a addr]...
+ *
+ * First checks the write paths once (setPowerAlarm, resetEnergy and, with a
+ * single meter, setAddress), then polls readValues() for the given time,
+ * round robin over the addresses, back to back or every period_ms like the
+ * sampler does. Reports the achieved poll
+ * rate, the poll time of good reads, and for every run of failed polls how
+ * long it took from the first failed request to the next good reading.
+ * The port is taken from HOST_UART1 like in the firmware.
+ */
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "pzem.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#define BENCH_MAX_SLAVES    8
+
+typedef struct {
+    uint32_t polls;
+    uint32_t good;
+    uint32_t failed;
+    int64_t goodTimeUs;
+    int64_t minGoodUs;          // Near zero means a stale reply was waiting in the buffer
+    int64_t maxPollUs;
+    uint32_t episodes;          // Runs of consecutive failures that ended
+    int64_t recoveryTotalUs;
+    int64_t recoveryMaxUs;
+} bench_stats_t;
+
+static const char *okText(bool ok)
+{
+    return ok ? "ok" : "FAILED";
+}
+
+int main(int argc, char **argv)
+{
+    uart_data_t uart = { .uart_port = UART_NUM_1, .tx_io_num = 4, .rx_io_num = 5 };
+    uint8_t addrs[BENCH_MAX_SLAVES];
+    int addrCount = 0;
+    int seconds = 10;
+    int periodMs = 0;
+    bench_stats_t stats = { 0 };
+    int64_t failStart = -1;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "t:p:a:")) != -1) {
+        switch (opt) {
+        case 't':
+            seconds = atoi(optarg);
+            break;
+        case 'p':
+            periodMs = atoi(optarg);
+            break;
+        case 'a':
+            if (addrCount < BENCH_MAX_SLAVES)
+                addrs[addrCount++] = strtoul(optarg, NULL, 0);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-t seconds] [-p period_ms] [-a addr]...\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (addrCount == 0)
+        addrs[addrCount++] = PZEM_DEFAULT_ADDR;
+
+    PZEM004Tv30_Init(&uart, addrs[0]);
+    printf("setPowerAlarm  %s\n", okText(setPowerAlarm(2000)));
+    printf("resetEnergy    %s\n", okText(resetEnergy()));
+    if (addrCount == 1 && addrs[0] != PZEM_DEFAULT_ADDR) {
+        init(PZEM_DEFAULT_ADDR);
+        printf("setAddress     %s\n", okText(setAddress(addrs[0])));
+    }
+
+    const int64_t end = esp_timer_get_time() + (int64_t)seconds * 1000000;
+    TickType_t wake = xTaskGetTickCount();
+    for (int i = 0; esp_timer_get_time() < end; i = (i + 1) % addrCount) {
+        if (periodMs > 0)
+            vTaskDelayUntil(&wake, pdMS_TO_TICKS(periodMs));
+        const int64_t start = esp_timer_get_time();
+
+        init(addrs[i]);
+        const bool ok = readValues();
+        const int64_t now = esp_timer_get_time();
+
+        stats.polls++;
+        if (now - start > stats.maxPollUs)
+            stats.maxPollUs = now - start;
+        if (!ok) {
+            stats.failed++;
+            if (failStart < 0)
+                failStart = start;
+            continue;
+        }
+        stats.good++;
+        stats.goodTimeUs += now - start;
+        if (stats.good == 1 || now - start < stats.minGoodUs)
+            stats.minGoodUs = now - start;
+        if (failStart >= 0) {
+            const int64_t recovery = now - failStart;
+
+            stats.episodes++;
+            stats.recoveryTotalUs += recovery;
+            if (recovery > stats.recoveryMaxUs)
+                stats.recoveryMaxUs = recovery;
+            failStart = -1;
+        }
+    }
+
+    printf("polls          %u in %d s (%.1f/s), %u good (%.1f/s), %u failed (%.2f%%)\n",
+           stats.polls, seconds, stats.polls / (double)seconds, stats.good,
+           stats.good / (double)seconds, stats.failed,
+           stats.polls ? 100.0 * stats.failed / stats.polls : 0.0);
+    printf("poll time      good reads mean %.1f ms, min %.1f ms; all polls max %.1f ms\n",
+           stats.good ? stats.goodTimeUs / 1000.0 / stats.good : 0.0, stats.minGoodUs / 1000.0,
+           stats.maxPollUs / 1000.0);
+    printf("recovery       %u episodes, mean %.1f ms, max %.1f ms\n", stats.episodes,
+           stats.episodes ? stats.recoveryTotalUs / 1000.0 / stats.episodes : 0.0,
+           stats.recoveryMaxUs / 1000.0);
+    return stats.good > 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,39 @@
+#ifndef ESP_TLS_H
+#define ESP_TLS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include "esp_err.h"
+
+/* What esp_tls_conn_read() returns when the receive timeout passed without
+ * data, mbedTLS's MBEDTLS_ERR_SSL_WANT_READ on the device. */
+#define ESP_TLS_ERR_SSL_WANT_READ       -0x6900
+
+typedef struct esp_tls esp_tls_t;
+
+/* The members the firmware sets. Certificates and keys are PEM, with the
+ * terminating NUL counted, or DER. */
+typedef struct {
+    const char **alpn_protos;
+    bool use_global_ca_store;
+    const unsigned char *cacert_buf;
+    unsigned int cacert_bytes;
+    const unsigned char *clientcert_buf;
+    unsigned int clientcert_bytes;
+    const unsigned char *clientkey_buf;
+    unsigned int clientkey_bytes;
+    bool use_secure_element;
+    void *ds_data;
+    int timeout_ms;
+    bool skip_common_name;
+} esp_tls_cfg_t;
+
+esp_tls_t *esp_tls_init(void);
+int esp_tls_conn_new_sync(const char *hostname, int hostlen, int port, const esp_tls_cfg_t *cfg, esp_tls_t *tls);
+ssize_t esp_tls_conn_read(esp_tls_t *tls, void *data, size_t datalen);
+ssize_t esp_tls_conn_write(esp_tls_t *tls, const void *data, size_t datalen);
+int esp_tls_conn_destroy(esp_tls_t *tls);
+esp_err_t esp_tls_set_global_ca_store(const unsigned char *cacert_pem_buf, const unsigned int cacert_pem_bytes);
+
+#endif /* ESP_TLS_H */
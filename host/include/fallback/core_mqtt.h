@@ -0,0 +1,10 @@
+/*
+ * Used only when the coreMQTT submodule is not checked out. demo_config.h
+ * needs nothing but the version string from it.
+ */
+#ifndef CORE_MQTT_H
+#define CORE_MQTT_H
+
+#define MQTT_LIBRARY_VERSION    "unavailable"
+
+#endif /* ifndef CORE_MQTT_H */
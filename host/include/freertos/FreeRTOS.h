@@ -0,0 +1,55 @@
+/*
+ * Subset of the FreeRTOS API used by main/, implemented on top of POSIX
+ * threads by host/port/freertos_posix.c. One tick is one millisecond.
+ */
+#ifndef INC_FREERTOS_H
+#define INC_FREERTOS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include "sdkconfig.h"
+#include "esp_attr.h"
+
+typedef uint32_t TickType_t;
+typedef int BaseType_t;
+typedef unsigned int UBaseType_t;
+typedef uint8_t StackType_t;        // Stack sizes are in bytes, like on ESP-IDF
+
+typedef struct { void *pxDummy1; uint32_t ulDummy2[4]; } StaticTask_t;
+typedef struct { void *pvDummy1; uint32_t ulDummy2[4]; } StaticQueue_t;
+typedef StaticQueue_t StaticSemaphore_t;
+
+typedef void (*TaskFunction_t)(void *);
+
+#define pdFALSE                 ((BaseType_t)0)
+#define pdTRUE                  ((BaseType_t)1)
+#define pdFAIL                  pdFALSE
+#define pdPASS                  pdTRUE
+
+#define configTICK_RATE_HZ      1000
+#define configMAX_PRIORITIES    25
+#define portTICK_PERIOD_MS      ((TickType_t)1000 / configTICK_RATE_HZ)
+#define portTICK_RATE_MS        portTICK_PERIOD_MS
+#define portMAX_DELAY           ((TickType_t)0xffffffffUL)
+#define portNUM_PROCESSORS      2
+#define pdMS_TO_TICKS(ms)       ((TickType_t)(ms) * configTICK_RATE_HZ / 1000)
+#define tskNO_AFFINITY          0x7FFFFFFF
+#define tskKERNEL_VERSION_NUMBER "V10.4.3-posix"
+
+/* The FreeRTOS heap is the C heap. */
+#define pvPortMalloc(size)              malloc(size)
+#define vPortFree(ptr)                  free(ptr)
+
+/* Critical sections map to one process wide recursive lock. */
+typedef struct { int unused; } portMUX_TYPE;
+#define portMUX_INITIALIZER_UNLOCKED    { 0 }
+void vHostEnterCritical(void);
+void vHostExitCritical(void);
+#define portENTER_CRITICAL(mux)         ((void)(mux), vHostEnterCritical())
+#define portEXIT_CRITICAL(mux)          ((void)(mux), vHostExitCritical())
+#define portENTER_CRITICAL_ISR(mux)     portENTER_CRITICAL(mux)
+#define portEXIT_CRITICAL_ISR(mux)      portEXIT_CRITICAL(mux)
+
+#endif /* INC_FREERTOS_H */
@@ -0,0 +1,26 @@
+#ifndef QUEUE_H
+#define QUEUE_H
+
+#include "FreeRTOS.h"
+
+typedef struct HostQueue *QueueHandle_t;
+
+QueueHandle_t xQueueCreate(UBaseType_t uxQueueLength, UBaseType_t uxItemSize);
+QueueHandle_t xQueueCreateStatic(UBaseType_t uxQueueLength, UBaseType_t uxItemSize,
+                                 uint8_t *pucQueueStorage, StaticQueue_t *pxQueueBuffer);
+BaseType_t xQueueGenericSend(QueueHandle_t xQueue, const void *pvItemToQueue, TickType_t xTicksToWait,
+                             BaseType_t xToFront, BaseType_t xOverwrite);
+BaseType_t xQueueReceive(QueueHandle_t xQueue, void *pvBuffer, TickType_t xTicksToWait);
+BaseType_t xQueuePeek(QueueHandle_t xQueue, void *pvBuffer, TickType_t xTicksToWait);
+BaseType_t xQueueReset(QueueHandle_t xQueue);
+UBaseType_t uxQueueMessagesWaiting(QueueHandle_t xQueue);
+UBaseType_t uxQueueSpacesAvailable(QueueHandle_t xQueue);
+void vQueueDelete(QueueHandle_t xQueue);
+
+#define xQueueSend(q, item, wait)           xQueueGenericSend(q, item, wait, pdFALSE, pdFALSE)
+#define xQueueSendToBack(q, item, wait)     xQueueGenericSend(q, item, wait, pdFALSE, pdFALSE)
+#define xQueueSendToFront(q, item, wait)    xQueueGenericSend(q, item, wait, pdTRUE, pdFALSE)
+#define xQueueOverwrite(q, item)            xQueueGenericSend(q, item, 0, pdFALSE, pdTRUE)
+#define xQueueSendFromISR(q, item, woken)   xQueueGenericSend(q, item, 0, pdFALSE, pdFALSE)
+
+#endif /* QUEUE_H */
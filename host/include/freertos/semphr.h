@@ -0,0 +1,22 @@
+#ifndef SEMAPHORE_H
+#define SEMAPHORE_H
+
+#include "queue.h"
+
+/* As in FreeRTOS, semaphores are queues of zero sized items. */
+typedef QueueHandle_t SemaphoreHandle_t;
+
+SemaphoreHandle_t xSemaphoreCreateMutex(void);
+SemaphoreHandle_t xSemaphoreCreateMutexStatic(StaticSemaphore_t *pxMutexBuffer);
+SemaphoreHandle_t xSemaphoreCreateBinary(void);
+SemaphoreHandle_t xSemaphoreCreateBinaryStatic(StaticSemaphore_t *pxSemaphoreBuffer);
+SemaphoreHandle_t xSemaphoreCreateCounting(UBaseType_t uxMaxCount, UBaseType_t uxInitialCount);
+SemaphoreHandle_t xSemaphoreCreateCountingStatic(UBaseType_t uxMaxCount, UBaseType_t uxInitialCount,
+                                                StaticSemaphore_t *pxSemaphoreBuffer);
+
+#define xSemaphoreTake(sem, wait)           xQueueReceive(sem, NULL, wait)
+#define xSemaphoreGive(sem)                 xQueueGenericSend(sem, NULL, 0, pdFALSE, pdFALSE)
+#define xSemaphoreGiveFromISR(sem, woken)   xSemaphoreGive(sem)
+#define vSemaphoreDelete(sem)               vQueueDelete(sem)
+
+#endif /* SEMAPHORE_H */
@@ -0,0 +1,9 @@
+#ifndef PROTOCOL_EXAMPLES_COMMON_H
+#define PROTOCOL_EXAMPLES_COMMON_H
+
+#include "esp_err.h"
+
+/* The host is already on the network. */
+esp_err_t example_connect(void);
+
+#endif /* PROTOCOL_EXAMPLES_COMMON_H */
@@ -0,0 +1,46 @@
+/*
+ * Configuration of the host build. Mirrors the defaults of the Kconfig
+ * options used by main/, keep it in sync when adding options.
+ */
+#ifndef SDKCONFIG_H
+#define SDKCONFIG_H
+
+#define CONFIG_IDF_TARGET_LINUX             1
+
+#define CONFIG_MQTT_CLIENT_IDENTIFIER       "ESP32"
+#define CONFIG_MQTT_BROKER_ENDPOINT         "localhost"
+#define CONFIG_MQTT_BROKER_PORT             8883
+#define CONFIG_HARDWARE_PLATFORM_NAME       "Linux"
+#define CONFIG_MQTT_NETWORK_BUFFER_SIZE     1024
+#define CONFIG_STATUS_LOG_PERIOD_S          300
+
+#define CONFIG_PZEM_SAMPLE_PERIOD_MS        1000
+#define CONFIG_AGG_SHORT_WINDOW_S           60
+#define CONFIG_AGG_LONG_WINDOW_S            900
+#define CONFIG_FLICKER_WINDOW_SAMPLES       32
+#define CONFIG_LEDGER_SAVE_INTERVAL_S       900
+#define CONFIG_LEDGER_SAVE_DELTA_WH         100
+#define CONFIG_DISAGG_REPORT_PERIOD_S       900
+
+#define CONFIG_SHED_POWER_CAP_W             0
+#define CONFIG_SHED_HYSTERESIS_W            200
+#define CONFIG_SHED_DEBOUNCE_MS             3000
+#define CONFIG_SHED_RESTORE_DELAY_S         60
+#define CONFIG_SHED_ORDER                   "4321"
+
+/* host/sim/ntp_sim serves time on this unprivileged port */
+#define CONFIG_TIMESYNC_SERVER              "localhost"
+#define CONFIG_TIMESYNC_PORT                12300
+#define CONFIG_TIMESYNC_INTERVAL_S          900
+
+#define CONFIG_SHADOW_COALESCE_MS           200
+
+#define CONFIG_NEXTION_REFRESH_PERIOD_MS    500
+#define CONFIG_NEXTION_BAUD_RATE            115200
+#define CONFIG_TREND_WAVEFORM_ID            1
+#define CONFIG_TREND_WINDOW_POINTS          240
+#define CONFIG_TREND_DECIMATION             5
+#define CONFIG_TREND_POWER_FULL_SCALE_W     2300
+#define CONFIG_TREND_FRAME_BUDGET_BYTES     256
+
+#endif /* SDKCONFIG_H */
@@ -0,0 +1 @@
+/* No UART registers on the host, the driver shim talks to a tty. */
@@ -0,0 +1,18 @@
+/*
+ * Entry point of the host build: run app_main() like the IDF startup task
+ * does, then keep the process alive for the tasks it started.
+ */
+#include <signal.h>
+#include <unistd.h>
+
+void app_main(void);
+
+int main(void)
+{
+    /* A simulator closing its pty must not kill us on the next write. */
+    signal(SIGPIPE, SIG_IGN);
+    app_main();
+    for (;;)
+        pause();
+    return 0;
+}
@@ -0,0 +1,71 @@
+/*
+ * Stand-in for main/credentials.c in the host build with MQTT, which has no
+ * certificates embedded: the root CA and the client certificate and key are
+ * read from the PEM files named by HOST_TLS_CA, HOST_TLS_CERT and
+ * HOST_TLS_KEY. Without a client certificate none is offered, which
+ * mqtt_sim accepts unless it was started with -a.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "esp_log.h"
+#include "network_transport.h"
+#include "credentials.h"
+
+static const char *CRED_TAG = "CREDENTIALS";
+
+static char *caPem = NULL;
+static char *certPem = NULL;
+static char *keyPem = NULL;
+
+/* The whole file as a string, or NULL if the variable is unset or the file unreadable. */
+static char *readPem(const char *variable)
+{
+    const char *path = getenv(variable);
+    FILE *f;
+    char *pem;
+    long len;
+
+    if (path == NULL)
+        return NULL;
+    f = fopen(path, "rb");
+    if (f == NULL || fseek(f, 0, SEEK_END) != 0 || (len = ftell(f)) < 0 || fseek(f, 0, SEEK_SET) != 0 ||
+        (pem = malloc(len + 1)) == NULL) {
+        ESP_LOGE(CRED_TAG, "Cannot read %s=%s", variable, path);
+        if (f != NULL)
+            fclose(f);
+        return NULL;
+    }
+    pem[fread(pem, 1, len, f)] = '\0';
+    fclose(f);
+    return pem;
+}
+
+void credentials_init(void)
+{
+    caPem = readPem("HOST_TLS_CA");
+    certPem = readPem("HOST_TLS_CERT");
+    keyPem = readPem("HOST_TLS_KEY");
+    if (caPem == NULL) {
+        ESP_LOGW(CRED_TAG, "No root CA in HOST_TLS_CA, the broker cannot be verified");
+    }
+    ESP_LOGI(CRED_TAG, "TLS credentials from files: CA %s, client certificate %s",
+             caPem != NULL ? "yes" : "no", certPem != NULL && keyPem != NULL ? "yes" : "no");
+}
+
+void credentials_apply_ca(struct NetworkContext *network)
+{
+    // The transport takes its length, an empty one fails the connection instead
+    network->pcServerRootCAPem = caPem != NULL ? caPem : "";
+    network->useGlobalCaStore = false;
+}
+
+void credentials_apply_client(struct NetworkContext *network)
+{
+    const bool haveClient = certPem != NULL && keyPem != NULL;
+
+    network->pcClientCertPem = haveClient ? certPem : NULL;
+    network->pcClientKeyPem = haveClient ? keyPem : NULL;
+    network->pucClientCertDer = NULL;
+    network->pucClientKeyDer = NULL;
+}
@@ -0,0 +1,178 @@
+/*
+ * esp_timer on the host. Like ESP_TIMER_TASK dispatch on the target, all
+ * callbacks run one after another on a single dispatcher thread. Periodic
+ * timers keep their phase: the next expiry is computed from the previous
+ * deadline, not from when the callback finished.
+ */
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "esp_timer.h"
+
+struct esp_timer {
+    esp_timer_cb_t callback;
+    void *arg;
+    int64_t expiry;
+    uint64_t period;
+    bool armed;
+    struct esp_timer *next;
+};
+
+static pthread_mutex_t timerLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t timerCond;
+static pthread_once_t timerOnce = PTHREAD_ONCE_INIT;
+static struct esp_timer *timers;
+
+static struct timespec startTime;
+static pthread_once_t startOnce = PTHREAD_ONCE_INIT;
+
+static void setStartTime(void)
+{
+    clock_gettime(CLOCK_MONOTONIC, &startTime);
+}
+
+/* Microseconds since the process started, like time since boot. */
+int64_t esp_timer_get_time(void)
+{
+    struct timespec now;
+
+    pthread_once(&startOnce, setStartTime);
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t)(now.tv_sec - startTime.tv_sec) * 1000000 + (now.tv_nsec - startTime.tv_nsec) / 1000;
+}
+
+static struct timespec monotonicAt(int64_t us)
+{
+    struct timespec now;
+    int64_t delta = us - esp_timer_get_time();
+    int64_t ns;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (delta < 0)
+        delta = 0;
+    ns = now.tv_nsec + delta * 1000;
+    now.tv_sec += ns / 1000000000;
+    now.tv_nsec = ns % 1000000000;
+    return now;
+}
+
+static struct esp_timer *earliest(void)
+{
+    struct esp_timer *best = NULL;
+
+    for (struct esp_timer *t = timers; t != NULL; t = t->next)
+        if (t->armed && (best == NULL || t->expiry < best->expiry))
+            best = t;
+    return best;
+}
+
+static void *dispatcher(void *arg)
+{
+    (void)arg;
+    pthread_mutex_lock(&timerLock);
+    for (;;) {
+        struct esp_timer *t = earliest();
+
+        if (t == NULL) {
+            pthread_cond_wait(&timerCond, &timerLock);
+            continue;
+        }
+        if (t->expiry > esp_timer_get_time()) {
+            struct timespec deadline = monotonicAt(t->expiry);
+
+            pthread_cond_timedwait(&timerCond, &timerLock, &deadline);
+            continue;
+        }
+        if (t->period > 0)
+            t->expiry += t->period;
+        else
+            t->armed = false;
+
+        /* Callbacks may start or stop timers, so run them unlocked. */
+        pthread_mutex_unlock(&timerLock);
+        t->callback(t->arg);
+        pthread_mutex_lock(&timerLock);
+    }
+    return NULL;
+}
+
+static void startDispatcher(void)
+{
+    pthread_condattr_t attr;
+    pthread_t thread;
+
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&timerCond, &attr);
+    pthread_condattr_destroy(&attr);
+    pthread_create(&thread, NULL, dispatcher, NULL);
+    pthread_detach(thread);
+}
+
+esp_err_t esp_timer_create(const esp_timer_create_args_t *create_args, esp_timer_handle_t *out_handle)
+{
+    struct esp_timer *t;
+
+    if (create_args == NULL || create_args->callback == NULL || out_handle == NULL)
+        return ESP_ERR_INVALID_ARG;
+    t = calloc(1, sizeof(*t));
+    if (t == NULL)
+        return ESP_ERR_NO_MEM;
+    t->callback = create_args->callback;
+    t->arg = create_args->arg;
+
+    pthread_once(&timerOnce, startDispatcher);
+    pthread_mutex_lock(&timerLock);
+    t->next = timers;
+    timers = t;
+    pthread_mutex_unlock(&timerLock);
+    *out_handle = t;
+    return ESP_OK;
+}
+
+static esp_err_t arm(esp_timer_handle_t timer, uint64_t timeout, uint64_t period)
+{
+    esp_err_t err = ESP_OK;
+
+    pthread_mutex_lock(&timerLock);
+    if (timer->armed) {
+        err = ESP_ERR_INVALID_STATE;
+    } else {
+        timer->expiry = esp_timer_get_time() + (int64_t)timeout;
+        timer->period = period;
+        timer->armed = true;
+        pthread_cond_signal(&timerCond);
+    }
+    pthread_mutex_unlock(&timerLock);
+    return err;
+}
+
+esp_err_t esp_timer_start_periodic(esp_timer_handle_t timer, uint64_t period)
+{
+    if (timer == NULL || period == 0)
+        return ESP_ERR_INVALID_ARG;
+    return arm(timer, period, period);
+}
+
+esp_err_t esp_timer_start_once(esp_timer_handle_t timer, uint64_t timeout_us)
+{
+    if (timer == NULL)
+        return ESP_ERR_INVALID_ARG;
+    return arm(timer, timeout_us, 0);
+}
+
+esp_err_t esp_timer_stop(esp_timer_handle_t timer)
+{
+    esp_err_t err = ESP_OK;
+
+    if (timer == NULL)
+        return ESP_ERR_INVALID_ARG;
+    pthread_mutex_lock(&timerLock);
+    if (!timer->armed)
+        err = ESP_ERR_INVALID_STATE;
+    timer->armed = false;
+    pthread_mutex_unlock(&timerLock);
+    return err;
+}
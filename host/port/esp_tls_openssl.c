@@ -0,0 +1,254 @@
+/*
+ * esp-tls for the host build, on OpenSSL: the blocking client connection
+ * libraries/coreMQTT/port/network_transport.c opens, reads and writes, and
+ * the global CA store main/credentials.c would fill. As on the device, the
+ * configured timeout also bounds every read, which then returns
+ * ESP_TLS_ERR_SSL_WANT_READ.
+ */
+#include <errno.h>
+#include <netdb.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include <openssl/err.h>
+#include <openssl/pem.h>
+#include <openssl/ssl.h>
+#include <openssl/x509.h>
+
+#include "esp_log.h"
+#include "esp_tls.h"
+
+static const char *TAG = "esp-tls";
+
+struct esp_tls {
+    SSL_CTX *ctx;
+    SSL *ssl;
+    int sock;
+};
+
+static X509_STORE *globalCaStore = NULL;
+
+/* PEM when it looks like PEM, DER otherwise. */
+static bool isPem(const unsigned char *buf, unsigned int len)
+{
+    return len > 10 && memcmp(buf, "-----BEGIN", 10) == 0;
+}
+
+/* The certificates of a PEM bundle or the one DER certificate, into store. */
+static bool addCertificates(X509_STORE *store, const unsigned char *buf, unsigned int len)
+{
+    X509 *cert;
+    int added = 0;
+
+    if (!isPem(buf, len)) {
+        const unsigned char *p = buf;
+        cert = d2i_X509(NULL, &p, len);
+        added = cert != NULL && X509_STORE_add_cert(store, cert) == 1;
+        X509_free(cert);
+        return added;
+    }
+    BIO *bio = BIO_new_mem_buf(buf, (int)strnlen((const char *)buf, len));
+    while ((cert = PEM_read_bio_X509(bio, NULL, NULL, NULL)) != NULL) {
+        added += X509_STORE_add_cert(store, cert) == 1;
+        X509_free(cert);
+    }
+    BIO_free(bio);
+    ERR_clear_error();
+    return added > 0;
+}
+
+static bool useClientCredentials(SSL_CTX *ctx, const esp_tls_cfg_t *cfg)
+{
+    X509 *cert = NULL;
+    EVP_PKEY *key = NULL;
+    bool ok;
+
+    if (isPem(cfg->clientcert_buf, cfg->clientcert_bytes)) {
+        BIO *bio = BIO_new_mem_buf(cfg->clientcert_buf, (int)strnlen((const char *)cfg->clientcert_buf,
+                                                                      cfg->clientcert_bytes));
+        cert = PEM_read_bio_X509(bio, NULL, NULL, NULL);
+        BIO_free(bio);
+    } else {
+        const unsigned char *p = cfg->clientcert_buf;
+        cert = d2i_X509(NULL, &p, cfg->clientcert_bytes);
+    }
+    if (isPem(cfg->clientkey_buf, cfg->clientkey_bytes)) {
+        BIO *bio = BIO_new_mem_buf(cfg->clientkey_buf, (int)strnlen((const char *)cfg->clientkey_buf,
+                                                                     cfg->clientkey_bytes));
+        key = PEM_read_bio_PrivateKey(bio, NULL, NULL, NULL);
+        BIO_free(bio);
+    } else {
+        const unsigned char *p = cfg->clientkey_buf;
+        key = d2i_AutoPrivateKey(NULL, &p, cfg->clientkey_bytes);
+    }
+    ok = cert != NULL && key != NULL && SSL_CTX_use_certificate(ctx, cert) == 1 &&
+         SSL_CTX_use_PrivateKey(ctx, key) == 1;
+    X509_free(cert);
+    EVP_PKEY_free(key);
+    return ok;
+}
+
+/* The NULL terminated protocol list in ALPN's wire format. */
+static bool setAlpn(SSL *ssl, const char **protos)
+{
+    unsigned char wire[256];
+    size_t used = 0;
+
+    for (; *protos != NULL; protos++) {
+        const size_t len = strlen(*protos);
+        if (len == 0 || len > 255 || used + 1 + len > sizeof(wire))
+            return false;
+        wire[used++] = (unsigned char)len;
+        memcpy(wire + used, *protos, len);
+        used += len;
+    }
+    return SSL_set_alpn_protos(ssl, wire, used) == 0;
+}
+
+static int connectSocket(const char *host, int port, int timeoutMs)
+{
+    const struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM };
+    struct addrinfo *list, *ai;
+    char service[8];
+    int sock = -1;
+
+    snprintf(service, sizeof(service), "%d", port);
+    if (getaddrinfo(host, service, &hints, &list) != 0) {
+        ESP_LOGE(TAG, "couldn't get hostname for :%s:", host);
+        return -1;
+    }
+    for (ai = list; ai != NULL && sock < 0; ai = ai->ai_next) {
+        sock = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (sock < 0)
+            continue;
+        if (timeoutMs >= 0) {
+            const struct timeval tv = { .tv_sec = timeoutMs / 1000, .tv_usec = (timeoutMs % 1000) * 1000 };
+            setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+            setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+        }
+        if (connect(sock, ai->ai_addr, ai->ai_addrlen) != 0) {
+            close(sock);
+            sock = -1;
+        }
+    }
+    freeaddrinfo(list);
+    if (sock < 0)
+        ESP_LOGE(TAG, "Failed to connect to host (errno %d)", errno);
+    return sock;
+}
+
+esp_tls_t *esp_tls_init(void)
+{
+    esp_tls_t *tls = calloc(1, sizeof(esp_tls_t));
+
+    if (tls != NULL)
+        tls->sock = -1;
+    return tls;
+}
+
+int esp_tls_conn_new_sync(const char *hostname, int hostlen, int port, const esp_tls_cfg_t *cfg, esp_tls_t *tls)
+{
+    char host[256];
+
+    if (tls == NULL || cfg == NULL || hostlen <= 0 || hostlen >= (int)sizeof(host))
+        return -1;
+    memcpy(host, hostname, hostlen);
+    host[hostlen] = '\0';
+
+    tls->ctx = SSL_CTX_new(TLS_client_method());
+    if (tls->ctx == NULL)
+        return -1;
+    SSL_CTX_set_verify(tls->ctx, SSL_VERIFY_PEER, NULL);
+    if (cfg->use_global_ca_store && globalCaStore != NULL) {
+        X509_STORE_up_ref(globalCaStore);
+        SSL_CTX_set_cert_store(tls->ctx, globalCaStore);
+    } else if (cfg->cacert_buf == NULL ||
+               !addCertificates(SSL_CTX_get_cert_store(tls->ctx), cfg->cacert_buf, cfg->cacert_bytes)) {
+        ESP_LOGE(TAG, "No usable CA certificate to verify the server with");
+        return -1;
+    }
+    if (cfg->clientcert_buf != NULL && cfg->clientkey_buf != NULL && !useClientCredentials(tls->ctx, cfg)) {
+        ESP_LOGE(TAG, "Client certificate or key does not parse");
+        return -1;
+    }
+
+    tls->sock = connectSocket(host, port, cfg->timeout_ms);
+    if (tls->sock < 0)
+        return -1;
+    tls->ssl = SSL_new(tls->ctx);
+    SSL_set_fd(tls->ssl, tls->sock);
+    if (!cfg->skip_common_name) {
+        SSL_set_tlsext_host_name(tls->ssl, host);
+        SSL_set1_host(tls->ssl, host);
+    }
+    if (cfg->alpn_protos != NULL && !setAlpn(tls->ssl, cfg->alpn_protos)) {
+        ESP_LOGE(TAG, "Invalid ALPN protocols");
+        return -1;
+    }
+    if (SSL_connect(tls->ssl) != 1) {
+        const long result = SSL_get_verify_result(tls->ssl);
+        ESP_LOGE(TAG, "Failed to open a new connection: %s",
+                 result != X509_V_OK ? X509_verify_cert_error_string(result)
+                                     : ERR_reason_error_string(ERR_peek_last_error()));
+        ERR_clear_error();
+        return -1;
+    }
+    return 1;
+}
+
+ssize_t esp_tls_conn_read(esp_tls_t *tls, void *data, size_t datalen)
+{
+    const int n = SSL_read(tls->ssl, data, (int)datalen);
+
+    if (n > 0)
+        return n;
+    if (SSL_get_error(tls->ssl, n) == SSL_ERROR_WANT_READ) {
+        ERR_clear_error();
+        return ESP_TLS_ERR_SSL_WANT_READ;
+    }
+    ERR_clear_error();
+    return -1;
+}
+
+ssize_t esp_tls_conn_write(esp_tls_t *tls, const void *data, size_t datalen)
+{
+    const int n = SSL_write(tls->ssl, data, (int)datalen);
+
+    if (n > 0)
+        return n;
+    ERR_clear_error();
+    return -1;
+}
+
+int esp_tls_conn_destroy(esp_tls_t *tls)
+{
+    if (tls == NULL)
+        return -1;
+    if (tls->ssl != NULL) {
+        SSL_shutdown(tls->ssl);
+        SSL_free(tls->ssl);
+    }
+    SSL_CTX_free(tls->ctx);
+    if (tls->sock >= 0)
+        close(tls->sock);
+    free(tls);
+    return 0;
+}
+
+esp_err_t esp_tls_set_global_ca_store(const unsigned char *cacert_pem_buf, const unsigned int cacert_pem_bytes)
+{
+    X509_STORE *store = X509_STORE_new();
+
+    if (store == NULL)
+        return ESP_ERR_NO_MEM;
+    if (!addCertificates(store, cacert_pem_buf, cacert_pem_bytes)) {
+        X509_STORE_free(store);
+        return ESP_FAIL;
+    }
+    X509_STORE_free(globalCaStore);
+    globalCaStore = store;
+    return ESP_OK;
+}
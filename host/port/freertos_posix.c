@@ -0,0 +1,554 @@
+/*
+ * FreeRTOS task, queue and semaphore API on top of POSIX threads.
+ *
+ * Only what main/ needs is provided. Priorities and core affinity are
+ * recorded but not enforced, the host scheduler decides who runs. Every
+ * task is a detached pthread with its own notification value; threads not
+ * created through this API (the process main thread, esp_timer's thread)
+ * get a task record on first use.
+ */
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sched.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+
+#define HOST_TASK_NAME_LEN 16
+
+struct HostTask {
+    char name[HOST_TASK_NAME_LEN];
+    TaskFunction_t entry;
+    void *arg;
+    uint32_t stackSize;
+    UBaseType_t priority;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    uint32_t notifyValue;
+    bool notifyPending;
+};
+
+struct HostQueue {
+    pthread_mutex_t lock;
+    pthread_cond_t notEmpty;
+    pthread_cond_t notFull;
+    UBaseType_t length;
+    UBaseType_t itemSize;
+    UBaseType_t count;
+    UBaseType_t head;
+    uint8_t *storage;
+    bool isMutex;
+};
+
+static pthread_key_t taskKey;
+static pthread_once_t taskKeyOnce = PTHREAD_ONCE_INIT;
+static pthread_mutex_t criticalLock;
+static pthread_once_t criticalOnce = PTHREAD_ONCE_INIT;
+static struct timespec startTime;
+
+static void makeTaskKey(void)
+{
+    pthread_key_create(&taskKey, NULL);
+    clock_gettime(CLOCK_MONOTONIC, &startTime);
+}
+
+static void makeCriticalLock(void)
+{
+    pthread_mutexattr_t attr;
+
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&criticalLock, &attr);
+    pthread_mutexattr_destroy(&attr);
+}
+
+void vHostEnterCritical(void)
+{
+    pthread_once(&criticalOnce, makeCriticalLock);
+    pthread_mutex_lock(&criticalLock);
+}
+
+void vHostExitCritical(void)
+{
+    pthread_mutex_unlock(&criticalLock);
+}
+
+/* Condition variables wait on CLOCK_MONOTONIC so wall clock steps do not
+ * stretch or cut timeouts. */
+static void initCond(pthread_cond_t *cond)
+{
+    pthread_condattr_t attr;
+
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(cond, &attr);
+    pthread_condattr_destroy(&attr);
+}
+
+static struct timespec deadlineAfter(TickType_t ticks)
+{
+    struct timespec ts;
+    uint64_t ns;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    ns = (uint64_t)ts.tv_nsec + (uint64_t)ticks * (1000000000ULL / configTICK_RATE_HZ);
+    ts.tv_sec += ns / 1000000000ULL;
+    ts.tv_nsec = ns % 1000000000ULL;
+    return ts;
+}
+
+/* Waits on cond until pred() holds or the tick timeout expires. Returns
+ * false on timeout. The caller holds lock. */
+static bool waitFor(pthread_cond_t *cond, pthread_mutex_t *lock, TickType_t ticks,
+                    bool (*pred)(void *), void *ctx)
+{
+    struct timespec deadline;
+
+    if (pred(ctx))
+        return true;
+    if (ticks == 0)
+        return false;
+    if (ticks != portMAX_DELAY)
+        deadline = deadlineAfter(ticks);
+    while (!pred(ctx)) {
+        if (ticks == portMAX_DELAY)
+            pthread_cond_wait(cond, lock);
+        else if (pthread_cond_timedwait(cond, lock, &deadline) == ETIMEDOUT)
+            return pred(ctx);
+    }
+    return true;
+}
+
+/* ---- Tasks ---- */
+
+static struct HostTask *newTask(const char *name, TaskFunction_t entry, void *arg,
+                                uint32_t stackSize, UBaseType_t priority)
+{
+    struct HostTask *task = calloc(1, sizeof(*task));
+
+    if (task == NULL)
+        return NULL;
+    snprintf(task->name, sizeof(task->name), "%s", name);
+    task->entry = entry;
+    task->arg = arg;
+    task->stackSize = stackSize;
+    task->priority = priority;
+    pthread_mutex_init(&task->lock, NULL);
+    initCond(&task->cond);
+    return task;
+}
+
+static struct HostTask *currentTask(void)
+{
+    struct HostTask *task;
+
+    pthread_once(&taskKeyOnce, makeTaskKey);
+    task = pthread_getspecific(taskKey);
+    if (task == NULL) {
+        task = newTask("host", NULL, NULL, 0, 0);
+        pthread_setspecific(taskKey, task);
+    }
+    return task;
+}
+
+static void *taskTrampoline(void *param)
+{
+    struct HostTask *task = param;
+
+    pthread_setspecific(taskKey, task);
+    task->entry(task->arg);
+    return NULL;
+}
+
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t pxTaskCode, const char *pcName, uint32_t usStackDepth,
+                                   void *pvParameters, UBaseType_t uxPriority, TaskHandle_t *pxCreatedTask,
+                                   BaseType_t xCoreID)
+{
+    struct HostTask *task;
+    pthread_attr_t attr;
+    pthread_t thread;
+    int rc;
+
+    (void)xCoreID;
+    pthread_once(&taskKeyOnce, makeTaskKey);
+    task = newTask(pcName, pxTaskCode, pvParameters, usStackDepth, uxPriority);
+    if (task == NULL)
+        return pdFAIL;
+
+    /* Host libc needs far more stack than the firmware budget, so the
+     * requested size is only a lower bound. */
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    pthread_attr_setstacksize(&attr, usStackDepth < (256 * 1024) ? (256 * 1024) : usStackDepth);
+    rc = pthread_create(&thread, &attr, taskTrampoline, task);
+    pthread_attr_destroy(&attr);
+    if (rc != 0) {
+        free(task);
+        return pdFAIL;
+    }
+#ifdef __GLIBC__
+    pthread_setname_np(thread, task->name);
+#endif
+    if (pxCreatedTask != NULL)
+        *pxCreatedTask = task;
+    return pdPASS;
+}
+
+TaskHandle_t xTaskCreateStaticPinnedToCore(TaskFunction_t pxTaskCode, const char *pcName, uint32_t ulStackDepth,
+                                           void *pvParameters, UBaseType_t uxPriority, StackType_t *pxStackBuffer,
+                                           StaticTask_t *pxTaskBuffer, BaseType_t xCoreID)
+{
+    TaskHandle_t handle = NULL;
+
+    (void)pxStackBuffer;
+    (void)pxTaskBuffer;
+    if (xTaskCreatePinnedToCore(pxTaskCode, pcName, ulStackDepth, pvParameters, uxPriority,
+                                &handle, xCoreID) != pdPASS)
+        return NULL;
+    return handle;
+}
+
+void vTaskDelete(TaskHandle_t xTaskToDelete)
+{
+    /* Only self deletion is used by main/. The record stays allocated since
+     * other tasks may still hold the handle. */
+    if (xTaskToDelete == NULL || xTaskToDelete == currentTask())
+        pthread_exit(NULL);
+}
+
+static void sleepTicks(TickType_t ticks)
+{
+    struct timespec ts = {
+        .tv_sec = ticks / configTICK_RATE_HZ,
+        .tv_nsec = (long)(ticks % configTICK_RATE_HZ) * (1000000000L / configTICK_RATE_HZ),
+    };
+
+    while (clock_nanosleep(CLOCK_MONOTONIC, 0, &ts, &ts) == EINTR)
+        ;
+}
+
+void vTaskDelay(TickType_t xTicksToDelay)
+{
+    if (xTicksToDelay == 0)
+        sched_yield();
+    else
+        sleepTicks(xTicksToDelay);
+}
+
+void vTaskDelayUntil(TickType_t *pxPreviousWakeTime, TickType_t xTimeIncrement)
+{
+    TickType_t wake = *pxPreviousWakeTime + xTimeIncrement;
+    TickType_t now = xTaskGetTickCount();
+
+    *pxPreviousWakeTime = wake;
+    if ((int32_t)(wake - now) > 0)
+        sleepTicks(wake - now);
+}
+
+TickType_t xTaskGetTickCount(void)
+{
+    struct timespec ts;
+
+    pthread_once(&taskKeyOnce, makeTaskKey);
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (TickType_t)((ts.tv_sec - startTime.tv_sec) * configTICK_RATE_HZ +
+                        (ts.tv_nsec - startTime.tv_nsec) / (1000000000L / configTICK_RATE_HZ));
+}
+
+TaskHandle_t xTaskGetCurrentTaskHandle(void)
+{
+    return currentTask();
+}
+
+char *pcTaskGetName(TaskHandle_t xTaskToQuery)
+{
+    return (xTaskToQuery != NULL ? xTaskToQuery : currentTask())->name;
+}
+
+UBaseType_t uxTaskGetStackHighWaterMark(TaskHandle_t xTask)
+{
+    /* Stack usage is not tracked, report the whole budget as free. */
+    return (xTask != NULL ? xTask : currentTask())->stackSize;
+}
+
+void vHostYield(void)
+{
+    sched_yield();
+}
+
+/* ---- Task notifications ---- */
+
+BaseType_t xTaskGenericNotify(TaskHandle_t xTaskToNotify, uint32_t ulValue, eNotifyAction eAction,
+                              uint32_t *pulPreviousNotificationValue)
+{
+    struct HostTask *task = xTaskToNotify;
+    BaseType_t ret = pdPASS;
+
+    pthread_mutex_lock(&task->lock);
+    if (pulPreviousNotificationValue != NULL)
+        *pulPreviousNotificationValue = task->notifyValue;
+    switch (eAction) {
+    case eSetBits:
+        task->notifyValue |= ulValue;
+        break;
+    case eIncrement:
+        task->notifyValue++;
+        break;
+    case eSetValueWithOverwrite:
+        task->notifyValue = ulValue;
+        break;
+    case eSetValueWithoutOverwrite:
+        if (task->notifyPending)
+            ret = pdFAIL;
+        else
+            task->notifyValue = ulValue;
+        break;
+    case eNoAction:
+        break;
+    }
+    task->notifyPending = true;
+    pthread_cond_broadcast(&task->cond);
+    pthread_mutex_unlock(&task->lock);
+    return ret;
+}
+
+static bool notifyPending(void *ctx)
+{
+    return ((struct HostTask *)ctx)->notifyPending;
+}
+
+static bool notifyNonZero(void *ctx)
+{
+    return ((struct HostTask *)ctx)->notifyValue != 0;
+}
+
+BaseType_t xTaskNotifyWait(uint32_t ulBitsToClearOnEntry, uint32_t ulBitsToClearOnExit,
+                           uint32_t *pulNotificationValue, TickType_t xTicksToWait)
+{
+    struct HostTask *task = currentTask();
+    BaseType_t ret = pdFALSE;
+
+    pthread_mutex_lock(&task->lock);
+    if (!task->notifyPending)
+        task->notifyValue &= ~ulBitsToClearOnEntry;
+    if (waitFor(&task->cond, &task->lock, xTicksToWait, notifyPending, task)) {
+        task->notifyPending = false;
+        ret = pdTRUE;
+    }
+    if (pulNotificationValue != NULL)
+        *pulNotificationValue = task->notifyValue;
+    if (ret == pdTRUE)
+        task->notifyValue &= ~ulBitsToClearOnExit;
+    pthread_mutex_unlock(&task->lock);
+    return ret;
+}
+
+uint32_t ulTaskNotifyTake(BaseType_t xClearCountOnExit, TickType_t xTicksToWait)
+{
+    struct HostTask *task = currentTask();
+    uint32_t value;
+
+    pthread_mutex_lock(&task->lock);
+    waitFor(&task->cond, &task->lock, xTicksToWait, notifyNonZero, task);
+    value = task->notifyValue;
+    if (value != 0)
+        task->notifyValue = xClearCountOnExit ? 0 : value - 1;
+    task->notifyPending = false;
+    pthread_mutex_unlock(&task->lock);
+    return value;
+}
+
+/* ---- Queues and semaphores ---- */
+
+static struct HostQueue *newQueue(UBaseType_t length, UBaseType_t itemSize, UBaseType_t initialCount)
+{
+    struct HostQueue *queue = calloc(1, sizeof(*queue));
+
+    if (queue == NULL)
+        return NULL;
+    if (itemSize > 0) {
+        queue->storage = calloc(length, itemSize);
+        if (queue->storage == NULL) {
+            free(queue);
+            return NULL;
+        }
+    }
+    queue->length = length;
+    queue->itemSize = itemSize;
+    queue->count = initialCount;
+    pthread_mutex_init(&queue->lock, NULL);
+    initCond(&queue->notEmpty);
+    initCond(&queue->notFull);
+    return queue;
+}
+
+QueueHandle_t xQueueCreate(UBaseType_t uxQueueLength, UBaseType_t uxItemSize)
+{
+    return newQueue(uxQueueLength, uxItemSize, 0);
+}
+
+QueueHandle_t xQueueCreateStatic(UBaseType_t uxQueueLength, UBaseType_t uxItemSize,
+                                 uint8_t *pucQueueStorage, StaticQueue_t *pxQueueBuffer)
+{
+    (void)pucQueueStorage;
+    (void)pxQueueBuffer;
+    return newQueue(uxQueueLength, uxItemSize, 0);
+}
+
+static bool queueHasItem(void *ctx)
+{
+    return ((struct HostQueue *)ctx)->count > 0;
+}
+
+static bool queueHasSpace(void *ctx)
+{
+    struct HostQueue *queue = ctx;
+
+    return queue->count < queue->length;
+}
+
+BaseType_t xQueueGenericSend(QueueHandle_t xQueue, const void *pvItemToQueue, TickType_t xTicksToWait,
+                             BaseType_t xToFront, BaseType_t xOverwrite)
+{
+    struct HostQueue *queue = xQueue;
+    UBaseType_t slot;
+
+    pthread_mutex_lock(&queue->lock);
+    if (xOverwrite && queue->count == queue->length)
+        queue->count--;
+    if (!waitFor(&queue->notFull, &queue->lock, xTicksToWait, queueHasSpace, queue)) {
+        pthread_mutex_unlock(&queue->lock);
+        return pdFAIL;
+    }
+    if (queue->itemSize > 0) {
+        if (xToFront) {
+            queue->head = (queue->head + queue->length - 1) % queue->length;
+            slot = queue->head;
+        } else {
+            slot = (queue->head + queue->count) % queue->length;
+        }
+        memcpy(queue->storage + slot * queue->itemSize, pvItemToQueue, queue->itemSize);
+    }
+    queue->count++;
+    pthread_cond_signal(&queue->notEmpty);
+    pthread_mutex_unlock(&queue->lock);
+    return pdPASS;
+}
+
+static BaseType_t queueTake(struct HostQueue *queue, void *pvBuffer, TickType_t xTicksToWait, bool remove)
+{
+    pthread_mutex_lock(&queue->lock);
+    if (!waitFor(&queue->notEmpty, &queue->lock, xTicksToWait, queueHasItem, queue)) {
+        pthread_mutex_unlock(&queue->lock);
+        return pdFALSE;
+    }
+    if (queue->itemSize > 0 && pvBuffer != NULL)
+        memcpy(pvBuffer, queue->storage + queue->head * queue->itemSize, queue->itemSize);
+    if (remove) {
+        if (queue->itemSize > 0)
+            queue->head = (queue->head + 1) % queue->length;
+        queue->count--;
+        pthread_cond_signal(&queue->notFull);
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return pdTRUE;
+}
+
+BaseType_t xQueueReceive(QueueHandle_t xQueue, void *pvBuffer, TickType_t xTicksToWait)
+{
+    return queueTake(xQueue, pvBuffer, xTicksToWait, true);
+}
+
+BaseType_t xQueuePeek(QueueHandle_t xQueue, void *pvBuffer, TickType_t xTicksToWait)
+{
+    return queueTake(xQueue, pvBuffer, xTicksToWait, false);
+}
+
+BaseType_t xQueueReset(QueueHandle_t xQueue)
+{
+    struct HostQueue *queue = xQueue;
+
+    pthread_mutex_lock(&queue->lock);
+    queue->count = queue->isMutex ? 1 : 0;
+    queue->head = 0;
+    pthread_cond_broadcast(&queue->notFull);
+    pthread_mutex_unlock(&queue->lock);
+    return pdPASS;
+}
+
+UBaseType_t uxQueueMessagesWaiting(QueueHandle_t xQueue)
+{
+    struct HostQueue *queue = xQueue;
+    UBaseType_t count;
+
+    pthread_mutex_lock(&queue->lock);
+    count = queue->count;
+    pthread_mutex_unlock(&queue->lock);
+    return count;
+}
+
+UBaseType_t uxQueueSpacesAvailable(QueueHandle_t xQueue)
+{
+    struct HostQueue *queue = xQueue;
+
+    return queue->length - uxQueueMessagesWaiting(xQueue);
+}
+
+void vQueueDelete(QueueHandle_t xQueue)
+{
+    struct HostQueue *queue = xQueue;
+
+    if (queue == NULL)
+        return;
+    pthread_mutex_destroy(&queue->lock);
+    pthread_cond_destroy(&queue->notEmpty);
+    pthread_cond_destroy(&queue->notFull);
+    free(queue->storage);
+    free(queue);
+}
+
+/* Mutexes are binary semaphores that start out given. Priority
+ * inheritance and recursion are not modelled. */
+SemaphoreHandle_t xSemaphoreCreateMutex(void)
+{
+    struct HostQueue *queue = newQueue(1, 0, 1);
+
+    if (queue != NULL)
+        queue->isMutex = true;
+    return queue;
+}
+
+SemaphoreHandle_t xSemaphoreCreateMutexStatic(StaticSemaphore_t *pxMutexBuffer)
+{
+    (void)pxMutexBuffer;
+    return xSemaphoreCreateMutex();
+}
+
+SemaphoreHandle_t xSemaphoreCreateBinary(void)
+{
+    return newQueue(1, 0, 0);
+}
+
+SemaphoreHandle_t xSemaphoreCreateBinaryStatic(StaticSemaphore_t *pxSemaphoreBuffer)
+{
+    (void)pxSemaphoreBuffer;
+    return newQueue(1, 0, 0);
+}
+
+SemaphoreHandle_t xSemaphoreCreateCounting(UBaseType_t uxMaxCount, UBaseType_t uxInitialCount)
+{
+    return newQueue(uxMaxCount, 0, uxInitialCount);
+}
+
+SemaphoreHandle_t xSemaphoreCreateCountingStatic(UBaseType_t uxMaxCount, UBaseType_t uxInitialCount,
+                                                StaticSemaphore_t *pxSemaphoreBuffer)
+{
+    (void)pxSemaphoreBuffer;
+    return newQueue(uxMaxCount, 0, uxInitialCount);
+}
@@ -0,0 +1,68 @@
+/*
+ * GPIO on the host only remembers levels and logs output changes, which is
+ * enough to follow the relay outputs while the firmware runs.
+ */
+#include "driver/gpio.h"
+#include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+
+static const char *TAG = "gpio_host";
+
+static uint8_t levels[GPIO_NUM_MAX];
+static gpio_mode_t modes[GPIO_NUM_MAX];
+static portMUX_TYPE gpioLock = portMUX_INITIALIZER_UNLOCKED;
+
+static bool validPin(gpio_num_t gpio_num)
+{
+    return gpio_num >= 0 && gpio_num < GPIO_NUM_MAX;
+}
+
+esp_err_t gpio_config(const gpio_config_t *pGPIOConfig)
+{
+    if (pGPIOConfig == NULL)
+        return ESP_ERR_INVALID_ARG;
+    for (int pin = 0; pin < GPIO_NUM_MAX; pin++)
+        if (pGPIOConfig->pin_bit_mask & (1ULL << pin))
+            gpio_set_direction(pin, pGPIOConfig->mode);
+    return ESP_OK;
+}
+
+esp_err_t gpio_reset_pin(gpio_num_t gpio_num)
+{
+    return gpio_set_direction(gpio_num, GPIO_MODE_INPUT);
+}
+
+esp_err_t gpio_set_direction(gpio_num_t gpio_num, gpio_mode_t mode)
+{
+    if (!validPin(gpio_num))
+        return ESP_ERR_INVALID_ARG;
+    modes[gpio_num] = mode;
+    return ESP_OK;
+}
+
+esp_err_t gpio_set_level(gpio_num_t gpio_num, uint32_t level)
+{
+    bool changed;
+
+    if (!validPin(gpio_num))
+        return ESP_ERR_INVALID_ARG;
+    portENTER_CRITICAL(&gpioLock);
+    changed = levels[gpio_num] != (level ? 1 : 0);
+    levels[gpio_num] = level ? 1 : 0;
+    portEXIT_CRITICAL(&gpioLock);
+    if (changed)
+        ESP_LOGI(TAG, "GPIO%d -> %u", gpio_num, level ? 1 : 0);
+    return ESP_OK;
+}
+
+int gpio_get_level(gpio_num_t gpio_num)
+{
+    int level;
+
+    if (!validPin(gpio_num))
+        return 0;
+    portENTER_CRITICAL(&gpioLock);
+    level = levels[gpio_num];
+    portEXIT_CRITICAL(&gpioLock);
+    return level;
+}
@@ -0,0 +1,211 @@
+/*
+ * NVS backed by plain files: every key is one file named
+ * <namespace>.<key> under HOST_NVS_DIR (default ./nvs). Values hit the
+ * disk on set, commit only exists for API compatibility. Keeping the
+ * directory between runs behaves like flash surviving a reboot; deleting
+ * it is nvs_flash_erase().
+ */
+#include <dirent.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "nvs.h"
+#include "nvs_flash.h"
+#include "esp_log.h"
+
+#define NVS_KEY_NAME_MAX_SIZE   16
+#define NVS_MAX_HANDLES         16
+
+static const char *TAG = "nvs_host";
+
+typedef struct {
+    char ns[NVS_KEY_NAME_MAX_SIZE];
+    nvs_open_mode_t mode;
+    bool used;
+} host_nvs_handle_t;
+
+static host_nvs_handle_t handles[NVS_MAX_HANDLES];
+
+static const char *nvsDir(void)
+{
+    const char *dir = getenv("HOST_NVS_DIR");
+
+    return dir != NULL ? dir : "nvs";
+}
+
+static host_nvs_handle_t *getHandle(nvs_handle_t handle)
+{
+    if (handle == 0 || handle > NVS_MAX_HANDLES || !handles[handle - 1].used)
+        return NULL;
+    return &handles[handle - 1];
+}
+
+static esp_err_t keyPath(host_nvs_handle_t *h, const char *key, char *path, size_t size)
+{
+    if (key == NULL || strlen(key) >= NVS_KEY_NAME_MAX_SIZE)
+        return ESP_ERR_INVALID_ARG;
+    snprintf(path, size, "%s/%s.%s", nvsDir(), h->ns, key);
+    return ESP_OK;
+}
+
+esp_err_t nvs_flash_init(void)
+{
+    if (mkdir(nvsDir(), 0755) != 0 && errno != EEXIST) {
+        ESP_LOGE(TAG, "mkdir %s: %s", nvsDir(), strerror(errno));
+        return ESP_FAIL;
+    }
+    return ESP_OK;
+}
+
+esp_err_t nvs_flash_erase(void)
+{
+    DIR *dir = opendir(nvsDir());
+    struct dirent *entry;
+    char path[512];
+
+    if (dir == NULL)
+        return ESP_OK;
+    while ((entry = readdir(dir)) != NULL) {
+        if (entry->d_name[0] == '.')
+            continue;
+        snprintf(path, sizeof(path), "%s/%s", nvsDir(), entry->d_name);
+        unlink(path);
+    }
+    closedir(dir);
+    return ESP_OK;
+}
+
+esp_err_t nvs_open(const char *name, nvs_open_mode_t open_mode, nvs_handle_t *out_handle)
+{
+    if (name == NULL || out_handle == NULL || strlen(name) >= NVS_KEY_NAME_MAX_SIZE)
+        return ESP_ERR_INVALID_ARG;
+    for (int i = 0; i < NVS_MAX_HANDLES; i++) {
+        if (!handles[i].used) {
+            snprintf(handles[i].ns, sizeof(handles[i].ns), "%s", name);
+            handles[i].mode = open_mode;
+            handles[i].used = true;
+            *out_handle = i + 1;
+            return ESP_OK;
+        }
+    }
+    return ESP_ERR_NO_MEM;
+}
+
+void nvs_close(nvs_handle_t handle)
+{
+    host_nvs_handle_t *h = getHandle(handle);
+
+    if (h != NULL)
+        h->used = false;
+}
+
+esp_err_t nvs_commit(nvs_handle_t handle)
+{
+    return getHandle(handle) != NULL ? ESP_OK : ESP_ERR_NVS_INVALID_HANDLE;
+}
+
+esp_err_t nvs_erase_key(nvs_handle_t handle, const char *key)
+{
+    host_nvs_handle_t *h = getHandle(handle);
+    char path[256];
+
+    if (h == NULL)
+        return ESP_ERR_NVS_INVALID_HANDLE;
+    if (keyPath(h, key, path, sizeof(path)) != ESP_OK)
+        return ESP_ERR_INVALID_ARG;
+    return unlink(path) == 0 ? ESP_OK : ESP_ERR_NVS_NOT_FOUND;
+}
+
+esp_err_t nvs_get_blob(nvs_handle_t handle, const char *key, void *out_value, size_t *length)
+{
+    host_nvs_handle_t *h = getHandle(handle);
+    char path[256];
+    struct stat st;
+    FILE *f;
+    esp_err_t err = ESP_OK;
+
+    if (h == NULL)
+        return ESP_ERR_NVS_INVALID_HANDLE;
+    if (length == NULL || keyPath(h, key, path, sizeof(path)) != ESP_OK)
+        return ESP_ERR_INVALID_ARG;
+    if (stat(path, &st) != 0)
+        return ESP_ERR_NVS_NOT_FOUND;
+    if (out_value == NULL) {
+        *length = st.st_size;
+        return ESP_OK;
+    }
+    if (*length < (size_t)st.st_size)
+        return ESP_ERR_NVS_INVALID_LENGTH;
+    f = fopen(path, "rb");
+    if (f == NULL)
+        return ESP_ERR_NVS_NOT_FOUND;
+    if (fread(out_value, 1, st.st_size, f) != (size_t)st.st_size)
+        err = ESP_FAIL;
+    fclose(f);
+    *length = st.st_size;
+    return err;
+}
+
+esp_err_t nvs_set_blob(nvs_handle_t handle, const char *key, const void *value, size_t length)
+{
+    host_nvs_handle_t *h = getHandle(handle);
+    char path[256];
+    char tmp[264];
+    FILE *f;
+
+    if (h == NULL)
+        return ESP_ERR_NVS_INVALID_HANDLE;
+    if (h->mode == NVS_READONLY)
+        return ESP_ERR_NVS_READ_ONLY;
+    if (keyPath(h, key, path, sizeof(path)) != ESP_OK)
+        return ESP_ERR_INVALID_ARG;
+
+    /* Write then rename, so a killed process never leaves half a value,
+     * like the atomic entry update in real NVS. */
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    f = fopen(tmp, "wb");
+    if (f == NULL)
+        return ESP_FAIL;
+    if (fwrite(value, 1, length, f) != length) {
+        fclose(f);
+        unlink(tmp);
+        return ESP_FAIL;
+    }
+    fclose(f);
+    return rename(tmp, path) == 0 ? ESP_OK : ESP_FAIL;
+}
+
+static esp_err_t getFixed(nvs_handle_t handle, const char *key, void *out, size_t size)
+{
+    size_t length = size;
+    esp_err_t err = nvs_get_blob(handle, key, out, &length);
+
+    if (err == ESP_OK && length != size)
+        return ESP_ERR_NVS_TYPE_MISMATCH;
+    return err;
+}
+
+esp_err_t nvs_get_u32(nvs_handle_t handle, const char *key, uint32_t *out_value)
+{
+    return getFixed(handle, key, out_value, sizeof(*out_value));
+}
+
+esp_err_t nvs_set_u32(nvs_handle_t handle, const char *key, uint32_t value)
+{
+    return nvs_set_blob(handle, key, &value, sizeof(value));
+}
+
+esp_err_t nvs_get_u64(nvs_handle_t handle, const char *key, uint64_t *out_value)
+{
+    return getFixed(handle, key, out_value, sizeof(*out_value));
+}
+
+esp_err_t nvs_set_u64(nvs_handle_t handle, const char *key, uint64_t value)
+{
+    return nvs_set_blob(handle, key, &value, sizeof(value));
+}
@@ -0,0 +1,37 @@
+/*
+ * Stand-in for main/ota_agent.c, whose OTA library is not part of the host
+ * build. There are no OTA jobs: the task only idles and every publish is
+ * left to aws.c.
+ */
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "ota_agent.h"
+
+void ota_agent_task(void *arg)
+{
+    (void)arg;
+    for (;;)
+        vTaskDelay(portMAX_DELAY);
+}
+
+void ota_agent_connected(void)
+{
+}
+
+void ota_agent_disconnected(void)
+{
+}
+
+bool ota_agent_handle_publish(const char *topic, uint16_t topicLength, const void *payload, size_t length)
+{
+    (void)topic;
+    (void)topicLength;
+    (void)payload;
+    (void)length;
+    return false;
+}
+
+bool ota_agent_is_downloading(void)
+{
+    return false;
+}
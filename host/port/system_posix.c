@@ -0,0 +1,118 @@
+/*
+ * Logging, heap, restart and network bring-up for the host build. The
+ * network calls succeed immediately, the host is already online.
+ */
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "esp_system.h"
+#include "esp_log.h"
+#include "esp_event.h"
+#include "esp_netif.h"
+#include "protocol_examples_common.h"
+
+static esp_log_level_t logLevel = ESP_LOG_INFO;
+static pthread_mutex_t logLock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Per tag levels are not kept, any call sets the global level. HOST_LOG_LEVEL
+ * (0 none .. 5 verbose) overrides whatever the firmware asks for. */
+void esp_log_level_set(const char *tag, esp_log_level_t level)
+{
+    const char *env = getenv("HOST_LOG_LEVEL");
+
+    (void)tag;
+    logLevel = env != NULL ? (esp_log_level_t)atoi(env) : level;
+}
+
+void esp_log_write(esp_log_level_t level, const char *tag, const char *format, ...)
+{
+    va_list args;
+
+    (void)tag;
+    if (level > logLevel)
+        return;
+    va_start(args, format);
+    pthread_mutex_lock(&logLock);
+    vfprintf(stderr, format, args);
+    pthread_mutex_unlock(&logLock);
+    va_end(args);
+}
+
+uint32_t esp_log_timestamp(void)
+{
+    return (uint32_t)(esp_timer_get_time() / 1000);
+}
+
+/* There is no fixed heap on the host; report the available memory so the
+ * supervisor's heap line still means something. Capped at INT32_MAX since
+ * callers print it with %d. */
+uint32_t esp_get_free_heap_size(void)
+{
+    long pages = sysconf(_SC_AVPHYS_PAGES);
+    long pageSize = sysconf(_SC_PAGESIZE);
+    uint64_t bytes = (uint64_t)pages * (uint64_t)pageSize;
+
+    return bytes > INT32_MAX ? INT32_MAX : (uint32_t)bytes;
+}
+
+uint32_t esp_get_minimum_free_heap_size(void)
+{
+    static uint32_t minimum = INT32_MAX;
+    uint32_t now = esp_get_free_heap_size();
+
+    if (now < minimum)
+        minimum = now;
+    return minimum;
+}
+
+const char *esp_get_idf_version(void)
+{
+    return "host";
+}
+
+void esp_restart(void)
+{
+    ESP_LOGW("system_host", "esp_restart() called, exiting");
+    fflush(NULL);
+    exit(EXIT_FAILURE);
+}
+
+const char *esp_err_to_name(esp_err_t code)
+{
+    switch (code) {
+    case ESP_OK:                        return "ESP_OK";
+    case ESP_FAIL:                      return "ESP_FAIL";
+    case ESP_ERR_NO_MEM:                return "ESP_ERR_NO_MEM";
+    case ESP_ERR_INVALID_ARG:           return "ESP_ERR_INVALID_ARG";
+    case ESP_ERR_INVALID_STATE:         return "ESP_ERR_INVALID_STATE";
+    case ESP_ERR_INVALID_SIZE:          return "ESP_ERR_INVALID_SIZE";
+    case ESP_ERR_NOT_FOUND:             return "ESP_ERR_NOT_FOUND";
+    case ESP_ERR_NOT_SUPPORTED:         return "ESP_ERR_NOT_SUPPORTED";
+    case ESP_ERR_TIMEOUT:               return "ESP_ERR_TIMEOUT";
+    case ESP_ERR_NVS_NOT_FOUND:         return "ESP_ERR_NVS_NOT_FOUND";
+    case ESP_ERR_NVS_TYPE_MISMATCH:     return "ESP_ERR_NVS_TYPE_MISMATCH";
+    case ESP_ERR_NVS_READ_ONLY:         return "ESP_ERR_NVS_READ_ONLY";
+    case ESP_ERR_NVS_INVALID_HANDLE:    return "ESP_ERR_NVS_INVALID_HANDLE";
+    case ESP_ERR_NVS_INVALID_LENGTH:    return "ESP_ERR_NVS_INVALID_LENGTH";
+    default:                            return "ERROR";
+    }
+}
+
+esp_err_t esp_netif_init(void)
+{
+    return ESP_OK;
+}
+
+esp_err_t esp_event_loop_create_default(void)
+{
+    return ESP_OK;
+}
+
+esp_err_t example_connect(void)
+{
+    return ESP_OK;
+}
@@ -0,0 +1,232 @@
+/*
+ * UART driver on top of a tty. Port n opens the device named by the
+ * HOST_UART<n> environment variable, normally the pty slave printed by one
+ * of the simulators in host/sim. The line speed is applied with termios so
+ * a simulator sharing the pty can tell when both ends disagree on the baud
+ * rate, which is how a real mismatch looks on the wire.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include "driver/uart.h"
+#include "esp_log.h"
+
+static const char *TAG = "uart_host";
+
+typedef struct {
+    int fd;
+    bool installed;
+    uint32_t baud;
+} host_uart_t;
+
+static host_uart_t ports[UART_NUM_MAX] = {
+    { .fd = -1 }, { .fd = -1 }, { .fd = -1 },
+};
+
+static const struct {
+    uint32_t rate;
+    speed_t speed;
+} speeds[] = {
+    { 2400, B2400 }, { 4800, B4800 }, { 9600, B9600 }, { 19200, B19200 },
+    { 38400, B38400 }, { 57600, B57600 }, { 115200, B115200 }, { 230400, B230400 },
+    { 460800, B460800 }, { 921600, B921600 },
+};
+
+static host_uart_t *getPort(uart_port_t uart_num)
+{
+    if (uart_num < 0 || uart_num >= UART_NUM_MAX)
+        return NULL;
+    return &ports[uart_num];
+}
+
+static void applyBaud(host_uart_t *port)
+{
+    struct termios tio;
+
+    if (port->fd < 0 || port->baud == 0 || tcgetattr(port->fd, &tio) != 0)
+        return;
+    for (size_t i = 0; i < sizeof(speeds) / sizeof(speeds[0]); i++) {
+        if (speeds[i].rate == port->baud) {
+            cfsetispeed(&tio, speeds[i].speed);
+            cfsetospeed(&tio, speeds[i].speed);
+            tcsetattr(port->fd, TCSANOW, &tio);
+            return;
+        }
+    }
+    ESP_LOGW(TAG, "no termios speed for %u baud", port->baud);
+}
+
+esp_err_t uart_driver_install(uart_port_t uart_num, int rx_buffer_size, int tx_buffer_size,
+                              int queue_size, QueueHandle_t *uart_queue, int intr_alloc_flags)
+{
+    host_uart_t *port = getPort(uart_num);
+    char var[16];
+    const char *path;
+    struct termios tio;
+
+    (void)rx_buffer_size;
+    (void)tx_buffer_size;
+    (void)queue_size;
+    (void)intr_alloc_flags;
+    if (port == NULL)
+        return ESP_ERR_INVALID_ARG;
+    if (uart_queue != NULL)
+        *uart_queue = NULL;
+    if (port->installed)
+        return ESP_FAIL;
+    port->installed = true;
+
+    snprintf(var, sizeof(var), "HOST_UART%d", uart_num);
+    path = getenv(var);
+    if (path == NULL) {
+        ESP_LOGW(TAG, "%s not set, UART%d is disconnected", var, uart_num);
+        return ESP_OK;
+    }
+    port->fd = open(path, O_RDWR | O_NOCTTY);
+    if (port->fd < 0) {
+        ESP_LOGE(TAG, "open %s: %s", path, strerror(errno));
+        return ESP_OK;
+    }
+    if (tcgetattr(port->fd, &tio) == 0) {
+        cfmakeraw(&tio);
+        tio.c_cc[VMIN] = 0;
+        tio.c_cc[VTIME] = 0;
+        tcsetattr(port->fd, TCSANOW, &tio);
+    }
+    applyBaud(port);
+    ESP_LOGI(TAG, "UART%d on %s", uart_num, path);
+    return ESP_OK;
+}
+
+esp_err_t uart_param_config(uart_port_t uart_num, const uart_config_t *uart_config)
+{
+    host_uart_t *port = getPort(uart_num);
+
+    if (port == NULL || uart_config == NULL)
+        return ESP_ERR_INVALID_ARG;
+    port->baud = uart_config->baud_rate;
+    applyBaud(port);
+    return ESP_OK;
+}
+
+esp_err_t uart_set_pin(uart_port_t uart_num, int tx_io_num, int rx_io_num, int rts_io_num, int cts_io_num)
+{
+    (void)tx_io_num;
+    (void)rx_io_num;
+    (void)rts_io_num;
+    (void)cts_io_num;
+    return getPort(uart_num) != NULL ? ESP_OK : ESP_ERR_INVALID_ARG;
+}
+
+esp_err_t uart_set_baudrate(uart_port_t uart_num, uint32_t baudrate)
+{
+    host_uart_t *port = getPort(uart_num);
+
+    if (port == NULL)
+        return ESP_ERR_INVALID_ARG;
+    port->baud = baudrate;
+    applyBaud(port);
+    return ESP_OK;
+}
+
+esp_err_t uart_get_baudrate(uart_port_t uart_num, uint32_t *baudrate)
+{
+    host_uart_t *port = getPort(uart_num);
+
+    if (port == NULL || baudrate == NULL)
+        return ESP_ERR_INVALID_ARG;
+    *baudrate = port->baud;
+    return ESP_OK;
+}
+
+int uart_write_bytes(uart_port_t uart_num, const void *src, size_t size)
+{
+    host_uart_t *port = getPort(uart_num);
+    const uint8_t *p = src;
+    size_t left = size;
+
+    if (port == NULL || !port->installed)
+        return -1;
+    if (port->fd < 0)
+        return (int)size;
+    while (left > 0) {
+        ssize_t n = write(port->fd, p, left);
+
+        if (n < 0) {
+            if (errno == EINTR || errno == EAGAIN)
+                continue;
+            return -1;
+        }
+        p += n;
+        left -= n;
+    }
+    return (int)size;
+}
+
+/* Same contract as the IDF driver: wait until length bytes have arrived or
+ * the timeout expires, and return however many were read. */
+int uart_read_bytes(uart_port_t uart_num, void *buf, uint32_t length, TickType_t ticks_to_wait)
+{
+    host_uart_t *port = getPort(uart_num);
+    uint8_t *p = buf;
+    uint32_t got = 0;
+    int64_t deadline;
+
+    if (port == NULL || !port->installed)
+        return -1;
+    if (port->fd < 0) {
+        vTaskDelay(ticks_to_wait);
+        return 0;
+    }
+    deadline = esp_timer_get_time() + (int64_t)ticks_to_wait * portTICK_PERIOD_MS * 1000;
+    while (got < length) {
+        int64_t left = deadline - esp_timer_get_time();
+        struct pollfd pfd = { .fd = port->fd, .events = POLLIN };
+        ssize_t n;
+
+        if (left < 0)
+            left = 0;
+        if (poll(&pfd, 1, (int)((left + 999) / 1000)) <= 0)
+            break;
+        if (pfd.revents & (POLLHUP | POLLERR)) {
+            /* Simulator went away, behave like a silent line. */
+            vTaskDelay(left / 1000 / portTICK_PERIOD_MS);
+            break;
+        }
+        n = read(port->fd, p + got, length - got);
+        if (n < 0 && errno != EINTR && errno != EAGAIN)
+            break;
+        if (n > 0)
+            got += n;
+    }
+    return (int)got;
+}
+
+esp_err_t uart_flush_input(uart_port_t uart_num)
+{
+    host_uart_t *port = getPort(uart_num);
+
+    if (port == NULL)
+        return ESP_ERR_INVALID_ARG;
+    if (port->fd >= 0)
+        tcflush(port->fd, TCIFLUSH);
+    return ESP_OK;
+}
+
+esp_err_t uart_wait_tx_done(uart_port_t uart_num, TickType_t ticks_to_wait)
+{
+    host_uart_t *port = getPort(uart_num);
+
+    (void)ticks_to_wait;
+    if (port == NULL)
+        return ESP_ERR_INVALID_ARG;
+    if (port->fd >= 0)
+        tcdrain(port->fd);
+    return ESP_OK;
+}
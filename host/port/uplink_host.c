@@ -0,0 +1,66 @@
+/*
+ * Stand-in for aws.c. The real uplink needs the coreMQTT and cJSON
+ * submodules plus the ESP-TLS transport, none of which exist on the host,
+ * so this drains the uplink queue and prints every message on stdout,
+ * prefixed with the topic it would be published to. Pipe stdout into
+ * mosquitto_pub or a file to feed a local broker.
+ *
+ * It also answers for the device shadow service: there is no document at
+ * first, and every reported update is accepted. firmware_host_mqtt runs
+ * aws.c itself instead, against host/sim/mqtt_sim.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "freertos/FreeRTOS.h"
+#include "uplink.h"
+#include "device_shadow.h"
+#include "credentials.h"
+#include "demo_config.h"
+
+static const char *topics[UPLINK_TOPICS] = {
+    [UPLINK_TELEMETRY] = CLIENT_IDENTIFIER "/pub",
+    [UPLINK_EVENT] = CLIENT_IDENTIFIER "/events",
+    [UPLINK_SHADOW_UPDATE] = "$aws/things/" CLIENT_IDENTIFIER "/shadow/update",
+    [UPLINK_SHADOW_GET] = "$aws/things/" CLIENT_IDENTIFIER "/shadow/get",
+};
+
+static void answerShadow(const uplink_message_t *message)
+{
+    static const char key[] = "\"clientToken\":\"";
+    char token[16] = "";
+    const char *p;
+
+    if (message->topic == UPLINK_SHADOW_GET) {
+        device_shadow_on_document(0, NULL, NULL);
+        return;
+    }
+    p = memmem(message->payload, message->length, key, sizeof(key) - 1);
+    if (p != NULL)
+        sscanf(p + sizeof(key) - 1, "%15[^\"]", token);
+    device_shadow_on_update_result(token, true);
+}
+
+int aws_iot_demo_main(int argc, char **argv)
+{
+    static uplink_message_t message;
+
+    (void)argc;
+    (void)argv;
+    device_shadow_sync();
+    for (;;) {
+        if (!uplink_receive(&message, portMAX_DELAY))
+            continue;
+        printf("%s %.*s\n", topics[message.topic], message.length, message.payload);
+        fflush(stdout);
+        if (message.topic == UPLINK_SHADOW_UPDATE || message.topic == UPLINK_SHADOW_GET)
+            answerShadow(&message);
+    }
+    return EXIT_SUCCESS;
+}
+
+/* No TLS on the host, so nothing to parse. */
+void credentials_init(void)
+{
+}
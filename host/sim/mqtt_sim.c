@@ -0,0 +1,443 @@
+/*
+ * MQTT 3.1.1 broker stand-in over TLS, for the host build of main/aws.c.
+ *
+ * Takes CONNECT, SUBSCRIBE, UNSUBSCRIBE, PUBLISH at QoS 0 and 1, PINGREQ and
+ * DISCONNECT from one client at a time and hands every publish to the
+ * client's own matching subscriptions, wildcards included, granting QoS 1
+ * at most. It also answers for the device shadow service as
+ * host/port/uplink_host.c does: there is no document, so a get is rejected,
+ * and every update is accepted with its client token and the next version.
+ *
+ *   mqtt_sim [-p port] [-c cert.pem] [-k key.pem] [-a ca.pem]
+ *
+ *   -p  TCP port, 8883 by default like the host sdkconfig.h
+ *   -c  server certificate, server.crt by default; its name must be the
+ *       broker endpoint, localhost on the host
+ *   -k  its private key, server.key by default
+ *   -a  CA the client certificate must be signed by; without it none is
+ *       asked for
+ *
+ * Every publish received is logged on stdout after its topic. A line typed
+ * in, "<topic> <payload>", is published to the client, e.g. a shadow delta
+ * on $aws/things/ESP32/shadow/update/delta. On SIGINT/SIGTERM the totals
+ * are printed on stderr.
+ */
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+
+#define MAX_PACKET          (64 * 1024)
+#define MAX_SUBSCRIPTIONS   16
+#define MAX_FILTER          128
+
+#define PACKET_CONNECT      1
+#define PACKET_PUBLISH      3
+#define PACKET_PUBACK       4
+#define PACKET_SUBSCRIBE    8
+#define PACKET_UNSUBSCRIBE  10
+#define PACKET_PINGREQ      12
+#define PACKET_DISCONNECT   14
+
+typedef struct {
+    char filter[MAX_FILTER];
+    int qos;
+} subscription_t;
+
+typedef struct {
+    SSL *ssl;
+    char clientId[64];
+    subscription_t subs[MAX_SUBSCRIPTIONS];
+    int subCount;
+    uint16_t nextPacketId;
+} client_t;
+
+static volatile sig_atomic_t stop = 0;
+static unsigned connections = 0, received = 0, sent = 0, shadowVersion = 0;
+
+static void onSignal(int sig)
+{
+    (void)sig;
+    stop = 1;
+}
+
+static bool readExact(SSL *ssl, uint8_t *buf, size_t len)
+{
+    while (len > 0) {
+        const int n = SSL_read(ssl, buf, len);
+
+        if (n <= 0)
+            return false;
+        buf += n;
+        len -= n;
+    }
+    return true;
+}
+
+static bool writeAll(SSL *ssl, const uint8_t *buf, size_t len)
+{
+    return SSL_write(ssl, buf, len) == (int)len;
+}
+
+/* Fixed header and body of the next packet. */
+static bool readPacket(SSL *ssl, uint8_t *type, uint8_t *body, size_t *length)
+{
+    uint8_t byte;
+    size_t remaining = 0;
+
+    if (!readExact(ssl, type, 1))
+        return false;
+    for (int shift = 0; shift < 28; shift += 7) {
+        if (!readExact(ssl, &byte, 1))
+            return false;
+        remaining |= (size_t)(byte & 0x7F) << shift;
+        if (!(byte & 0x80)) {
+            *length = remaining;
+            return remaining <= MAX_PACKET && readExact(ssl, body, remaining);
+        }
+    }
+    return false;
+}
+
+/* Fixed header and body in one write, so in one TLS record. */
+static bool sendPacket(SSL *ssl, uint8_t type, const uint8_t *body, size_t length)
+{
+    static uint8_t packet[5 + MAX_PACKET + MAX_FILTER];
+    size_t used = 1, rest = length;
+
+    packet[0] = type;
+    do {
+        packet[used] = rest & 0x7F;
+        rest >>= 7;
+        packet[used++] |= rest > 0 ? 0x80 : 0;
+    } while (rest > 0);
+    if (length > 0)
+        memcpy(packet + used, body, length);
+    return writeAll(ssl, packet, used + length);
+}
+
+/* MQTT filter matching: "+" is one level, a trailing "#" any number of them. */
+static bool topicMatches(const char *filter, const char *topic, size_t topicLength)
+{
+    const char *t = topic, *end = topic + topicLength;
+
+    for (const char *f = filter; *f != '\0'; f++) {
+        if (*f == '#')
+            return true;
+        if (*f == '+') {
+            while (t < end && *t != '/')
+                t++;
+        } else if (t < end && *t == *f) {
+            t++;
+        } else {
+            return false;
+        }
+    }
+    return t == end;
+}
+
+/* To the client, once however many of its subscriptions match. */
+static void deliver(client_t *c, const char *topic, size_t topicLength, const char *payload, size_t length)
+{
+    static uint8_t body[MAX_PACKET + MAX_FILTER];
+    int qos = -1;
+    size_t used = 0;
+
+    for (int i = 0; i < c->subCount; i++) {
+        if (topicMatches(c->subs[i].filter, topic, topicLength) && c->subs[i].qos > qos)
+            qos = c->subs[i].qos;
+    }
+    if (qos < 0 || topicLength > MAX_FILTER || length > MAX_PACKET)
+        return;
+    body[used++] = topicLength >> 8;
+    body[used++] = topicLength & 0xFF;
+    memcpy(body + used, topic, topicLength);
+    used += topicLength;
+    if (qos > 0) {
+        if (++c->nextPacketId == 0)
+            c->nextPacketId = 1;
+        body[used++] = c->nextPacketId >> 8;
+        body[used++] = c->nextPacketId & 0xFF;
+    }
+    memcpy(body + used, payload, length);
+    used += length;
+    if (sendPacket(c->ssl, (PACKET_PUBLISH << 4) | (qos << 1), body, used))
+        sent++;
+}
+
+/* The shadow service's reply to a get or an update of the thing's shadow. */
+static void answerShadow(client_t *c, const char *topic, size_t topicLength, const char *payload, size_t length)
+{
+    static const char key[] = "\"clientToken\":\"";
+    char thing[64], action[16], reply[160], document[256], token[64] = "";
+    const char *p = memmem(payload, length, key, sizeof(key) - 1);
+    char name[MAX_FILTER];
+    int n;
+
+    if (topicLength >= sizeof(name))
+        return;
+    memcpy(name, topic, topicLength);
+    name[topicLength] = '\0';
+    if (sscanf(name, "$aws/things/%63[^/]/shadow/%15s", thing, action) != 2)
+        return;
+    if (p != NULL)
+        sscanf(p + sizeof(key) - 1, "%63[^\"]", token);
+
+    if (strcmp(action, "get") == 0) {
+        snprintf(reply, sizeof(reply), "$aws/things/%s/shadow/get/rejected", thing);
+        n = snprintf(document, sizeof(document),
+                     "{\"code\":404,\"message\":\"No shadow exists with name: '%s'\",\"clientToken\":\"%s\"}",
+                     thing, token);
+    } else if (strcmp(action, "update") == 0) {
+        snprintf(reply, sizeof(reply), "$aws/things/%s/shadow/update/accepted", thing);
+        n = snprintf(document, sizeof(document), "{\"version\":%u,\"timestamp\":%lld,\"clientToken\":\"%s\"}",
+                     ++shadowVersion, (long long)time(NULL), token);
+    } else {
+        return;
+    }
+    deliver(c, reply, strlen(reply), document, n);
+}
+
+static bool handlePublish(client_t *c, uint8_t flags, const uint8_t *body, size_t length)
+{
+    const int qos = (flags >> 1) & 3;
+    size_t used = 2;
+
+    if (length < 2 || qos > 1)
+        return false;
+    const size_t topicLength = (size_t)body[0] << 8 | body[1];
+    if (used + topicLength + (qos > 0 ? 2 : 0) > length)
+        return false;
+    const char *topic = (const char *)body + used;
+    used += topicLength;
+    if (qos > 0) {
+        const uint8_t ack[2] = { body[used], body[used + 1] };
+        used += 2;
+        if (!sendPacket(c->ssl, PACKET_PUBACK << 4, ack, sizeof(ack)))
+            return false;
+    }
+    received++;
+    printf("%.*s %.*s\n", (int)topicLength, topic, (int)(length - used), (const char *)body + used);
+    fflush(stdout);
+    deliver(c, topic, topicLength, (const char *)body + used, length - used);
+    answerShadow(c, topic, topicLength, (const char *)body + used, length - used);
+    return true;
+}
+
+static bool handleSubscribe(client_t *c, const uint8_t *body, size_t length, bool subscribe)
+{
+    uint8_t ack[2 + MAX_SUBSCRIPTIONS] = { body[0], body[1] };
+    size_t used = 2, acks = 2;
+
+    while (used + 2 <= length) {
+        const size_t filterLength = (size_t)body[used] << 8 | body[used + 1];
+        const char *filter = (const char *)body + used + 2;
+        int qos = 0;
+
+        used += 2 + filterLength;
+        if (subscribe) {
+            if (used >= length)
+                return false;
+            qos = body[used++] & 3;
+            qos = qos > 1 ? 1 : qos;
+        }
+        if (used > length || filterLength >= MAX_FILTER)
+            return false;
+        // A filter subscribed again replaces the first
+        int i;
+        for (i = 0; i < c->subCount; i++) {
+            if (strlen(c->subs[i].filter) == filterLength && memcmp(c->subs[i].filter, filter, filterLength) == 0)
+                break;
+        }
+        if (subscribe) {
+            if (i == c->subCount && c->subCount == MAX_SUBSCRIPTIONS) {
+                qos = 0x80;
+            } else {
+                c->subCount += i == c->subCount;
+                memcpy(c->subs[i].filter, filter, filterLength);
+                c->subs[i].filter[filterLength] = '\0';
+                c->subs[i].qos = qos;
+            }
+            if (acks < sizeof(ack))
+                ack[acks++] = qos;
+            printf("%s subscribed to %.*s\n", c->clientId, (int)filterLength, filter);
+        } else if (i < c->subCount) {
+            c->subs[i] = c->subs[--c->subCount];
+            printf("%s unsubscribed from %.*s\n", c->clientId, (int)filterLength, filter);
+        }
+    }
+    fflush(stdout);
+    return subscribe ? sendPacket(c->ssl, 0x90, ack, acks) : sendPacket(c->ssl, 0xB0, ack, 2);
+}
+
+static bool handleConnect(client_t *c, const uint8_t *body, size_t length)
+{
+    static const uint8_t accepted[2] = { 0, 0 };
+
+    // Protocol name "MQTT", level 4, flags, keep alive, then the client identifier
+    if (length < 12 || memcmp(body, "\0\4MQTT\4", 7) != 0)
+        return false;
+    const size_t idLength = (size_t)body[10] << 8 | body[11];
+    if (12 + idLength > length)
+        return false;
+    snprintf(c->clientId, sizeof(c->clientId), "%.*s", (int)idLength, (const char *)body + 12);
+    printf("%s connected, keep alive %u s\n", c->clientId, (unsigned)(body[8] << 8 | body[9]));
+    fflush(stdout);
+    return sendPacket(c->ssl, 0x20, accepted, sizeof(accepted));
+}
+
+/* A line from stdin: "<topic> <payload>". */
+static void publishLine(client_t *c, char *line)
+{
+    char *space = strchr(line, ' ');
+
+    line[strcspn(line, "\r\n")] = '\0';
+    if (space == NULL) {
+        fprintf(stderr, "expected \"<topic> <payload>\"\n");
+        return;
+    }
+    *space = '\0';
+    deliver(c, line, strlen(line), space + 1, strlen(space + 1));
+}
+
+/* One connection until the client leaves or breaks the protocol. */
+static void serve(SSL *ssl, int fd)
+{
+    static uint8_t body[MAX_PACKET];
+    client_t c = { .ssl = ssl, .clientId = "client" };
+    bool connected = false, open = true;
+
+    while (open && !stop) {
+        struct pollfd fds[2] = { { .fd = fd, .events = POLLIN }, { .fd = STDIN_FILENO, .events = POLLIN } };
+        uint8_t type;
+        size_t length;
+
+        if (SSL_pending(ssl) == 0 && poll(fds, connected ? 2 : 1, 200) <= 0)
+            continue;
+        if (connected && (fds[1].revents & POLLIN)) {
+            char line[1024];
+            if (fgets(line, sizeof(line), stdin) != NULL)
+                publishLine(&c, line);
+            if (!(fds[0].revents & POLLIN) && SSL_pending(ssl) == 0)
+                continue;
+        }
+        if (!readPacket(ssl, &type, body, &length))
+            break;
+        if (!connected && type >> 4 != PACKET_CONNECT)
+            break;
+        switch (type >> 4) {
+        case PACKET_CONNECT:
+            open = !connected && handleConnect(&c, body, length);
+            connected = true;
+            break;
+        case PACKET_PUBLISH:
+            open = handlePublish(&c, type & 0x0F, body, length);
+            break;
+        case PACKET_PUBACK:
+            break;
+        case PACKET_SUBSCRIBE:
+        case PACKET_UNSUBSCRIBE:
+            open = length >= 2 && handleSubscribe(&c, body, length, type >> 4 == PACKET_SUBSCRIBE);
+            break;
+        case PACKET_PINGREQ:
+            open = sendPacket(ssl, 0xD0, NULL, 0);
+            break;
+        case PACKET_DISCONNECT:
+            open = false;
+            break;
+        default:
+            fprintf(stderr, "unsupported packet type %u\n", (unsigned)(type >> 4));
+            open = false;
+            break;
+        }
+    }
+    printf("%s disconnected\n", c.clientId);
+    fflush(stdout);
+}
+
+int main(int argc, char **argv)
+{
+    struct sockaddr_in addr = { .sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_ANY) };
+    const char *cert = "server.crt", *key = "server.key", *ca = NULL;
+    int port = 8883, opt, one = 1;
+
+    while ((opt = getopt(argc, argv, "p:c:k:a:")) != -1) {
+        switch (opt) {
+        case 'p':
+            port = atoi(optarg);
+            break;
+        case 'c':
+            cert = optarg;
+            break;
+        case 'k':
+            key = optarg;
+            break;
+        case 'a':
+            ca = optarg;
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-p port] [-c cert.pem] [-k key.pem] [-a ca.pem]\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    SSL_CTX *ctx = SSL_CTX_new(TLS_server_method());
+    if (ctx == NULL || SSL_CTX_use_certificate_chain_file(ctx, cert) != 1 ||
+        SSL_CTX_use_PrivateKey_file(ctx, key, SSL_FILETYPE_PEM) != 1 ||
+        (ca != NULL && SSL_CTX_load_verify_locations(ctx, ca, NULL) != 1)) {
+        ERR_print_errors_fp(stderr);
+        return EXIT_FAILURE;
+    }
+    if (ca != NULL)
+        SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER | SSL_VERIFY_FAIL_IF_NO_PEER_CERT, NULL);
+
+    signal(SIGINT, onSignal);
+    signal(SIGTERM, onSignal);
+    signal(SIGPIPE, SIG_IGN);
+    const int sock = socket(AF_INET, SOCK_STREAM, 0);
+    addr.sin_port = htons(port);
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (sock < 0 || bind(sock, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(sock, 1) != 0) {
+        perror("bind");
+        return EXIT_FAILURE;
+    }
+    printf("serving MQTT over TLS on port %d%s\n", port, ca != NULL ? ", client certificates required" : "");
+    fflush(stdout);
+
+    while (!stop) {
+        struct pollfd pfd = { .fd = sock, .events = POLLIN };
+
+        // Wake up now and then to notice a signal
+        if (poll(&pfd, 1, 200) <= 0)
+            continue;
+        const int fd = accept(sock, NULL, NULL);
+        if (fd < 0)
+            continue;
+        SSL *ssl = SSL_new(ctx);
+        SSL_set_fd(ssl, fd);
+        if (SSL_accept(ssl) == 1) {
+            connections++;
+            serve(ssl, fd);
+            SSL_shutdown(ssl);
+        } else {
+            ERR_print_errors_fp(stderr);
+        }
+        SSL_free(ssl);
+        close(fd);
+    }
+    fprintf(stderr, "%u connections, %u publishes received, %u sent\n", connections, received, sent);
+    close(sock);
+    SSL_CTX_free(ctx);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,199 @@
+/*
+ * Nextion HMI simulator on a pseudo-terminal.
+ *
+ * Understands what the firmware sends: "sendme", "baud=", the "addt"
+ * transparent transfer (0xFE ready, raw points, 0xFD done), "cle" and
+ * component assignments. Assignments are printed on stdout whenever a
+ * value changes. Each line typed on stdin is sent to the firmware as is,
+ * the way the HMI's touch events send "D1ON", "ALLOFF", ..., except
+ * "page <n>", which loads page n and reports it as the HMI's "sendme" does.
+ *
+ *   nextion_sim [-b baud] [-l link]
+ *
+ * The display only answers while the firmware's line speed (read back from
+ * the pty) matches its own, so a baud mismatch shows up as silence, which
+ * is what the negotiation has to cope with on real hardware.
+ */
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "sim_pty.h"
+
+#define NEXTION_CMD_MAX     256
+#define NEXTION_FIELDS_MAX  64
+#define NEXTION_NAME_MAX    32
+#define NEXTION_VALUE_MAX   48
+
+#define RET_TRANSPARENT_END     0xFD
+#define RET_TRANSPARENT_READY   0xFE
+#define RET_SENDME              0x66
+
+typedef struct {
+    char name[NEXTION_NAME_MAX];
+    char value[NEXTION_VALUE_MAX];
+} field_t;
+
+typedef struct {
+    int fd;
+    uint32_t baud;
+    uint8_t page;
+    char cmd[NEXTION_CMD_MAX];
+    size_t cmdLen;
+    int terminators;
+    size_t addtLeft;        // Raw bytes still expected by an addt transfer
+    unsigned long points;
+    field_t fields[NEXTION_FIELDS_MAX];
+    size_t fieldCount;
+} nextion_t;
+
+static void reply(nextion_t *hmi, const uint8_t *data, size_t len)
+{
+    uint32_t peer = sim_peer_baud(hmi->fd);
+
+    if (peer != 0 && peer != hmi->baud)
+        return;     // Would be garbage at the firmware's rate
+    sim_write(hmi->fd, data, len);
+}
+
+static void replyCode(nextion_t *hmi, uint8_t code)
+{
+    const uint8_t frame[] = { code, 0xFF, 0xFF, 0xFF };
+
+    reply(hmi, frame, sizeof(frame));
+}
+
+static void setField(nextion_t *hmi, const char *name, const char *value)
+{
+    field_t *f = NULL;
+
+    for (size_t i = 0; i < hmi->fieldCount; i++) {
+        if (strcmp(hmi->fields[i].name, name) == 0) {
+            f = &hmi->fields[i];
+            break;
+        }
+    }
+    if (f == NULL) {
+        if (hmi->fieldCount == NEXTION_FIELDS_MAX)
+            return;
+        f = &hmi->fields[hmi->fieldCount++];
+        snprintf(f->name, sizeof(f->name), "%s", name);
+        f->value[0] = 0;
+    }
+    if (strcmp(f->value, value) != 0) {
+        snprintf(f->value, sizeof(f->value), "%s", value);
+        printf("%s = %s\n", f->name, f->value);
+        fflush(stdout);
+    }
+}
+
+static void handleCommand(nextion_t *hmi, char *cmd)
+{
+    unsigned id, ch, count, baud;
+    char *eq;
+
+    if (strcmp(cmd, "sendme") == 0) {
+        const uint8_t frame[] = { RET_SENDME, hmi->page, 0xFF, 0xFF, 0xFF };
+
+        reply(hmi, frame, sizeof(frame));
+    } else if (sscanf(cmd, "baud=%u", &baud) == 1) {
+        hmi->baud = baud;
+        printf("# baud %u\n", baud);
+        fflush(stdout);
+    } else if (sscanf(cmd, "addt %u,%u,%u", &id, &ch, &count) == 3) {
+        if (count == 0 || count > 1024) {
+            replyCode(hmi, 0x1A);   // Invalid variable
+            return;
+        }
+        hmi->addtLeft = count;
+        replyCode(hmi, RET_TRANSPARENT_READY);
+    } else if (strncmp(cmd, "cle ", 4) == 0) {
+        printf("# %s\n", cmd);
+        fflush(stdout);
+    } else if ((eq = strchr(cmd, '=')) != NULL) {
+        *eq = 0;
+        setField(hmi, cmd, eq + 1);
+    }
+}
+
+static void feed(nextion_t *hmi, const uint8_t *data, size_t len)
+{
+    for (size_t i = 0; i < len; i++) {
+        uint8_t c = data[i];
+
+        if (hmi->addtLeft > 0) {
+            hmi->points++;
+            if (--hmi->addtLeft == 0)
+                replyCode(hmi, RET_TRANSPARENT_END);
+            continue;
+        }
+        if (c == 0xFF) {
+            if (++hmi->terminators == 3) {
+                hmi->cmd[hmi->cmdLen] = 0;
+                if (hmi->cmdLen > 0)
+                    handleCommand(hmi, hmi->cmd);
+                hmi->cmdLen = 0;
+                hmi->terminators = 0;
+            }
+            continue;
+        }
+        hmi->terminators = 0;
+        if (hmi->cmdLen < NEXTION_CMD_MAX - 1)
+            hmi->cmd[hmi->cmdLen++] = c;
+    }
+}
+
+int main(int argc, char **argv)
+{
+    static nextion_t hmi = { .baud = 9600 };
+    const char *link = NULL;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "b:l:")) != -1) {
+        switch (opt) {
+        case 'b':
+            hmi.baud = strtoul(optarg, NULL, 0);
+            break;
+        case 'l':
+            link = optarg;
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-b baud] [-l link]\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    hmi.fd = sim_open_pty(link);
+    if (hmi.fd < 0)
+        return EXIT_FAILURE;
+
+    for (;;) {
+        uint8_t buf[512];
+        char line[128];
+
+        if (sim_wait_readable(STDIN_FILENO, 0) && fgets(line, sizeof(line), stdin) != NULL) {
+            unsigned page;
+
+            line[strcspn(line, "\r\n")] = 0;
+            if (sscanf(line, "page %u", &page) == 1) {
+                // A page whose preinit event runs "sendme", as the HMI's pages do
+                const uint8_t frame[] = { RET_SENDME, (uint8_t)page, 0xFF, 0xFF, 0xFF };
+
+                hmi.page = page;
+                printf("# page %u\n", page);
+                fflush(stdout);
+                reply(&hmi, frame, sizeof(frame));
+            } else {
+                reply(&hmi, (const uint8_t *)line, strlen(line));
+            }
+        }
+        if (!sim_wait_readable(hmi.fd, 50))
+            continue;
+        ssize_t n = read(hmi.fd, buf, sizeof(buf));
+        if (n > 0)
+            feed(&hmi, buf, n);
+    }
+}
@@ -0,0 +1,158 @@
+/*
+ * SNTP server stand-in for the time synchronisation in main/timesync.c.
+ *
+ * Answers NTP client requests on a UDP port with the time of a simulated
+ * reference clock: the host's real time, shifted by an offset and running
+ * fast or slow by a rate, so the firmware has an offset to remove and a
+ * drift to learn.
+ *
+ *   ntp_sim [-p port] [-o ms] [-r ppm] [-d ms] [-x rate] [-s seed]
+ *
+ *   -p  UDP port, 12300 by default like the host sdkconfig.h
+ *   -o  offset of the reference clock from the host's real time
+ *   -r  rate of the reference clock relative to the host's, in ppm
+ *   -d  extra delay on the reply path only, which biases the offset the
+ *       client sees by half of it like an asymmetric route does
+ *   -x  probability that a request is ignored
+ *   -s  seed for the drop generator
+ *
+ * Every reply is logged on stdout with the reference time it carried.
+ */
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+
+#define NTP_PACKET_LEN      48
+#define NTP_UNIX_OFFSET_S   2208988800ULL
+
+static volatile sig_atomic_t stop = 0;
+
+static void onSignal(int sig)
+{
+    (void)sig;
+    stop = 1;
+}
+
+static int64_t clockUs(clockid_t id)
+{
+    struct timespec ts;
+
+    clock_gettime(id, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* The reference clock: real time at start, then the monotonic clock scaled by the rate. */
+static int64_t referenceUs(int64_t startRealUs, int64_t startMonoUs, double offsetMs, double ratePpm)
+{
+    const int64_t elapsed = clockUs(CLOCK_MONOTONIC) - startMonoUs;
+
+    return startRealUs + elapsed + (int64_t)(elapsed * ratePpm / 1e6) + (int64_t)(offsetMs * 1000);
+}
+
+static void putNtpTime(uint8_t *p, int64_t unixUs)
+{
+    const uint64_t seconds = (uint64_t)(unixUs / 1000000) + NTP_UNIX_OFFSET_S;
+    const uint64_t fraction = ((uint64_t)(unixUs % 1000000) << 32) / 1000000;
+    const uint64_t ts = (seconds << 32) | (fraction & 0xFFFFFFFFULL);
+
+    for (int i = 7; i >= 0; i--)
+        p[7 - i] = (ts >> (i * 8)) & 0xFF;
+}
+
+int main(int argc, char **argv)
+{
+    struct sockaddr_in addr = { .sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_ANY) };
+    int port = 12300;
+    double offsetMs = 0, ratePpm = 0, delayMs = 0, dropRate = 0;
+    long seed = 1;
+    unsigned replies = 0, dropped = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "p:o:r:d:x:s:")) != -1) {
+        switch (opt) {
+        case 'p':
+            port = atoi(optarg);
+            break;
+        case 'o':
+            offsetMs = atof(optarg);
+            break;
+        case 'r':
+            ratePpm = atof(optarg);
+            break;
+        case 'd':
+            delayMs = atof(optarg);
+            break;
+        case 'x':
+            dropRate = atof(optarg);
+            break;
+        case 's':
+            seed = strtol(optarg, NULL, 0);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-p port] [-o ms] [-r ppm] [-d ms] [-x rate] [-s seed]\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    srand48(seed);
+    signal(SIGINT, onSignal);
+    signal(SIGTERM, onSignal);
+
+    const int sock = socket(AF_INET, SOCK_DGRAM, 0);
+    addr.sin_port = htons(port);
+    if (sock < 0 || bind(sock, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        perror("bind");
+        return EXIT_FAILURE;
+    }
+    /* Wake up now and then to notice a signal, recvfrom() is restarted after one. */
+    const struct timeval wake = { .tv_sec = 0, .tv_usec = 200000 };
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &wake, sizeof(wake));
+    const int64_t startRealUs = clockUs(CLOCK_REALTIME);
+    const int64_t startMonoUs = clockUs(CLOCK_MONOTONIC);
+    printf("serving on udp port %d, offset %.1f ms, rate %+.3f ppm\n", port, offsetMs, ratePpm);
+    fflush(stdout);
+
+    while (!stop) {
+        uint8_t packet[NTP_PACKET_LEN];
+        struct sockaddr_in from;
+        socklen_t fromLen = sizeof(from);
+        const ssize_t n = recvfrom(sock, packet, sizeof(packet), 0, (struct sockaddr *)&from, &fromLen);
+
+        if (n < NTP_PACKET_LEN || (packet[0] & 0x07) != 3)
+            continue;
+        if (drand48() < dropRate) {
+            dropped++;
+            continue;
+        }
+        const int64_t received = referenceUs(startRealUs, startMonoUs, offsetMs, ratePpm);
+
+        memcpy(packet + 24, packet + 40, 8);            // Originate: the client's transmit time
+        packet[0] = (0 << 6) | (4 << 3) | 4;            // No leap second, version 4, server
+        packet[1] = 1;                                  // Stratum 1, a reference clock
+        packet[2] = 6;
+        packet[3] = (uint8_t)-20;                       // About 1 us precision
+        memset(packet + 4, 0, 8);
+        memcpy(packet + 12, "SIM", 4);
+        putNtpTime(packet + 16, received);              // Reference: last set now
+        putNtpTime(packet + 32, received);
+        putNtpTime(packet + 40, received);
+        // The extra delay is on the way back, after the transmit time was taken
+        if (delayMs > 0)
+            usleep((useconds_t)(delayMs * 1000));
+        sendto(sock, packet, sizeof(packet), 0, (struct sockaddr *)&from, fromLen);
+        replies++;
+        printf("reply to %s:%d at %lld.%06lld\n", inet_ntoa(from.sin_addr), ntohs(from.sin_port),
+               (long long)(received / 1000000), (long long)(received % 1000000));
+        fflush(stdout);
+    }
+    fprintf(stderr, "%u replies, %u requests dropped\n", replies, dropped);
+    close(sock);
+    return EXIT_SUCCESS;
+}
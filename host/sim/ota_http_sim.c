@@ -0,0 +1,339 @@
+/*
+ * HTTP/1.1 file server for OTA downloads over HTTP, see main/ota_http.c.
+ *
+ * Serves one image for any path: GET and HEAD, single "Range: bytes=" ranges
+ * answered with 206 and Content-Range, keep-alive connections and requests
+ * pipelined on them, answered in order. Set CONFIG_OTA_HTTP_URL_OVERRIDE to
+ * http://<host>:<port>/<anything> and the firmware fetches its OTA file here
+ * instead of from the job's URL.
+ *
+ *   ota_http_sim [-p port] [-d ms] [-r KiB/s] [-k n] [-x rate] [-s seed] image.bin
+ *
+ *   -p  TCP port, 8080 by default
+ *   -d  delay before each response, standing in for the round trip
+ *   -r  send no faster than this
+ *   -k  close the connection after this many responses, as servers that
+ *       limit keep-alive do
+ *   -x  probability that a response is cut off halfway and the connection
+ *       dropped
+ *   -s  seed for the fault generator
+ *
+ * Connections are served one at a time. Every response is logged on stdout;
+ * on SIGINT/SIGTERM the totals are printed on stderr.
+ */
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#define REQUEST_MAX         8192
+#define SEND_CHUNK          4096
+
+typedef struct {
+    double delayMs;
+    double rateKiBps;
+    unsigned keepAliveMax;
+    double cutRate;
+} faults_t;
+
+typedef struct {
+    unsigned connections;
+    unsigned responses;
+    unsigned cut;
+    unsigned long long bytes;
+} totals_t;
+
+static volatile sig_atomic_t stop = 0;
+
+static void onSignal(int sig)
+{
+    (void)sig;
+    stop = 1;
+}
+
+static bool sendAll(int fd, const void *data, size_t len)
+{
+    const uint8_t *p = data;
+
+    while (len > 0) {
+        const ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+
+        if (n <= 0)
+            return false;
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+/* The body in chunks, paced to the rate limit. */
+static bool sendBody(int fd, const uint8_t *data, size_t len, const faults_t *faults)
+{
+    for (size_t pos = 0; pos < len; pos += SEND_CHUNK) {
+        const size_t n = len - pos < SEND_CHUNK ? len - pos : SEND_CHUNK;
+
+        if (!sendAll(fd, data + pos, n))
+            return false;
+        if (faults->rateKiBps > 0)
+            usleep((useconds_t)(n * 1e6 / (faults->rateKiBps * 1024)));
+    }
+    return true;
+}
+
+/* Value of a header in the request head, NULL if it is not there. */
+static const char *header(const char *head, const char *name, char *value, size_t size)
+{
+    const size_t nameLen = strlen(name);
+
+    for (const char *line = strstr(head, "\r\n"); line != NULL; line = strstr(line + 2, "\r\n")) {
+        const char *p = line + 2;
+
+        if (strncasecmp(p, name, nameLen) != 0 || p[nameLen] != ':')
+            continue;
+        p += nameLen + 1;
+        while (*p == ' ')
+            p++;
+        size_t len = strcspn(p, "\r\n");
+        if (len >= size)
+            len = size - 1;
+        memcpy(value, p, len);
+        value[len] = '\0';
+        return value;
+    }
+    return NULL;
+}
+
+/* "bytes=a-b", "bytes=a-" or "bytes=-n" against a file of size bytes. */
+static bool parseRange(const char *spec, size_t size, size_t *first, size_t *last)
+{
+    char *end;
+
+    if (strncmp(spec, "bytes=", 6) != 0 || strchr(spec, ',') != NULL)
+        return false;
+    spec += 6;
+    if (*spec == '-') {
+        const unsigned long long n = strtoull(spec + 1, &end, 10);
+
+        if (end == spec + 1 || n == 0 || size == 0)
+            return false;
+        *first = n >= size ? 0 : size - n;
+        *last = size - 1;
+        return true;
+    }
+    const unsigned long long a = strtoull(spec, &end, 10);
+    if (end == spec || *end != '-' || a >= size)
+        return false;
+    spec = end + 1;
+    unsigned long long b = size - 1;
+    if (*spec != '\0') {
+        b = strtoull(spec, &end, 10);
+        if (end == spec || b < a)
+            return false;
+        if (b >= size)
+            b = size - 1;
+    }
+    *first = a;
+    *last = b;
+    return true;
+}
+
+/* Answer one request; false once the connection is to be closed. */
+static bool respond(int fd, const char *head, const uint8_t *image, size_t size, const faults_t *faults,
+                    unsigned served, totals_t *totals)
+{
+    char method[16], range[128] = "", connection[32], reply[512];
+    size_t first = 0, last = size - 1;
+    int status = 200;
+
+    if (sscanf(head, "%15s", method) != 1)
+        return false;
+    const bool headOnly = strcmp(method, "HEAD") == 0;
+    bool keepAlive = strstr(head, "HTTP/1.1\r\n") != NULL;
+    if (header(head, "Connection", connection, sizeof(connection)) != NULL)
+        keepAlive = strcasecmp(connection, "close") != 0;
+    if (faults->keepAliveMax > 0 && served + 1 >= faults->keepAliveMax)
+        keepAlive = false;
+
+    int len;
+    if (!headOnly && strcmp(method, "GET") != 0) {
+        status = 405;
+        len = snprintf(reply, sizeof(reply), "HTTP/1.1 405 Method Not Allowed\r\nContent-Length: 0\r\n%s\r\n",
+                       keepAlive ? "" : "Connection: close\r\n");
+    } else if (header(head, "Range", range, sizeof(range)) != NULL && !parseRange(range, size, &first, &last)) {
+        status = 416;
+        len = snprintf(reply, sizeof(reply),
+                       "HTTP/1.1 416 Range Not Satisfiable\r\nContent-Range: bytes */%zu\r\nContent-Length: 0\r\n%s\r\n",
+                       size, keepAlive ? "" : "Connection: close\r\n");
+    } else if (header(head, "Range", range, sizeof(range)) != NULL) {
+        status = 206;
+        len = snprintf(reply, sizeof(reply),
+                       "HTTP/1.1 206 Partial Content\r\nContent-Type: application/octet-stream\r\n"
+                       "Content-Range: bytes %zu-%zu/%zu\r\nContent-Length: %zu\r\n%s\r\n",
+                       first, last, size, last - first + 1, keepAlive ? "" : "Connection: close\r\n");
+    } else {
+        len = snprintf(reply, sizeof(reply),
+                       "HTTP/1.1 200 OK\r\nContent-Type: application/octet-stream\r\nAccept-Ranges: bytes\r\n"
+                       "Content-Length: %zu\r\n%s\r\n", size, keepAlive ? "" : "Connection: close\r\n");
+    }
+
+    if (faults->delayMs > 0)
+        usleep((useconds_t)(faults->delayMs * 1000));
+    const size_t bodyLen = (status == 200 || status == 206) && !headOnly ? last - first + 1 : 0;
+    const bool cut = bodyLen > 0 && drand48() < faults->cutRate;
+    const bool sent = sendAll(fd, reply, len) &&
+                      sendBody(fd, image + first, cut ? bodyLen / 2 : bodyLen, faults);
+
+    totals->responses++;
+    totals->bytes += bodyLen;
+    printf("%s %s -> %d, %zu bytes%s\n", method, range, status, bodyLen,
+           cut ? ", cut off" : "");
+    fflush(stdout);
+    if (cut) {
+        totals->cut++;
+        return false;
+    }
+    return sent && keepAlive;
+}
+
+/* Serve requests on a connection until either side closes it. Pipelined
+ * requests sit in the buffer and are answered one after the other. */
+static void serve(int fd, const uint8_t *image, size_t size, const faults_t *faults, totals_t *totals)
+{
+    char buf[REQUEST_MAX + 1];
+    size_t have = 0;
+    unsigned served = 0;
+
+    while (!stop) {
+        char *end;
+
+        buf[have] = '\0';
+        while ((end = strstr(buf, "\r\n\r\n")) != NULL) {
+            const size_t headLen = end + 4 - buf;
+
+            end[2] = '\0';
+            if (!respond(fd, buf, image, size, faults, served++, totals))
+                return;
+            memmove(buf, buf + headLen, have - headLen);
+            have -= headLen;
+            buf[have] = '\0';
+        }
+        if (have == REQUEST_MAX)
+            return;     // A head that big is not a request of ours
+        const ssize_t n = recv(fd, buf + have, REQUEST_MAX - have, 0);
+        if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+            return;
+        if (n > 0)
+            have += n;
+    }
+}
+
+static int readImage(const char *path, uint8_t **data, size_t *length)
+{
+    FILE *f = fopen(path, "rb");
+    long size;
+
+    if (f == NULL || fseek(f, 0, SEEK_END) != 0 || (size = ftell(f)) <= 0) {
+        fprintf(stderr, "%s: cannot read or empty\n", path);
+        return -1;
+    }
+    rewind(f);
+    *length = (size_t)size;
+    *data = malloc(*length);
+    if (*data == NULL || fread(*data, 1, *length, f) != *length) {
+        perror(path);
+        fclose(f);
+        return -1;
+    }
+    fclose(f);
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    struct sockaddr_in addr = { .sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_ANY) };
+    faults_t faults = { 0 };
+    totals_t totals = { 0 };
+    int port = 8080, opt, one = 1;
+    long seed = 1;
+    uint8_t *image;
+    size_t size;
+
+    while ((opt = getopt(argc, argv, "p:d:r:k:x:s:")) != -1) {
+        switch (opt) {
+        case 'p':
+            port = atoi(optarg);
+            break;
+        case 'd':
+            faults.delayMs = atof(optarg);
+            break;
+        case 'r':
+            faults.rateKiBps = atof(optarg);
+            break;
+        case 'k':
+            faults.keepAliveMax = (unsigned)atoi(optarg);
+            break;
+        case 'x':
+            faults.cutRate = atof(optarg);
+            break;
+        case 's':
+            seed = strtol(optarg, NULL, 0);
+            break;
+        default:
+            optind = argc;
+            break;
+        }
+    }
+    if (optind != argc - 1) {
+        fprintf(stderr, "usage: %s [-p port] [-d ms] [-r KiB/s] [-k n] [-x rate] [-s seed] image.bin\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    if (readImage(argv[optind], &image, &size) != 0)
+        return EXIT_FAILURE;
+    srand48(seed);
+    signal(SIGINT, onSignal);
+    signal(SIGTERM, onSignal);
+
+    const int sock = socket(AF_INET, SOCK_STREAM, 0);
+    addr.sin_port = htons(port);
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (sock < 0 || bind(sock, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(sock, 4) != 0) {
+        perror("bind");
+        return EXIT_FAILURE;
+    }
+    /* Wake up now and then to notice a signal, accept() and recv() are restarted after one. */
+    const struct timeval wake = { .tv_sec = 0, .tv_usec = 200000 };
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &wake, sizeof(wake));
+    printf("serving %s (%zu bytes) on tcp port %d\n", argv[optind], size, port);
+    fflush(stdout);
+
+    while (!stop) {
+        struct sockaddr_in from;
+        socklen_t fromLen = sizeof(from);
+        const int fd = accept(sock, (struct sockaddr *)&from, &fromLen);
+
+        if (fd < 0)
+            continue;
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &wake, sizeof(wake));
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        totals.connections++;
+        printf("connection from %s:%d\n", inet_ntoa(from.sin_addr), ntohs(from.sin_port));
+        fflush(stdout);
+        serve(fd, image, size, &faults, &totals);
+        close(fd);
+    }
+    fprintf(stderr, "%u connections, %u responses, %llu body bytes, %u cut off\n", totals.connections,
+            totals.responses, totals.bytes, totals.cut);
+    close(sock);
+    free(image);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,358 @@
+/*
+ * PZEM-004T v3.0 simulator on a pseudo-terminal.
+ *
+ * Answers the Modbus-RTU subset of the meter: read holding registers (0x03,
+ * alarm threshold and slave address), read input registers (0x04,
+ * REG_VOLTAGE..REG_ALARM), write single register (0x06) and energy reset
+ * (0x42). The load follows a slow repeating profile so the display and
+ * trend have something to show, and energy integrates it.
+ *
+ *   pzem_sim [-a addr]... [-l link] [-d ms] [-j ms] [-e rate] [-t rate]
+ *            [-x rate] [-s seed]
+ *
+ *   -a  answer as this slave address, repeat for several meters on one bus
+ *   -d  extra turnaround before each reply, on top of the wire time at the
+ *       line speed the firmware set
+ *   -j  random extra delay of up to this much
+ *   -e  probability that a reply byte gets one bit flipped
+ *   -t  probability that a reply is cut short
+ *   -x  probability that a request is ignored
+ *   -s  seed for the fault generator, runs are reproducible
+ *
+ * The pty slave path is printed on stdout; -l also symlinks it, so
+ * HOST_UART1 can point at a fixed name. On SIGINT/SIGTERM the counters of
+ * injected faults are printed on stderr.
+ */
+#include <math.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "sim_pty.h"
+
+#define CMD_RHR             0x03
+#define CMD_RIR             0x04
+#define CMD_WSR             0x06
+#define CMD_REST            0x42
+#define CMD_ERROR           0x80
+
+#define WREG_ALARM_THR      0x0001
+#define WREG_ADDR           0x0002
+
+#define PZEM_DEFAULT_ADDR   0xF8
+#define PZEM_REGS           10
+#define PZEM_HOLDING_REGS   3
+#define PZEM_MAX_SLAVES     8
+
+typedef struct {
+    uint8_t addr;
+    uint16_t alarmThreshold;
+    double energyWh;
+    double lastUpdate;
+} pzem_t;
+
+typedef struct {
+    double latencyMs;
+    double jitterMs;
+    double bitErrorRate;
+    double truncateRate;
+    double dropRate;
+} faults_t;
+
+typedef struct {
+    unsigned long requests;
+    unsigned long replies;
+    unsigned long bitErrors;
+    unsigned long truncated;
+    unsigned long dropped;
+    unsigned long badRequests;
+} counters_t;
+
+static volatile sig_atomic_t stop;
+
+static uint16_t crc16(const uint8_t *data, size_t len)
+{
+    uint16_t crc = 0xFFFF;
+
+    while (len--) {
+        crc ^= *data++;
+        for (int i = 0; i < 8; i++)
+            crc = (crc & 1) ? (crc >> 1) ^ 0xA001 : crc >> 1;
+    }
+    return crc;
+}
+
+static void setCrc(uint8_t *frame, size_t len)
+{
+    uint16_t crc = crc16(frame, len - 2);
+
+    frame[len - 2] = crc & 0xFF;
+    frame[len - 1] = crc >> 8;
+}
+
+static bool checkCrc(const uint8_t *frame, size_t len)
+{
+    return len > 2 && crc16(frame, len - 2) == (frame[len - 2] | frame[len - 1] << 8);
+}
+
+/* Load profile: base load plus an appliance cycling every minute. */
+static void fillRegisters(pzem_t *dev, uint16_t *regs)
+{
+    double t = sim_now();
+    double voltage = 230.0 + 2.0 * sin(t / 7.0);
+    double power = 180.0 + ((long)t % 60 < 20 ? 1500.0 : 0.0) + 20.0 * sin(t);
+    double pf = 0.92;
+    double current = power / (voltage * pf);
+    uint32_t rawCurrent, rawPower, rawEnergy;
+
+    if (dev->lastUpdate > 0)
+        dev->energyWh += power * (t - dev->lastUpdate) / 3600.0;
+    dev->lastUpdate = t;
+
+    rawCurrent = (uint32_t)lround(current * 1000.0);
+    rawPower = (uint32_t)lround(power * 10.0);
+    rawEnergy = (uint32_t)dev->energyWh;
+
+    regs[0] = (uint16_t)lround(voltage * 10.0);
+    regs[1] = rawCurrent & 0xFFFF;
+    regs[2] = rawCurrent >> 16;
+    regs[3] = rawPower & 0xFFFF;
+    regs[4] = rawPower >> 16;
+    regs[5] = rawEnergy & 0xFFFF;
+    regs[6] = rawEnergy >> 16;
+    regs[7] = (uint16_t)lround((50.0 + 0.05 * sin(t / 11.0)) * 10.0);
+    regs[8] = (uint16_t)lround(pf * 100.0);
+    regs[9] = (dev->alarmThreshold != 0 && power >= dev->alarmThreshold) ? 0xFFFF : 0;
+}
+
+static size_t errorReply(uint8_t *out, uint8_t addr, uint8_t cmd, uint8_t code)
+{
+    out[0] = addr;
+    out[1] = cmd | CMD_ERROR;
+    out[2] = code;
+    setCrc(out, 5);
+    return 5;
+}
+
+/* Builds the reply of one slave to a request frame, returns its length. */
+static size_t handleFrame(pzem_t *dev, const uint8_t *req, size_t len, uint8_t *out)
+{
+    uint16_t reg = req[2] << 8 | req[3];
+    uint16_t val = req[4] << 8 | req[5];
+
+    switch (req[1]) {
+    case CMD_RHR: {
+        uint16_t regs[PZEM_HOLDING_REGS] = { 0, dev->alarmThreshold, dev->addr };
+
+        if (len != 8 || reg + val > PZEM_HOLDING_REGS || val == 0)
+            return errorReply(out, dev->addr, req[1], 0x02);
+        out[0] = dev->addr;
+        out[1] = CMD_RHR;
+        out[2] = val * 2;
+        for (uint16_t i = 0; i < val; i++) {
+            out[3 + 2 * i] = regs[reg + i] >> 8;
+            out[4 + 2 * i] = regs[reg + i] & 0xFF;
+        }
+        setCrc(out, 5 + val * 2);
+        return 5 + val * 2;
+    }
+    case CMD_RIR: {
+        uint16_t regs[PZEM_REGS];
+
+        if (len != 8 || reg + val > PZEM_REGS || val == 0)
+            return errorReply(out, dev->addr, req[1], 0x02);
+        fillRegisters(dev, regs);
+        out[0] = dev->addr;
+        out[1] = CMD_RIR;
+        out[2] = val * 2;
+        for (uint16_t i = 0; i < val; i++) {
+            out[3 + 2 * i] = regs[reg + i] >> 8;
+            out[4 + 2 * i] = regs[reg + i] & 0xFF;
+        }
+        setCrc(out, 5 + val * 2);
+        return 5 + val * 2;
+    }
+    case CMD_WSR:
+        if (reg == WREG_ADDR && val >= 0x01 && val <= 0xF7)
+            dev->addr = val;
+        else if (reg == WREG_ALARM_THR)
+            dev->alarmThreshold = val;
+        else
+            return errorReply(out, dev->addr, req[1], 0x02);
+        memcpy(out, req, 8);    // Echo, as the meter does
+        return 8;
+    case CMD_REST:
+        dev->energyWh = 0;
+        memcpy(out, req, 4);
+        return 4;
+    default:
+        return errorReply(out, dev->addr, req[1], 0x01);
+    }
+}
+
+static size_t frameLength(uint8_t cmd)
+{
+    return cmd == CMD_REST ? 4 : 8;
+}
+
+/* The slave a request is for. The general address 0xF8 reaches whichever
+ * meter is first; on a real bus with several meters it would collide. */
+static pzem_t *findSlave(pzem_t *slaves, int count, uint8_t addr)
+{
+    for (int i = 0; i < count; i++)
+        if (slaves[i].addr == addr)
+            return &slaves[i];
+    return addr == PZEM_DEFAULT_ADDR ? &slaves[0] : NULL;
+}
+
+static bool chance(double rate)
+{
+    return rate > 0 && drand48() < rate;
+}
+
+static void sleepMs(double ms)
+{
+    struct timespec ts;
+
+    if (ms <= 0)
+        return;
+    ts.tv_sec = (time_t)(ms / 1000);
+    ts.tv_nsec = (long)((ms - ts.tv_sec * 1000.0) * 1e6);
+    nanosleep(&ts, NULL);
+}
+
+/* Delays, corrupts or cuts a reply as configured, then sends it. */
+static void sendReply(int fd, const faults_t *faults, counters_t *count,
+                      uint8_t *reply, size_t len, size_t reqLen)
+{
+    uint32_t baud = sim_peer_baud(fd);
+    double wireMs = baud != 0 ? (reqLen + len) * 10 * 1000.0 / baud : 0;
+
+    sleepMs(wireMs + faults->latencyMs + faults->jitterMs * drand48());
+    for (size_t i = 0; i < len; i++) {
+        if (chance(faults->bitErrorRate)) {
+            reply[i] ^= 1 << (lrand48() % 8);
+            count->bitErrors++;
+        }
+    }
+    if (len > 1 && chance(faults->truncateRate)) {
+        len = 1 + lrand48() % (len - 1);
+        count->truncated++;
+    }
+    sim_write(fd, reply, len);
+    count->replies++;
+}
+
+static void onSignal(int sig)
+{
+    (void)sig;
+    stop = 1;
+}
+
+int main(int argc, char **argv)
+{
+    pzem_t slaves[PZEM_MAX_SLAVES];
+    int slaveCount = 0;
+    faults_t faults = { 0 };
+    counters_t count = { 0 };
+    const char *link = NULL;
+    long seed = 1;
+    uint8_t rx[64];
+    size_t have = 0;
+    int opt, fd;
+
+    while ((opt = getopt(argc, argv, "a:l:d:j:e:t:x:s:")) != -1) {
+        switch (opt) {
+        case 'a':
+            if (slaveCount == PZEM_MAX_SLAVES) {
+                fprintf(stderr, "at most %d slaves\n", PZEM_MAX_SLAVES);
+                return EXIT_FAILURE;
+            }
+            slaves[slaveCount++] = (pzem_t){ .addr = strtoul(optarg, NULL, 0) };
+            break;
+        case 'l':
+            link = optarg;
+            break;
+        case 'd':
+            faults.latencyMs = atof(optarg);
+            break;
+        case 'j':
+            faults.jitterMs = atof(optarg);
+            break;
+        case 'e':
+            faults.bitErrorRate = atof(optarg);
+            break;
+        case 't':
+            faults.truncateRate = atof(optarg);
+            break;
+        case 'x':
+            faults.dropRate = atof(optarg);
+            break;
+        case 's':
+            seed = strtol(optarg, NULL, 0);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-a addr]... [-l link] [-d ms] [-j ms] [-e rate] "
+                    "[-t rate] [-x rate] [-s seed]\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (slaveCount == 0)
+        slaves[slaveCount++] = (pzem_t){ .addr = PZEM_DEFAULT_ADDR };
+    srand48(seed);
+    signal(SIGINT, onSignal);
+    signal(SIGTERM, onSignal);
+
+    fd = sim_open_pty(link);
+    if (fd < 0)
+        return EXIT_FAILURE;
+
+    while (!stop) {
+        uint8_t reply[64];
+        ssize_t n;
+
+        /* A gap of a few character times ends a Modbus frame. */
+        if (!sim_wait_readable(fd, have > 0 ? 20 : 200)) {
+            have = 0;
+            continue;
+        }
+        n = read(fd, rx + have, sizeof(rx) - have);
+        if (n <= 0)
+            continue;
+        have += n;
+
+        while (have >= 2 && have >= frameLength(rx[1])) {
+            size_t len = frameLength(rx[1]);
+
+            if (checkCrc(rx, len)) {
+                pzem_t *dev = findSlave(slaves, slaveCount, rx[0]);
+
+                count.requests++;
+                if (dev != NULL && !chance(faults.dropRate)) {
+                    size_t out = handleFrame(dev, rx, len, reply);
+
+                    sendReply(fd, &faults, &count, reply, out, len);
+                } else if (dev != NULL) {
+                    count.dropped++;
+                }
+            } else {
+                count.badRequests++;
+                len = 1;    // Resynchronise one byte at a time
+            }
+            memmove(rx, rx + len, have - len);
+            have -= len;
+        }
+        if (have == sizeof(rx))
+            have = 0;
+    }
+
+    fprintf(stderr, "requests %lu, replies %lu, bit errors %lu, truncated %lu, dropped %lu, "
+            "bad requests %lu\n", count.requests, count.replies, count.bitErrors,
+            count.truncated, count.dropped, count.badRequests);
+    return EXIT_SUCCESS;
+}
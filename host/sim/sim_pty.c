@@ -0,0 +1,99 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "sim_pty.h"
+
+int sim_open_pty(const char *link)
+{
+    struct termios tio;
+    const char *slave;
+    int fd = posix_openpt(O_RDWR | O_NOCTTY);
+
+    if (fd < 0 || grantpt(fd) != 0 || unlockpt(fd) != 0 || (slave = ptsname(fd)) == NULL) {
+        perror("pty");
+        return -1;
+    }
+
+    /* Keep our own handle on the slave so the master never reports a hangup
+     * while the firmware is restarting. It also sets the line to raw before
+     * the firmware opens it. */
+    int keep = open(slave, O_RDWR | O_NOCTTY);
+    if (keep >= 0 && tcgetattr(keep, &tio) == 0) {
+        cfmakeraw(&tio);
+        cfsetispeed(&tio, B9600);
+        cfsetospeed(&tio, B9600);
+        tcsetattr(keep, TCSANOW, &tio);
+    }
+    if (tcgetattr(fd, &tio) == 0) {
+        cfmakeraw(&tio);
+        tcsetattr(fd, TCSANOW, &tio);
+    }
+
+    if (link != NULL) {
+        unlink(link);
+        if (symlink(slave, link) != 0)
+            perror("symlink");
+    }
+    printf("%s\n", slave);
+    fflush(stdout);
+    return fd;
+}
+
+bool sim_wait_readable(int fd, int timeoutMs)
+{
+    struct pollfd pfd = { .fd = fd, .events = POLLIN };
+
+    return poll(&pfd, 1, timeoutMs) > 0;
+}
+
+void sim_write(int fd, const void *data, size_t len)
+{
+    const uint8_t *p = data;
+
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+
+        if (n < 0) {
+            if (errno == EINTR || errno == EAGAIN)
+                continue;
+            return;
+        }
+        p += n;
+        len -= n;
+    }
+}
+
+/* On Linux termios requests on the master act on the slave, so this sees
+ * what the firmware configured. */
+uint32_t sim_peer_baud(int fd)
+{
+    static const struct { speed_t speed; uint32_t rate; } speeds[] = {
+        { B2400, 2400 }, { B4800, 4800 }, { B9600, 9600 }, { B19200, 19200 },
+        { B38400, 38400 }, { B57600, 57600 }, { B115200, 115200 }, { B230400, 230400 },
+        { B460800, 460800 }, { B921600, 921600 },
+    };
+    struct termios tio;
+
+    if (tcgetattr(fd, &tio) != 0)
+        return 0;
+    for (size_t i = 0; i < sizeof(speeds) / sizeof(speeds[0]); i++)
+        if (cfgetospeed(&tio) == speeds[i].speed)
+            return speeds[i].rate;
+    return 0;
+}
+
+double sim_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
@@ -0,0 +1,27 @@
+/*
+ * Helpers shared by the peripheral simulators.
+ */
+#ifndef SIM_PTY_H
+#define SIM_PTY_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Opens a raw pty, prints the slave path on stdout and optionally symlinks
+ * it to link. Returns the master fd or -1. */
+int sim_open_pty(const char *link);
+
+/* Waits up to timeoutMs (-1 forever) for input, true if readable. */
+bool sim_wait_readable(int fd, int timeoutMs);
+
+/* Writes all of data, retrying short writes. */
+void sim_write(int fd, const void *data, size_t len);
+
+/* Line speed the firmware set on the slave side, 0 if unknown. */
+uint32_t sim_peer_baud(int fd);
+
+/* Monotonic time in seconds. */
+double sim_now(void);
+
+#endif /* SIM_PTY_H */
@@ -0,0 +1,158 @@
+/*
+ * The OTA heatshrink decoder against streams laid out the way heatshrink's
+ * own encoder (heatshrink_encoder.c, as run by "heatshrink -e -w 11 -l 4")
+ * lays them out.
+ *
+ *   ota_heatshrink_test
+ *
+ * That encoder starts from a window of zeros and looks for matches from the
+ * nearest position back, so a file starting with a zero run, as ESP images
+ * do after their header bytes, refers to before its first byte. The encoder
+ * below follows its match search and break-even rule; a fixed stream checks
+ * the bit layout itself.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ota_heatshrink.h"
+
+#define LOOKAHEAD       (1U << OTA_HEATSHRINK_LOOKAHEAD_BITS)
+#define BREAK_EVEN      ((1 + OTA_HEATSHRINK_WINDOW_BITS + OTA_HEATSHRINK_LOOKAHEAD_BITS) / 8)
+#define BLOCK_SIZE      1024
+#define IMAGE_SIZE      (20 * 1024)
+
+typedef struct {
+    uint8_t *data;
+    size_t length;
+    uint32_t acc;
+    int bits;
+} bit_writer_t;
+
+typedef struct {
+    uint8_t *data;
+    size_t capacity;
+    size_t length;
+} output_t;
+
+static int failures = 0;
+
+static void putBits(bit_writer_t *w, uint32_t value, int count)
+{
+    while (count-- > 0) {
+        w->acc = (w->acc << 1) | ((value >> count) & 1);
+        if (++w->bits == 8) {
+            w->data[w->length++] = w->acc;
+            w->acc = 0;
+            w->bits = 0;
+        }
+    }
+}
+
+/* find_longest_match() and the break-even rule of heatshrink_encoder.c, over
+ * the input behind a window of zeros. */
+static size_t encode(const uint8_t *image, size_t imageLength, uint8_t *out)
+{
+    const size_t length = OTA_HEATSHRINK_WINDOW_SIZE + imageLength;
+    uint8_t *in = calloc(length, 1);
+    bit_writer_t w = { .data = out };
+
+    memcpy(in + OTA_HEATSHRINK_WINDOW_SIZE, image, imageLength);
+    for (size_t end = OTA_HEATSHRINK_WINDOW_SIZE; end < length;) {
+        const size_t maxLen = length - end < LOOKAHEAD ? length - end : LOOKAHEAD;
+        size_t best = 0, index = 0;
+
+        for (size_t pos = end - 1; pos + 1 > end - OTA_HEATSHRINK_WINDOW_SIZE; pos--) {
+            size_t len = 0;
+
+            while (len < maxLen && in[pos + len] == in[end + len])
+                len++;
+            if (len > best) {
+                best = len;
+                index = pos;
+                if (len == maxLen)
+                    break;
+            }
+        }
+        if (best > BREAK_EVEN) {
+            putBits(&w, 0, 1);
+            putBits(&w, end - index - 1, OTA_HEATSHRINK_WINDOW_BITS);
+            putBits(&w, best - 1, OTA_HEATSHRINK_LOOKAHEAD_BITS);
+            end += best;
+        } else {
+            putBits(&w, 1, 1);
+            putBits(&w, in[end++], 8);
+        }
+    }
+    if (w.bits > 0)
+        w.data[w.length++] = w.acc << (8 - w.bits);
+    free(in);
+    return w.length;
+}
+
+static int takeDecoded(void *ctx, uint32_t offset, const uint8_t *buf, size_t len)
+{
+    output_t *out = ctx;
+
+    if (offset != out->length || out->length + len > out->capacity)
+        return -1;
+    memcpy(out->data + offset, buf, len);
+    out->length += len;
+    return 0;
+}
+
+/* Decode in file blocks and compare with what was compressed. */
+static void expectDecodes(const char *what, const uint8_t *packed, size_t packedLength, const uint8_t *image,
+                          size_t length)
+{
+    static ota_heatshrink_t decoder;
+    output_t decoded = { .data = malloc(length + 1), .capacity = length };
+    ota_heatshrink_status_t status = OTA_HEATSHRINK_OK;
+
+    ota_heatshrink_begin(&decoder, takeDecoded, &decoded);
+    for (size_t pos = 0; pos < packedLength && status == OTA_HEATSHRINK_OK; pos += BLOCK_SIZE)
+        status = ota_heatshrink_feed(&decoder, packed + pos,
+                                     packedLength - pos < BLOCK_SIZE ? packedLength - pos : BLOCK_SIZE);
+    if (status == OTA_HEATSHRINK_OK)
+        status = ota_heatshrink_end(&decoder);
+
+    if (status != OTA_HEATSHRINK_OK || decoded.length != length || memcmp(decoded.data, image, length) != 0) {
+        printf("FAIL %s: %s, %zu of %zu bytes\n", what, ota_heatshrink_strerror(status), decoded.length, length);
+        failures++;
+    }
+    free(decoded.data);
+}
+
+int main(void)
+{
+    // 16 zeros: one reference at distance 1, into the initial window, of length 16
+    static const uint8_t zeros[16];
+    static const uint8_t zerosPacked[] = { 0x00, 0x0F };
+    uint8_t *image = malloc(IMAGE_SIZE);
+    uint8_t *packed = malloc(IMAGE_SIZE + IMAGE_SIZE / 8 + 2);
+    size_t packedLength;
+
+    expectDecodes("zero run, fixed stream", zerosPacked, sizeof(zerosPacked), zeros, sizeof(zeros));
+    packedLength = encode(zeros, sizeof(zeros), packed);
+    if (packedLength != sizeof(zerosPacked) || memcmp(packed, zerosPacked, packedLength) != 0) {
+        printf("FAIL zero run: encoder does not match the fixed stream\n");
+        failures++;
+    }
+
+    // An ESP image: header, zero padding, code with repeats and noise
+    srand(1);
+    memset(image, 0, IMAGE_SIZE);
+    image[0] = 0xE9;
+    image[1] = 4;
+    image[2] = 2;
+    image[3] = 0x20;
+    for (size_t i = 64; i < IMAGE_SIZE; i++)
+        image[i] = (i / 512) % 3 == 0 ? 0 : (i / 512) % 3 == 1 ? (uint8_t)(i * 7) : (uint8_t)rand();
+    packedLength = encode(image, IMAGE_SIZE, packed);
+    expectDecodes("ESP image", packed, packedLength, image, IMAGE_SIZE);
+
+    printf("%s\n", failures ? "ota_heatshrink_test failed" : "ota_heatshrink_test passed");
+    free(image);
+    free(packed);
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,222 @@
+/*
+ * Host side of delta OTA updates, see libraries/ota-for-aws-iot-embedded-sdk/port/ota_delta.h.
+ *
+ *   ota_delta pack patch.bsdiff patch.delta
+ *   ota_delta apply old.bin patch.delta new.bin
+ *
+ * pack turns a patch made by the classic bsdiff tool (BSDIFF40, three bzip2
+ * streams) into the uncompressed, interleaved layout the device applies as
+ * it goes. apply rebuilds the new image with the same code as the device,
+ * reading the old image from a file in place of the running partition, so
+ * a patch can be checked against the image it was made from before it is
+ * put in an OTA job:
+ *
+ *   bsdiff old.bin new.bin patch.bsdiff
+ *   ota_delta pack patch.bsdiff patch.delta
+ *   ota_delta apply old.bin patch.delta check.bin && cmp new.bin check.bin
+ */
+#include <bzlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "ota_delta.h"
+
+typedef struct {
+    uint8_t *data;
+    size_t length;
+} blob_t;
+
+static int readFile(const char *path, blob_t *blob)
+{
+    FILE *f = fopen(path, "rb");
+    long size;
+
+    if (f == NULL || fseek(f, 0, SEEK_END) != 0 || (size = ftell(f)) < 0) {
+        perror(path);
+        return -1;
+    }
+    rewind(f);
+    blob->length = (size_t)size;
+    blob->data = malloc(blob->length ? blob->length : 1);
+    if (blob->data == NULL || fread(blob->data, 1, blob->length, f) != blob->length) {
+        perror(path);
+        fclose(f);
+        return -1;
+    }
+    fclose(f);
+    return 0;
+}
+
+static int64_t offtin(const uint8_t *buf)
+{
+    int64_t value = buf[7] & 0x7F;
+
+    for (int i = 6; i >= 0; i--)
+        value = (value << 8) | buf[i];
+    return (buf[7] & 0x80) ? -value : value;
+}
+
+static void offtout(int64_t value, uint8_t *buf)
+{
+    uint64_t magnitude = value < 0 ? (uint64_t)-value : (uint64_t)value;
+
+    for (int i = 0; i < 8; i++, magnitude >>= 8)
+        buf[i] = magnitude & 0xFF;
+    if (value < 0)
+        buf[7] |= 0x80;
+}
+
+/* Decompress a whole bzip2 stream, growing the output as needed. */
+static int bunzip(const uint8_t *in, size_t inLength, blob_t *out)
+{
+    bz_stream bz = { 0 };
+    size_t capacity = inLength * 4 + 1024;
+    int ret;
+
+    out->data = malloc(capacity);
+    out->length = 0;
+    if (out->data == NULL || BZ2_bzDecompressInit(&bz, 0, 0) != BZ_OK)
+        return -1;
+    bz.next_in = (char *)in;
+    bz.avail_in = inLength;
+    do {
+        if (out->length == capacity) {
+            capacity *= 2;
+            out->data = realloc(out->data, capacity);
+            if (out->data == NULL)
+                return -1;
+        }
+        bz.next_out = (char *)out->data + out->length;
+        bz.avail_out = capacity - out->length;
+        ret = BZ2_bzDecompress(&bz);
+        out->length = capacity - bz.avail_out;
+    } while (ret == BZ_OK && (bz.avail_in > 0 || bz.avail_out == 0));
+    BZ2_bzDecompressEnd(&bz);
+    return ret == BZ_STREAM_END ? 0 : -1;
+}
+
+static int pack(const char *inPath, const char *outPath)
+{
+    blob_t patch, ctrl, diff, extra;
+    uint8_t field[OTA_DELTA_HEADER_LEN];
+    size_t diffPos = 0, extraPos = 0;
+    int64_t newPos = 0;
+
+    if (readFile(inPath, &patch) != 0)
+        return EXIT_FAILURE;
+    if (patch.length < 32 || memcmp(patch.data, "BSDIFF40", 8) != 0) {
+        fprintf(stderr, "%s: not a BSDIFF40 patch\n", inPath);
+        return EXIT_FAILURE;
+    }
+    const int64_t ctrlLength = offtin(patch.data + 8);
+    const int64_t diffLength = offtin(patch.data + 16);
+    const int64_t newSize = offtin(patch.data + 24);
+    if (ctrlLength < 0 || diffLength < 0 || newSize < 0 || 32 + ctrlLength + diffLength > (int64_t)patch.length ||
+        bunzip(patch.data + 32, ctrlLength, &ctrl) != 0 ||
+        bunzip(patch.data + 32 + ctrlLength, diffLength, &diff) != 0 ||
+        bunzip(patch.data + 32 + ctrlLength + diffLength, patch.length - 32 - ctrlLength - diffLength, &extra) != 0) {
+        fprintf(stderr, "%s: corrupt patch\n", inPath);
+        return EXIT_FAILURE;
+    }
+
+    FILE *out = fopen(outPath, "wb");
+    if (out == NULL) {
+        perror(outPath);
+        return EXIT_FAILURE;
+    }
+    memcpy(field, OTA_DELTA_MAGIC, OTA_DELTA_MAGIC_LEN);
+    offtout(newSize, field + OTA_DELTA_MAGIC_LEN);
+    fwrite(field, 1, OTA_DELTA_HEADER_LEN, out);
+    for (size_t c = 0; c + OTA_DELTA_CONTROL_LEN <= ctrl.length && newPos < newSize; c += OTA_DELTA_CONTROL_LEN) {
+        const int64_t diffBytes = offtin(ctrl.data + c);
+        const int64_t extraBytes = offtin(ctrl.data + c + 8);
+
+        if (diffBytes < 0 || extraBytes < 0 || diffPos + diffBytes > diff.length ||
+            extraPos + extraBytes > extra.length) {
+            fprintf(stderr, "%s: corrupt control block\n", inPath);
+            fclose(out);
+            return EXIT_FAILURE;
+        }
+        fwrite(ctrl.data + c, 1, OTA_DELTA_CONTROL_LEN, out);
+        fwrite(diff.data + diffPos, 1, diffBytes, out);
+        fwrite(extra.data + extraPos, 1, extraBytes, out);
+        diffPos += diffBytes;
+        extraPos += extraBytes;
+        newPos += diffBytes + extraBytes;
+    }
+    const long packed = ftell(out);
+    fclose(out);
+    if (newPos != newSize) {
+        fprintf(stderr, "%s: controls cover %lld of %lld bytes\n", inPath, (long long)newPos, (long long)newSize);
+        return EXIT_FAILURE;
+    }
+    printf("%lld byte image, patch %zu bytes, %ld bytes packed\n", (long long)newSize, patch.length, packed);
+    return EXIT_SUCCESS;
+}
+
+static int readSource(void *ctx, uint32_t offset, uint8_t *buf, size_t len)
+{
+    const blob_t *source = ctx;
+
+    if ((size_t)offset + len > source->length)
+        return -1;
+    memcpy(buf, source->data + offset, len);
+    return 0;
+}
+
+static FILE *target;
+
+static int writeTarget(void *ctx, uint32_t offset, const uint8_t *buf, size_t len)
+{
+    (void)ctx;
+    return fseek(target, offset, SEEK_SET) == 0 && fwrite(buf, 1, len, target) == len ? 0 : -1;
+}
+
+static int apply(const char *oldPath, const char *patchPath, const char *newPath)
+{
+    static ota_delta_t delta;
+    blob_t source, patch;
+    struct timespec start, end;
+    ota_delta_status_t status;
+
+    if (readFile(oldPath, &source) != 0 || readFile(patchPath, &patch) != 0)
+        return EXIT_FAILURE;
+    target = fopen(newPath, "wb");
+    if (target == NULL) {
+        perror(newPath);
+        return EXIT_FAILURE;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    ota_delta_begin(&delta, readSource, writeTarget, &source, source.length, UINT32_MAX);
+    // Fed in 1 KiB pieces like file blocks
+    for (size_t pos = 0; pos < patch.length; pos += 1024) {
+        const size_t n = patch.length - pos < 1024 ? patch.length - pos : 1024;
+
+        if (ota_delta_feed(&delta, patch.data + pos, n) != OTA_DELTA_OK)
+            break;
+    }
+    status = ota_delta_end(&delta);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    fclose(target);
+    if (status != OTA_DELTA_OK) {
+        fprintf(stderr, "%s: %s\n", patchPath, ota_delta_strerror(status));
+        return EXIT_FAILURE;
+    }
+    const double ms = (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6;
+    printf("%u byte image from %zu byte patch in %.1f ms\n", delta.target_size, patch.length, ms);
+    return EXIT_SUCCESS;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc == 4 && strcmp(argv[1], "pack") == 0)
+        return pack(argv[2], argv[3]);
+    if (argc == 5 && strcmp(argv[1], "apply") == 0)
+        return apply(argv[2], argv[3], argv[4]);
+    fprintf(stderr, "usage: %s pack patch.bsdiff patch.delta\n"
+                    "       %s apply old.bin patch.delta new.bin\n", argv[0], argv[0]);
+    return EXIT_FAILURE;
+}
@@ -1,19 +1,20 @@
+#include <string.h>
 #include "freertos/FreeRTOS.h"
 #include "freertos/semphr.h"
 #include "esp_log.h"
+#include "esp_system.h"
+#include "esp_timer.h"
 #include "esp_tls.h"
 #include "network_transport.h"
 #include "sdkconfig.h"
 
+static const char *TAG = "TLS_TRANSPORT";
+
 TlsTransportStatus_t xTlsConnect( NetworkContext_t* pxNetworkContext )
 {
     TlsTransportStatus_t xRet = TLS_TRANSPORT_SUCCESS;
 
     esp_tls_cfg_t xEspTlsConfig = {
-        .cacert_buf = (const unsigned char*) ( pxNetworkContext->pcServerRootCAPem ),
-        .cacert_bytes = strlen( pxNetworkContext->pcServerRootCAPem ) + 1,
-        .clientcert_buf = (const unsigned char*) ( pxNetworkContext->pcClientCertPem ),
-        .clientcert_bytes = strlen( pxNetworkContext->pcClientCertPem ) + 1,
         .skip_common_name = pxNetworkContext->disableSni,
         .alpn_protos = pxNetworkContext->pAlpnProtos,
 #ifdef CONFIG_EXAMPLE_USE_SECURE_ELEMENT
@@ -23,12 +24,50 @@ TlsTransportStatus_t xTlsConnect( NetworkContext_t* pxNetworkContext )
         .ds_data = pxNetworkContext->ds_data,
 #else
         .ds_data = NULL,
-        .clientkey_buf = ( const unsigned char* )( pxNetworkContext->pcClientKeyPem ),
-        .clientkey_bytes = strlen( pxNetworkContext->pcClientKeyPem ) + 1,
 #endif /* CONFIG_EXAMPLE_USE_DS_PERIPHERAL */
         .timeout_ms = 3000,
     };
 
+    /* Credentials parsed in advance where there are any, see main/credentials.c. */
+    if( pxNetworkContext->useGlobalCaStore )
+    {
+        xEspTlsConfig.use_global_ca_store = true;
+    }
+    else
+    {
+        xEspTlsConfig.cacert_buf = ( const unsigned char* )( pxNetworkContext->pcServerRootCAPem );
+        xEspTlsConfig.cacert_bytes = strlen( pxNetworkContext->pcServerRootCAPem ) + 1;
+    }
+
+    if( pxNetworkContext->pucClientCertDer != NULL )
+    {
+        xEspTlsConfig.clientcert_buf = pxNetworkContext->pucClientCertDer;
+        xEspTlsConfig.clientcert_bytes = pxNetworkContext->xClientCertDerSize;
+    }
+    else if( pxNetworkContext->pcClientCertPem != NULL )
+    {
+        xEspTlsConfig.clientcert_buf = ( const unsigned char* )( pxNetworkContext->pcClientCertPem );
+        xEspTlsConfig.clientcert_bytes = strlen( pxNetworkContext->pcClientCertPem ) + 1;
+    }
+
+#ifndef CONFIG_EXAMPLE_USE_DS_PERIPHERAL
+    if( pxNetworkContext->pucClientKeyDer != NULL )
+    {
+        xEspTlsConfig.clientkey_buf = pxNetworkContext->pucClientKeyDer;
+        xEspTlsConfig.clientkey_bytes = pxNetworkContext->xClientKeyDerSize;
+    }
+    else if( pxNetworkContext->pcClientKeyPem != NULL )
+    {
+        xEspTlsConfig.clientkey_buf = ( const unsigned char* )( pxNetworkContext->pcClientKeyPem );
+        xEspTlsConfig.clientkey_bytes = strlen( pxNetworkContext->pcClientKeyPem ) + 1;
+    }
+#endif /* CONFIG_EXAMPLE_USE_DS_PERIPHERAL */
+
+    /* The handshake's time includes the round trips; the heap still taken
+     * once it is done is what the session holds on to. */
+    const int64_t xStartUs = esp_timer_get_time();
+    const uint32_t ulFreeBefore = esp_get_free_heap_size();
+
     esp_tls_t* pxTls = esp_tls_init();
 
     xSemaphoreTake(pxNetworkContext->xTlsContextSemaphore, portMAX_DELAY);
@@ -44,6 +83,15 @@ TlsTransportStatus_t xTlsConnect( NetworkContext_t* pxNetworkContext )
 
     xSemaphoreGive(pxNetworkContext->xTlsContextSemaphore);
 
+    if( xRet == TLS_TRANSPORT_SUCCESS )
+    {
+        ESP_LOGI( TAG, "Connected to %s in %u ms, session holds %d bytes, lowest free heap %u bytes",
+                  pxNetworkContext->pcHostname,
+                  ( unsigned ) ( ( esp_timer_get_time() - xStartUs ) / 1000 ),
+                  ( int ) ( ulFreeBefore - esp_get_free_heap_size() ),
+                  ( unsigned ) esp_get_minimum_free_heap_size() );
+    }
+
     return xRet;
 }
 
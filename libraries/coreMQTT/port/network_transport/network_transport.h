@@ -28,6 +28,14 @@ struct NetworkContext
     const char *pcServerRootCAPem;   /**< @brief String representing a trusted server root certificate. */
     const char *pcClientCertPem;     /**< @brief String representing the client certificate. */
     const char *pcClientKeyPem;      /**< @brief String representing the client certificate's private key. */
+    bool useGlobalCaStore;           /**< @brief Verify the server against esp-tls's global CA store, parsed
+                                                 once, instead of parsing pcServerRootCAPem. */
+    const unsigned char *pucClientCertDer; /**< @brief The client certificate in DER, used instead of
+                                                       pcClientCertPem when set. */
+    size_t xClientCertDerSize;
+    const unsigned char *pucClientKeyDer;  /**< @brief The private key in DER, used instead of
+                                                       pcClientKeyPem when set. */
+    size_t xClientKeyDerSize;
     bool use_secure_element;         /**< @brief Boolean representing the use of secure element
                                                  for the TLS connection. */
     void *ds_data;                   /**< @brief Pointer for digital signature peripheral context */
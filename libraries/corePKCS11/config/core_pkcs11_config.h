@@ -122,6 +122,12 @@
  */
 #define pkcs11configSTORAGE_NS         "creds"
 
+/**
+ * @brief Bytes of RAM the PAL may hold on to for public objects read from
+ * NVS. 0 reads every object from NVS.
+ */
+#define pkcs11configPAL_CACHE_SIZE     CONFIG_CORE_PKCS_PAL_CACHE_SIZE
+
 /**
  * @brief PKCS #11 default user PIN.
  *
@@ -23,6 +23,7 @@
 /* PKCS#11 Interface Include. */
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
+#include "freertos/semphr.h"
 #include "iot_crypto.h"
 #include "core_pkcs11.h"
 #include "core_pkcs11_pal.h"
@@ -54,6 +55,26 @@ enum eObjectHandles
     eAwsCodeSigningKey,
     eAwsJITPCertificate
 };
+
+/**
+ * @brief A public object as last read from NVS.
+ */
+typedef struct
+{
+    CK_BYTE_PTR pucData;
+    CK_ULONG ulDataSize;
+} PalCacheEntry_t;
+
+#if pkcs11configPAL_CACHE_SIZE > 0
+/* Indexed by handle. Only certificates and the code signing key go in, the
+ * device public key shares its NVS blob with the private key. */
+static PalCacheEntry_t xCache[ eAwsJITPCertificate + 1 ];
+static CK_ULONG ulCacheBytes;
+/* Bumped on every write, an object read before it is not put in the cache. */
+static uint32_t ulCacheGeneration;
+static SemaphoreHandle_t xCacheMutex;
+static StaticSemaphore_t xCacheMutexBuffer;
+#endif
 /*-----------------------------------------------------------*/
 
 static void initialize_nvs_partition()
@@ -161,9 +182,157 @@ void prvLabelToFilenameHandle( uint8_t * pcLabel,
     }
 }
 
+#if pkcs11configPAL_CACHE_SIZE > 0
+
+static CK_BBOOL prvIsCacheable( CK_OBJECT_HANDLE xHandle )
+{
+    return ( ( xHandle == eAwsDeviceCertificate ) ||
+             ( xHandle == eAwsCodeSigningKey ) ||
+             ( xHandle == eAwsJITPCertificate ) ) ? CK_TRUE : CK_FALSE;
+}
+
+/**
+ * @brief Copies a cached object into a buffer of the caller's, freed by
+ * PKCS11_PAL_GetObjectValueCleanup() like one read from NVS.
+ *
+ * @param[out] pulGeneration  On a miss, the generation to pass to prvCachePut().
+ *
+ * @return CK_TRUE on a hit.
+ */
+static CK_BBOOL prvCacheGet( CK_OBJECT_HANDLE xHandle,
+                             CK_BYTE_PTR * ppucData,
+                             CK_ULONG_PTR pulDataSize,
+                             uint32_t * pulGeneration )
+{
+    CK_BBOOL xHit = CK_FALSE;
+
+    if( ( xCacheMutex == NULL ) || ( prvIsCacheable( xHandle ) == CK_FALSE ) )
+    {
+        return CK_FALSE;
+    }
+
+    xSemaphoreTake( xCacheMutex, portMAX_DELAY );
+
+    if( xCache[ xHandle ].pucData != NULL )
+    {
+        CK_BYTE_PTR pucCopy = pvPortMalloc( xCache[ xHandle ].ulDataSize );
+
+        if( pucCopy != NULL )
+        {
+            ( void ) memcpy( pucCopy, xCache[ xHandle ].pucData, xCache[ xHandle ].ulDataSize );
+            *ppucData = pucCopy;
+            *pulDataSize = xCache[ xHandle ].ulDataSize;
+            xHit = CK_TRUE;
+        }
+    }
+
+    *pulGeneration = ulCacheGeneration;
+    xSemaphoreGive( xCacheMutex );
+
+    return xHit;
+}
+
+/**
+ * @brief Keeps a copy of an object just read from NVS, unless it was written
+ * since the read began or there is no room left for it.
+ */
+static void prvCachePut( CK_OBJECT_HANDLE xHandle,
+                         const CK_BYTE * pucData,
+                         CK_ULONG ulDataSize,
+                         uint32_t ulGeneration )
+{
+    if( ( xCacheMutex == NULL ) || ( prvIsCacheable( xHandle ) == CK_FALSE ) )
+    {
+        return;
+    }
+
+    xSemaphoreTake( xCacheMutex, portMAX_DELAY );
+
+    if( ( ulGeneration == ulCacheGeneration ) &&
+        ( xCache[ xHandle ].pucData == NULL ) &&
+        ( ulCacheBytes + ulDataSize <= pkcs11configPAL_CACHE_SIZE ) )
+    {
+        CK_BYTE_PTR pucCopy = pvPortMalloc( ulDataSize );
+
+        if( pucCopy != NULL )
+        {
+            ( void ) memcpy( pucCopy, pucData, ulDataSize );
+            xCache[ xHandle ].pucData = pucCopy;
+            xCache[ xHandle ].ulDataSize = ulDataSize;
+            ulCacheBytes += ulDataSize;
+        }
+    }
+
+    xSemaphoreGive( xCacheMutex );
+}
+
+/**
+ * @brief Drops the cached copy of an object about to change in NVS.
+ */
+static void prvCacheInvalidate( CK_OBJECT_HANDLE xHandle )
+{
+    if( xCacheMutex == NULL )
+    {
+        return;
+    }
+
+    xSemaphoreTake( xCacheMutex, portMAX_DELAY );
+    ulCacheGeneration++;
+
+    if( ( prvIsCacheable( xHandle ) == CK_TRUE ) && ( xCache[ xHandle ].pucData != NULL ) )
+    {
+        ulCacheBytes -= xCache[ xHandle ].ulDataSize;
+        vPortFree( xCache[ xHandle ].pucData );
+        xCache[ xHandle ].pucData = NULL;
+        xCache[ xHandle ].ulDataSize = 0;
+    }
+
+    xSemaphoreGive( xCacheMutex );
+}
+
+static CK_BBOOL prvIsCached( CK_OBJECT_HANDLE xHandle )
+{
+    CK_BBOOL xCached = CK_FALSE;
+
+    if( ( xCacheMutex != NULL ) && ( prvIsCacheable( xHandle ) == CK_TRUE ) )
+    {
+        xSemaphoreTake( xCacheMutex, portMAX_DELAY );
+        xCached = ( xCache[ xHandle ].pucData != NULL ) ? CK_TRUE : CK_FALSE;
+        xSemaphoreGive( xCacheMutex );
+    }
+
+    return xCached;
+}
+
+#else /* pkcs11configPAL_CACHE_SIZE > 0 */
+
+static CK_BBOOL prvCacheGet( CK_OBJECT_HANDLE xHandle,
+                             CK_BYTE_PTR * ppucData,
+                             CK_ULONG_PTR pulDataSize,
+                             uint32_t * pulGeneration )
+{
+    ( void ) xHandle;
+    ( void ) ppucData;
+    ( void ) pulDataSize;
+    *pulGeneration = 0;
+    return CK_FALSE;
+}
+
+#define prvCachePut( xHandle, pucData, ulDataSize, ulGeneration )    do {} while( 0 )
+#define prvCacheInvalidate( xHandle )                                 do {} while( 0 )
+#define prvIsCached( xHandle )                                        ( CK_FALSE )
+
+#endif /* pkcs11configPAL_CACHE_SIZE > 0 */
+
 CK_RV PKCS11_PAL_Initialize( void )
 {
     CRYPTO_Init();
+#if pkcs11configPAL_CACHE_SIZE > 0
+    if( xCacheMutex == NULL )
+    {
+        xCacheMutex = xSemaphoreCreateMutexStatic( &xCacheMutexBuffer );
+    }
+#endif
     return CKR_OK;
 }
 
@@ -201,6 +370,8 @@ CK_OBJECT_HANDLE PKCS11_PAL_SaveObject( CK_ATTRIBUTE_PTR pxLabel,
     }
 
     err = nvs_set_blob(handle, pcFileName, ( char * ) pucData, ( uint32_t ) ulDataSize);
+    /* Even a failed write may have replaced the blob. */
+    prvCacheInvalidate( xHandle );
     if (err != ESP_OK) {
         ESP_LOGE(TAG, "failed nvs set blob %d", err);
         nvs_close(handle);
@@ -240,7 +411,9 @@ CK_OBJECT_HANDLE PKCS11_PAL_FindObject( CK_BYTE_PTR pxLabel,
                               &pcFileName,
                               &xHandle );
 
-    if( pcFileName != NULL )
+    /* A cached object is known to be there, GetObjectValue() below checks it
+     * has not been destroyed. */
+    if( ( pcFileName != NULL ) && ( prvIsCached( xHandle ) == CK_FALSE ) )
     {
         ESP_LOGD( TAG, "Finding file %s", pcFileName );
         nvs_handle handle;
@@ -305,10 +478,9 @@ CK_RV PKCS11_PAL_GetObjectValue( CK_OBJECT_HANDLE xHandle,
                                       CK_ULONG_PTR pulDataSize,
                                       CK_BBOOL * pIsPrivate )
 {
-    initialize_nvs_partition();
-
     char * pcFileName = NULL;
     CK_RV ulReturn = CKR_OK;
+    uint32_t ulGeneration;
 
     if( xHandle == eAwsDeviceCertificate )
     {
@@ -341,8 +513,16 @@ CK_RV PKCS11_PAL_GetObjectValue( CK_OBJECT_HANDLE xHandle,
         ulReturn = CKR_OBJECT_HANDLE_INVALID;
     }
 
+    if( ( ulReturn == CKR_OK ) && ( prvCacheGet( xHandle, ppucData, pulDataSize, &ulGeneration ) == CK_TRUE ) )
+    {
+        ESP_LOGD(TAG, "Reading file %s from cache", pcFileName);
+        return CKR_OK;
+    }
+
     if (ulReturn == CKR_OK)
     {
+        initialize_nvs_partition();
+
         ESP_LOGD(TAG, "Reading file %s", pcFileName);
         nvs_handle handle;
         esp_err_t err = nvs_open_from_partition(NVS_PART_NAME, NAMESPACE, NVS_READONLY, &handle);
@@ -377,6 +557,7 @@ CK_RV PKCS11_PAL_GetObjectValue( CK_OBJECT_HANDLE xHandle,
         }
 
         *pulDataSize = required_size;
+        prvCachePut( xHandle, data, required_size, ulGeneration );
 done:
         nvs_close(handle);
     }
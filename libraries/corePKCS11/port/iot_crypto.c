@@ -27,7 +27,12 @@
 #include "freertos/FreeRTOS.h"
 #include "iot_crypto.h"
 
-/* mbedTLS includes. */
+/* mbedTLS includes. With CONFIG_MBEDTLS_HARDWARE_SHA and
+ * CONFIG_MBEDTLS_HARDWARE_MPI, ESP-IDF's mbedTLS runs the hashes below on the
+ * SHA engine and the bignum arithmetic under ECDSA and RSA verification on the
+ * RSA (MPI) engine, falling back to software while another context holds the
+ * engine. The ESP32 has no ECC engine; ECDSA point arithmetic stays in
+ * software on top of the MPI engine. */
 
 #if !defined( MBEDTLS_CONFIG_FILE )
     #include "mbedtls/config.h"
@@ -61,6 +66,23 @@ typedef struct SignatureVerificationState
     mbedtls_sha256_context xSHA256Context;
 } SignatureVerificationState_t, * SignatureVerificationStatePtr_t;
 
+/**
+ * @brief The signer certificate of the last verification, parsed.
+ *
+ * Every image is verified against the same code signing certificate, so it is
+ * only parsed again when a different one comes along.
+ */
+typedef struct SignerCertificateCache
+{
+    SemaphoreHandle_t xMutex;
+    StaticSemaphore_t xMutexBuffer;
+    mbedtls_x509_crt xCertificate;
+    uint8_t * pucEncoded; /* The certificate as it was passed in, to compare against. */
+    size_t xEncodedLength;
+} SignerCertificateCache_t;
+
+static SignerCertificateCache_t xSignerCache;
+
 /*-----------------------------------------------------------*/
 /*------ Helper functions for FreeRTOS heap management ------*/
 /*-----------------------------------------------------------*/
@@ -176,6 +198,58 @@ typedef struct SignatureVerificationState
 
 /*-----------------------------------------------------------*/
 
+/**
+ * @brief Makes the signer certificate cache hold the given certificate,
+ * parsing it unless it already does. Called with the cache mutex held.
+ *
+ * @return pdTRUE if the cache holds the certificate, pdFALSE if it does not
+ * parse.
+ */
+static BaseType_t prvCacheSignerCertificate( const char * pcSignerCertificate,
+                                             size_t xSignerCertificateLength )
+{
+    if( ( xSignerCache.pucEncoded != NULL ) &&
+        ( xSignerCache.xEncodedLength == xSignerCertificateLength ) &&
+        ( 0 == memcmp( xSignerCache.pucEncoded, pcSignerCertificate, xSignerCertificateLength ) ) )
+    {
+        return pdTRUE;
+    }
+
+    /*
+     * A different certificate, drop the old one
+     */
+    if( xSignerCache.pucEncoded != NULL )
+    {
+        mbedtls_x509_crt_free( &xSignerCache.xCertificate );
+        vPortFree( xSignerCache.pucEncoded );
+        xSignerCache.pucEncoded = NULL;
+        xSignerCache.xEncodedLength = 0;
+    }
+
+    xSignerCache.pucEncoded = pvPortMalloc( xSignerCertificateLength );
+
+    if( xSignerCache.pucEncoded == NULL )
+    {
+        return pdFALSE;
+    }
+
+    mbedtls_x509_crt_init( &xSignerCache.xCertificate );
+
+    if( 0 != mbedtls_x509_crt_parse(
+            &xSignerCache.xCertificate, ( const unsigned char * ) pcSignerCertificate, xSignerCertificateLength ) )
+    {
+        mbedtls_x509_crt_free( &xSignerCache.xCertificate );
+        vPortFree( xSignerCache.pucEncoded );
+        xSignerCache.pucEncoded = NULL;
+        return pdFALSE;
+    }
+
+    memcpy( xSignerCache.pucEncoded, pcSignerCertificate, xSignerCertificateLength );
+    xSignerCache.xEncodedLength = xSignerCertificateLength;
+
+    return pdTRUE;
+}
+
 /**
  * @brief Verifies a cryptographic signature based on the signer
  * certificate, hash algorithm, and the data that was signed.
@@ -190,6 +264,7 @@ static BaseType_t prvVerifySignature( char * pcSignerCertificate,
 {
     BaseType_t xResult = pdTRUE;
     mbedtls_x509_crt xCertCtx;
+    mbedtls_x509_crt * pxCert = &xCertCtx;
     mbedtls_md_type_t xMbedHashAlg = MBEDTLS_MD_SHA256;
 
 
@@ -204,14 +279,23 @@ static BaseType_t prvVerifySignature( char * pcSignerCertificate,
     }
 
     /*
-     * Decode and create a certificate context
+     * Decode and create a certificate context, or take the cached one
      */
-    mbedtls_x509_crt_init( &xCertCtx );
-
-    if( 0 != mbedtls_x509_crt_parse(
-            &xCertCtx, ( const unsigned char * ) pcSignerCertificate, xSignerCertificateLength ) )
+    if( xSignerCache.xMutex != NULL )
     {
-        xResult = pdFALSE;
+        ( void ) xSemaphoreTake( xSignerCache.xMutex, portMAX_DELAY );
+        pxCert = &xSignerCache.xCertificate;
+        xResult = prvCacheSignerCertificate( pcSignerCertificate, xSignerCertificateLength );
+    }
+    else
+    {
+        mbedtls_x509_crt_init( &xCertCtx );
+
+        if( 0 != mbedtls_x509_crt_parse(
+                &xCertCtx, ( const unsigned char * ) pcSignerCertificate, xSignerCertificateLength ) )
+        {
+            xResult = pdFALSE;
+        }
     }
 
     /*
@@ -220,7 +304,7 @@ static BaseType_t prvVerifySignature( char * pcSignerCertificate,
     if( pdTRUE == xResult )
     {
         if( 0 != mbedtls_pk_verify(
-                &xCertCtx.pk,
+                &pxCert->pk,
                 xMbedHashAlg,
                 pucHash,
                 xHashLength,
@@ -234,7 +318,14 @@ static BaseType_t prvVerifySignature( char * pcSignerCertificate,
     /*
      * Clean-up
      */
-    mbedtls_x509_crt_free( &xCertCtx );
+    if( pxCert == &xCertCtx )
+    {
+        mbedtls_x509_crt_free( &xCertCtx );
+    }
+    else
+    {
+        ( void ) xSemaphoreGive( xSignerCache.xMutex );
+    }
 
     return xResult;
 }
@@ -246,6 +337,12 @@ static BaseType_t prvVerifySignature( char * pcSignerCertificate,
 void CRYPTO_Init( void )
 {
     CRYPTO_ConfigureThreading();
+
+    /* Without the mutex every verification parses its certificate. */
+    if( xSignerCache.xMutex == NULL )
+    {
+        xSignerCache.xMutex = xSemaphoreCreateMutexStatic( &xSignerCache.xMutexBuffer );
+    }
 }
 
 void CRYPTO_ConfigureThreading( void )
@@ -383,8 +480,18 @@ BaseType_t CRYPTO_SignatureVerificationFinal( void * pvContext,
         }
 
         /*
-         * Clean-up
+         * Clean-up. With the SHA engine in use, this is what gives it back
+         * to other hashes, whether or not the hash was finished.
          */
+        if( cryptoHASH_ALGORITHM_SHA1 == pxCtx->xHashAlgorithm )
+        {
+            mbedtls_sha1_free( &pxCtx->xSHA1Context );
+        }
+        else
+        {
+            mbedtls_sha256_free( &pxCtx->xSHA256Context );
+        }
+
         vPortFree( pxCtx );
     }
 
@@ -113,6 +113,50 @@
  */
 #define otaconfigFILE_BLOCK_SIZE                ( 1UL << otaconfigLOG2_FILE_BLOCK_SIZE )
 
+/**
+ * @brief Size of each of the two buffers the PAL collects consecutive file blocks in.
+ *
+ * While one buffer is filled from the network, the other is written to flash by the PAL's
+ * writer task. A multiple of the flash sector size, and at least one file block.
+ */
+#define otapalconfigWRITE_BUFFER_SIZE           4096U
+
+/**
+ * @brief How far ahead of the highest offset written the update partition is kept erased, in sectors.
+ *
+ * The writer task erases these one sector at a time while it has nothing to write, so a
+ * buffer handed to it seldom waits for an erase.
+ */
+#define otapalconfigERASE_AHEAD_SECTORS         4U
+
+/**
+ * @brief Priority and stack size in bytes of the PAL's writer task.
+ *
+ * Above the OTA agent, so a full buffer is written as soon as it is handed over.
+ */
+#define otapalconfigWRITER_TASK_PRIORITY        4U
+#define otapalconfigWRITER_TASK_STACK_SIZE      3072U
+
+/**
+ * @brief File blocks the PAL holds back in RAM while a block before them is missing.
+ *
+ * Once the missing block comes they are stored in order. See OTA_PAL_REORDER_BLOCKS in Kconfig.
+ */
+#define otapalconfigREORDER_BLOCKS              CONFIG_OTA_PAL_REORDER_BLOCKS
+
+/**
+ * @brief File type flags, as given when the OTA job is created.
+ *
+ * A delta file is a patch in the layout of ota_delta.h, which the PAL applies to the running
+ * image once it has all of it. A compressed file is in the heatshrink format of ota_heatshrink.h
+ * and decoded as it comes; a compressed image has to fit in the update partition next to the
+ * compressed file, in case blocks come out of order and have to be kept until close. The flags
+ * combine, 3 being a compressed patch, and the file signature in the job is always that of the
+ * resulting image. File type 0 is a full image.
+ */
+#define otapalconfigDELTA_FILE_TYPE             1U
+#define otapalconfigCOMPRESSED_FILE_TYPE        2U
+
 /**
  * @brief Milliseconds to wait for the self test phase to succeed before we force reset.
  */
@@ -122,9 +166,21 @@
  * @brief Milliseconds to wait before requesting data blocks from the OTA service if nothing is happening.
  *
  * The wait timer is reset whenever a data block is received from the OTA service so we will only send
- * the request message after being idle for this amount of time.
+ * the request message after being idle for this amount of time. A request with a block dropped on the
+ * way is only complete once this runs out, and the next one asks for the missing blocks only, so it is
+ * kept short. The timer already runs while main/ota_agent.c holds a request back for the download
+ * rate limit, so it allows for that on top.
+ */
+#define otaconfigFILE_REQUEST_WAIT_MS           ( 2000U + otaconfigFILE_REQUEST_THROTTLE_MS )
+
+/**
+ * @brief Longest a block request is held back for CONFIG_OTA_MAX_RATE_KBPS: the time one request's
+ * worth of blocks takes at that rate, 0 without a limit.
  */
-#define otaconfigFILE_REQUEST_WAIT_MS           10000U
+#define otaconfigFILE_REQUEST_THROTTLE_MS                                                       \
+    ( ( CONFIG_OTA_MAX_RATE_KBPS > 0 ) ?                                                        \
+      ( CONFIG_MAX_NUM_BLOCKS_REQUEST * ( 1000U << CONFIG_LOG2_FILE_BLOCK_SIZE ) ) /            \
+      ( 1024U * ( ( CONFIG_OTA_MAX_RATE_KBPS > 0 ) ? CONFIG_OTA_MAX_RATE_KBPS : 1U ) ) : 0U )
 
 /**
  * @brief The maximum allowed length of the thing name used by the OTA agent.
@@ -0,0 +1,225 @@
+/*
+ * Streaming bsdiff patch applier for delta OTA updates, see ota_delta.h.
+ */
+
+#include <string.h>
+
+#include "ota_delta.h"
+
+#define MIN_OF( a, b )    ( ( ( a ) < ( b ) ) ? ( a ) : ( b ) )
+
+/* bsdiff's offtin(): 8 byte little endian magnitude, sign in the top bit. */
+static int64_t read_offset( const uint8_t * buf )
+{
+    int64_t value = buf[ 7 ] & 0x7F;
+
+    for( int i = 6; i >= 0; i-- )
+    {
+        value = ( value << 8 ) | buf[ i ];
+    }
+
+    return ( buf[ 7 ] & 0x80 ) ? -value : value;
+}
+
+static ota_delta_status_t flush_target( ota_delta_t * delta )
+{
+    if( delta->target_len > 0 )
+    {
+        if( delta->write_target( delta->ctx, delta->target_pos - delta->target_len,
+                                 delta->target, delta->target_len ) != 0 )
+        {
+            return OTA_DELTA_WRITE_FAILED;
+        }
+
+        delta->target_len = 0;
+    }
+
+    return OTA_DELTA_OK;
+}
+
+static ota_delta_status_t put_target( ota_delta_t * delta,
+                                      const uint8_t * data,
+                                      size_t len )
+{
+    memcpy( delta->target + delta->target_len, data, len );
+    delta->target_len += len;
+    delta->target_pos += len;
+
+    return ( delta->target_len == OTA_DELTA_TARGET_CHUNK ) ? flush_target( delta ) : OTA_DELTA_OK;
+}
+
+/* Add len bytes of the source image at source_pos to the diff bytes. */
+static ota_delta_status_t apply_diff( ota_delta_t * delta,
+                                      const uint8_t * diff,
+                                      size_t len )
+{
+    uint8_t * out = delta->target + delta->target_len;
+    const int64_t pos = delta->source_pos;
+    size_t inside = 0, skip = 0;
+
+    /* Only the part of the range inside the source image is read. */
+    if( ( pos + ( int64_t ) len > 0 ) && ( pos < ( int64_t ) delta->source_size ) )
+    {
+        skip = ( pos < 0 ) ? ( size_t ) -pos : 0;
+        inside = MIN_OF( len - skip, ( size_t ) ( delta->source_size - ( pos + skip ) ) );
+    }
+
+    if( ( inside > 0 ) &&
+        ( delta->read_source( delta->ctx, ( uint32_t ) ( pos + skip ), delta->source, inside ) != 0 ) )
+    {
+        return OTA_DELTA_READ_FAILED;
+    }
+
+    for( size_t i = 0; i < len; i++ )
+    {
+        out[ i ] = ( ( i >= skip ) && ( i < skip + inside ) ) ? diff[ i ] + delta->source[ i - skip ] : diff[ i ];
+    }
+
+    delta->source_pos += len;
+    delta->target_len += len;
+    delta->target_pos += len;
+
+    return ( delta->target_len == OTA_DELTA_TARGET_CHUNK ) ? flush_target( delta ) : OTA_DELTA_OK;
+}
+
+/* Act on a complete header or control triple. */
+static ota_delta_status_t take_field( ota_delta_t * delta )
+{
+    if( delta->target_size == 0 )
+    {
+        const int64_t size = read_offset( delta->field + OTA_DELTA_MAGIC_LEN );
+
+        if( ( memcmp( delta->field, OTA_DELTA_MAGIC, OTA_DELTA_MAGIC_LEN ) != 0 ) ||
+            ( size <= 0 ) || ( size > ( int64_t ) delta->target_limit ) )
+        {
+            return OTA_DELTA_BAD_HEADER;
+        }
+
+        delta->target_size = ( uint32_t ) size;
+    }
+    else
+    {
+        const int64_t room = ( int64_t ) delta->target_size - delta->target_pos;
+
+        delta->diff_left = read_offset( delta->field );
+        delta->extra_left = read_offset( delta->field + 8 );
+        delta->seek = read_offset( delta->field + 16 );
+
+        if( ( delta->diff_left < 0 ) || ( delta->extra_left < 0 ) ||
+            ( delta->diff_left > room ) || ( delta->extra_left > room - delta->diff_left ) )
+        {
+            return OTA_DELTA_BAD_CONTROL;
+        }
+    }
+
+    delta->field_len = 0;
+
+    return OTA_DELTA_OK;
+}
+
+void ota_delta_begin( ota_delta_t * delta,
+                      ota_delta_read_t read_source,
+                      ota_delta_write_t write_target,
+                      void * ctx,
+                      uint32_t source_size,
+                      uint32_t target_limit )
+{
+    memset( delta, 0, offsetof( ota_delta_t, source ) );
+    delta->read_source = read_source;
+    delta->write_target = write_target;
+    delta->ctx = ctx;
+    delta->source_size = source_size;
+    delta->target_limit = target_limit;
+    delta->target_len = 0;
+}
+
+ota_delta_status_t ota_delta_feed( ota_delta_t * delta,
+                                   const uint8_t * patch,
+                                   size_t len )
+{
+    while( ( len > 0 ) && ( delta->status == OTA_DELTA_OK ) )
+    {
+        size_t n;
+
+        if( delta->diff_left > 0 )
+        {
+            /* Bounded by the room left in the target buffer, which is flushed
+             * when full, and by the source buffer. */
+            n = MIN_OF( MIN_OF( len, ( size_t ) delta->diff_left ), OTA_DELTA_TARGET_CHUNK - delta->target_len );
+            n = MIN_OF( n, OTA_DELTA_SOURCE_CHUNK );
+            delta->status = apply_diff( delta, patch, n );
+            delta->diff_left -= n;
+        }
+        else if( delta->extra_left > 0 )
+        {
+            n = MIN_OF( MIN_OF( len, ( size_t ) delta->extra_left ), OTA_DELTA_TARGET_CHUNK - delta->target_len );
+            delta->status = put_target( delta, patch, n );
+            delta->extra_left -= n;
+        }
+        else
+        {
+            /* The previous triple is done, move on in the source image. */
+            delta->source_pos += delta->seek;
+            delta->seek = 0;
+
+            const size_t want = ( delta->target_size == 0 ) ? OTA_DELTA_HEADER_LEN : OTA_DELTA_CONTROL_LEN;
+
+            n = MIN_OF( len, want - delta->field_len );
+            memcpy( delta->field + delta->field_len, patch, n );
+            delta->field_len += n;
+
+            if( delta->field_len == want )
+            {
+                delta->status = take_field( delta );
+            }
+        }
+
+        patch += n;
+        len -= n;
+    }
+
+    return delta->status;
+}
+
+ota_delta_status_t ota_delta_end( ota_delta_t * delta )
+{
+    if( delta->status != OTA_DELTA_OK )
+    {
+        return delta->status;
+    }
+
+    if( ( delta->target_size == 0 ) || ( delta->target_pos != delta->target_size ) ||
+        ( delta->diff_left > 0 ) || ( delta->extra_left > 0 ) || ( delta->field_len > 0 ) )
+    {
+        return OTA_DELTA_TRUNCATED;
+    }
+
+    return flush_target( delta );
+}
+
+const char * ota_delta_strerror( ota_delta_status_t status )
+{
+    switch( status )
+    {
+        case OTA_DELTA_OK:
+            return "ok";
+
+        case OTA_DELTA_BAD_HEADER:
+            return "bad header";
+
+        case OTA_DELTA_BAD_CONTROL:
+            return "bad control";
+
+        case OTA_DELTA_READ_FAILED:
+            return "source read failed";
+
+        case OTA_DELTA_WRITE_FAILED:
+            return "target write failed";
+
+        case OTA_DELTA_TRUNCATED:
+            return "truncated";
+
+        default:
+            return "unknown";
+    }
+}
@@ -0,0 +1,89 @@
+/*
+ * Streaming bsdiff patch applier for delta OTA updates.
+ *
+ * Rebuilds a new firmware image from the running one and a patch in the
+ * "ENDSLEY/BSDIFF43" layout without compression: a 16 byte magic, the new
+ * image size, then for every control triple (diff length, extra length,
+ * source seek) the diff bytes, added to the source image, followed by the
+ * extra bytes, copied as they are. Numbers are 8 byte sign-magnitude little
+ * endian, as in bsdiff. The patch can be fed in pieces of any size, the
+ * source image is read and the new image written through callbacks, and the
+ * applier needs no memory beyond ota_delta_t.
+ */
+
+#ifndef OTA_DELTA_H
+#define OTA_DELTA_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define OTA_DELTA_MAGIC          "ENDSLEY/BSDIFF43"
+#define OTA_DELTA_MAGIC_LEN      16U
+#define OTA_DELTA_HEADER_LEN     ( OTA_DELTA_MAGIC_LEN + 8U )
+#define OTA_DELTA_CONTROL_LEN    24U
+
+/* Source image bytes are read this many at a time. */
+#define OTA_DELTA_SOURCE_CHUNK    512U
+/* New image bytes are collected into writes of this size, a flash sector. */
+#define OTA_DELTA_TARGET_CHUNK    4096U
+
+typedef enum
+{
+    OTA_DELTA_OK = 0,
+    OTA_DELTA_BAD_HEADER,     /* Not a patch, or the new image does not fit */
+    OTA_DELTA_BAD_CONTROL,    /* A control triple goes past the new image */
+    OTA_DELTA_READ_FAILED,
+    OTA_DELTA_WRITE_FAILED,
+    OTA_DELTA_TRUNCATED       /* The patch ended before the new image was complete */
+} ota_delta_status_t;
+
+/* Read len bytes of the source image at offset, return 0 on success. */
+typedef int (* ota_delta_read_t)( void * ctx,
+                                  uint32_t offset,
+                                  uint8_t * buf,
+                                  size_t len );
+
+/* Write len bytes of the new image at offset, return 0 on success. */
+typedef int (* ota_delta_write_t)( void * ctx,
+                                   uint32_t offset,
+                                   const uint8_t * buf,
+                                   size_t len );
+
+typedef struct
+{
+    ota_delta_read_t read_source;
+    ota_delta_write_t write_target;
+    void * ctx;
+    uint32_t source_size;        /* Source bytes past this count as zero, as in bspatch */
+    uint32_t target_limit;       /* Largest new image accepted */
+
+    uint32_t target_size;        /* From the header, 0 until it is in */
+    uint32_t target_pos;         /* New image bytes produced */
+    int64_t source_pos;
+    int64_t diff_left;
+    int64_t extra_left;
+    int64_t seek;
+    ota_delta_status_t status;   /* First failure, sticks */
+
+    /* Header or control triple being collected, and how much of it is in. */
+    uint8_t field[ OTA_DELTA_HEADER_LEN ];
+    size_t field_len;
+
+    uint8_t source[ OTA_DELTA_SOURCE_CHUNK ];
+    uint8_t target[ OTA_DELTA_TARGET_CHUNK ];
+    size_t target_len;
+} ota_delta_t;
+
+void ota_delta_begin( ota_delta_t * delta,
+                      ota_delta_read_t read_source,
+                      ota_delta_write_t write_target,
+                      void * ctx,
+                      uint32_t source_size,
+                      uint32_t target_limit );
+ota_delta_status_t ota_delta_feed( ota_delta_t * delta,
+                                   const uint8_t * patch,
+                                   size_t len );
+ota_delta_status_t ota_delta_end( ota_delta_t * delta );
+const char * ota_delta_strerror( ota_delta_status_t status );
+
+#endif /* OTA_DELTA_H */
@@ -0,0 +1,179 @@
+/*
+ * Streaming heatshrink decoder for compressed OTA files, see ota_heatshrink.h.
+ */
+
+#include <string.h>
+
+#include "ota_heatshrink.h"
+
+#define WINDOW_MASK    ( OTA_HEATSHRINK_WINDOW_SIZE - 1U )
+
+enum
+{
+    STATE_TAG,
+    STATE_LITERAL,
+    STATE_DISTANCE,
+    STATE_LENGTH
+};
+
+static ota_heatshrink_status_t flush_window( ota_heatshrink_t * decoder )
+{
+    const uint32_t len = decoder->out_len - decoder->flushed;
+
+    if( len > 0 )
+    {
+        if( decoder->write( decoder->ctx, decoder->flushed,
+                            decoder->window + ( decoder->flushed & WINDOW_MASK ), len ) != 0 )
+        {
+            return OTA_HEATSHRINK_WRITE_FAILED;
+        }
+
+        decoder->flushed = decoder->out_len;
+    }
+
+    return OTA_HEATSHRINK_OK;
+}
+
+/* Add a byte to the window, handing the window on once it is full. */
+static ota_heatshrink_status_t put_byte( ota_heatshrink_t * decoder,
+                                         uint8_t byte )
+{
+    decoder->window[ decoder->out_len & WINDOW_MASK ] = byte;
+    decoder->out_len++;
+
+    return ( ( decoder->out_len & WINDOW_MASK ) == 0 ) ? flush_window( decoder ) : OTA_HEATSHRINK_OK;
+}
+
+/* Take count bits off the input if that many are in, most significant first. */
+static int take_bits( ota_heatshrink_t * decoder,
+                      uint8_t count,
+                      uint16_t * value )
+{
+    if( decoder->bits_len < count )
+    {
+        return 0;
+    }
+
+    decoder->bits_len -= count;
+    *value = ( uint16_t ) ( ( decoder->bits >> decoder->bits_len ) & ( ( 1U << count ) - 1U ) );
+    decoder->symbol_bits += count;
+
+    return 1;
+}
+
+void ota_heatshrink_begin( ota_heatshrink_t * decoder,
+                           ota_heatshrink_write_t write,
+                           void * ctx )
+{
+    /* heatshrink's encoder starts from a window of zeros too, and refers to
+     * it for zero runs at the start of the file. */
+    memset( decoder, 0, sizeof( *decoder ) );
+    decoder->write = write;
+    decoder->ctx = ctx;
+    decoder->state = STATE_TAG;
+}
+
+ota_heatshrink_status_t ota_heatshrink_feed( ota_heatshrink_t * decoder,
+                                             const uint8_t * in,
+                                             size_t len )
+{
+    uint16_t value;
+
+    while( ( len > 0 ) && ( decoder->status == OTA_HEATSHRINK_OK ) )
+    {
+        /* Never more than 16 + 8 bits are held, the longest field is 16. */
+        decoder->bits = ( decoder->bits << 8 ) | *in++;
+        decoder->bits_len += 8;
+        len--;
+
+        for( int progress = 1; progress && ( decoder->status == OTA_HEATSHRINK_OK ); )
+        {
+            switch( decoder->state )
+            {
+                case STATE_TAG:
+
+                    if( ( progress = take_bits( decoder, 1, &value ) ) != 0 )
+                    {
+                        decoder->state = value ? STATE_LITERAL : STATE_DISTANCE;
+                    }
+
+                    break;
+
+                case STATE_LITERAL:
+
+                    if( ( progress = take_bits( decoder, 8, &value ) ) != 0 )
+                    {
+                        decoder->status = put_byte( decoder, ( uint8_t ) value );
+                        decoder->symbol_bits = 0;
+                        decoder->state = STATE_TAG;
+                    }
+
+                    break;
+
+                case STATE_DISTANCE:
+
+                    if( ( progress = take_bits( decoder, OTA_HEATSHRINK_WINDOW_BITS, &value ) ) != 0 )
+                    {
+                        decoder->distance = value + 1U;
+                        decoder->state = STATE_LENGTH;
+                    }
+
+                    break;
+
+                default:
+
+                    if( ( progress = take_bits( decoder, OTA_HEATSHRINK_LOOKAHEAD_BITS, &value ) ) != 0 )
+                    {
+                        /* Byte by byte, the reference may overlap what it produces. */
+                        for( uint32_t i = 0; ( i <= value ) && ( decoder->status == OTA_HEATSHRINK_OK ); i++ )
+                        {
+                            decoder->status = put_byte( decoder,
+                                                        decoder->window[ ( decoder->out_len - decoder->distance ) & WINDOW_MASK ] );
+                        }
+
+                        decoder->symbol_bits = 0;
+                        decoder->state = STATE_TAG;
+                    }
+
+                    break;
+            }
+        }
+    }
+
+    return decoder->status;
+}
+
+ota_heatshrink_status_t ota_heatshrink_end( ota_heatshrink_t * decoder )
+{
+    if( decoder->status != OTA_HEATSHRINK_OK )
+    {
+        return decoder->status;
+    }
+
+    /* The encoder pads the last byte with zero bits, which read as the start
+     * of a back reference that never completes. */
+    if( decoder->symbol_bits + decoder->bits_len >= 8U )
+    {
+        return OTA_HEATSHRINK_TRUNCATED;
+    }
+
+    return flush_window( decoder );
+}
+
+const char * ota_heatshrink_strerror( ota_heatshrink_status_t status )
+{
+    switch( status )
+    {
+        case OTA_HEATSHRINK_OK:
+            return "ok";
+
+        case OTA_HEATSHRINK_WRITE_FAILED:
+            return "write failed";
+
+        case OTA_HEATSHRINK_TRUNCATED:
+            return "truncated";
+
+        default:
+            return "unknown";
+    }
+}
@@ -0,0 +1,72 @@
+/*
+ * Streaming decoder for OTA files compressed in the heatshrink format.
+ *
+ * heatshrink is LZSS over a bit stream read most significant bit first: a 1
+ * bit is followed by a literal byte, a 0 bit by a back reference of
+ * OTA_HEATSHRINK_WINDOW_BITS bits of distance - 1 and
+ * OTA_HEATSHRINK_LOOKAHEAD_BITS bits of length - 1. Files made with
+ *
+ *   heatshrink -e -w 11 -l 4 image.bin image.hs
+ *
+ * decode with the defaults below. The window, 2 KiB by default, doubles as
+ * the output buffer: decoded bytes are handed on each time it wraps, so the
+ * decoder needs no memory beyond ota_heatshrink_t whatever the file size.
+ * Like the encoder's, it starts out as zeros, which back references at the
+ * start of a file may point into.
+ */
+
+#ifndef OTA_HEATSHRINK_H
+#define OTA_HEATSHRINK_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#ifndef OTA_HEATSHRINK_WINDOW_BITS
+    #define OTA_HEATSHRINK_WINDOW_BITS    11U
+#endif
+#ifndef OTA_HEATSHRINK_LOOKAHEAD_BITS
+    #define OTA_HEATSHRINK_LOOKAHEAD_BITS    4U
+#endif
+
+#define OTA_HEATSHRINK_WINDOW_SIZE    ( 1U << OTA_HEATSHRINK_WINDOW_BITS )
+
+typedef enum
+{
+    OTA_HEATSHRINK_OK = 0,
+    OTA_HEATSHRINK_WRITE_FAILED,
+    OTA_HEATSHRINK_TRUNCATED        /* The file ended inside a literal or back reference */
+} ota_heatshrink_status_t;
+
+/* Take len decoded bytes at offset in the output, return 0 on success. */
+typedef int (* ota_heatshrink_write_t)( void * ctx,
+                                        uint32_t offset,
+                                        const uint8_t * buf,
+                                        size_t len );
+
+typedef struct
+{
+    ota_heatshrink_write_t write;
+    void * ctx;
+    uint32_t out_len;                /* Bytes decoded */
+    uint32_t flushed;                /* Bytes handed to write */
+    ota_heatshrink_status_t status;  /* First failure, sticks */
+
+    uint32_t bits;                   /* Input bits not used yet, low bits_len of them */
+    uint8_t bits_len;
+    uint8_t symbol_bits;             /* Bits taken since the last complete literal or back reference */
+    uint8_t state;
+    uint16_t distance;
+
+    uint8_t window[ OTA_HEATSHRINK_WINDOW_SIZE ];
+} ota_heatshrink_t;
+
+void ota_heatshrink_begin( ota_heatshrink_t * decoder,
+                           ota_heatshrink_write_t write,
+                           void * ctx );
+ota_heatshrink_status_t ota_heatshrink_feed( ota_heatshrink_t * decoder,
+                                             const uint8_t * in,
+                                             size_t len );
+ota_heatshrink_status_t ota_heatshrink_end( ota_heatshrink_t * decoder );
+const char * ota_heatshrink_strerror( ota_heatshrink_status_t status );
+
+#endif /* OTA_HEATSHRINK_H */
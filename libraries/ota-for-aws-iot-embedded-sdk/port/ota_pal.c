@@ -39,10 +39,15 @@
 #include "esp_image_format.h"
 #include "esp_ota_ops.h"
 #include "aws_esp_ota_ops.h"
+#include "ota_delta.h"
+#include "ota_heatshrink.h"
 #include "mbedtls/asn1.h"
 #include "mbedtls/bignum.h"
 #include "mbedtls/base64.h"
+#include "esp_timer.h"
 #include "freertos/task.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
 
 #define OTA_HALF_SECOND_DELAY    pdMS_TO_TICKS( 500UL )
 #define ECDSA_INTEGER_LEN        32
@@ -60,6 +65,13 @@
  */
 #define ECDSA_SIG_SIZE    80
 
+#if otaconfigFILE_BLOCK_SIZE > otapalconfigWRITE_BUFFER_SIZE
+    #error "otapalconfigWRITE_BUFFER_SIZE must hold at least one file block."
+#endif
+
+#define WRITE_BUFFER_COUNT    2
+#define ERASE_AHEAD_LEN       ( otapalconfigERASE_AHEAD_SECTORS * SPI_FLASH_SEC_SIZE )
+
 typedef struct
 {
     const esp_partition_t * update_partition;
@@ -67,8 +79,58 @@ typedef struct
     esp_ota_handle_t update_handle;
     uint32_t data_write_len;
     bool valid_image;
+    uint32_t next_offset;         /* Every block below this is stored */
+    uint32_t decoded_upto;        /* Compressed images: blocks below this have gone through the decoder */
+    bool staging;                 /* Compressed images: a block came out of order, the rest is decoded at close */
 } esp_ota_context_t;
 
+/* A block received after a missing one, held back until the missing one comes. */
+typedef struct
+{
+    uint32_t offset;
+    uint32_t length;
+    bool used;
+    uint8_t data[ otaconfigFILE_BLOCK_SIZE ];
+} esp_ota_held_block_t;
+
+/* Consecutive file blocks waiting to be written to flash. */
+typedef struct
+{
+    uint32_t offset;
+    uint32_t length;
+    uint8_t data[ otapalconfigWRITE_BUFFER_SIZE ];
+} esp_ota_write_buffer_t;
+
+/* The update partition as the writer task sees it. Only touched by the writer
+ * task while a file is open, and by the OTA agent once it has been drained. */
+typedef struct
+{
+    const esp_partition_t * partition;
+    esp_ota_handle_t handle;
+    uint32_t stage_base;          /* Delta and compressed files are kept from here to the end, else the partition size. */
+    uint32_t erased_len;          /* Image sectors below this are erased or written. */
+    uint32_t stage_erased;        /* Staged sectors below this are erased or written. */
+    uint32_t written_end;         /* End of the last write, erasing ahead goes on from there. */
+    esp_err_t error;              /* First write or erase failure, sticks until the next file. */
+    bool active;                  /* Owned by the writer task, which erases ahead. */
+    void * verify_ctx;            /* Image hash, from CRYPTO_SignatureVerificationStart() */
+    uint32_t hashed_len;          /* The image below this has gone into verify_ctx. */
+} esp_ota_writer_t;
+
+typedef struct
+{
+    uint32_t blocks;
+    uint32_t bytes;
+    uint32_t held;                /* Blocks held back for a missing one */
+    uint32_t out_of_order;        /* Blocks stored after a missing one, no slot being free */
+    int64_t start_us;
+    int64_t block_us;             /* OTA agent in otaPal_WriteBlock(), decoding or waiting for a buffer or the flash */
+    int64_t decode_us;
+    int64_t write_us;
+    int64_t erase_us;
+    int64_t hash_us;
+} esp_ota_write_stats_t;
+
 typedef struct
 {
     uint8_t sec_ver[ 4 ];
@@ -77,8 +139,39 @@ typedef struct
 } esp_sec_boot_sig_t;
 
 static esp_ota_context_t ota_ctx;
+static esp_ota_writer_t ota_writer;
+static esp_ota_write_stats_t write_stats;
+static ota_heatshrink_t decoder;
 static const char * TAG = "ota_pal";
 
+/* Blocks are stored in order as far as the reorder slots allow, so the image
+ * is written in sequence and hashed and decoded as it comes even though the
+ * OTA agent has many blocks in flight. Both the slots and stored_blocks, with
+ * a bit per block of the file, are only allocated while a file is open. */
+static esp_ota_held_block_t * held_blocks;
+static uint32_t held_slots;
+static uint8_t * stored_blocks;
+
+#if CONFIG_OTA_PAL_PIPELINED_WRITES
+    static esp_ota_write_buffer_t write_buffers[ WRITE_BUFFER_COUNT ];
+    static esp_ota_write_buffer_t * fill_buffer;
+
+    /* Buffers travel as pointers: empty ones from the writer task back to
+     * otaPal_WriteBlock() through free_buffers, full ones the other way. A NULL
+     * in full_buffers asks the writer task to stop and give writer_idle. */
+    static StaticQueue_t free_buffers_struct;
+    static StaticQueue_t full_buffers_struct;
+    static uint8_t free_buffers_storage[ WRITE_BUFFER_COUNT * sizeof( esp_ota_write_buffer_t * ) ];
+    static uint8_t full_buffers_storage[ ( WRITE_BUFFER_COUNT + 1 ) * sizeof( esp_ota_write_buffer_t * ) ];
+    static QueueHandle_t free_buffers;
+    static QueueHandle_t full_buffers;
+    static StaticSemaphore_t writer_idle_struct;
+    static SemaphoreHandle_t writer_idle;
+    static StaticTask_t writer_task_struct;
+    static StackType_t writer_task_stack[ otapalconfigWRITER_TASK_STACK_SIZE ];
+    static TaskHandle_t writer_task;
+#endif
+
 static const char codeSigningCertificatePEM[] = otapalconfigCODE_SIGNING_CERTIFICATE;
 
 /* Specify the OTA signature algorithm we support on this platform. */
@@ -172,6 +265,626 @@ static void _esp_ota_ctx_close( OtaFileContext_t * pFileContext )
     ota_ctx.cur_ota = 0;
 }
 
+/* The update partition holds the image from its start and, for delta and
+ * compressed files, the file as received from stage_base. Each region is
+ * erased from its start as it is written. */
+static uint32_t * _esp_ota_erased_len( uint32_t offset )
+{
+    return ( offset < ota_writer.stage_base ) ? &ota_writer.erased_len : &ota_writer.stage_erased;
+}
+
+static uint32_t _esp_ota_region_end( uint32_t offset )
+{
+    return ( offset < ota_writer.stage_base ) ? ota_writer.stage_base : ota_writer.partition->size;
+}
+
+/* Erase the region offset is in up to end, rounded up to a sector. */
+static esp_err_t _esp_ota_erase_through( uint32_t offset,
+                                         uint32_t end )
+{
+    uint32_t * erased_len = _esp_ota_erased_len( offset );
+    esp_err_t ret = ESP_OK;
+
+    end = MIN( ( end + SPI_FLASH_SEC_SIZE - 1 ) & ~( SPI_FLASH_SEC_SIZE - 1 ), _esp_ota_region_end( offset ) );
+
+    if( end > *erased_len )
+    {
+        const int64_t start = esp_timer_get_time();
+
+        ret = esp_partition_erase_range( ota_writer.partition, *erased_len, end - *erased_len );
+
+        if( ret == ESP_OK )
+        {
+            *erased_len = end;
+        }
+
+        write_stats.erase_us += esp_timer_get_time() - start;
+    }
+
+    return ret;
+}
+
+static esp_err_t _esp_ota_write_range( const uint8_t * data,
+                                       uint32_t length,
+                                       uint32_t offset )
+{
+    esp_err_t ret;
+
+    if( ( offset < ota_writer.stage_base ) && ( offset + length > ota_writer.stage_base ) )
+    {
+        LogError( ( "The image runs into the file staged at 0x%x", ota_writer.stage_base ) );
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    ret = _esp_ota_erase_through( offset, offset + length );
+
+    if( ret == ESP_OK )
+    {
+        const int64_t start = esp_timer_get_time();
+
+        ret = esp_ota_write_with_offset( ota_writer.handle, data, length, offset );
+        write_stats.write_us += esp_timer_get_time() - start;
+    }
+
+    if( ret == ESP_OK )
+    {
+        ota_writer.written_end = offset + length;
+
+        /* Hash the image while it is written, as far as it has come in order.
+         * Whatever follows a gap is read back from flash at close. */
+        if( ( ota_writer.verify_ctx != NULL ) && ( offset == ota_writer.hashed_len ) && ( offset < ota_writer.stage_base ) )
+        {
+            const int64_t start = esp_timer_get_time();
+
+            CRYPTO_SignatureVerificationUpdate( ota_writer.verify_ctx, data, length );
+            ota_writer.hashed_len += length;
+            write_stats.hash_us += esp_timer_get_time() - start;
+        }
+    }
+    else
+    {
+        LogError( ( "Couldn't flash at the offset %u (%d)", offset, ret ) );
+    }
+
+    return ret;
+}
+
+#if CONFIG_OTA_PAL_PIPELINED_WRITES
+
+    static bool _esp_ota_erase_ahead_pending( void )
+    {
+        return ota_writer.active && ota_writer.error == ESP_OK &&
+               *_esp_ota_erased_len( ota_writer.written_end ) <
+               MIN( ota_writer.written_end + ERASE_AHEAD_LEN, _esp_ota_region_end( ota_writer.written_end ) );
+    }
+
+    static void _esp_ota_writer_task( void * pvParameters )
+    {
+        esp_ota_write_buffer_t * buf;
+
+        ( void ) pvParameters;
+
+        for( ; ; )
+        {
+            /* With nothing to write, erase ahead of the blocks, one sector at a
+             * time so a buffer handed over meanwhile waits for one erase at most. */
+            if( xQueueReceive( full_buffers, &buf, _esp_ota_erase_ahead_pending() ? 0 : portMAX_DELAY ) != pdTRUE )
+            {
+                ota_writer.error = _esp_ota_erase_through( ota_writer.written_end,
+                                                           *_esp_ota_erased_len( ota_writer.written_end ) + SPI_FLASH_SEC_SIZE );
+            }
+            else if( buf == NULL )
+            {
+                ota_writer.active = false;
+                xSemaphoreGive( writer_idle );
+            }
+            else
+            {
+                if( ota_writer.error == ESP_OK )
+                {
+                    ota_writer.error = _esp_ota_write_range( buf->data, buf->length, buf->offset );
+                }
+
+                buf->length = 0;
+                xQueueSend( free_buffers, &buf, portMAX_DELAY );
+            }
+        }
+    }
+
+    static bool _esp_ota_writer_start( void )
+    {
+        if( writer_task == NULL )
+        {
+            free_buffers = xQueueCreateStatic( WRITE_BUFFER_COUNT, sizeof( esp_ota_write_buffer_t * ),
+                                               free_buffers_storage, &free_buffers_struct );
+            full_buffers = xQueueCreateStatic( WRITE_BUFFER_COUNT + 1, sizeof( esp_ota_write_buffer_t * ),
+                                               full_buffers_storage, &full_buffers_struct );
+            writer_idle = xSemaphoreCreateBinaryStatic( &writer_idle_struct );
+
+            for( int i = 0; i < WRITE_BUFFER_COUNT; i++ )
+            {
+                esp_ota_write_buffer_t * buf = &write_buffers[ i ];
+
+                xQueueSend( free_buffers, &buf, 0 );
+            }
+
+            writer_task = xTaskCreateStatic( _esp_ota_writer_task, "ota_writer", otapalconfigWRITER_TASK_STACK_SIZE,
+                                             NULL, otapalconfigWRITER_TASK_PRIORITY, writer_task_stack, &writer_task_struct );
+        }
+
+        return writer_task != NULL;
+    }
+
+    static void _esp_ota_writer_submit( void )
+    {
+        if( fill_buffer != NULL )
+        {
+            xQueueSend( fill_buffer->length > 0 ? full_buffers : free_buffers, &fill_buffer, portMAX_DELAY );
+            fill_buffer = NULL;
+        }
+    }
+
+#endif /* CONFIG_OTA_PAL_PIPELINED_WRITES */
+
+/* Write to the update partition from the OTA agent: collected into buffers for
+ * the writer task while it is active, else straight to flash. */
+static esp_err_t _esp_ota_queue_write( const uint8_t * data,
+                                       uint32_t length,
+                                       uint32_t offset )
+{
+    #if CONFIG_OTA_PAL_PIPELINED_WRITES
+        if( ota_writer.active )
+        {
+            while( length > 0 )
+            {
+                /* Hand the buffer to the writer task once it is full or the
+                 * data does not follow on. */
+                if( ( fill_buffer != NULL ) &&
+                    ( ( offset != fill_buffer->offset + fill_buffer->length ) ||
+                      ( fill_buffer->length == otapalconfigWRITE_BUFFER_SIZE ) ) )
+                {
+                    _esp_ota_writer_submit();
+                }
+
+                if( fill_buffer == NULL )
+                {
+                    /* Both buffers are with the writer task: the flash is the
+                     * bottleneck, so wait for it. */
+                    xQueueReceive( free_buffers, &fill_buffer, portMAX_DELAY );
+                    fill_buffer->offset = offset;
+                    fill_buffer->length = 0;
+                }
+
+                const uint32_t len = MIN( length, otapalconfigWRITE_BUFFER_SIZE - fill_buffer->length );
+
+                memcpy( fill_buffer->data + fill_buffer->length, data, len );
+                fill_buffer->length += len;
+                data += len;
+                offset += len;
+                length -= len;
+
+                if( fill_buffer->length == otapalconfigWRITE_BUFFER_SIZE )
+                {
+                    _esp_ota_writer_submit();
+                }
+            }
+
+            return ota_writer.error;
+        }
+    #endif /* CONFIG_OTA_PAL_PIPELINED_WRITES */
+
+    return _esp_ota_write_range( data, length, offset );
+}
+
+/* Get every block received so far onto flash and stop erasing ahead, after
+ * which ota_writer belongs to the caller. */
+static esp_err_t _esp_ota_writer_drain( void )
+{
+    #if CONFIG_OTA_PAL_PIPELINED_WRITES
+        esp_ota_write_buffer_t * stop = NULL;
+
+        if( !ota_writer.active )
+        {
+            return ota_writer.error;
+        }
+
+        _esp_ota_writer_submit();
+        xQueueSend( full_buffers, &stop, portMAX_DELAY );
+        xSemaphoreTake( writer_idle, portMAX_DELAY );
+    #endif
+
+    return ota_writer.error;
+}
+
+static void _esp_ota_log_write_stats( void )
+{
+    const uint32_t ms = ( uint32_t ) ( ( esp_timer_get_time() - write_stats.start_us ) / 1000 );
+
+    LogInfo( ( "Wrote %u blocks, %u bytes in %u ms (%u B/s), %u held back, %u out of order: in write block %u ms, decode %u ms, flash write %u ms, erase %u ms, hash %u ms",
+               write_stats.blocks, write_stats.bytes, ms,
+               ms > 0 ? ( uint32_t ) ( write_stats.bytes * 1000ULL / ms ) : 0,
+               write_stats.held, write_stats.out_of_order,
+               ( uint32_t ) ( write_stats.block_us / 1000 ),
+               ( uint32_t ) ( write_stats.decode_us / 1000 ),
+               ( uint32_t ) ( write_stats.write_us / 1000 ),
+               ( uint32_t ) ( write_stats.erase_us / 1000 ),
+               ( uint32_t ) ( write_stats.hash_us / 1000 ) ) );
+}
+
+/* Drop the image hash of a transfer that is not verified. */
+static void _esp_ota_verify_discard( void )
+{
+    if( ota_writer.verify_ctx != NULL )
+    {
+        /* Without a certificate and signature this only frees the context. */
+        ( void ) CRYPTO_SignatureVerificationFinal( ota_writer.verify_ctx, NULL, 0, NULL, 0 );
+        ota_writer.verify_ctx = NULL;
+    }
+}
+
+/* Decoded output of a compressed image, written where it belongs in the image. */
+static int _esp_ota_decoded_write( void * ctx,
+                                   uint32_t offset,
+                                   const uint8_t * buf,
+                                   size_t len )
+{
+    ( void ) ctx;
+
+    return _esp_ota_queue_write( buf, len, offset ) == ESP_OK ? 0 : -1;
+}
+
+static int _esp_ota_delta_read( void * ctx,
+                                uint32_t offset,
+                                uint8_t * buf,
+                                size_t len )
+{
+    return esp_partition_read( ( const esp_partition_t * ) ctx, offset, buf, len ) == ESP_OK ? 0 : -1;
+}
+
+static int _esp_ota_delta_write( void * ctx,
+                                 uint32_t offset,
+                                 const uint8_t * buf,
+                                 size_t len )
+{
+    ( void ) ctx;
+
+    return _esp_ota_write_range( buf, len, offset ) == ESP_OK ? 0 : -1;
+}
+
+/* Decoded output of a compressed patch, applied as it comes. */
+static int _esp_ota_delta_decoded( void * ctx,
+                                   uint32_t offset,
+                                   const uint8_t * buf,
+                                   size_t len )
+{
+    ( void ) offset;
+
+    return ota_delta_feed( ( ota_delta_t * ) ctx, buf, len ) == OTA_DELTA_OK ? 0 : -1;
+}
+
+static int _esp_ota_feed_delta( void * ctx,
+                                const uint8_t * data,
+                                size_t len )
+{
+    return ota_delta_feed( ( ota_delta_t * ) ctx, data, len ) == OTA_DELTA_OK ? 0 : -1;
+}
+
+static int _esp_ota_feed_decoder( void * ctx,
+                                  const uint8_t * data,
+                                  size_t len )
+{
+    return ota_heatshrink_feed( ( ota_heatshrink_t * ) ctx, data, len ) == OTA_HEATSHRINK_OK ? 0 : -1;
+}
+
+/* Pass the staged file from offset from up to to through feed, a block at a
+ * time. Returns 0, or -1 once reading or feed fails. */
+static int _esp_ota_feed_staged( uint32_t from,
+                                 uint32_t to,
+                                 int ( * feed )( void * ctx, const uint8_t * data, size_t len ),
+                                 void * ctx )
+{
+    static uint8_t staged[ otaconfigFILE_BLOCK_SIZE ];
+
+    for( uint32_t offset = from; offset < to; offset += sizeof( staged ) )
+    {
+        const uint32_t len = MIN( sizeof( staged ), to - offset );
+
+        if( esp_partition_read( ota_writer.partition, ota_writer.stage_base + offset, staged, len ) != ESP_OK )
+        {
+            LogError( ( "Couldn't read the staged file at the offset %u", offset ) );
+            return -1;
+        }
+
+        if( feed( ctx, staged, len ) != 0 )
+        {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/* Delta updates: rebuild the new image at the start of the update partition
+ * from the running image and the patch staged at its end, decompressing the
+ * patch on the way if it is compressed. Called with the writer drained. */
+static OtaPalMainStatus_t _esp_ota_apply_delta( bool compressed )
+{
+    static ota_delta_t delta;
+    const esp_partition_t * running = esp_ota_get_running_partition();
+    const uint32_t patch_len = ota_ctx.data_write_len;
+    const int64_t start = esp_timer_get_time();
+    ota_heatshrink_status_t decode_status = OTA_HEATSHRINK_OK;
+    ota_delta_status_t status = OTA_DELTA_OK;
+
+    /* The image, and the signature after it, have to end before the patch. */
+    ota_writer.written_end = 0;
+    ota_delta_begin( &delta, _esp_ota_delta_read, _esp_ota_delta_write, ( void * ) running,
+                     running->size, ota_writer.stage_base - ECDSA_SIG_SIZE );
+
+    if( compressed )
+    {
+        ota_heatshrink_begin( &decoder, _esp_ota_delta_decoded, &delta );
+
+        if( _esp_ota_feed_staged( 0, patch_len, _esp_ota_feed_decoder, &decoder ) == 0 )
+        {
+            decode_status = ota_heatshrink_end( &decoder );
+        }
+        else
+        {
+            decode_status = ( decoder.status != OTA_HEATSHRINK_OK ) ? decoder.status : OTA_HEATSHRINK_TRUNCATED;
+        }
+
+        write_stats.decode_us += esp_timer_get_time() - start;
+    }
+    else if( _esp_ota_feed_staged( 0, patch_len, _esp_ota_feed_delta, &delta ) != 0 )
+    {
+        status = ( delta.status != OTA_DELTA_OK ) ? delta.status : OTA_DELTA_READ_FAILED;
+    }
+
+    /* A patch the applier rejected while it was decoded has the reason in delta. */
+    if( ( status == OTA_DELTA_OK ) && ( delta.status != OTA_DELTA_OK ) )
+    {
+        status = delta.status;
+    }
+    else if( ( status == OTA_DELTA_OK ) && ( decode_status == OTA_HEATSHRINK_OK ) )
+    {
+        status = ota_delta_end( &delta );
+    }
+
+    if( ( status != OTA_DELTA_OK ) || ( decode_status != OTA_HEATSHRINK_OK ) )
+    {
+        LogError( ( "Applying the delta update failed: %s", ( status != OTA_DELTA_OK ) ?
+                    ota_delta_strerror( status ) : ota_heatshrink_strerror( decode_status ) ) );
+        return OtaPalFileClose;
+    }
+
+    ota_ctx.data_write_len = delta.target_size;
+    LogInfo( ( "Rebuilt a %u byte image from a %u byte patch in %u ms", delta.target_size, patch_len,
+               ( uint32_t ) ( ( esp_timer_get_time() - start ) / 1000 ) ) );
+
+    return OtaPalSuccess;
+}
+
+/* Compressed images: decode whatever was staged after a block came out of
+ * order and finish the image. Called with the writer drained. */
+static OtaPalMainStatus_t _esp_ota_finish_decode( void )
+{
+    const uint32_t file_len = ota_ctx.data_write_len;
+    const int64_t start = esp_timer_get_time();
+    ota_heatshrink_status_t status = OTA_HEATSHRINK_OK;
+
+    if( ota_ctx.staging &&
+        ( _esp_ota_feed_staged( ota_ctx.decoded_upto, file_len, _esp_ota_feed_decoder, &decoder ) != 0 ) )
+    {
+        status = ( decoder.status != OTA_HEATSHRINK_OK ) ? decoder.status : OTA_HEATSHRINK_TRUNCATED;
+    }
+
+    if( status == OTA_HEATSHRINK_OK )
+    {
+        status = ota_heatshrink_end( &decoder );
+    }
+
+    write_stats.decode_us += esp_timer_get_time() - start;
+
+    if( status != OTA_HEATSHRINK_OK )
+    {
+        LogError( ( "Decompressing the image failed: %s", ota_heatshrink_strerror( status ) ) );
+        return OtaPalFileClose;
+    }
+
+    ota_ctx.data_write_len = decoder.out_len;
+    LogInfo( ( "Decompressed a %u byte file to a %u byte image, %u bytes of it at close", file_len,
+               decoder.out_len, ota_ctx.staging ? file_len - ota_ctx.decoded_upto : 0 ) );
+
+    return OtaPalSuccess;
+}
+
+/* Store a block of the file: decode it, or queue it for flash at its place in
+ * the image or, for delta and compressed files, in the staged file. */
+static esp_err_t _esp_ota_store_block( const OtaFileContext_t * pFileContext,
+                                       uint32_t iOffset,
+                                       const uint8_t * pacData,
+                                       uint32_t iBlockSize )
+{
+    const bool compressed = ( pFileContext->fileType == otapalconfigCOMPRESSED_FILE_TYPE );
+    const uint32_t block = iOffset / otaconfigFILE_BLOCK_SIZE;
+    uint32_t offset = iOffset;
+    esp_err_t ret;
+
+    if( iOffset != ota_ctx.next_offset )
+    {
+        write_stats.out_of_order++;
+    }
+
+    /* A compressed image is decoded while its blocks come in order. From
+     * the first block out of order on, it is staged like a delta update's
+     * patch and the rest is decoded at close. */
+    if( compressed && !ota_ctx.staging && ( iOffset == ota_ctx.decoded_upto ) )
+    {
+        const int64_t start = esp_timer_get_time();
+
+        ret = ( ota_heatshrink_feed( &decoder, pacData, iBlockSize ) == OTA_HEATSHRINK_OK ) ? ESP_OK : ESP_FAIL;
+        ota_ctx.decoded_upto += iBlockSize;
+        write_stats.decode_us += esp_timer_get_time() - start;
+
+        if( ret != ESP_OK )
+        {
+            LogError( ( "Decompressing the block at the offset %u failed: %s", iOffset,
+                        ota_heatshrink_strerror( decoder.status ) ) );
+        }
+    }
+    else
+    {
+        if( compressed && !ota_ctx.staging )
+        {
+            LogInfo( ( "Block at the offset %u out of order, staging from %u", iOffset, ota_ctx.decoded_upto ) );
+            ota_ctx.staging = true;
+        }
+
+        if( ota_writer.stage_base < ota_ctx.update_partition->size )
+        {
+            offset += ota_writer.stage_base;
+        }
+
+        if( ( ota_writer.error != ESP_OK ) || ( offset + iBlockSize > ota_ctx.update_partition->size ) )
+        {
+            LogError( ( "Couldn't flash at the offset %u", iOffset ) );
+            return ESP_FAIL;
+        }
+
+        ret = _esp_ota_queue_write( pacData, iBlockSize, offset );
+    }
+
+    if( ( ret == ESP_OK ) && ( iOffset < pFileContext->fileSize ) )
+    {
+        stored_blocks[ block / 8 ] |= ( uint8_t ) ( 1U << ( block % 8 ) );
+    }
+
+    return ret;
+}
+
+static bool _esp_ota_block_stored( uint32_t offset )
+{
+    const uint32_t block = offset / otaconfigFILE_BLOCK_SIZE;
+
+    return ( stored_blocks[ block / 8 ] & ( 1U << ( block % 8 ) ) ) != 0;
+}
+
+static esp_ota_held_block_t * _esp_ota_held_block( uint32_t offset )
+{
+    for( uint32_t i = 0; i < held_slots; i++ )
+    {
+        if( held_blocks[ i ].used && ( held_blocks[ i ].offset == offset ) )
+        {
+            return &held_blocks[ i ];
+        }
+    }
+
+    return NULL;
+}
+
+/* Store the blocks held back that now follow on, and move past the ones
+ * already stored out of order. */
+static esp_err_t _esp_ota_store_in_order( const OtaFileContext_t * pFileContext )
+{
+    esp_err_t ret = ESP_OK;
+
+    while( ( ret == ESP_OK ) && ( ota_ctx.next_offset < pFileContext->fileSize ) )
+    {
+        esp_ota_held_block_t * held = _esp_ota_held_block( ota_ctx.next_offset );
+
+        if( held != NULL )
+        {
+            ret = _esp_ota_store_block( pFileContext, held->offset, held->data, held->length );
+            held->used = false;
+        }
+        else if( !_esp_ota_block_stored( ota_ctx.next_offset ) )
+        {
+            break;
+        }
+
+        ota_ctx.next_offset += otaconfigFILE_BLOCK_SIZE;
+    }
+
+    return ret;
+}
+
+/* Hold back a block that came after a missing one. With every slot taken,
+ * the block furthest ahead is stored out of order instead, as the one least
+ * likely to follow on soon. */
+static esp_err_t _esp_ota_hold_block( const OtaFileContext_t * pFileContext,
+                                      uint32_t iOffset,
+                                      const uint8_t * pacData,
+                                      uint32_t iBlockSize )
+{
+    esp_ota_held_block_t * slot = NULL;
+    esp_ota_held_block_t * furthest = NULL;
+
+    for( uint32_t i = 0; ( i < held_slots ) && ( slot == NULL ); i++ )
+    {
+        if( !held_blocks[ i ].used )
+        {
+            slot = &held_blocks[ i ];
+        }
+        else if( ( furthest == NULL ) || ( held_blocks[ i ].offset > furthest->offset ) )
+        {
+            furthest = &held_blocks[ i ];
+        }
+    }
+
+    if( slot == NULL )
+    {
+        if( ( furthest == NULL ) || ( furthest->offset < iOffset ) )
+        {
+            return _esp_ota_store_block( pFileContext, iOffset, pacData, iBlockSize );
+        }
+
+        if( _esp_ota_store_block( pFileContext, furthest->offset, furthest->data, furthest->length ) != ESP_OK )
+        {
+            return ESP_FAIL;
+        }
+
+        slot = furthest;
+    }
+
+    memcpy( slot->data, pacData, iBlockSize );
+    slot->offset = iOffset;
+    slot->length = iBlockSize;
+    slot->used = true;
+    write_stats.held++;
+
+    return ESP_OK;
+}
+
+static bool _esp_ota_reorder_start( uint32_t file_size )
+{
+    stored_blocks = calloc( ( file_size / otaconfigFILE_BLOCK_SIZE ) / 8 + 1, 1 );
+    held_slots = otapalconfigREORDER_BLOCKS;
+    held_blocks = ( held_slots > 0 ) ? calloc( held_slots, sizeof( esp_ota_held_block_t ) ) : NULL;
+
+    if( held_blocks == NULL )
+    {
+        if( held_slots > 0 )
+        {
+            LogWarn( ( "No memory to hold back blocks, blocks after a missing one are stored out of order" ) );
+        }
+
+        held_slots = 0;
+    }
+
+    return stored_blocks != NULL;
+}
+
+/* Drop the blocks held back and the map of blocks stored, at the end of a file. */
+static void _esp_ota_reorder_end( void )
+{
+    free( held_blocks );
+    held_blocks = NULL;
+    held_slots = 0;
+    free( stored_blocks );
+    stored_blocks = NULL;
+}
+
 /* Abort receiving the specified OTA update by closing the file. */
 OtaPalStatus_t otaPal_Abort( OtaFileContext_t * const pFileContext )
 {
@@ -179,6 +892,9 @@ OtaPalStatus_t otaPal_Abort( OtaFileContext_t * const pFileContext )
 
     if( _esp_ota_ctx_validate( pFileContext ) )
     {
+        ( void ) _esp_ota_writer_drain();
+        _esp_ota_verify_discard();
+        _esp_ota_reorder_end();
         _esp_ota_ctx_close( pFileContext );
         ota_ret = OTA_PAL_COMBINE_ERR( OtaPalSuccess, 0 );
     }
@@ -209,12 +925,49 @@ OtaPalStatus_t otaPal_CreateFileForRx( OtaFileContext_t * const pFileContext )
     LogInfo( ( "Writing to partition subtype %d at offset 0x%x",
                update_partition->subtype, update_partition->address ) );
 
+    /* Finish with whatever an aborted transfer left behind. */
+    ( void ) _esp_ota_writer_drain();
+    _esp_ota_verify_discard();
+    _esp_ota_reorder_end();
+
+    if( !_esp_ota_reorder_start( pFileContext->fileSize ) )
+    {
+        LogError( ( "No memory for the map of blocks stored" ) );
+        return OTA_PAL_COMBINE_ERR( OtaPalRxFileCreateFailed, 0 );
+    }
+
+    #if CONFIG_OTA_PAL_PIPELINED_WRITES
+        if( !_esp_ota_writer_start() )
+        {
+            LogError( ( "Failed to start the flash writer task" ) );
+            return OTA_PAL_COMBINE_ERR( OtaPalRxFileCreateFailed, 0 );
+        }
+    #endif
+
+    /* The image is hashed as it is written, so closing the file only has to
+     * check the signature. While this context holds the SHA engine, other
+     * SHA-256 users fall back to software. */
+    void * verify_ctx = NULL;
+
+    if( CRYPTO_SignatureVerificationStart( &verify_ctx, cryptoASYMMETRIC_ALGORITHM_ECDSA,
+                                           cryptoHASH_ALGORITHM_SHA256 ) == pdFALSE )
+    {
+        LogError( ( "Signature verification start failed" ) );
+        return OTA_PAL_COMBINE_ERR( OtaPalRxFileCreateFailed, 0 );
+    }
+
+    /* The partition is erased as the blocks come in rather than here, which
+     * would hold up the OTA agent for the whole partition. esp_ota_begin()
+     * erases the first sector only; OTA_WITH_SEQUENTIAL_WRITES would leave
+     * the handle erasing on write, which esp_ota_write_with_offset() asserts
+     * against. */
     esp_ota_handle_t update_handle;
-    esp_err_t err = esp_ota_begin( update_partition, OTA_SIZE_UNKNOWN, &update_handle );
+    esp_err_t err = esp_ota_begin( update_partition, SPI_FLASH_SEC_SIZE, &update_handle );
 
     if( err != ESP_OK )
     {
         LogError( ( "esp_ota_begin failed (%d)", err ) );
+        ( void ) CRYPTO_SignatureVerificationFinal( verify_ctx, NULL, 0, NULL, 0 );
         return OTA_PAL_COMBINE_ERR( OtaPalRxFileCreateFailed, 0 );
     }
 
@@ -225,6 +978,42 @@ OtaPalStatus_t otaPal_CreateFileForRx( OtaFileContext_t * const pFileContext )
     pFileContext->pFile = ( uint8_t * ) &ota_ctx;
     ota_ctx.data_write_len = 0;
     ota_ctx.valid_image = false;
+    ota_ctx.next_offset = 0;
+    ota_ctx.decoded_upto = 0;
+    ota_ctx.staging = false;
+
+    /* A delta update's patch goes to the end of the partition, out of the
+     * way of the image rebuilt from it at close. So do the blocks of a
+     * compressed image from the first one out of order. */
+    ota_writer.stage_base = update_partition->size;
+
+    if( ( pFileContext->fileType & ( otapalconfigDELTA_FILE_TYPE | otapalconfigCOMPRESSED_FILE_TYPE ) ) != 0U )
+    {
+        ota_writer.stage_base = ( update_partition->size - MIN( pFileContext->fileSize, update_partition->size ) ) &
+                                ~( SPI_FLASH_SEC_SIZE - 1 );
+        LogInfo( ( "%s%s update, staged at offset 0x%x",
+                   ( pFileContext->fileType & otapalconfigCOMPRESSED_FILE_TYPE ) ? "Compressed " : "",
+                   ( pFileContext->fileType & otapalconfigDELTA_FILE_TYPE ) ? "delta" : "image",
+                   ota_writer.stage_base ) );
+    }
+
+    if( pFileContext->fileType == otapalconfigCOMPRESSED_FILE_TYPE )
+    {
+        ota_heatshrink_begin( &decoder, _esp_ota_decoded_write, NULL );
+    }
+
+    memset( &write_stats, 0, sizeof( write_stats ) );
+    ota_writer.handle = update_handle;
+    ota_writer.erased_len = MIN( SPI_FLASH_SEC_SIZE, ota_writer.stage_base );
+    ota_writer.stage_erased = MAX( SPI_FLASH_SEC_SIZE, ota_writer.stage_base );
+    ota_writer.written_end = ( pFileContext->fileType & otapalconfigDELTA_FILE_TYPE ) ? ota_writer.stage_base : 0;
+    ota_writer.error = ESP_OK;
+    ota_writer.verify_ctx = verify_ctx;
+    ota_writer.hashed_len = 0;
+    ota_writer.partition = update_partition;
+    #if CONFIG_OTA_PAL_PIPELINED_WRITES
+        ota_writer.active = true;
+    #endif
 
     LogInfo( ( "esp_ota_begin succeeded" ) );
 
@@ -398,16 +1187,19 @@ OtaPalStatus_t otaPal_CheckFileSignature( OtaFileContext_t * const pFileContext
 {
     OtaPalStatus_t result;
     uint32_t ulSignerCertSize;
-    void * pvSigVerifyContext;
     uint8_t * pucSignerCert = 0;
     static spi_flash_mmap_memory_t ota_data_map;
-    uint32_t mmu_free_pages_count, len, flash_offset = 0;
+    uint32_t mmu_free_pages_count, len, flash_offset;
 
-    /* Verify an ECDSA-SHA256 signature. */
-    if( CRYPTO_SignatureVerificationStart( &pvSigVerifyContext, cryptoASYMMETRIC_ALGORITHM_ECDSA,
-                                           cryptoHASH_ALGORITHM_SHA256 ) == pdFALSE )
+    /* Verify an ECDSA-SHA256 signature over the hash started when the file
+     * was created. */
+    void * pvSigVerifyContext = ota_writer.verify_ctx;
+
+    ota_writer.verify_ctx = NULL;
+
+    if( pvSigVerifyContext == NULL )
     {
-        LogError( ( "Signature verification start failed" ) );
+        LogError( ( "No image hash to verify" ) );
         return OTA_PAL_COMBINE_ERR( OtaPalSignatureCheckFailed, 0 );
     }
 
@@ -416,11 +1208,16 @@ OtaPalStatus_t otaPal_CheckFileSignature( OtaFileContext_t * const pFileContext
     if( pucSignerCert == NULL )
     {
         LogError( ( "Cert read failed" ) );
+        ( void ) CRYPTO_SignatureVerificationFinal( pvSigVerifyContext, NULL, 0, NULL, 0 );
         return OTA_PAL_COMBINE_ERR( OtaPalBadSignerCert, 0 );
     }
 
+    /* Only the part of the image after the first block that came out of
+     * order is still to be hashed, usually nothing. */
     mmu_free_pages_count = spi_flash_mmap_get_free_pages( SPI_FLASH_MMAP_DATA );
-    len = ota_ctx.data_write_len;
+    flash_offset = ota_writer.hashed_len;
+    len = ota_ctx.data_write_len - flash_offset;
+    LogInfo( ( "Hashed %u bytes while writing, reading back %u", ota_writer.hashed_len, len ) );
 
     while( len > 0 )
     {
@@ -437,6 +1234,7 @@ OtaPalStatus_t otaPal_CheckFileSignature( OtaFileContext_t * const pFileContext
         if( ret != ESP_OK )
         {
             LogError( ( "Partition mmap failed %d", ret ) );
+            ( void ) CRYPTO_SignatureVerificationFinal( pvSigVerifyContext, NULL, 0, NULL, 0 );
             result = OTA_PAL_COMBINE_ERR( OtaPalSignatureCheckFailed, 0 );
             goto end;
         }
@@ -479,7 +1277,30 @@ OtaPalStatus_t otaPal_CloseFile( OtaFileContext_t * const pFileContext )
         return OTA_PAL_COMBINE_ERR( OtaPalFileClose, 0 );
     }
 
-    if( pFileContext->pSignature == NULL )
+    /* Every block has come by now, so nothing should be held back. */
+    for( uint32_t i = 0; i < held_slots; i++ )
+    {
+        if( held_blocks[ i ].used &&
+            ( _esp_ota_store_block( pFileContext, held_blocks[ i ].offset, held_blocks[ i ].data,
+                                    held_blocks[ i ].length ) != ESP_OK ) )
+        {
+            mainErr = OtaPalFileClose;
+        }
+    }
+
+    _esp_ota_reorder_end();
+
+    if( mainErr != OtaPalSuccess )
+    {
+        ( void ) _esp_ota_writer_drain();
+        LogError( ( "Writing the image to flash failed" ) );
+    }
+    else if( _esp_ota_writer_drain() != ESP_OK )
+    {
+        LogError( ( "Writing the image to flash failed" ) );
+        mainErr = OtaPalFileClose;
+    }
+    else if( pFileContext->pSignature == NULL )
     {
         LogError( ( "Image Signature not found" ) );
         _esp_ota_ctx_clear( &ota_ctx );
@@ -492,8 +1313,22 @@ OtaPalStatus_t otaPal_CloseFile( OtaFileContext_t * const pFileContext )
     }
     else
     {
+        /* A delta update's image only exists once the patch is applied, and a
+         * compressed image may still have staged blocks to decode. */
+        if( pFileContext->fileType & otapalconfigDELTA_FILE_TYPE )
+        {
+            mainErr = _esp_ota_apply_delta( ( pFileContext->fileType & otapalconfigCOMPRESSED_FILE_TYPE ) != 0U );
+        }
+        else if( pFileContext->fileType == otapalconfigCOMPRESSED_FILE_TYPE )
+        {
+            mainErr = _esp_ota_finish_decode();
+        }
+
         /* Verify the file signature, close the file and return the signature verification result. */
-        mainErr = OTA_PAL_MAIN_ERR( otaPal_CheckFileSignature( pFileContext ) );
+        if( mainErr == OtaPalSuccess )
+        {
+            mainErr = OTA_PAL_MAIN_ERR( otaPal_CheckFileSignature( pFileContext ) );
+        }
 
         if( mainErr != OtaPalSuccess )
         {
@@ -512,7 +1347,7 @@ OtaPalStatus_t otaPal_CloseFile( OtaFileContext_t * const pFileContext )
 
                 if( mainErr == OtaPalSuccess )
                 {
-                    esp_err_t ret = esp_ota_write_with_offset( ota_ctx.update_handle, sec_boot_sig, ECDSA_SIG_SIZE, ota_ctx.data_write_len );
+                    esp_err_t ret = _esp_ota_write_range( ( const uint8_t * ) sec_boot_sig, ECDSA_SIG_SIZE, ota_ctx.data_write_len );
 
                     if( ret != ESP_OK )
                     {
@@ -532,6 +1367,9 @@ OtaPalStatus_t otaPal_CloseFile( OtaFileContext_t * const pFileContext )
         }
     }
 
+    _esp_ota_verify_discard();
+    _esp_ota_log_write_stats();
+
     return OTA_PAL_COMBINE_ERR( mainErr, 0 );
 }
 
@@ -583,14 +1421,41 @@ int16_t otaPal_WriteBlock( OtaFileContext_t * const pFileContext,
 {
     if( _esp_ota_ctx_validate( pFileContext ) )
     {
-        esp_err_t ret = esp_ota_write_with_offset( ota_ctx.update_handle, pacData, iBlockSize, iOffset );
+        const int64_t start = esp_timer_get_time();
+        esp_err_t ret;
+
+        if( write_stats.blocks == 0 )
+        {
+            write_stats.start_us = start;
+        }
+
+        if( iOffset == ota_ctx.next_offset )
+        {
+            ret = _esp_ota_store_block( pFileContext, iOffset, pacData, iBlockSize );
+            ota_ctx.next_offset += otaconfigFILE_BLOCK_SIZE;
+
+            if( ret == ESP_OK )
+            {
+                ret = _esp_ota_store_in_order( pFileContext );
+            }
+        }
+        else if( ( iOffset > ota_ctx.next_offset ) && ( iBlockSize <= otaconfigFILE_BLOCK_SIZE ) )
+        {
+            ret = _esp_ota_hold_block( pFileContext, iOffset, pacData, iBlockSize );
+        }
+        else
+        {
+            ret = _esp_ota_store_block( pFileContext, iOffset, pacData, iBlockSize );
+        }
 
         if( ret != ESP_OK )
         {
-            LogError( ( "Couldn't flash at the offset %d", iOffset ) );
             return -1;
         }
 
+        write_stats.block_us += esp_timer_get_time() - start;
+        write_stats.blocks++;
+        write_stats.bytes += iBlockSize;
         ota_ctx.data_write_len += iBlockSize;
     }
     else
@@ -0,0 +1,191 @@
+#include <stdio.h>
+#include <math.h>
+#include "esp_log.h"
+#include "sampler.h"
+#include "uplink.h"
+#include "flicker.h"
+#include "timesync.h"
+#include "aggregate.h"
+
+static const char *AGG_TAG = "AGGREGATE";
+
+static agg_window_t windows[AGG_WINDOWS] = {
+    { .lengthS = AGG_SHORT_WINDOW_S },
+    { .lengthS = AGG_LONG_WINDOW_S },
+};
+static char payload[UPLINK_PAYLOAD_MAX];
+static int64_t lastTimestamp = 0;
+static float lastPower = 0;
+
+static void statReset(agg_stat_t *s, float x)
+{
+    s->min = x;
+    s->max = x;
+    s->mean = x;
+    s->m2 = 0;
+}
+
+/* Welford's update, numerically stable where sum and sum of squares are not. */
+static void statAdd(agg_stat_t *s, float x, uint32_t count)
+{
+    const float delta = x - s->mean;
+
+    if (x < s->min) {
+        s->min = x;
+    }
+    if (x > s->max) {
+        s->max = x;
+    }
+    s->mean += delta / count;
+    s->m2 += delta * (x - s->mean);
+}
+
+/* Population variance of the window. */
+float aggregate_variance(const agg_stat_t *s, uint32_t count)
+{
+    return count > 0 ? s->m2 / count : 0;
+}
+
+/* RMS from mean and variance: mean(x^2) = mean^2 + variance. */
+float aggregate_rms(const agg_stat_t *s, uint32_t count)
+{
+    return sqrtf(s->mean * s->mean + aggregate_variance(s, count));
+}
+
+/* Kahan summation keeps the small per-sample energy from vanishing into a large total. */
+static void kahanAdd(float *sum, float *comp, float value)
+{
+    const float y = value - *comp;
+    const float t = *sum + y;
+
+    *comp = (t - *sum) - y;
+    *sum = t;
+}
+
+static void windowStart(agg_window_t *w, const power_meansuare_t *m, const float *values)
+{
+    w->count = 1;
+    w->startUs = m->timestamp;
+    w->endUs = m->timestamp;
+    for (int q = 0; q < AGG_QUANTITIES; q++) {
+        statReset(&w->stat[q], values[q]);
+    }
+    w->energyStartWh = m->totalWh;
+    w->energyEndWh = m->totalWh;
+    w->integratedWh = 0;
+    w->integratedComp = 0;
+    w->flickerSdMax = -1;
+    w->flickerDvMax = -1;
+}
+
+static void flickerAdd(agg_window_t *w, const flicker_index_t *f)
+{
+    if (f->sdPct > w->flickerSdMax) {
+        w->flickerSdMax = f->sdPct;
+    }
+    if (f->dvPct > w->flickerDvMax) {
+        w->flickerDvMax = f->dvPct;
+    }
+}
+
+static int appendStat(char *buf, size_t len, const char *name, const agg_stat_t *s, uint32_t count)
+{
+    return snprintf(buf, len, "\"%s\":{\"min\":%.3f,\"max\":%.3f,\"mean\":%.3f,\"rms\":%.3f,\"var\":%.4g},",
+                    name, s->min, s->max, s->mean, aggregate_rms(s, count), aggregate_variance(s, count));
+}
+
+/* JSON document of a closed window. Returns the length, or a negative value if buf is too small. */
+int aggregate_format(const agg_window_t *w, char *buf, size_t len)
+{
+    static const char *names[AGG_QUANTITIES] = { "U", "I", "P", "F", "PF" };
+    int used = snprintf(buf, len, "{\"window\":%u,\"start_ms\":%lld,\"end_ms\":%lld,\"n\":%u,",
+                        (unsigned)w->lengthS, (long long)timesync_epoch_ms(w->startUs),
+                        (long long)timesync_epoch_ms(w->endUs), (unsigned)w->count);
+
+    for (int q = 0; q < AGG_QUANTITIES && used >= 0 && (size_t)used < len; q++) {
+        used += appendStat(buf + used, len - used, names[q], &w->stat[q], w->count);
+    }
+    // Only once the fluctuation window has filled
+    if (w->flickerSdMax >= 0 && used >= 0 && (size_t)used < len) {
+        used += snprintf(buf + used, len - used, "\"Flicker\":{\"sd_max_pct\":%.3f,\"dv_max_pct\":%.3f},",
+                         w->flickerSdMax, w->flickerDvMax);
+    }
+    // kWh with three decimals from the integer Wh, exact however large the total
+    if (used >= 0 && (size_t)used < len) {
+        const uint64_t deltaWh = w->energyEndWh - w->energyStartWh;
+        used += snprintf(buf + used, len - used,
+                         "\"Energy\":{\"start\":%llu.%03u,\"delta\":%llu.%03u,\"integrated_wh\":%.2f}}",
+                         (unsigned long long)(w->energyStartWh / 1000), (unsigned)(w->energyStartWh % 1000),
+                         (unsigned long long)(deltaWh / 1000), (unsigned)(deltaWh % 1000), w->integratedWh);
+    }
+    return (used >= 0 && (size_t)used < len) ? used : -1;
+}
+
+static void windowClose(const agg_window_t *w)
+{
+    const int len = aggregate_format(w, payload, sizeof(payload));
+
+    if (len < 0) {
+        ESP_LOGE(AGG_TAG, "Aggregate of the %us window does not fit %u bytes", (unsigned)w->lengthS,
+                 (unsigned)sizeof(payload));
+        return;
+    }
+    ESP_LOGD(AGG_TAG, "%s", payload);
+    uplink_send(UPLINK_TELEMETRY, payload, len);
+}
+
+/*
+ * Feed one meter sample to every window. Runs in the sampler task, O(1) in
+ * time and memory. A window closes on the first sample at or past its end,
+ * which then opens the next window, so windows follow the sample clock.
+ */
+void aggregate_add_sample(const power_meansuare_t *m)
+{
+    const float values[AGG_QUANTITIES] = { m->voltage, m->current, m->power, m->frequency, m->pf };
+    float energyWh = 0;
+    flicker_index_t flicker;
+    const bool haveFlicker = flicker_get_index(&flicker);
+
+    // Energy of the interval since the previous sample, at the previous power
+    if (lastTimestamp != 0 && m->timestamp - lastTimestamp <= (int64_t)AGG_MAX_GAP_PERIODS * SAMPLER_PERIOD_MS * 1000) {
+        energyWh = lastPower * (float)(m->timestamp - lastTimestamp) / 3.6e9f;
+    }
+    lastTimestamp = m->timestamp;
+    lastPower = m->power;
+
+    for (int i = 0; i < AGG_WINDOWS; i++) {
+        agg_window_t *w = &windows[i];
+
+        if (w->lengthS == 0) {
+            continue;
+        }
+        if (w->count == 0) {
+            windowStart(w, m, values);
+            if (haveFlicker) {
+                flickerAdd(w, &flicker);
+            }
+            continue;
+        }
+        kahanAdd(&w->integratedWh, &w->integratedComp, energyWh);
+        // Half a period of slack, so timer jitter cannot push a sample across the boundary
+        if (m->timestamp - w->startUs >= (int64_t)w->lengthS * 1000000 - SAMPLER_PERIOD_MS * 500) {
+            // The boundary sample ends one window's counter delta and starts the next one's
+            w->energyEndWh = m->totalWh;
+            windowClose(w);
+            windowStart(w, m, values);
+            if (haveFlicker) {
+                flickerAdd(w, &flicker);
+            }
+            continue;
+        }
+        w->count++;
+        w->endUs = m->timestamp;
+        for (int q = 0; q < AGG_QUANTITIES; q++) {
+            statAdd(&w->stat[q], values[q], w->count);
+        }
+        w->energyEndWh = m->totalWh;
+        if (haveFlicker) {
+            flickerAdd(w, &flicker);
+        }
+    }
+}
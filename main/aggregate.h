@@ -0,0 +1,53 @@
+#ifndef AGGREGATE_H
+#define AGGREGATE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "sdkconfig.h"
+#include "pzem.h"
+
+/* Aggregation windows in seconds, a zero length disables the window. */
+#define AGG_SHORT_WINDOW_S      CONFIG_AGG_SHORT_WINDOW_S
+#define AGG_LONG_WINDOW_S       CONFIG_AGG_LONG_WINDOW_S
+#define AGG_WINDOWS             2
+
+/* A gap longer than this many sample periods is not integrated into energy. */
+#define AGG_MAX_GAP_PERIODS     5
+
+typedef enum {
+    AGG_VOLTAGE,
+    AGG_CURRENT,
+    AGG_POWER,
+    AGG_FREQUENCY,
+    AGG_PF,
+    AGG_QUANTITIES
+} agg_quantity_t;
+
+/* Running statistics of one quantity, updated in O(1) per sample. */
+typedef struct {
+    float min;
+    float max;
+    float mean;     // Welford running mean
+    float m2;       // Welford sum of squared deviations from the mean
+} agg_stat_t;
+
+typedef struct {
+    uint32_t lengthS;           // Nominal window length
+    uint32_t count;             // Samples in the window
+    int64_t startUs;            // esp_timer time of the first sample
+    int64_t endUs;              // esp_timer time of the last sample
+    agg_stat_t stat[AGG_QUANTITIES];
+    uint64_t energyStartWh;     // Ledger total at the first sample
+    uint64_t energyEndWh;       // Ledger total at the last sample
+    float integratedWh;         // Power integrated over time, Kahan summed
+    float integratedComp;       // Kahan compensation term of integratedWh
+    float flickerSdMax;         // Largest voltage fluctuation index seen, negative if none yet
+    float flickerDvMax;
+} agg_window_t;
+
+void aggregate_add_sample(const power_meansuare_t *m);
+float aggregate_variance(const agg_stat_t *stat, uint32_t count);
+float aggregate_rms(const agg_stat_t *stat, uint32_t count);
+int aggregate_format(const agg_window_t *window, char *buf, size_t len);
+
+#endif // AGGREGATE_H
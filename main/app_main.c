@@ -19,72 +19,56 @@
 #include "driver/gpio.h"
 #include "esp_log.h"
 #include "pzem.h"
+#include "nextion.h"
+#include "supervisor.h"
+#include "sampler.h"
+#include "uplink.h"
+#include "relay.h"
+#include "events.h"
+#include "shed.h"
+#include "timesync.h"
+#include "device_shadow.h"
+#include "ota_agent.h"
+#include "credentials.h"
+#if CONFIG_OTA_DATA_OVER_HTTP
+#include "ota_http.h"
+#endif
 #include "demo_config.h"
-int aws_iot_demo_main( int argc, char ** argv, param_t param);
+int aws_iot_demo_main( int argc, char ** argv );
 
 static const char *TAG = "MQTT_EXAMPLE";
 param_t param;
+
+static void aws_task(void *arg){
+    // Only returns when the MQTT library cannot be set up, which retrying does not fix
+    aws_iot_demo_main(0, NULL);
+    supervisor_task_exit("MQTT could not be initialised");
+}
+
 /*
- * Prototypes for the demos that can be started from this project.  Note the
- * MQTT demo is not actually started until the network is already.
+ * Every application task, created by the supervisor in this order with a
+ * static stack. Metering and HMI share core 1, TLS/MQTT sits on core 0 with
+ * Wi-Fi and lwIP. All priorities stay well below the Wi-Fi (23) and lwIP (18)
+ * tasks; the meter poller is high so sampling is not delayed by the HMI, and
+ * the load shedding controller is just above it so it acts on each sample as
+ * soon as it is posted. The SNTP client only wakes up every few minutes.
+ * The OTA agent sits below the MQTT task it shares the connection with, so a
+ * download never holds up telemetry; its stack holds the OTA job parser.
+ * With OTA data over HTTP the download task has its own TLS session.
  */
-static void pzem_task(void *arg){
-    uart_data_t uart_data= {
-        .uart_port = UART_NUM_1,
-        .tx_io_num = GPIO_NUM_4,
-        .rx_io_num = GPIO_NUM_5,
-    };
-    PZEM004Tv30_Init(&uart_data,PZEM_DEFAULT_ADDR);
-    bool pzem004_ajustado = false;
-	const uint8_t addr = 0x42;
-
-    while (1) {
-    	if (!pzem004_ajustado)
-    	{
-    		ESP_LOGI("TAG_PZEM004T", "Set address to 0x42");
-    		setAddress(addr);
-    		if (addr == getAddress())
-    		{
-				ESP_LOGI("TAG_PZEM004T", "New Address %#.2x", getAddress());
-				ESP_LOGI("TAG_PZEM004T", "Reset Energy");
-				resetEnergy();
-				pzem004_ajustado = true;
-    		}
-    		else
-    		{
-    			ESP_LOGI("TAG_PZEM004T", "Error to set New Address");
-    			vTaskDelay( 1000 / portTICK_PERIOD_MS);
-    		}
-    	}
+static supervisor_task_t app_tasks[] = {
+    SUPERVISED_TASK(sampler_task,       "pzem_task",    4096, 6, METER_CORE, NULL),
+    SUPERVISED_TASK(shed_task,          "shed_task",    3072, 7, METER_CORE, NULL),
+    SUPERVISED_TASK(nextion_tx_task,    "uart_tx_task", 3072, 4, METER_CORE, &param),
+    SUPERVISED_TASK(nextion_rx_task,    "uart_rx_task", 3072, 3, METER_CORE, NULL),
+    SUPERVISED_TASK(aws_task,           "aws_task",     9216, 5, NET_CORE,   NULL),
+    SUPERVISED_TASK(timesync_task,      "timesync",     3072, 2, NET_CORE,   NULL),
+    SUPERVISED_TASK(ota_agent_task,     "ota_task",     8192, 3, NET_CORE,   NULL),
+#if CONFIG_OTA_DATA_OVER_HTTP
+    SUPERVISED_TASK(ota_http_task,      "ota_http",     8192, 3, NET_CORE,   NULL),
+#endif
+};
 
-    	//Ensure that mqtt is connected
-		if(pzem004_ajustado) {
-			power_meansuare_t * mensures = meansures();
-            ESP_LOGI("TAG_PZEM004T","voltage %f",mensures->voltage);
-            ESP_LOGI("TAG_PZEM004T","current %f",mensures->current);
-            ESP_LOGI("TAG_PZEM004T","power %f",mensures->power);
-            ESP_LOGI("TAG_PZEM004T","energy %f",mensures->energy);
-            ESP_LOGI("TAG_PZEM004T","frequency %f",mensures->frequency);
-            ESP_LOGI("TAG_PZEM004T","pf %f",mensures->pf);
-            param.voltage=mensures->voltage;
-            param.current=mensures->current;
-            param.power=mensures->power;
-            param.energy=mensures->energy;
-            param.frequency=mensures->frequency;
-            param.pf=mensures->pf;
-			vTaskDelay( 1000 / portTICK_PERIOD_MS );
-		}
-		else
-		{
-			taskYIELD();
-		}
-	}
-}
-bool run_pzem(){
-    xTaskCreate(&pzem_task, "pzem_task", 9216, NULL, 1, NULL);
-    vTaskDelay( 1000 / portTICK_PERIOD_MS );
-    return true;
-}
 void app_main()
 {
     ESP_LOGI(TAG, "[APP] Startup..");
@@ -112,7 +96,14 @@ void app_main()
      * examples/protocols/README.md for more information about this function.
      */
     ESP_ERROR_CHECK(example_connect());
-    if(run_pzem()){
-        aws_iot_demo_main(0,NULL, param);
-    }
+    credentials_init();
+    relay_init();
+    nextion_main();
+    uplink_init();
+    events_init();
+    device_shadow_init();
+#if CONFIG_OTA_DATA_OVER_HTTP
+    ota_http_init();
+#endif
+    supervisor_start(app_tasks, sizeof(app_tasks) / sizeof(app_tasks[0]));
 }
@@ -81,6 +81,7 @@
 /* For ESP_LOG*/
 #include "esp_log.h"
 #include "aws.h"
+#include "credentials.h"
 /**
  * These configuration settings are required to run the mutual auth demo.
  * Throw compilation error if the below configs are not defined.
@@ -573,7 +574,7 @@ static int connectToServerWithBackoffRetries( NetworkContext_t * pNetworkContext
     uint16_t nextRetryBackOff;
 
     /* Initialize credentials for establishing TLS session. */
-    pNetworkContext->pcServerRootCAPem = root_cert_auth_pem_start;
+    credentials_apply_ca( pNetworkContext );
 
     /* If #CLIENT_USERNAME is defined, username/password is used for authenticating
      * the client. */
@@ -589,8 +590,7 @@ static int connectToServerWithBackoffRetries( NetworkContext_t * pNetworkContext
     /* The ds_data can be populated using the API's provided by esp_secure_cert_mgr */
 #else
     #ifndef CLIENT_USERNAME
-        pNetworkContext->pcClientCertPem = client_cert_pem_start;
-        pNetworkContext->pcClientKeyPem = client_key_pem_start;
+        credentials_apply_client( pNetworkContext );
     #endif
 #endif
     /* AWS IoT requires devices to send the Server Name Indication (SNI)
@@ -697,6 +697,14 @@ static int getNextFreeIndexForOutgoingPublishes( uint8_t * pIndex )
 }
 /*-----------------------------------------------------------*/
 
+static bool hasFreeOutgoingPublish( void )
+{
+    uint8_t index;
+
+    return getNextFreeIndexForOutgoingPublishes( &index ) == EXIT_SUCCESS;
+}
+/*-----------------------------------------------------------*/
+
 static void cleanupOutgoingPublishAt( uint8_t index )
 {
     assert( outgoingPublishPackets != NULL );
@@ -817,6 +825,167 @@ static int handlePublishResend( MQTTContext_t * pMqttContext )
 
 /*-----------------------------------------------------------*/
 
+static void handleEventConfig( const cJSON * pEvents )
+{
+    events_config_t config;
+    const cJSON * pItem = NULL;
+
+    events_get_config( &config );
+
+    for( int type = 0; type < EVENT_TYPES; type++ )
+    {
+        const cJSON * pRule = cJSON_GetObjectItemCaseSensitive( pEvents, events_name( type ) );
+
+        if( !cJSON_IsObject( pRule ) )
+        {
+            continue;
+        }
+
+        pItem = cJSON_GetObjectItemCaseSensitive( pRule, "enabled" );
+        if( cJSON_IsBool( pItem ) )
+        {
+            config.rule[ type ].enabled = cJSON_IsTrue( pItem );
+        }
+
+        pItem = cJSON_GetObjectItemCaseSensitive( pRule, "threshold" );
+        if( cJSON_IsNumber( pItem ) )
+        {
+            config.rule[ type ].threshold = ( float ) pItem->valuedouble;
+        }
+
+        pItem = cJSON_GetObjectItemCaseSensitive( pRule, "hysteresis" );
+        if( cJSON_IsNumber( pItem ) )
+        {
+            config.rule[ type ].hysteresis = ( float ) pItem->valuedouble;
+        }
+
+        pItem = cJSON_GetObjectItemCaseSensitive( pRule, "min_ms" );
+        if( cJSON_IsNumber( pItem ) && ( pItem->valuedouble >= 0 ) )
+        {
+            config.rule[ type ].minDurationMs = ( uint32_t ) pItem->valuedouble;
+        }
+    }
+
+    pItem = cJSON_GetObjectItemCaseSensitive( pEvents, "circuit_limits_a" );
+    if( cJSON_IsArray( pItem ) && ( cJSON_GetArraySize( pItem ) == RELAY_CHANNELS ) )
+    {
+        for( int i = 0; i < RELAY_CHANNELS; i++ )
+        {
+            const cJSON * pLimit = cJSON_GetArrayItem( pItem, i );
+
+            if( cJSON_IsNumber( pLimit ) )
+            {
+                config.circuitLimitA[ i ] = ( float ) pLimit->valuedouble;
+            }
+        }
+    }
+
+    if( events_set_config( &config ) )
+    {
+        LogInfo( ( "Event rules updated." ) );
+    }
+}
+
+/*-----------------------------------------------------------*/
+
+static void parseShadowState( const cJSON * pObject, shadow_state_t * pState )
+{
+    const cJSON * pItem = NULL;
+
+    ( void ) memset( pState, 0, sizeof( *pState ) );
+
+    for( int i = 0; i < RELAY_CHANNELS; i++ )
+    {
+        pItem = cJSON_GetObjectItemCaseSensitive( pObject, device_shadow_field_name( SHADOW_FIELD_RELAY_1 + i ) );
+        if( cJSON_IsBool( pItem ) )
+        {
+            pState->fields |= 1U << ( SHADOW_FIELD_RELAY_1 + i );
+            pState->relays |= ( cJSON_IsTrue( pItem ) ? 1U : 0U ) << i;
+        }
+    }
+
+    pItem = cJSON_GetObjectItemCaseSensitive( pObject, device_shadow_field_name( SHADOW_FIELD_CAP ) );
+    if( cJSON_IsNumber( pItem ) && ( pItem->valuedouble >= 0 ) )
+    {
+        pState->fields |= 1U << SHADOW_FIELD_CAP;
+        pState->capW = ( float ) pItem->valuedouble;
+    }
+
+    pItem = cJSON_GetObjectItemCaseSensitive( pObject, device_shadow_field_name( SHADOW_FIELD_LIMITS ) );
+    if( cJSON_IsArray( pItem ) && ( cJSON_GetArraySize( pItem ) == RELAY_CHANNELS ) )
+    {
+        for( int i = 0; i < RELAY_CHANNELS; i++ )
+        {
+            const cJSON * pLimit = cJSON_GetArrayItem( pItem, i );
+
+            if( !cJSON_IsNumber( pLimit ) || ( pLimit->valuedouble < 0 ) )
+            {
+                return;
+            }
+
+            pState->circuitLimitA[ i ] = ( float ) pLimit->valuedouble;
+        }
+
+        pState->fields |= 1U << SHADOW_FIELD_LIMITS;
+    }
+}
+
+/*-----------------------------------------------------------*/
+
+static void handleShadowMessage( ShadowMessageType_t type,
+                                 const MQTTPublishInfo_t * pPublishInfo )
+{
+    static shadow_state_t reported;
+    static shadow_state_t delta;
+    cJSON * pDocument = cJSON_ParseWithLength( ( const char * ) pPublishInfo->pPayload,
+                                               pPublishInfo->payloadLength );
+    const cJSON * pVersion = cJSON_GetObjectItemCaseSensitive( pDocument, "version" );
+    const cJSON * pToken = cJSON_GetObjectItemCaseSensitive( pDocument, "clientToken" );
+    const cJSON * pState = cJSON_GetObjectItemCaseSensitive( pDocument, "state" );
+    const uint32_t version = cJSON_IsNumber( pVersion ) ? ( uint32_t ) pVersion->valuedouble : 0U;
+    const char * pClientToken = cJSON_IsString( pToken ) ? pToken->valuestring : NULL;
+
+    LogDebug( ( "Shadow message on %.*s: %.*s",
+                pPublishInfo->topicNameLength,
+                pPublishInfo->pTopicName,
+                ( int ) pPublishInfo->payloadLength,
+                ( const char * ) pPublishInfo->pPayload ) );
+
+    switch( type )
+    {
+        case ShadowMessageTypeGetAccepted:
+            parseShadowState( cJSON_GetObjectItemCaseSensitive( pState, "reported" ), &reported );
+            parseShadowState( cJSON_GetObjectItemCaseSensitive( pState, "delta" ), &delta );
+            device_shadow_on_document( version, &reported, &delta );
+            break;
+
+        case ShadowMessageTypeGetRejected:
+            /* Most likely no document yet, which the first update creates. */
+            device_shadow_on_document( 0U, NULL, NULL );
+            break;
+
+        case ShadowMessageTypeUpdateDelta:
+            parseShadowState( pState, &delta );
+            device_shadow_on_delta( version, &delta );
+            break;
+
+        case ShadowMessageTypeUpdateAccepted:
+            device_shadow_on_update_result( pClientToken, true );
+            break;
+
+        case ShadowMessageTypeUpdateRejected:
+            device_shadow_on_update_result( pClientToken, false );
+            break;
+
+        default:
+            break;
+    }
+
+    cJSON_Delete( pDocument );
+}
+
+/*-----------------------------------------------------------*/
+
 static void handleIncomingPublish( MQTTPublishInfo_t * pPublishInfo,
                                    uint16_t packetIdentifier )
 {
@@ -826,9 +995,32 @@ static void handleIncomingPublish( MQTTPublishInfo_t * pPublishInfo,
     const cJSON *Device_2 = NULL;
     const cJSON *Device_3 = NULL;
     const cJSON *Device_4 = NULL;
+    ShadowMessageType_t shadowType;
+
+    /* Job documents and file blocks for the OTA agent. These come in
+     * quick succession during a download, so they are not logged. */
+    if( ota_agent_handle_publish( pPublishInfo->pTopicName,
+                                  pPublishInfo->topicNameLength,
+                                  pPublishInfo->pPayload,
+                                  pPublishInfo->payloadLength ) )
+    {
+        return;
+    }
+
     /* Process incoming Publish. */
     LogInfo( ( "Incoming QOS : %d.", pPublishInfo->qos ) );
 
+    /* Replies of the device shadow service. */
+    if( Shadow_MatchTopic( pPublishInfo->pTopicName,
+                           pPublishInfo->topicNameLength,
+                           &shadowType,
+                           NULL,
+                           NULL ) == SHADOW_SUCCESS )
+    {
+        handleShadowMessage( shadowType, pPublishInfo );
+        return;
+    }
+
     /* Verify the received publish is for the topic we have subscribed to. */
     if( ( pPublishInfo->topicNameLength == MQTT_EXAMPLE_TOPIC_LENGTH ) &&
         ( 0 == strncmp( MQTT_EXAMPLE_TOPIC,
@@ -845,7 +1037,9 @@ static void handleIncomingPublish( MQTTPublishInfo_t * pPublishInfo,
                    ( const char * ) pPublishInfo->pPayload ) );
 
         ESP_LOGI(JSON, "Deserialize ...");
-        device_json = cJSON_Parse( ( const char * ) pPublishInfo->pPayload );
+        /* The payload is not NUL terminated. */
+        device_json = cJSON_ParseWithLength( ( const char * ) pPublishInfo->pPayload,
+                                             pPublishInfo->payloadLength );
         if (device_json == NULL) 
         {
             const char *error_ptr = cJSON_GetErrorPtr();
@@ -856,28 +1050,45 @@ static void handleIncomingPublish( MQTTPublishInfo_t * pPublishInfo,
             }
         }
             
+        const cJSON *events = cJSON_GetObjectItemCaseSensitive(device_json, "events");
+        if (cJSON_IsObject(events))
+        {
+            handleEventConfig(events);
+        }
+
+        const cJSON *shed = cJSON_GetObjectItemCaseSensitive(device_json, "shed");
+        const cJSON *cap = cJSON_GetObjectItemCaseSensitive(shed, "cap_w");
+        if (cJSON_IsNumber(cap) && cap->valuedouble >= 0)
+        {
+            shed_set_cap((float)cap->valuedouble);
+        }
+
         Device_1 = cJSON_GetObjectItemCaseSensitive(device_json, "Device 1");
         if (cJSON_IsNumber(Device_1))
         {
             printf("Checking Device 1: %d\n", Device_1->valueint);
+            relay_set(0, Device_1->valueint != 0);
         }
 
         Device_2 = cJSON_GetObjectItemCaseSensitive(device_json, "Device 2");
         if (cJSON_IsNumber(Device_2))
         {
             printf("Checking Device 2: %d\n", Device_2->valueint);
+            relay_set(1, Device_2->valueint != 0);
         }
 
         Device_3 = cJSON_GetObjectItemCaseSensitive(device_json, "Device 3");
         if (cJSON_IsNumber(Device_3))
         {
             printf("Checking Device 3: %d\n", Device_3->valueint);
+            relay_set(2, Device_3->valueint != 0);
         }
 
         Device_4 = cJSON_GetObjectItemCaseSensitive(device_json, "Device 4");
         if (cJSON_IsNumber(Device_4))
         {
             printf("Checking Device 4: %d\n", Device_4->valueint);
+            relay_set(3, Device_4->valueint != 0);
         }
 
         goto End;
@@ -904,8 +1115,17 @@ static void updateSubAckStatus( MQTTPacketInfo_t * pPacketInfo )
     /* Suppress unused variable warning when asserts are disabled in build. */
     ( void ) mqttStatus;
 
-    /* Demo only subscribes to one topic, so only one status code is returned. */
+    /* One status code per topic subscribed to, in order. A refused topic
+     * makes the whole subscription count as refused. */
     globalSubAckStatus = pPayload[ 0 ];
+
+    for( size_t i = 1; i < pSize; i++ )
+    {
+        if( pPayload[ i ] == MQTTSubAckFailure )
+        {
+            globalSubAckStatus = MQTTSubAckFailure;
+        }
+    }
 }
 
 /*-----------------------------------------------------------*/
@@ -945,9 +1165,8 @@ static int handleResubscribe( MQTTContext_t * pMqttContext )
             break;
         }
 
-        LogInfo( ( "SUBSCRIBE sent for topic %.*s to broker.\n\n",
-                   MQTT_EXAMPLE_TOPIC_LENGTH,
-                   MQTT_EXAMPLE_TOPIC ) );
+        LogInfo( ( "SUBSCRIBE sent for %u topics to broker.\n\n",
+                   ( unsigned ) SUBSCRIPTION_COUNT ) );
 
         /* Process incoming packet. */
         mqttStatus = MQTT_ProcessLoop( pMqttContext, MQTT_PROCESS_LOOP_TIMEOUT_MS );
@@ -1020,6 +1239,13 @@ static void eventCallback( MQTTContext_t * pMqttContext,
         {
             case MQTT_PACKET_TYPE_SUBACK:
 
+                /* The OTA agent's subscriptions are not waited for. */
+                if( packetIdentifier != globalSubscribePacketIdentifier )
+                {
+                    LogDebug( ( "SUBACK received for packet id %u.", packetIdentifier ) );
+                    break;
+                }
+
                 /* A SUBACK from the broker, containing the server response to our subscription request, has been received.
                  * It contains the status code indicating server approval/rejection for the subscription to the single topic
                  * requested. The SUBACK will be parsed to obtain the status code, and this status code will be stored in global
@@ -1031,9 +1257,8 @@ static void eventCallback( MQTTContext_t * pMqttContext,
                  * by the server, indicating a successful subscription attempt. */
                 if( globalSubAckStatus != MQTTSubAckFailure )
                 {
-                    LogInfo( ( "Subscribed to the topic %.*s. with maximum QoS %u.\n\n",
-                               MQTT_EXAMPLE_TOPIC_LENGTH,
-                               MQTT_EXAMPLE_TOPIC,
+                    LogInfo( ( "Subscribed to %u topics with maximum QoS %u.\n\n",
+                               ( unsigned ) SUBSCRIPTION_COUNT,
                                globalSubAckStatus ) );
                 }
 
@@ -1042,9 +1267,15 @@ static void eventCallback( MQTTContext_t * pMqttContext,
                 break;
 
             case MQTT_PACKET_TYPE_UNSUBACK:
-                LogInfo( ( "Unsubscribed from the topic %.*s.\n\n",
-                           MQTT_EXAMPLE_TOPIC_LENGTH,
-                           MQTT_EXAMPLE_TOPIC ) );
+
+                if( packetIdentifier != globalUnsubscribePacketIdentifier )
+                {
+                    LogDebug( ( "UNSUBACK received for packet id %u.", packetIdentifier ) );
+                    break;
+                }
+
+                LogInfo( ( "Unsubscribed from %u topics.\n\n",
+                           ( unsigned ) SUBSCRIPTION_COUNT ) );
                 /* Make sure ACK packet identifier matches with Request packet identifier. */
                 assert( globalUnsubscribePacketIdentifier == packetIdentifier );
                 break;
@@ -1187,10 +1418,13 @@ static int subscribeToTopic( MQTTContext_t * pMqttContext )
     /* Start with everything at 0. */
     ( void ) memset( ( void * ) pGlobalSubscriptionList, 0x00, sizeof( pGlobalSubscriptionList ) );
 
-    /* This example subscribes to only one topic and uses QOS1. */
-    pGlobalSubscriptionList[ 0 ].qos = MQTTQoS1;
-    pGlobalSubscriptionList[ 0 ].pTopicFilter = MQTT_EXAMPLE_TOPIC;
-    pGlobalSubscriptionList[ 0 ].topicFilterLength = MQTT_EXAMPLE_TOPIC_LENGTH;
+    /* The command topic and the shadow replies, all with QOS1. */
+    for( size_t i = 0; i < SUBSCRIPTION_COUNT; i++ )
+    {
+        pGlobalSubscriptionList[ i ].qos = MQTTQoS1;
+        pGlobalSubscriptionList[ i ].pTopicFilter = subscriptionTopics[ i ].pName;
+        pGlobalSubscriptionList[ i ].topicFilterLength = subscriptionTopics[ i ].length;
+    }
 
     /* Generate packet identifier for the SUBSCRIBE packet. */
     globalSubscribePacketIdentifier = MQTT_GetPacketId( pMqttContext );
@@ -1209,9 +1443,8 @@ static int subscribeToTopic( MQTTContext_t * pMqttContext )
     }
     else
     {
-        LogInfo( ( "SUBSCRIBE sent for topic %.*s to broker.\n\n",
-                   MQTT_EXAMPLE_TOPIC_LENGTH,
-                   MQTT_EXAMPLE_TOPIC ) );
+        LogInfo( ( "SUBSCRIBE sent for %u topics to broker.\n\n",
+                   ( unsigned ) SUBSCRIPTION_COUNT ) );
     }
 
     return returnStatus;
@@ -1229,11 +1462,13 @@ static int unsubscribeFromTopic( MQTTContext_t * pMqttContext )
     /* Start with everything at 0. */
     ( void ) memset( ( void * ) pGlobalSubscriptionList, 0x00, sizeof( pGlobalSubscriptionList ) );
 
-    /* This example subscribes to and unsubscribes from only one topic
-     * and uses QOS1. */
-    pGlobalSubscriptionList[ 0 ].qos = MQTTQoS1;
-    pGlobalSubscriptionList[ 0 ].pTopicFilter = MQTT_EXAMPLE_TOPIC;
-    pGlobalSubscriptionList[ 0 ].topicFilterLength = MQTT_EXAMPLE_TOPIC_LENGTH;
+    /* Unsubscribe from everything subscribeToTopic() subscribed to. */
+    for( size_t i = 0; i < SUBSCRIPTION_COUNT; i++ )
+    {
+        pGlobalSubscriptionList[ i ].qos = MQTTQoS1;
+        pGlobalSubscriptionList[ i ].pTopicFilter = subscriptionTopics[ i ].pName;
+        pGlobalSubscriptionList[ i ].topicFilterLength = subscriptionTopics[ i ].length;
+    }
 
     /* Generate packet identifier for the UNSUBSCRIBE packet. */
     globalUnsubscribePacketIdentifier = MQTT_GetPacketId( pMqttContext );
@@ -1252,9 +1487,8 @@ static int unsubscribeFromTopic( MQTTContext_t * pMqttContext )
     }
     else
     {
-        LogInfo( ( "UNSUBSCRIBE sent for topic %.*s to broker.\n\n",
-                   MQTT_EXAMPLE_TOPIC_LENGTH,
-                   MQTT_EXAMPLE_TOPIC ) );
+        LogInfo( ( "UNSUBSCRIBE sent for %u topics to broker.\n\n",
+                   ( unsigned ) SUBSCRIPTION_COUNT ) );
     }
 
     return returnStatus;
@@ -1262,13 +1496,14 @@ static int unsubscribeFromTopic( MQTTContext_t * pMqttContext )
 
 /*-----------------------------------------------------------*/
 
-static int publishToTopic( MQTTContext_t * pMqttContext, param_t param)
+static int publishToTopic( MQTTContext_t * pMqttContext, const uplink_message_t * pMessage )
 {
     int returnStatus = EXIT_SUCCESS;
     MQTTStatus_t mqttStatus = MQTTSuccess;
     uint8_t publishIndex = MAX_OUTGOING_PUBLISHES;
 
     assert( pMqttContext != NULL );
+    assert( pMessage != NULL );
 
     /* Get the next free index for the outgoing publish. All QoS1 outgoing
      * publishes are stored until a PUBACK is received. These messages are
@@ -1282,32 +1517,15 @@ static int publishToTopic( MQTTContext_t * pMqttContext, param_t param)
     }
     else
     {
-        ESP_LOGI("param","voltage %f",param.voltage);
-        ESP_LOGI("param","current %f",param.current);
-        ESP_LOGI("param","power %f",param.power);
-        ESP_LOGI("param","energy %f",param.energy);
-        ESP_LOGI("param","frequency %f",param.frequency);
-        ESP_LOGI("param","pf %f",param.pf);
-        /* Generate JSON data to publish */
-        /*TODO: Comunicate PZEM to get data*/
-        ESP_LOGI(JSON, "Serialize.....");
-        cJSON *root;
-        root = cJSON_CreateObject();
-        cJSON_AddStringToObject(root, "mac_Id", "01:02:03:04:05:06");
-        cJSON_AddNumberToObject(root, "U", param.voltage);
-        cJSON_AddNumberToObject(root, "I", param.current);
-        cJSON_AddNumberToObject(root, "F", param.frequency);
-        cJSON_AddNumberToObject(root, "P", param.power);
-        cJSON_AddNumberToObject(root, "Energy", param.energy);
-        char *data_JSON = cJSON_Print(root);
-
-        cJSON_Delete(root);
-        /* This example publishes to only one topic and uses QOS1. */
+        /* The payload lives next to the packet until it is acknowledged. */
+        ( void ) memcpy( outgoingPayloads[ publishIndex ], pMessage->payload, pMessage->length );
+
+        /* All uplink messages go out with QOS1. */
         outgoingPublishPackets[ publishIndex ].pubInfo.qos = MQTTQoS1;
-        outgoingPublishPackets[ publishIndex ].pubInfo.pTopicName = MQTT_PUB_TOPIC;
-        outgoingPublishPackets[ publishIndex ].pubInfo.topicNameLength = MQTT_PUB_TOPIC_LENGTH;
-        outgoingPublishPackets[ publishIndex ].pubInfo.pPayload = data_JSON;
-        outgoingPublishPackets[ publishIndex ].pubInfo.payloadLength = strlen(data_JSON);
+        outgoingPublishPackets[ publishIndex ].pubInfo.pTopicName = uplinkTopics[ pMessage->topic ].pName;
+        outgoingPublishPackets[ publishIndex ].pubInfo.topicNameLength = uplinkTopics[ pMessage->topic ].length;
+        outgoingPublishPackets[ publishIndex ].pubInfo.pPayload = outgoingPayloads[ publishIndex ];
+        outgoingPublishPackets[ publishIndex ].pubInfo.payloadLength = pMessage->length;
 
         /* Get a new packet id. */
         outgoingPublishPackets[ publishIndex ].packetId = MQTT_GetPacketId( pMqttContext );
@@ -1327,8 +1545,8 @@ static int publishToTopic( MQTTContext_t * pMqttContext, param_t param)
         else
         {
             LogInfo( ( "PUBLISH sent for topic %.*s to broker with packet ID %u.\n\n",
-                       MQTT_PUB_TOPIC_LENGTH,
-                       MQTT_PUB_TOPIC,
+                       uplinkTopics[ pMessage->topic ].length,
+                       uplinkTopics[ pMessage->topic ].pName,
                        outgoingPublishPackets[ publishIndex ].packetId ) );
         }
     }
@@ -1379,13 +1597,13 @@ static int initializeMqtt( MQTTContext_t * pMqttContext,
 /*-----------------------------------------------------------*/
 
 static int subscribePublishLoop( MQTTContext_t * pMqttContext,
-                                 bool * pClientSessionPresent, param_t param)
+                                 bool * pClientSessionPresent )
 {
     int returnStatus = EXIT_SUCCESS;
     bool mqttSessionEstablished = false, brokerSessionPresent;
     MQTTStatus_t mqttStatus = MQTTSuccess;
-    uint32_t publishCount = 0;
-    const uint32_t maxPublishCount = MQTT_PUBLISH_COUNT_PER_LOOP;
+    /* Static, the aws task stack is sized for TLS, not for a payload copy. */
+    static uplink_message_t uplinkMessage;
     bool createCleanSession = false;
 
     assert( pMqttContext != NULL );
@@ -1487,22 +1705,52 @@ static int subscribePublishLoop( MQTTContext_t * pMqttContext,
 
     if( returnStatus == EXIT_SUCCESS )
     {
-        /* Publish messages with QOS1, receive incoming messages and
-         * send keep alive messages. */
-        for( publishCount = 0; publishCount < maxPublishCount; publishCount++ )
+        /* Read the shadow document again: deltas may have been missed while
+         * disconnected, and what was reported may have changed since. */
+        device_shadow_sync();
+
+        /* Let the OTA agent use the connection from here on. */
+        xSemaphoreTake( mqttLock, portMAX_DELAY );
+        pSharedContext = pMqttContext;
+        xSemaphoreGive( mqttLock );
+        ota_agent_connected();
+
+        /* Publish every message the metering side queues, with QOS1, while
+         * receiving incoming messages and sending keep alive messages. A
+         * message is only taken off the queue when a slot is free to keep it
+         * until its PUBACK; otherwise it waits there and the process loop
+         * collects the outstanding acks. The loop sleeps in uplink_receive,
+         * which returns as soon as an event is queued, and only briefly in
+         * the process loop, so events go out within a few tens of ms. While
+         * the OTA agent downloads, blocks arrive between uplink messages, so
+         * the wait is cut short to read them as they come. The OTA agent
+         * sends its requests between two passes through #mqttLock. */
+        for( ; ; )
         {
-            LogInfo( ( "Sending Publish to the MQTT topic %.*s.",
-                       MQTT_PUB_TOPIC_LENGTH,
-                       MQTT_PUB_TOPIC ) );
-            returnStatus = publishToTopic( pMqttContext, param);
-
-            /* Calling MQTT_ProcessLoop to process incoming publish echo, since
-             * application subscribed to the same topic the broker will send
-             * publish message back to the application. This function also
-             * sends ping request to broker if MQTT_KEEP_ALIVE_INTERVAL_SECONDS
-             * has expired since the last MQTT packet sent and receive
-             * ping responses. */
-            mqttStatus = MQTT_ProcessLoop( pMqttContext, MQTT_PROCESS_LOOP_TIMEOUT_MS );
+            const uint32_t waitMs = ota_agent_is_downloading() ? OTA_AGENT_UPLINK_WAIT_MS : MQTT_UPLINK_WAIT_MS;
+
+            if( hasFreeOutgoingPublish() &&
+                uplink_receive( &uplinkMessage, pdMS_TO_TICKS( waitMs ) ) )
+            {
+                LogInfo( ( "Sending Publish to the MQTT topic %.*s.",
+                           uplinkTopics[ uplinkMessage.topic ].length,
+                           uplinkTopics[ uplinkMessage.topic ].pName ) );
+                xSemaphoreTake( mqttLock, portMAX_DELAY );
+                returnStatus = publishToTopic( pMqttContext, &uplinkMessage );
+                xSemaphoreGive( mqttLock );
+
+                if( returnStatus != EXIT_SUCCESS )
+                {
+                    break;
+                }
+            }
+
+            /* This also sends ping request to broker if
+             * MQTT_KEEP_ALIVE_INTERVAL_SECONDS has expired since the last MQTT
+             * packet sent and receive ping responses. */
+            xSemaphoreTake( mqttLock, portMAX_DELAY );
+            mqttStatus = MQTT_ProcessLoop( pMqttContext, MQTT_UPLINK_PROCESS_LOOP_MS );
+            xSemaphoreGive( mqttLock );
 
             /* For any error in #MQTT_ProcessLoop, exit the loop and disconnect
              * from the broker. */
@@ -1513,14 +1761,15 @@ static int subscribePublishLoop( MQTTContext_t * pMqttContext,
                 returnStatus = EXIT_FAILURE;
                 break;
             }
-
-            LogInfo( ( "Delay before continuing to next iteration.\n\n" ) );
-
-            /* Leave connection idle for some time. */
-            vTaskDelay( 30000 / portTICK_PERIOD_MS );
         }
     }
 
+    /* The OTA agent waits for the next connection. */
+    xSemaphoreTake( mqttLock, portMAX_DELAY );
+    pSharedContext = NULL;
+    xSemaphoreGive( mqttLock );
+    ota_agent_disconnected();
+
     if( returnStatus == EXIT_SUCCESS )
     {
         /* Unsubscribe from the topic. */
@@ -1572,6 +1821,98 @@ static int subscribePublishLoop( MQTTContext_t * pMqttContext,
 
 /*-----------------------------------------------------------*/
 
+bool aws_mqtt_publish( const char * topic,
+                       uint16_t topicLength,
+                       const void * payload,
+                       size_t length,
+                       uint8_t qos )
+{
+    MQTTStatus_t mqttStatus = MQTTIllegalState;
+    MQTTPublishInfo_t publishInfo = { 0 };
+
+    publishInfo.qos = ( MQTTQoS_t ) qos;
+    publishInfo.pTopicName = topic;
+    publishInfo.topicNameLength = topicLength;
+    publishInfo.pPayload = payload;
+    publishInfo.payloadLength = length;
+
+    if( mqttLock == NULL )
+    {
+        return false;
+    }
+
+    /* Not kept for a resend: the OTA agent repeats its requests itself. */
+    xSemaphoreTake( mqttLock, portMAX_DELAY );
+
+    if( pSharedContext != NULL )
+    {
+        mqttStatus = MQTT_Publish( pSharedContext,
+                                   &publishInfo,
+                                   ( qos == MQTTQoS0 ) ? 0U : MQTT_GetPacketId( pSharedContext ) );
+    }
+
+    xSemaphoreGive( mqttLock );
+
+    if( mqttStatus != MQTTSuccess )
+    {
+        LogWarn( ( "Publish to %.*s failed: %s.", topicLength, topic, MQTT_Status_strerror( mqttStatus ) ) );
+    }
+
+    return mqttStatus == MQTTSuccess;
+}
+
+/*-----------------------------------------------------------*/
+
+static bool sharedSubscription( const char * topicFilter,
+                                uint16_t length,
+                                uint8_t qos,
+                                bool subscribe )
+{
+    MQTTStatus_t mqttStatus = MQTTIllegalState;
+    MQTTSubscribeInfo_t subscription = { 0 };
+
+    subscription.qos = ( MQTTQoS_t ) qos;
+    subscription.pTopicFilter = topicFilter;
+    subscription.topicFilterLength = length;
+
+    if( mqttLock == NULL )
+    {
+        return false;
+    }
+
+    xSemaphoreTake( mqttLock, portMAX_DELAY );
+
+    if( pSharedContext != NULL )
+    {
+        mqttStatus = subscribe ?
+                     MQTT_Subscribe( pSharedContext, &subscription, 1, MQTT_GetPacketId( pSharedContext ) ) :
+                     MQTT_Unsubscribe( pSharedContext, &subscription, 1, MQTT_GetPacketId( pSharedContext ) );
+    }
+
+    xSemaphoreGive( mqttLock );
+
+    LogInfo( ( "%s %.*s: %s.", subscribe ? "Subscribing to" : "Unsubscribing from",
+               length, topicFilter, MQTT_Status_strerror( mqttStatus ) ) );
+
+    return mqttStatus == MQTTSuccess;
+}
+
+bool aws_mqtt_subscribe( const char * topicFilter,
+                         uint16_t length,
+                         uint8_t qos )
+{
+    return sharedSubscription( topicFilter, length, qos, true );
+}
+
+bool aws_mqtt_unsubscribe( const char * topicFilter,
+                           uint16_t length,
+                           uint8_t qos )
+{
+    return sharedSubscription( topicFilter, length, qos, false );
+}
+
+/*-----------------------------------------------------------*/
+
 /**
  * @brief Entry point of demo.
  *
@@ -1587,7 +1928,7 @@ static int subscribePublishLoop( MQTTContext_t * pMqttContext,
  * publishes are stored until a PUBACK is received.
  */
 int aws_iot_demo_main( int argc,
-          char ** argv ,param_t param)
+                       char ** argv )
 {
     int returnStatus = EXIT_SUCCESS;
     MQTTContext_t mqttContext = { 0 };
@@ -1605,6 +1946,8 @@ int aws_iot_demo_main( int argc,
     /* Seed pseudo random number generator with nanoseconds. */
     srand( tp.tv_nsec );
 
+    mqttLock = xSemaphoreCreateMutexStatic( &mqttLockBuffer );
+
     /* Initialize MQTT library. Initialization of the MQTT library needs to be
      * done only once in this demo. */
     returnStatus = initializeMqtt( &mqttContext, &xNetworkContext );
@@ -1630,7 +1973,7 @@ int aws_iot_demo_main( int argc,
             else
             {
                 /* If TLS session is established, execute Subscribe/Publish loop. */
-                returnStatus = subscribePublishLoop( &mqttContext, &clientSessionPresent,param);
+                returnStatus = subscribePublishLoop( &mqttContext, &clientSessionPresent );
             }
 
             if( returnStatus == EXIT_SUCCESS )
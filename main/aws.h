@@ -78,9 +78,20 @@
 /* cJSON for data format */
 #include "cJSON.h"
 
+/* Device Shadow topic names and matching. */
+#include "shadow.h"
+
 /* For ESP_LOG*/
 #include "esp_log.h"
 
+/* Outbound messages from the metering side */
+#include "uplink.h"
+#include "relay.h"
+#include "events.h"
+#include "shed.h"
+#include "device_shadow.h"
+#include "ota_agent.h"
+
 /**
  * These configuration settings are required to run the mutual auth demo.
  * Throw compilation error if the below configs are not defined.
@@ -215,6 +226,33 @@
  * @brief Length of client MQTT topic.
  */
 #define MQTT_PUB_TOPIC_LENGTH           ( ( uint16_t ) ( sizeof( MQTT_PUB_TOPIC ) - 1 ) )
+
+/**
+ * @brief The topic power quality events are published to, as soon as they
+ * are detected and ahead of any queued telemetry.
+ */
+#define MQTT_EVENT_TOPIC                CLIENT_IDENTIFIER "/events"
+
+/**
+ * @brief Length of the event topic.
+ */
+#define MQTT_EVENT_TOPIC_LENGTH         ( ( uint16_t ) ( sizeof( MQTT_EVENT_TOPIC ) - 1 ) )
+
+/**
+ * @brief Device shadow topics. The thing name is the client identifier.
+ */
+#define SHADOW_UPDATE_TOPIC             SHADOW_TOPIC_STRING_UPDATE( CLIENT_IDENTIFIER )
+#define SHADOW_GET_TOPIC                SHADOW_TOPIC_STRING_GET( CLIENT_IDENTIFIER )
+#define SHADOW_UPDATE_DELTA_TOPIC       SHADOW_TOPIC_STRING_UPDATE_DELTA( CLIENT_IDENTIFIER )
+#define SHADOW_UPDATE_ACCEPTED_TOPIC    SHADOW_TOPIC_STRING_UPDATE_ACCEPTED( CLIENT_IDENTIFIER )
+#define SHADOW_UPDATE_REJECTED_TOPIC    SHADOW_TOPIC_STRING_UPDATE_REJECTED( CLIENT_IDENTIFIER )
+#define SHADOW_GET_ACCEPTED_TOPIC       SHADOW_TOPIC_STRING_GET_ACCEPTED( CLIENT_IDENTIFIER )
+#define SHADOW_GET_REJECTED_TOPIC       SHADOW_TOPIC_STRING_GET_REJECTED( CLIENT_IDENTIFIER )
+
+/**
+ * @brief Length of a topic given as a string literal.
+ */
+#define TOPIC_LENGTH( topic )           ( ( uint16_t ) ( sizeof( topic ) - 1 ) )
 /**
  * @brief The MQTT message published in this example.
  */
@@ -259,9 +297,17 @@
 #define DELAY_BETWEEN_PUBLISHES_SECONDS     ( 1U )
 
 /**
- * @brief Number of PUBLISH messages sent per iteration.
+ * @brief Longest time the publish loop waits for the next uplink message
+ * before running MQTT_ProcessLoop again, in milliseconds.
+ */
+#define MQTT_UPLINK_WAIT_MS                 ( 500U )
+
+/**
+ * @brief Timeout for MQTT_ProcessLoop between two uplink messages, in
+ * milliseconds. Kept short so an event is not held back behind a long
+ * receive; the publish loop blocks on the uplink queue instead.
  */
-#define MQTT_PUBLISH_COUNT_PER_LOOP         ( 5U )
+#define MQTT_UPLINK_PROCESS_LOOP_MS         ( 50U )
 
 /**
  * @brief Delay in seconds between two iterations of subscribePublishLoop().
@@ -336,11 +382,51 @@ static uint16_t globalUnsubscribePacketIdentifier = 0U;
  */
 static PublishPackets_t outgoingPublishPackets[ MAX_OUTGOING_PUBLISHES ] = { 0 };
 
+/**
+ * @brief Payloads of the outgoing publishes, one per slot of
+ * #outgoingPublishPackets, kept until the PUBACK like the packets.
+ */
+static char outgoingPayloads[ MAX_OUTGOING_PUBLISHES ][ UPLINK_PAYLOAD_MAX ];
+
+/**
+ * @brief Topic of each uplink message type, indexed by #uplink_topic_t.
+ */
+static const struct
+{
+    const char * pName;
+    uint16_t length;
+} uplinkTopics[ UPLINK_TOPICS ] =
+{
+    [ UPLINK_TELEMETRY ]     = { MQTT_PUB_TOPIC,      MQTT_PUB_TOPIC_LENGTH                 },
+    [ UPLINK_EVENT ]         = { MQTT_EVENT_TOPIC,    MQTT_EVENT_TOPIC_LENGTH               },
+    [ UPLINK_SHADOW_UPDATE ] = { SHADOW_UPDATE_TOPIC, TOPIC_LENGTH( SHADOW_UPDATE_TOPIC ) },
+    [ UPLINK_SHADOW_GET ]    = { SHADOW_GET_TOPIC,    TOPIC_LENGTH( SHADOW_GET_TOPIC )    },
+};
+
+/**
+ * @brief Topics subscribed to: the command topic and the shadow replies.
+ */
+static const struct
+{
+    const char * pName;
+    uint16_t length;
+} subscriptionTopics[] =
+{
+    { MQTT_EXAMPLE_TOPIC,           MQTT_EXAMPLE_TOPIC_LENGTH                     },
+    { SHADOW_UPDATE_DELTA_TOPIC,    TOPIC_LENGTH( SHADOW_UPDATE_DELTA_TOPIC )    },
+    { SHADOW_UPDATE_ACCEPTED_TOPIC, TOPIC_LENGTH( SHADOW_UPDATE_ACCEPTED_TOPIC ) },
+    { SHADOW_UPDATE_REJECTED_TOPIC, TOPIC_LENGTH( SHADOW_UPDATE_REJECTED_TOPIC ) },
+    { SHADOW_GET_ACCEPTED_TOPIC,    TOPIC_LENGTH( SHADOW_GET_ACCEPTED_TOPIC )    },
+    { SHADOW_GET_REJECTED_TOPIC,    TOPIC_LENGTH( SHADOW_GET_REJECTED_TOPIC )    },
+};
+
+#define SUBSCRIPTION_COUNT              ( sizeof( subscriptionTopics ) / sizeof( subscriptionTopics[ 0 ] ) )
+
 /**
  * @brief Array to keep subscription topics.
  * Used to re-subscribe to topics that failed initial subscription attempts.
  */
-static MQTTSubscribeInfo_t pGlobalSubscriptionList[ 1 ];
+static MQTTSubscribeInfo_t pGlobalSubscriptionList[ SUBSCRIPTION_COUNT ];
 
 /**
  * @brief The network buffer must remain valid for the lifetime of the MQTT context.
@@ -354,10 +440,24 @@ static uint8_t buffer[ NETWORK_BUFFER_SIZE ];
  */
 static MQTTSubAckStatus_t globalSubAckStatus = MQTTSubAckFailure;
 
+/**
+ * @brief Serializes use of the MQTT context between this task and the OTA
+ * agent, which publishes and subscribes through aws_mqtt_publish() and
+ * friends.
+ */
+static StaticSemaphore_t mqttLockBuffer;
+static SemaphoreHandle_t mqttLock = NULL;
+
+/**
+ * @brief The MQTT context while the connection is up and subscribed, NULL
+ * otherwise. Only changed with #mqttLock held.
+ */
+static MQTTContext_t * pSharedContext = NULL;
+
 static const char *JSON = "JSON";
 /*-----------------------------------------------------------*/
 
-int aws_iot_demo_main( int argc, char ** argv, param_t param);
+int aws_iot_demo_main( int argc, char ** argv );
 
 /**
  * @brief The random number generator to use for exponential backoff with
@@ -382,9 +482,8 @@ static int connectToServerWithBackoffRetries( NetworkContext_t * pNetworkContext
 
 /**
  * @brief A function that connects to MQTT broker,
- * subscribes a topic, publishes to the same
- * topic MQTT_PUBLISH_COUNT_PER_LOOP number of times, and verifies if it
- * receives the Publish message back.
+ * subscribes a topic, and publishes every message queued on the uplink
+ * until the connection fails.
  *
  * @param[in] pMqttContext MQTT context pointer.
  * @param[in,out] pClientSessionPresent Pointer to flag indicating if an
@@ -393,7 +492,34 @@ static int connectToServerWithBackoffRetries( NetworkContext_t * pNetworkContext
  * @return EXIT_FAILURE on failure; EXIT_SUCCESS on success.
  */
 static int subscribePublishLoop( MQTTContext_t * pMqttContext,
-                                 bool * pClientSessionPresent, param_t param);
+                                 bool * pClientSessionPresent );
+
+/**
+ * @brief Apply the "events" object of an incoming message to the event rules.
+ * Only the members present change, e.g.
+ * {"events":{"sag":{"threshold":200,"min_ms":40},"circuit_limits_a":[16,10,10,6]}}
+ *
+ * @param[in] pEvents The "events" object.
+ */
+static void handleEventConfig( const cJSON * pEvents );
+
+/**
+ * @brief Read the members of the device shadow document out of a "reported",
+ * "desired" or delta "state" object.
+ *
+ * @param[in] pObject The object, may be NULL.
+ * @param[out] pState The members found, with their bits in fields.
+ */
+static void parseShadowState( const cJSON * pObject, shadow_state_t * pState );
+
+/**
+ * @brief Pass a message on one of the shadow reply topics to device_shadow.
+ *
+ * @param[in] type Which shadow topic the message came on.
+ * @param[in] pPublishInfo The incoming publish.
+ */
+static void handleShadowMessage( ShadowMessageType_t type,
+                                 const MQTTPublishInfo_t * pPublishInfo );
 
 /**
  * @brief The function to handle the incoming publishes.
@@ -456,8 +582,7 @@ static int establishMqttSession( MQTTContext_t * pMqttContext,
 static int disconnectMqttSession( MQTTContext_t * pMqttContext );
 
 /**
- * @brief Sends an MQTT SUBSCRIBE to subscribe to #MQTT_EXAMPLE_TOPIC
- * defined at the top of the file.
+ * @brief Sends an MQTT SUBSCRIBE to subscribe to #subscriptionTopics.
  *
  * @param[in] pMqttContext MQTT context pointer.
  *
@@ -468,7 +593,7 @@ static int subscribeToTopic( MQTTContext_t * pMqttContext );
 
 /**
  * @brief Sends an MQTT UNSUBSCRIBE to unsubscribe from
- * #MQTT_EXAMPLE_TOPIC defined at the top of the file.
+ * #subscriptionTopics.
  *
  * @param[in] pMqttContext MQTT context pointer.
  *
@@ -478,15 +603,22 @@ static int subscribeToTopic( MQTTContext_t * pMqttContext );
 static int unsubscribeFromTopic( MQTTContext_t * pMqttContext );
 
 /**
- * @brief Sends an MQTT PUBLISH to #MQTT_EXAMPLE_TOPIC defined at
- * the top of the file.
+ * @brief Sends an uplink message as an MQTT PUBLISH to the topic it was
+ * queued for.
  *
  * @param[in] pMqttContext MQTT context pointer.
+ * @param[in] pMessage Message taken from the uplink queue.
  *
  * @return EXIT_SUCCESS if PUBLISH was successfully sent;
  * EXIT_FAILURE otherwise.
  */
-static int publishToTopic( MQTTContext_t * pMqttContext, param_t param);
+static int publishToTopic( MQTTContext_t * pMqttContext, const uplink_message_t * pMessage );
+
+/**
+ * @brief Tell whether a slot for an outgoing QoS1 publish is free, so a
+ * message is only taken from the uplink queue when it can be sent.
+ */
+static bool hasFreeOutgoingPublish( void );
 
 /**
  * @brief Function to get the free index at which an outgoing publish
@@ -534,7 +666,7 @@ static int handlePublishResend( MQTTContext_t * pMqttContext );
 /**
  * @brief Function to update variable globalSubAckStatus with status
  * information from Subscribe ACK. Called by eventCallback after processing
- * incoming subscribe echo.
+ * incoming subscribe echo. Any topic refused counts as a refusal.
  *
  * @param[in] Server response to the subscription request.
  */
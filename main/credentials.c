@@ -0,0 +1,125 @@
+/*
+ * The TLS credentials embedded from main/certs, parsed once at boot instead
+ * of by esp-tls on every connection. The root CA goes into esp-tls's global
+ * CA store, which a connection verifies the server against as it is. The
+ * client certificate and key are turned from PEM into DER; esp-tls still
+ * loads them into each session, but without the PEM scan and base64 decode.
+ */
+#include <string.h>
+#include <stdlib.h>
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_tls.h"
+#include "mbedtls/pk.h"
+#include "mbedtls/platform_util.h"
+#include "mbedtls/x509_crt.h"
+#include "network_transport.h"
+#include "credentials.h"
+
+static const char *CRED_TAG = "CREDENTIALS";
+
+/* Embedded by the top-level CMakeLists. */
+extern const char root_cert_auth_pem_start[] asm("_binary_root_cert_auth_pem_start");
+extern const char client_cert_pem_start[] asm("_binary_client_crt_start");
+extern const char client_key_pem_start[] asm("_binary_client_key_start");
+
+static uint8_t *certDer = NULL;
+static uint8_t *keyDer = NULL;
+static credentials_stats_t stats;
+
+#if CONFIG_TLS_PREPARSED_CREDENTIALS
+/* The certificate as the DER it was decoded to. */
+static bool loadCertificate(void)
+{
+    mbedtls_x509_crt crt;
+    bool ok = false;
+
+    mbedtls_x509_crt_init(&crt);
+    if (mbedtls_x509_crt_parse(&crt, (const unsigned char *)client_cert_pem_start,
+                               strlen(client_cert_pem_start) + 1) == 0 &&
+        (certDer = malloc(crt.raw.len)) != NULL) {
+        memcpy(certDer, crt.raw.p, crt.raw.len);
+        stats.certDerBytes = crt.raw.len;
+        ok = true;
+    }
+    mbedtls_x509_crt_free(&crt);
+    return ok;
+}
+
+/* The key written out again in DER, which is shorter than its PEM. */
+static bool loadKey(void)
+{
+    const size_t pemLen = strlen(client_key_pem_start) + 1;
+    mbedtls_pk_context pk;
+    uint8_t *buf = NULL;
+    int len = -1;
+
+    mbedtls_pk_init(&pk);
+    if (mbedtls_pk_parse_key(&pk, (const unsigned char *)client_key_pem_start, pemLen, NULL, 0) == 0 &&
+        (buf = malloc(pemLen)) != NULL) {
+        // Written at the end of the buffer
+        len = mbedtls_pk_write_key_der(&pk, buf, pemLen);
+    }
+    mbedtls_pk_free(&pk);
+    if (len > 0) {
+        keyDer = malloc(len);
+        if (keyDer != NULL) {
+            memcpy(keyDer, buf + pemLen - len, len);
+            stats.keyDerBytes = len;
+        }
+    }
+    if (buf != NULL) {
+        mbedtls_platform_zeroize(buf, pemLen);
+        free(buf);
+    }
+    return keyDer != NULL;
+}
+#endif
+
+void credentials_init(void)
+{
+#if CONFIG_TLS_PREPARSED_CREDENTIALS
+    const int64_t start = esp_timer_get_time();
+
+    stats.caInStore = esp_tls_set_global_ca_store((const unsigned char *)root_cert_auth_pem_start,
+                                                  strlen(root_cert_auth_pem_start) + 1) == ESP_OK;
+    if (!stats.caInStore) {
+        ESP_LOGW(CRED_TAG, "Root CA does not parse, connections get it as PEM");
+    }
+#if CONFIG_EXAMPLE_USE_PLAIN_FLASH_STORAGE
+    stats.clientDer = loadCertificate() && loadKey();
+    if (!stats.clientDer) {
+        ESP_LOGW(CRED_TAG, "Client certificate or key does not parse, connections get them as PEM");
+        free(certDer);
+        certDer = NULL;
+        stats.certDerBytes = 0;
+    }
+#endif
+    stats.parseUs = esp_timer_get_time() - start;
+    ESP_LOGI(CRED_TAG, "Parsed TLS credentials in %u ms: certificate %u bytes, key %u bytes in DER",
+             (unsigned)(stats.parseUs / 1000), (unsigned)stats.certDerBytes, (unsigned)stats.keyDerBytes);
+#else
+    ESP_LOGI(CRED_TAG, "TLS credentials are parsed from PEM by every connection");
+#endif
+}
+
+void credentials_apply_ca(struct NetworkContext *network)
+{
+    network->pcServerRootCAPem = root_cert_auth_pem_start;
+    network->useGlobalCaStore = stats.caInStore;
+}
+
+void credentials_apply_client(struct NetworkContext *network)
+{
+    network->pcClientCertPem = client_cert_pem_start;
+    network->pcClientKeyPem = client_key_pem_start;
+    if (stats.clientDer) {
+        network->pucClientCertDer = certDer;
+        network->xClientCertDerSize = stats.certDerBytes;
+        network->pucClientKeyDer = keyDer;
+        network->xClientKeyDerSize = stats.keyDerBytes;
+    } else {
+        network->pucClientCertDer = NULL;
+        network->pucClientKeyDer = NULL;
+    }
+}
@@ -0,0 +1,26 @@
+#ifndef CREDENTIALS_H
+#define CREDENTIALS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "sdkconfig.h"
+
+struct NetworkContext;
+
+typedef struct {
+    bool caInStore;             // The root CA is in esp-tls's global CA store
+    bool clientDer;             // The client certificate and key are held in DER
+    uint32_t certDerBytes;
+    uint32_t keyDerBytes;
+    uint32_t parseUs;           // Parsing all of it at boot, once instead of per connection
+} credentials_stats_t;
+
+/* Parses the certificates and key embedded from main/certs, once, before any
+ * connection is made. Whatever does not parse is handed to esp-tls as PEM. */
+void credentials_init(void);
+/* The root CA for verifying the server. */
+void credentials_apply_ca(struct NetworkContext *network);
+/* The client certificate and key, for brokers that ask for them. */
+void credentials_apply_client(struct NetworkContext *network);
+
+#endif // CREDENTIALS_H
@@ -0,0 +1,372 @@
+#include <stdio.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "esp_timer.h"
+#include "esp_log.h"
+#include "uplink.h"
+#include "shed.h"
+#include "events.h"
+#include "device_shadow.h"
+
+static const char *SHADOW_TAG = "SHADOW";
+
+#define FIELD_BIT(field)        (1UL << (field))
+#define ALL_FIELDS              ((1UL << SHADOW_FIELDS) - 1)
+
+static const char *fieldNames[SHADOW_FIELDS] = {
+    "relay1", "relay2", "relay3", "relay4", "shed_cap_w", "circuit_limits_a",
+};
+
+/* What the service has accepted as reported, and the update in flight. */
+static shadow_state_t reported;
+static shadow_state_t inFlight;
+static char inFlightToken[12];
+static int64_t inFlightSinceUs = 0;
+static bool deferred = false;           // Changes waiting for the update in flight
+static bool synced = false;             // Document read since the last (re)connect
+static uint32_t lastVersion = 0;
+static uint32_t tokenCount = 0;
+static shadow_stats_t stats;
+static StaticSemaphore_t lockBuffer;
+static SemaphoreHandle_t lock = NULL;
+static char payload[UPLINK_PAYLOAD_MAX];
+
+/* Coalescing of notified changes, touched from any task. */
+static esp_timer_handle_t timer = NULL;
+static portMUX_TYPE notifyLock = portMUX_INITIALIZER_UNLOCKED;
+static bool armed = false;
+static bool changed = false;
+static int64_t firstChangeUs = 0;
+static int64_t lastChangeUs = 0;
+static uint32_t changeCount = 0;
+
+const char *device_shadow_field_name(shadow_field_t field)
+{
+    return field < SHADOW_FIELDS ? fieldNames[field] : "unknown";
+}
+
+static void snapshot(shadow_state_t *s)
+{
+    events_config_t config;
+
+    events_get_config(&config);
+    s->fields = ALL_FIELDS;
+    s->relays = relay_get_mask();
+    s->capW = shed_get_cap();
+    memcpy(s->circuitLimitA, config.circuitLimitA, sizeof(s->circuitLimitA));
+}
+
+/* Fields of now that the service does not have yet. */
+static uint32_t differences(const shadow_state_t *now, const shadow_state_t *known)
+{
+    uint32_t diff = now->fields & ~known->fields;
+
+    for (int i = 0; i < RELAY_CHANNELS; i++) {
+        if (((now->relays ^ known->relays) >> i) & 1) {
+            diff |= FIELD_BIT(SHADOW_FIELD_RELAY_1 + i);
+        }
+    }
+    if (now->capW != known->capW) {
+        diff |= FIELD_BIT(SHADOW_FIELD_CAP);
+    }
+    if (memcmp(now->circuitLimitA, known->circuitLimitA, sizeof(now->circuitLimitA)) != 0) {
+        diff |= FIELD_BIT(SHADOW_FIELD_LIMITS);
+    }
+    return diff & now->fields;
+}
+
+/* Copy the given fields of from into to. */
+static void merge(shadow_state_t *to, const shadow_state_t *from, uint32_t fields)
+{
+    fields &= from->fields;
+    const uint8_t relayBits = (fields >> SHADOW_FIELD_RELAY_1) & RELAY_ALL_MASK;
+
+    to->relays = (to->relays & ~relayBits) | (from->relays & relayBits);
+    if (fields & FIELD_BIT(SHADOW_FIELD_CAP)) {
+        to->capW = from->capW;
+    }
+    if (fields & FIELD_BIT(SHADOW_FIELD_LIMITS)) {
+        memcpy(to->circuitLimitA, from->circuitLimitA, sizeof(to->circuitLimitA));
+    }
+    to->fields |= fields;
+}
+
+static int format(const shadow_state_t *s, uint32_t fields, const char *token)
+{
+    const char *sep = "";
+    int used = snprintf(payload, sizeof(payload), "{\"state\":{\"reported\":{");
+
+    for (int i = 0; i < RELAY_CHANNELS && used > 0 && (size_t)used < sizeof(payload); i++) {
+        if (fields & FIELD_BIT(SHADOW_FIELD_RELAY_1 + i)) {
+            used += snprintf(payload + used, sizeof(payload) - used, "%s\"%s\":%s", sep,
+                             fieldNames[SHADOW_FIELD_RELAY_1 + i], ((s->relays >> i) & 1) ? "true" : "false");
+            sep = ",";
+        }
+    }
+    if ((fields & FIELD_BIT(SHADOW_FIELD_CAP)) && used > 0 && (size_t)used < sizeof(payload)) {
+        used += snprintf(payload + used, sizeof(payload) - used, "%s\"%s\":%.0f", sep,
+                         fieldNames[SHADOW_FIELD_CAP], s->capW);
+        sep = ",";
+    }
+    if ((fields & FIELD_BIT(SHADOW_FIELD_LIMITS)) && used > 0 && (size_t)used < sizeof(payload)) {
+        used += snprintf(payload + used, sizeof(payload) - used, "%s\"%s\":[%.1f,%.1f,%.1f,%.1f]", sep,
+                         fieldNames[SHADOW_FIELD_LIMITS], s->circuitLimitA[0], s->circuitLimitA[1],
+                         s->circuitLimitA[2], s->circuitLimitA[3]);
+    }
+    if (used > 0 && (size_t)used < sizeof(payload)) {
+        used += snprintf(payload + used, sizeof(payload) - used, "}},\"clientToken\":\"%s\"}", token);
+    }
+    return (used > 0 && (size_t)used < sizeof(payload)) ? used : -1;
+}
+
+static void schedule(int64_t delayUs)
+{
+    bool start;
+
+    portENTER_CRITICAL(&notifyLock);
+    start = !armed;
+    armed = true;
+    portEXIT_CRITICAL(&notifyLock);
+    if (start) {
+        esp_timer_start_once(timer, delayUs);
+    }
+}
+
+/*
+ * Send what changed since the last accepted update, as one message. Only one
+ * update is in flight: changes made meanwhile wait for its answer, so they
+ * are diffed against what the service actually has.
+ */
+static void report(int64_t now)
+{
+    shadow_state_t state;
+    int64_t retryUs = 0;
+    int len = -1;
+
+    snapshot(&state);
+    xSemaphoreTake(lock, portMAX_DELAY);
+    if (synced && inFlightToken[0] != '\0') {
+        if (now - inFlightSinceUs < (int64_t)SHADOW_ACCEPT_TIMEOUT_MS * 1000) {
+            deferred = true;
+            retryUs = (int64_t)SHADOW_ACCEPT_TIMEOUT_MS * 1000 - (now - inFlightSinceUs);
+        } else {
+            ESP_LOGW(SHADOW_TAG, "Update %s not answered, sending again", inFlightToken);
+            stats.timeouts++;
+            inFlightToken[0] = '\0';
+        }
+    }
+    if (synced && inFlightToken[0] == '\0') {
+        const uint32_t diff = differences(&state, &reported);
+
+        if (diff != 0) {
+            snprintf(inFlightToken, sizeof(inFlightToken), "%u", (unsigned)++tokenCount);
+            len = format(&state, diff, inFlightToken);
+            inFlight = state;
+            inFlight.fields = diff;
+            inFlightSinceUs = now;
+            stats.reports++;
+        }
+    }
+    xSemaphoreGive(lock);
+
+    if (retryUs > 0) {
+        schedule(retryUs);
+    }
+    if (len > 0) {
+        ESP_LOGD(SHADOW_TAG, "%s", payload);
+        uplink_send(UPLINK_SHADOW_UPDATE, payload, len);
+    }
+}
+
+/* Runs once changes have been quiet for SHADOW_COALESCE_MS, or the burst is too old. */
+static void onTimer(void *arg)
+{
+    const int64_t now = esp_timer_get_time();
+    int64_t waitUs = 0;
+
+    portENTER_CRITICAL(&notifyLock);
+    if (changed) {
+        const int64_t quiet = now - lastChangeUs;
+        const int64_t age = now - firstChangeUs;
+        if (quiet < (int64_t)SHADOW_COALESCE_MS * 1000 && age < (int64_t)SHADOW_COALESCE_MAX_MS * 1000) {
+            waitUs = (int64_t)SHADOW_COALESCE_MS * 1000 - quiet;
+        }
+    }
+    if (waitUs == 0) {
+        armed = false;
+        changed = false;
+    }
+    portEXIT_CRITICAL(&notifyLock);
+
+    if (waitUs > 0) {
+        esp_timer_start_once(timer, waitUs);
+        return;
+    }
+    report(now);
+}
+
+void device_shadow_init(void)
+{
+    const esp_timer_create_args_t args = {
+        .callback = onTimer,
+        .name = "shadow",
+    };
+
+    lock = xSemaphoreCreateMutexStatic(&lockBuffer);
+    ESP_ERROR_CHECK(esp_timer_create(&args, &timer));
+}
+
+/* A relay or a setting changed, from any task. Cheap; the report follows
+ * once changes have stopped for SHADOW_COALESCE_MS. */
+void device_shadow_notify(void)
+{
+    const int64_t now = esp_timer_get_time();
+    bool start;
+
+    if (timer == NULL) {
+        return;
+    }
+    portENTER_CRITICAL(&notifyLock);
+    lastChangeUs = now;
+    if (!changed) {
+        changed = true;
+        firstChangeUs = now;
+    }
+    start = !armed;
+    armed = true;
+    changeCount++;
+    portEXIT_CRITICAL(&notifyLock);
+    if (start) {
+        esp_timer_start_once(timer, (uint64_t)SHADOW_COALESCE_MS * 1000);
+    }
+}
+
+/* After a (re)connect: forget what was in flight and read the document. */
+void device_shadow_sync(void)
+{
+    xSemaphoreTake(lock, portMAX_DELAY);
+    synced = false;
+    inFlightToken[0] = '\0';
+    xSemaphoreGive(lock);
+    uplink_send(UPLINK_SHADOW_GET, "{}", 2);
+}
+
+/* Bring the relays and settings to a desired state, touching only what differs. */
+static void applyDesired(const shadow_state_t *desired)
+{
+    uint32_t writes = 0, skips = 0;
+
+    for (int i = 0; i < RELAY_CHANNELS; i++) {
+        if (!(desired->fields & FIELD_BIT(SHADOW_FIELD_RELAY_1 + i))) {
+            continue;
+        }
+        const bool on = (desired->relays >> i) & 1;
+        if (relay_is_on(i) != on) {
+            relay_set(i, on);
+            writes++;
+        } else {
+            skips++;
+        }
+    }
+    if ((desired->fields & FIELD_BIT(SHADOW_FIELD_CAP)) && desired->capW != shed_get_cap()) {
+        shed_set_cap(desired->capW);
+    }
+    if (desired->fields & FIELD_BIT(SHADOW_FIELD_LIMITS)) {
+        events_config_t config;
+        events_get_config(&config);
+        if (memcmp(config.circuitLimitA, desired->circuitLimitA, sizeof(config.circuitLimitA)) != 0) {
+            memcpy(config.circuitLimitA, desired->circuitLimitA, sizeof(config.circuitLimitA));
+            events_set_config(&config);
+        }
+    }
+
+    xSemaphoreTake(lock, portMAX_DELAY);
+    stats.relayWrites += writes;
+    stats.relaySkips += skips;
+    xSemaphoreGive(lock);
+    // Even with nothing to switch, the reported state is behind the desired one
+    device_shadow_notify();
+}
+
+/* The document, from get/accepted; NULLs when there is no shadow yet. */
+void device_shadow_on_document(uint32_t version, const shadow_state_t *doc, const shadow_state_t *delta)
+{
+    xSemaphoreTake(lock, portMAX_DELAY);
+    memset(&reported, 0, sizeof(reported));
+    if (doc != NULL) {
+        merge(&reported, doc, doc->fields);
+    }
+    lastVersion = version;
+    synced = true;
+    xSemaphoreGive(lock);
+    ESP_LOGI(SHADOW_TAG, "Document version %u read", (unsigned)version);
+
+    if (delta != NULL && delta->fields != 0) {
+        applyDesired(delta);
+    } else {
+        device_shadow_notify();
+    }
+}
+
+/* A delta between desired and reported. Redelivered or reordered deltas
+ * carry a version already seen and are dropped. */
+void device_shadow_on_delta(uint32_t version, const shadow_state_t *desired)
+{
+    xSemaphoreTake(lock, portMAX_DELAY);
+    if (version <= lastVersion) {
+        stats.staleDeltas++;
+        xSemaphoreGive(lock);
+        ESP_LOGD(SHADOW_TAG, "Delta version %u already seen", (unsigned)version);
+        return;
+    }
+    lastVersion = version;
+    stats.deltas++;
+    xSemaphoreGive(lock);
+    applyDesired(desired);
+}
+
+/* update/accepted or update/rejected. Its version is left alone: the delta an
+ * update causes carries the same version and may arrive after it. */
+void device_shadow_on_update_result(const char *clientToken, bool accepted)
+{
+    bool resend = false;
+    bool retry = false;
+
+    xSemaphoreTake(lock, portMAX_DELAY);
+    if (clientToken != NULL && inFlightToken[0] != '\0' && strcmp(clientToken, inFlightToken) == 0) {
+        if (accepted) {
+            merge(&reported, &inFlight, inFlight.fields);
+            stats.accepted++;
+        } else {
+            ESP_LOGW(SHADOW_TAG, "Update %s rejected", inFlightToken);
+            stats.rejected++;
+            retry = true;
+        }
+        inFlightToken[0] = '\0';
+        resend = deferred;
+        deferred = false;
+    }
+    xSemaphoreGive(lock);
+
+    if (retry) {
+        schedule((int64_t)SHADOW_ACCEPT_TIMEOUT_MS * 1000);
+    } else if (resend) {
+        // The timer waits for the answer timeout, restart it for the changes
+        esp_timer_stop(timer);
+        portENTER_CRITICAL(&notifyLock);
+        armed = false;
+        portEXIT_CRITICAL(&notifyLock);
+        device_shadow_notify();
+    }
+}
+
+void device_shadow_get_stats(shadow_stats_t *out)
+{
+    xSemaphoreTake(lock, portMAX_DELAY);
+    *out = stats;
+    xSemaphoreGive(lock);
+    portENTER_CRITICAL(&notifyLock);
+    out->changes = changeCount;
+    portEXIT_CRITICAL(&notifyLock);
+}
@@ -0,0 +1,52 @@
+#ifndef DEVICE_SHADOW_H
+#define DEVICE_SHADOW_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "sdkconfig.h"
+#include "relay.h"
+
+/* Changes closer together than this go out as one reported update. */
+#define SHADOW_COALESCE_MS          CONFIG_SHADOW_COALESCE_MS
+/* A burst of changes is reported at the latest this long after it started. */
+#define SHADOW_COALESCE_MAX_MS      2000
+/* An update not accepted or rejected within this long is sent again. */
+#define SHADOW_ACCEPT_TIMEOUT_MS    10000
+
+/* Members of the shadow document, bits of shadow_state_t.fields. */
+typedef enum {
+    SHADOW_FIELD_RELAY_1,       // Up to SHADOW_FIELD_RELAY_1 + RELAY_CHANNELS - 1
+    SHADOW_FIELD_CAP = SHADOW_FIELD_RELAY_1 + RELAY_CHANNELS,
+    SHADOW_FIELD_LIMITS,
+    SHADOW_FIELDS
+} shadow_field_t;
+
+typedef struct {
+    uint32_t fields;                        // Which members below are set
+    uint8_t relays;                         // Bit n for channel n
+    float capW;                             // "shed_cap_w"
+    float circuitLimitA[RELAY_CHANNELS];    // "circuit_limits_a"
+} shadow_state_t;
+
+typedef struct {
+    uint32_t changes;           // Local state changes noted
+    uint32_t reports;           // Reported updates sent, each covering one burst of changes
+    uint32_t accepted;
+    uint32_t rejected;
+    uint32_t timeouts;          // Updates sent again without an answer
+    uint32_t deltas;            // Deltas applied
+    uint32_t staleDeltas;       // Deltas ignored for an old version
+    uint32_t relayWrites;       // Relays switched for a desired state
+    uint32_t relaySkips;        // Desired relay states that already held
+} shadow_stats_t;
+
+void device_shadow_init(void);
+void device_shadow_notify(void);
+void device_shadow_sync(void);
+void device_shadow_on_document(uint32_t version, const shadow_state_t *reported, const shadow_state_t *delta);
+void device_shadow_on_delta(uint32_t version, const shadow_state_t *desired);
+void device_shadow_on_update_result(const char *clientToken, bool accepted);
+const char *device_shadow_field_name(shadow_field_t field);
+void device_shadow_get_stats(shadow_stats_t *stats);
+
+#endif // DEVICE_SHADOW_H
@@ -0,0 +1,236 @@
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include "freertos/FreeRTOS.h"
+#include "esp_log.h"
+#include "nvs.h"
+#include "sampler.h"
+#include "aggregate.h"
+#include "uplink.h"
+#include "timesync.h"
+#include "disagg.h"
+
+static const char *DISAGG_TAG = "DISAGG";
+
+/* A switching waiting for the meter to show the new load. */
+typedef struct {
+    bool active;
+    int channel;
+    bool on;
+    int64_t changeUs;
+    float beforeW;          // Power of the last sample before the switching
+} pending_step_t;
+
+static disagg_state_t state;           // Worked on by the sampler task only
+static disagg_state_t published;       // Copy handed out to other tasks
+static portMUX_TYPE publishLock = portMUX_INITIALIZER_UNLOCKED;
+static relay_change_t seen[RELAY_CHANNELS];
+static uint32_t outlierRun[RELAY_CHANNELS];
+static pending_step_t pending;
+static bool havePrevious = false;
+static float lastPower = 0;
+static int64_t lastTimestamp = 0;
+static int64_t lastReportUs = 0;
+static char payload[UPLINK_PAYLOAD_MAX];
+
+/* Load the learned draws, the energies start from zero at every boot. */
+void disagg_init(void)
+{
+    nvs_handle_t handle;
+    disagg_model_t stored[RELAY_CHANNELS];
+    size_t len = sizeof(stored);
+
+    relay_get_changes(seen);
+    if (nvs_open(DISAGG_NVS_NAMESPACE, NVS_READONLY, &handle) != ESP_OK) {
+        return;
+    }
+    if (nvs_get_blob(handle, DISAGG_NVS_KEY, stored, &len) == ESP_OK && len == sizeof(stored)) {
+        memcpy(state.model, stored, sizeof(stored));
+        published = state;
+        ESP_LOGI(DISAGG_TAG, "Learned draws loaded from NVS");
+    }
+    nvs_close(handle);
+}
+
+/* Switchings are a few a day, storing the model on each one costs no flash life. */
+static void saveModel(void)
+{
+    nvs_handle_t handle;
+
+    if (nvs_open(DISAGG_NVS_NAMESPACE, NVS_READWRITE, &handle) != ESP_OK) {
+        return;
+    }
+    if (nvs_set_blob(handle, DISAGG_NVS_KEY, state.model, sizeof(state.model)) == ESP_OK) {
+        nvs_commit(handle);
+    }
+    nvs_close(handle);
+}
+
+/* Fold one observed power step into the draw of a channel. */
+static void learn(int channel, float step)
+{
+    disagg_model_t *model = &state.model[channel];
+
+    if (step < 0) {
+        state.ambiguous++;  // Something else dropped at the same time, nothing to tell apart
+        return;
+    }
+    if (model->steps >= 3) {
+        const float deviation = fabsf(step - model->nominalW);
+        if (deviation > DISAGG_NOISE_W && deviation > DISAGG_OUTLIER_FRACTION * model->nominalW) {
+            state.outliers++;
+            if (++outlierRun[channel] < DISAGG_OUTLIER_RESTART) {
+                return;
+            }
+            ESP_LOGI(DISAGG_TAG, "Channel %d draw changed, learning again", channel + 1);
+            model->steps = 0;
+        }
+    }
+    outlierRun[channel] = 0;
+
+    if (model->steps == 0) {
+        model->nominalW = step;
+        model->varianceW2 = 0;
+    } else {
+        // Exponentially weighted mean and variance, constant memory
+        const float delta = step - model->nominalW;
+        model->nominalW += DISAGG_LEARN_RATE * delta;
+        model->varianceW2 = (1 - DISAGG_LEARN_RATE) * (model->varianceW2 + DISAGG_LEARN_RATE * delta * delta);
+    }
+    model->steps++;
+    ESP_LOGD(DISAGG_TAG, "Channel %d step %.1f W, draw %.1f W", channel + 1, step, model->nominalW);
+    saveModel();
+}
+
+/* Note new switchings, and learn from one once the load has settled. */
+static void trackSteps(const power_meansuare_t *m, uint8_t mask, const relay_change_t *changes)
+{
+    uint32_t switched = 0;
+    int channel = -1;
+
+    for (int i = 0; i < RELAY_CHANNELS; i++) {
+        if (changes[i].count != seen[i].count) {
+            switched += changes[i].count - seen[i].count;
+            channel = i;
+        }
+        seen[i] = changes[i];
+    }
+    if (switched > 0) {
+        if (pending.active) {
+            state.ambiguous++;  // Two switchings inside one step
+            pending.active = false;
+        }
+        // Only a single switching after a sample taken before it tells one channel's draw
+        if (switched == 1 && havePrevious && lastTimestamp < changes[channel].timeUs) {
+            pending = (pending_step_t){
+                .active = true,
+                .channel = channel,
+                .on = (mask >> channel) & 1,
+                .changeUs = changes[channel].timeUs,
+                .beforeW = lastPower,
+            };
+        } else {
+            state.ambiguous++;
+        }
+    }
+
+    if (pending.active && m->timestamp >= pending.changeUs + (int64_t)DISAGG_SETTLE_MS * 1000) {
+        learn(pending.channel, pending.on ? m->power - pending.beforeW : pending.beforeW - m->power);
+        pending.active = false;
+    }
+}
+
+/*
+ * Split the energy of the last interval over the channels that are on, in
+ * proportion to their learned draw. When the draws add up to more than was
+ * measured they are scaled down, so the channels never get more than the
+ * meter saw; the rest is unattributed.
+ */
+static void attribute(const power_meansuare_t *m, uint8_t mask)
+{
+    const int64_t dt = m->timestamp - lastTimestamp;
+    float sumW = 0;
+    float share = 1;
+
+    if (!havePrevious || dt <= 0 || dt > (int64_t)SAMPLER_PERIOD_MS * 1000 * AGG_MAX_GAP_PERIODS) {
+        return;
+    }
+    const double hours = dt / 3.6e9;
+
+    state.measuredWh += lastPower * hours;
+    for (int i = 0; i < RELAY_CHANNELS; i++) {
+        if (((mask >> i) & 1) && state.model[i].steps > 0) {
+            sumW += state.model[i].nominalW;
+        }
+    }
+    if (sumW > lastPower && sumW > 0) {
+        share = lastPower / sumW;
+    }
+    for (int i = 0; i < RELAY_CHANNELS; i++) {
+        if (((mask >> i) & 1) && state.model[i].steps > 0) {
+            state.energyWh[i] += state.model[i].nominalW * share * hours;
+        }
+    }
+}
+
+static void report(int64_t now, uint8_t mask)
+{
+    double attributedWh = 0;
+    int used;
+
+    used = snprintf(payload, sizeof(payload), "{\"disagg\":{\"t_ms\":%lld,\"devices\":[", (long long)timesync_epoch_ms(now));
+    for (int i = 0; i < RELAY_CHANNELS && used > 0 && (size_t)used < sizeof(payload); i++) {
+        const disagg_model_t *model = &state.model[i];
+        attributedWh += state.energyWh[i];
+        used += snprintf(payload + used, sizeof(payload) - used,
+                         "%s{\"on\":%d,\"nominal_w\":%.1f,\"sd_w\":%.1f,\"steps\":%u,\"wh\":%.2f}",
+                         i > 0 ? "," : "", (mask >> i) & 1, model->nominalW, sqrtf(model->varianceW2),
+                         (unsigned)model->steps, state.energyWh[i]);
+    }
+    if (used > 0 && (size_t)used < sizeof(payload)) {
+        used += snprintf(payload + used, sizeof(payload) - used,
+                         "],\"measured_wh\":%.2f,\"unattributed_wh\":%.2f,\"ambiguous\":%u,\"outliers\":%u}}",
+                         state.measuredWh, state.measuredWh - attributedWh,
+                         (unsigned)state.ambiguous, (unsigned)state.outliers);
+    }
+    if (used <= 0 || (size_t)used >= sizeof(payload)) {
+        ESP_LOGE(DISAGG_TAG, "Report does not fit %u bytes", (unsigned)sizeof(payload));
+        return;
+    }
+    ESP_LOGD(DISAGG_TAG, "%s", payload);
+    uplink_send(UPLINK_TELEMETRY, payload, used);
+}
+
+/* Run the model over a fresh sample, in the sampler task. */
+void disagg_add_sample(const power_meansuare_t *m)
+{
+    relay_change_t changes[RELAY_CHANNELS];
+    const uint8_t mask = relay_get_changes(changes);
+
+    trackSteps(m, mask, changes);
+    attribute(m, mask);
+
+    if (lastReportUs == 0) {
+        lastReportUs = m->timestamp;
+    } else if (DISAGG_REPORT_PERIOD_S > 0
+               && m->timestamp - lastReportUs >= (int64_t)DISAGG_REPORT_PERIOD_S * 1000000) {
+        lastReportUs = m->timestamp;
+        report(m->timestamp, mask);
+    }
+
+    havePrevious = true;
+    lastPower = m->power;
+    lastTimestamp = m->timestamp;
+
+    portENTER_CRITICAL(&publishLock);
+    published = state;
+    portEXIT_CRITICAL(&publishLock);
+}
+
+/* The state as of the last sample, safe to call from any task. */
+void disagg_get_state(disagg_state_t *out)
+{
+    portENTER_CRITICAL(&publishLock);
+    *out = published;
+    portEXIT_CRITICAL(&publishLock);
+}
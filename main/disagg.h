@@ -0,0 +1,47 @@
+#ifndef DISAGG_H
+#define DISAGG_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "sdkconfig.h"
+#include "pzem.h"
+#include "relay.h"
+
+#define DISAGG_NVS_NAMESPACE        "disagg"
+#define DISAGG_NVS_KEY              "model"
+
+/* Published every this many seconds, 0 disables the report. */
+#define DISAGG_REPORT_PERIOD_S      CONFIG_DISAGG_REPORT_PERIOD_S
+
+/* The meter registers follow a change of load within about this long. */
+#define DISAGG_SETTLE_MS            500
+/* Weight of a new power step in the learned draw of a channel. */
+#define DISAGG_LEARN_RATE           0.25f
+/* A step that differs from a learned draw (3 steps or more) by more than
+ * this fraction, and by more than DISAGG_NOISE_W, is another load changing
+ * at the same time. That many outliers in a row mean the appliance itself
+ * changed, and the model starts over from the last step. */
+#define DISAGG_OUTLIER_FRACTION     0.3f
+#define DISAGG_NOISE_W              10.0f
+#define DISAGG_OUTLIER_RESTART      3
+
+typedef struct {
+    float nominalW;         // Learned draw when switched on
+    float varianceW2;       // Exponentially weighted variance of the steps
+    uint32_t steps;         // Steps learned from
+} disagg_model_t;
+
+typedef struct {
+    disagg_model_t model[RELAY_CHANNELS];
+    // Energy since boot, double as these grow far beyond a sample's worth
+    double energyWh[RELAY_CHANNELS];    // Attributed to each channel
+    double measuredWh;                  // Integrated from measured power
+    uint32_t ambiguous;                 // Switchings not learned from, e.g. ALL_ON
+    uint32_t outliers;                  // Steps rejected as outliers
+} disagg_state_t;
+
+void disagg_init(void);
+void disagg_add_sample(const power_meansuare_t *m);
+void disagg_get_state(disagg_state_t *state);
+
+#endif // DISAGG_H
@@ -0,0 +1,246 @@
+#include <stdio.h>
+#include <math.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "esp_log.h"
+#include "nvs.h"
+#include "uplink.h"
+#include "timesync.h"
+#include "device_shadow.h"
+#include "events.h"
+
+static const char *EVENTS_TAG = "EVENTS";
+
+typedef struct {
+    bool active;
+    int64_t pendingUs;      // First sample of a condition not yet long enough, 0 if none
+    int64_t startUs;        // Start of the active event
+    float extreme;          // Worst value seen during the event
+    float limit;            // Threshold in force, for over-current it follows the relays
+} rule_state_t;
+
+static const char *names[EVENT_TYPES] = { "sag", "swell", "overcurrent", "frequency", "pf" };
+
+/* Whether a rule fires above (true) or below (false) its threshold. */
+static const bool fireAbove[EVENT_TYPES] = { false, true, true, true, false };
+
+static events_config_t config = {
+    .rule = {
+        [EVENT_SAG]         = { true, EVENTS_NOMINAL_VOLTAGE_V * 0.9f, 2.0f, 0 },
+        [EVENT_SWELL]       = { true, EVENTS_NOMINAL_VOLTAGE_V * 1.1f, 2.0f, 0 },
+        [EVENT_OVERCURRENT] = { true, 0.5f, 0.1f, 2000 },
+        [EVENT_FREQUENCY]   = { true, 0.5f, 0.1f, 2000 },
+        [EVENT_PF]          = { true, 0.8f, 0.05f, 10000 },
+    },
+    .circuitLimitA = { 10.0f, 10.0f, 10.0f, 10.0f },
+};
+static rule_state_t state[EVENT_TYPES];
+static events_stats_t stats;
+static StaticSemaphore_t configLockBuffer;
+static SemaphoreHandle_t configLock = NULL;
+static char payload[UPLINK_PAYLOAD_MAX];
+
+/* A rule that fires above its limit only clears below limit - hysteresis, so
+ * the hysteresis has to stay under the limit or the event never ends. The
+ * over-current limit is the threshold with every relay off and at least one
+ * circuit limit otherwise. */
+static bool validConfig(const events_config_t *c)
+{
+    for (int type = 0; type < EVENT_TYPES; type++) {
+        const event_rule_t *rule = &c->rule[type];
+        if (isnan(rule->threshold) || !(rule->hysteresis >= 0) ||
+            (fireAbove[type] && rule->hysteresis >= rule->threshold)) {
+            ESP_LOGW(EVENTS_TAG, "Invalid %s rule rejected", names[type]);
+            return false;
+        }
+    }
+    for (int i = 0; i < RELAY_CHANNELS; i++) {
+        if (!(c->circuitLimitA[i] >= 0) ||
+            (c->circuitLimitA[i] > 0 && c->rule[EVENT_OVERCURRENT].hysteresis >= c->circuitLimitA[i])) {
+            ESP_LOGW(EVENTS_TAG, "Invalid limit for circuit %d rejected", i + 1);
+            return false;
+        }
+    }
+    return true;
+}
+
+/* Load the rules stored from MQTT, the defaults above otherwise. */
+void events_init(void)
+{
+    nvs_handle_t handle;
+    events_config_t stored;
+    size_t len = sizeof(stored);
+
+    configLock = xSemaphoreCreateMutexStatic(&configLockBuffer);
+    if (nvs_open(EVENTS_NVS_NAMESPACE, NVS_READONLY, &handle) != ESP_OK) {
+        return;
+    }
+    if (nvs_get_blob(handle, EVENTS_NVS_KEY, &stored, &len) == ESP_OK && len == sizeof(stored) &&
+        validConfig(&stored)) {
+        config = stored;
+        ESP_LOGI(EVENTS_TAG, "Rules loaded from NVS");
+    }
+    nvs_close(handle);
+}
+
+const char *events_name(event_type_t type)
+{
+    return type < EVENT_TYPES ? names[type] : "unknown";
+}
+
+/* Value a rule looks at, NAN when the rule does not apply to this sample. */
+static float ruleValue(event_type_t type, const power_meansuare_t *m)
+{
+    switch (type) {
+    case EVENT_SAG:
+    case EVENT_SWELL:
+        return m->voltage;
+    case EVENT_OVERCURRENT:
+        return m->current;
+    case EVENT_FREQUENCY:
+        return fabsf(m->frequency - EVENTS_NOMINAL_FREQUENCY_HZ);
+    case EVENT_PF:
+        return m->power >= EVENTS_PF_MIN_POWER_W ? m->pf : NAN;
+    default:
+        return NAN;
+    }
+}
+
+static float ruleLimit(event_type_t type, uint8_t circuits)
+{
+    float limit = 0;
+
+    if (type != EVENT_OVERCURRENT || circuits == 0) {
+        return config.rule[type].threshold;
+    }
+    for (int i = 0; i < RELAY_CHANNELS; i++) {
+        if (circuits & (1U << i)) {
+            limit += config.circuitLimitA[i];
+        }
+    }
+    return limit;
+}
+
+static void publish(event_type_t type, const rule_state_t *s, bool start, int64_t nowUs, float value,
+                    uint8_t circuits)
+{
+    int len;
+
+    if (start) {
+        len = snprintf(payload, sizeof(payload),
+                       "{\"event\":\"%s\",\"state\":\"start\",\"start_ms\":%lld,\"t_ms\":%lld,"
+                       "\"value\":%.3f,\"limit\":%.3f,\"circuits\":%u}",
+                       names[type], (long long)timesync_epoch_ms(s->startUs), (long long)timesync_epoch_ms(nowUs),
+                       value, s->limit, circuits);
+    } else {
+        len = snprintf(payload, sizeof(payload),
+                       "{\"event\":\"%s\",\"state\":\"end\",\"start_ms\":%lld,\"t_ms\":%lld,"
+                       "\"duration_ms\":%lld,\"extreme\":%.3f,\"limit\":%.3f,\"circuits\":%u}",
+                       names[type], (long long)timesync_epoch_ms(s->startUs), (long long)timesync_epoch_ms(nowUs),
+                       (long long)((nowUs - s->startUs) / 1000), s->extreme, s->limit, circuits);
+    }
+    ESP_LOGI(EVENTS_TAG, "%s", payload);
+    if (len > 0 && (size_t)len < sizeof(payload)) {
+        uplink_send(UPLINK_EVENT, payload, len);
+    }
+}
+
+static void evaluate(event_type_t type, const power_meansuare_t *m, uint8_t circuits)
+{
+    const event_rule_t *rule = &config.rule[type];
+    rule_state_t *s = &state[type];
+    const float value = ruleValue(type, m);
+    const float limit = ruleLimit(type, circuits);
+    const bool applies = rule->enabled && !isnan(value);
+
+    if (s->active) {
+        // The over-current limit follows the relays, also while the event lasts
+        const bool clear = !applies || (fireAbove[type] ? value < limit - rule->hysteresis
+                                                        : value > limit + rule->hysteresis);
+        s->limit = limit;
+        if (clear) {
+            s->active = false;
+            publish(type, s, false, m->timestamp, value, circuits);
+        } else if (fireAbove[type] ? value > s->extreme : value < s->extreme) {
+            s->extreme = value;
+        }
+        return;
+    }
+
+    if (!applies || !(fireAbove[type] ? value > limit : value < limit)) {
+        if (s->pendingUs != 0) {
+            stats.suppressed++;
+        }
+        s->pendingUs = 0;
+        return;
+    }
+    if (s->pendingUs == 0) {
+        s->pendingUs = m->timestamp;
+        s->extreme = value;
+    } else if (fireAbove[type] ? value > s->extreme : value < s->extreme) {
+        s->extreme = value;
+    }
+    if (m->timestamp - s->pendingUs >= (int64_t)rule->minDurationMs * 1000) {
+        s->active = true;
+        s->startUs = s->pendingUs;
+        s->limit = limit;
+        s->pendingUs = 0;
+        stats.started[type]++;
+        publish(type, s, true, m->timestamp, value, circuits);
+    }
+}
+
+/* Run every rule over a fresh sample, in the sampler task. */
+void events_add_sample(const power_meansuare_t *m)
+{
+    const uint8_t circuits = relay_get_mask();
+
+    if (configLock == NULL) {
+        return;
+    }
+    xSemaphoreTake(configLock, portMAX_DELAY);
+    for (int type = 0; type < EVENT_TYPES; type++) {
+        evaluate(type, m, circuits);
+    }
+    xSemaphoreGive(configLock);
+}
+
+void events_get_config(events_config_t *out)
+{
+    xSemaphoreTake(configLock, portMAX_DELAY);
+    *out = config;
+    xSemaphoreGive(configLock);
+}
+
+/* Replace the rules and keep them in NVS. Active events are judged against
+ * the new hysteresis from the next sample on. */
+bool events_set_config(const events_config_t *newConfig)
+{
+    nvs_handle_t handle;
+
+    if (!validConfig(newConfig)) {
+        return false;
+    }
+
+    xSemaphoreTake(configLock, portMAX_DELAY);
+    config = *newConfig;
+    xSemaphoreGive(configLock);
+    device_shadow_notify();
+
+    if (nvs_open(EVENTS_NVS_NAMESPACE, NVS_READWRITE, &handle) != ESP_OK) {
+        ESP_LOGW(EVENTS_TAG, "Cannot open NVS to store the rules");
+        return true;
+    }
+    if (nvs_set_blob(handle, EVENTS_NVS_KEY, newConfig, sizeof(*newConfig)) == ESP_OK) {
+        nvs_commit(handle);
+    }
+    nvs_close(handle);
+    return true;
+}
+
+void events_get_stats(events_stats_t *out)
+{
+    xSemaphoreTake(configLock, portMAX_DELAY);
+    *out = stats;
+    xSemaphoreGive(configLock);
+}
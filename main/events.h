@@ -0,0 +1,59 @@
+#ifndef EVENTS_H
+#define EVENTS_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "pzem.h"
+#include "relay.h"
+
+#define EVENTS_NVS_NAMESPACE        "events"
+#define EVENTS_NVS_KEY              "config"
+
+#define EVENTS_NOMINAL_VOLTAGE_V    230.0f
+#define EVENTS_NOMINAL_FREQUENCY_HZ 50.0f
+/* Below this load the power factor reported by the meter means nothing. */
+#define EVENTS_PF_MIN_POWER_W       50.0f
+
+typedef enum {
+    EVENT_SAG,              // Voltage below threshold
+    EVENT_SWELL,            // Voltage above threshold
+    EVENT_OVERCURRENT,      // Current above the limit of the energized circuits
+    EVENT_FREQUENCY,        // |frequency - nominal| above threshold
+    EVENT_PF,               // Power factor below threshold while loaded
+    EVENT_TYPES
+} event_type_t;
+
+/*
+ * An event starts once the condition has held for minDurationMs and ends
+ * when the value is back by more than hysteresis on the good side of the
+ * threshold, so a value hovering at the threshold does not flap.
+ */
+typedef struct {
+    bool enabled;
+    float threshold;
+    float hysteresis;
+    uint32_t minDurationMs;
+} event_rule_t;
+
+typedef struct {
+    event_rule_t rule[EVENT_TYPES];
+    // Over-current limit of each relay circuit. The meter sees the sum of all
+    // circuits, so the limit checked is the sum over the energized ones, or
+    // the over-current threshold alone when every relay is open.
+    float circuitLimitA[RELAY_CHANNELS];
+} events_config_t;
+
+typedef struct {
+    uint32_t started[EVENT_TYPES];
+    uint32_t suppressed;    // Conditions that cleared before their minimum duration
+} events_stats_t;
+
+void events_init(void);
+void events_add_sample(const power_meansuare_t *m);
+const char *events_name(event_type_t type);
+void events_get_config(events_config_t *config);
+bool events_set_config(const events_config_t *config);
+void events_get_stats(events_stats_t *stats);
+
+#endif // EVENTS_H
@@ -0,0 +1,68 @@
+#include <math.h>
+#include "flicker.h"
+
+/*
+ * The meter resolves 0.1 V, so samples are kept as integer decivolts from a
+ * reference. Sums of integers are exact: adding the new sample and removing
+ * the oldest one is O(1) and, unlike float running sums, never drifts or
+ * cancels out the small variance of a ~230 V signal.
+ */
+static int16_t window[FLICKER_WINDOW_SAMPLES];     // Voltage - reference
+static int16_t steps[FLICKER_WINDOW_SAMPLES];      // Change from the previous sample
+static uint32_t head = 0;
+static uint32_t count = 0;
+static int32_t reference = 0;
+static int32_t last = 0;
+static int64_t sum = 0;
+static int64_t sumSq = 0;
+static int64_t stepSumSq = 0;
+
+void flicker_add_sample(float voltage)
+{
+    const int32_t deci = (int32_t)lroundf(voltage * 10.0f);
+
+    if (count == 0 && head == 0) {
+        reference = deci;
+        last = deci;
+    }
+    const int32_t x = deci - reference;
+    const int32_t step = deci - last;
+    last = deci;
+
+    if (count == FLICKER_WINDOW_SAMPLES) {
+        const int32_t old = window[head];
+        const int32_t oldStep = steps[head];
+        sum -= old;
+        sumSq -= old * old;
+        stepSumSq -= oldStep * oldStep;
+    } else {
+        count++;
+    }
+    window[head] = (int16_t)x;
+    steps[head] = (int16_t)step;
+    sum += x;
+    sumSq += x * x;
+    stepSumSq += step * step;
+    head = (head + 1) % FLICKER_WINDOW_SAMPLES;
+}
+
+/* False until the window is full. */
+bool flicker_get_index(flicker_index_t *index)
+{
+    if (count < FLICKER_WINDOW_SAMPLES) {
+        return false;
+    }
+    const float n = (float)count;
+    const float mean = reference + sum / n;
+    // n^2 * variance, still exact in integers
+    const int64_t n2var = (int64_t)count * sumSq - sum * sum;
+
+    if (mean <= 0) {
+        return false;
+    }
+    index->meanV = mean / 10.0f;
+    index->sdPct = 100.0f * sqrtf((float)n2var) / n / mean;
+    // The oldest step reaches back to a sample outside the window, n steps in all
+    index->dvPct = 100.0f * sqrtf(stepSumSq / n) / mean;
+    return true;
+}
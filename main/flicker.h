@@ -0,0 +1,26 @@
+#ifndef FLICKER_H
+#define FLICKER_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "sdkconfig.h"
+
+/*
+ * Voltage fluctuation over the last FLICKER_WINDOW_SAMPLES samples. The
+ * meter only gives RMS values, so this is not IEC 61000-4-15 flicker, but at
+ * short sampling periods (CONFIG_PZEM_SAMPLE_PERIOD_MS of 100-200 ms) it shows
+ * the same loads: the spread of the voltage, and the RMS of the change from
+ * one sample to the next, which ignores slow drift.
+ */
+#define FLICKER_WINDOW_SAMPLES      CONFIG_FLICKER_WINDOW_SAMPLES
+
+typedef struct {
+    float meanV;
+    float sdPct;        // Standard deviation of the voltage, % of the mean
+    float dvPct;        // RMS of sample-to-sample changes, % of the mean
+} flicker_index_t;
+
+void flicker_add_sample(float voltage);
+bool flicker_get_index(flicker_index_t *index);
+
+#endif // FLICKER_H
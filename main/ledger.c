@@ -0,0 +1,151 @@
+#include <stdbool.h>
+#include "esp_log.h"
+#include "nvs.h"
+#include "ledger.h"
+
+static const char *LEDGER_TAG = "ledger";
+
+/* What is kept in NVS, written as one blob so total and counter always agree. */
+typedef struct {
+    uint64_t totalWh;
+    uint32_t meterWh;
+    uint32_t resets;
+    uint32_t wraps;
+} ledger_record_t;
+
+static ledger_state_t state;
+static bool haveRecord = false;     // state holds a total, from NVS or from the first sample
+static bool synced = false;         // meterWh was read from the meter since boot
+static int64_t lastSampleUs = 0;
+static bool jumped = false;        // The last sample was rejected, at jumpWh
+static uint32_t jumpWh = 0;
+static int64_t jumpUs = 0;
+static int64_t lastSaveUs = 0;
+static uint64_t savedWh = 0;
+
+void ledger_init(void)
+{
+    nvs_handle_t handle;
+    ledger_record_t record;
+    size_t len = sizeof(record);
+
+    if (nvs_open(LEDGER_NVS_NAMESPACE, NVS_READONLY, &handle) != ESP_OK) {
+        ESP_LOGI(LEDGER_TAG, "No stored total, starting from the meter counter");
+        return;
+    }
+    if (nvs_get_blob(handle, LEDGER_NVS_KEY, &record, &len) == ESP_OK && len == sizeof(record)) {
+        state.totalWh = record.totalWh;
+        state.meterWh = record.meterWh;
+        state.resets = record.resets;
+        state.wraps = record.wraps;
+        savedWh = record.totalWh;
+        haveRecord = true;
+        ESP_LOGI(LEDGER_TAG, "Recovered %llu Wh at meter counter %u Wh",
+                 (unsigned long long)state.totalWh, state.meterWh);
+    }
+    nvs_close(handle);
+}
+
+static void save(int64_t now)
+{
+    nvs_handle_t handle;
+    const ledger_record_t record = {
+        .totalWh = state.totalWh,
+        .meterWh = state.meterWh,
+        .resets = state.resets,
+        .wraps = state.wraps,
+    };
+
+    lastSaveUs = now;
+    if (nvs_open(LEDGER_NVS_NAMESPACE, NVS_READWRITE, &handle) != ESP_OK) {
+        ESP_LOGW(LEDGER_TAG, "Cannot open NVS to store the total");
+        return;
+    }
+    if (nvs_set_blob(handle, LEDGER_NVS_KEY, &record, sizeof(record)) == ESP_OK
+        && nvs_commit(handle) == ESP_OK) {
+        savedWh = state.totalWh;
+        state.saves++;
+    } else {
+        ESP_LOGW(LEDGER_TAG, "Storing the total failed");
+    }
+    nvs_close(handle);
+}
+
+/* Largest counter step the meter can make in dtUs, plus one count of rounding. */
+static uint32_t maxStep(int64_t dtUs)
+{
+    if (dtUs <= 0) {
+        return 1;
+    }
+    return (uint32_t)((uint64_t)LEDGER_MAX_POWER_W * (uint64_t)dtUs / 3600000000ULL) + 1;
+}
+
+/*
+ * Bring the total up to the meter counter of a fresh sample and return it.
+ *
+ * A counter that went down either wrapped (it was near the end of its range
+ * and is now near the start) or was reset, in which case whatever it counted
+ * since the reset is new energy. The first sample after boot is compared with
+ * the counter stored in NVS, so energy measured while the ESP32 was down is
+ * not lost; NVS only needs to be written often enough to survive a meter reset
+ * during downtime, which is what keeps flash wear low. A step too large for
+ * the time elapsed leaves the counter where it was, unless the next sample
+ * carries on from it.
+ */
+uint64_t ledger_add_sample(const power_meansuare_t *m)
+{
+    const uint32_t raw = m->energyWh;
+    bool urgent = false;
+
+    if (!haveRecord) {
+        // First boot ever, the meter counter is the best starting point we have
+        state.totalWh = raw;
+        haveRecord = true;
+        urgent = true;
+    } else if (raw >= state.meterWh) {
+        const uint32_t step = raw - state.meterWh;
+        if (synced && step > maxStep(m->timestamp - lastSampleUs)) {
+            if (jumped && raw >= jumpWh && raw - jumpWh <= maxStep(m->timestamp - jumpUs)) {
+                // Two samples agree, the counter really moved: count only what it moved since
+                ESP_LOGW(LEDGER_TAG, "Counter jumped %u -> %u Wh, step ignored", state.meterWh, jumpWh);
+                state.totalWh += raw - jumpWh;
+                urgent = true;
+            } else {
+                // Not physically possible, a bad reading until the next sample confirms it
+                state.rejected++;
+                jumped = true;
+                jumpWh = raw;
+                jumpUs = m->timestamp;
+                return state.totalWh;
+            }
+        } else {
+            state.totalWh += step;
+        }
+    } else if (state.meterWh > LEDGER_METER_WRAP_WH - LEDGER_METER_WRAP_WH / 10
+               && raw < LEDGER_METER_WRAP_WH / 10) {
+        state.totalWh += LEDGER_METER_WRAP_WH - state.meterWh + raw;
+        state.wraps++;
+        urgent = true;
+        ESP_LOGI(LEDGER_TAG, "Counter wrapped %u -> %u Wh", state.meterWh, raw);
+    } else {
+        state.totalWh += raw;
+        state.resets++;
+        urgent = true;
+        ESP_LOGI(LEDGER_TAG, "Counter reset %u -> %u Wh", state.meterWh, raw);
+    }
+    state.meterWh = raw;
+    jumped = false;
+    synced = true;
+    lastSampleUs = m->timestamp;
+
+    if (urgent || (state.totalWh - savedWh >= LEDGER_SAVE_DELTA_WH
+                   && m->timestamp - lastSaveUs >= (int64_t)LEDGER_SAVE_INTERVAL_S * 1000000)) {
+        save(m->timestamp);
+    }
+    return state.totalWh;
+}
+
+void ledger_get_state(ledger_state_t *out)
+{
+    *out = state;
+}
@@ -0,0 +1,36 @@
+#ifndef LEDGER_H
+#define LEDGER_H
+
+#include <stdint.h>
+#include "sdkconfig.h"
+#include "pzem.h"
+
+#define LEDGER_NVS_NAMESPACE        "ledger"
+#define LEDGER_NVS_KEY              "state"
+
+/* The meter counts up to 9999.99 kWh and then starts again from zero. */
+#define LEDGER_METER_WRAP_WH        10000000UL
+
+/* NVS writes are at most this frequent, and only once the total has moved
+ * by LEDGER_SAVE_DELTA_WH. Resets and wraps are saved right away. */
+#define LEDGER_SAVE_INTERVAL_S      CONFIG_LEDGER_SAVE_INTERVAL_S
+#define LEDGER_SAVE_DELTA_WH        CONFIG_LEDGER_SAVE_DELTA_WH
+
+/* Upper bound of the load the meter can measure (100 A at 260 V). A counter
+ * step larger than this power over the elapsed time is not believed. */
+#define LEDGER_MAX_POWER_W          26000
+
+typedef struct {
+    uint64_t totalWh;           // Cumulative energy, survives meter resets and reboots
+    uint32_t meterWh;           // Meter counter the total was last brought up to
+    uint32_t resets;            // Meter counter went back to a small value
+    uint32_t wraps;             // Meter counter rolled over at LEDGER_METER_WRAP_WH
+    uint32_t rejected;          // Implausible counter steps that were skipped
+    uint32_t saves;             // NVS writes since boot
+} ledger_state_t;
+
+void ledger_init(void);
+uint64_t ledger_add_sample(const power_meansuare_t *m);
+void ledger_get_state(ledger_state_t *state);
+
+#endif // LEDGER_H
@@ -1,20 +1,24 @@
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
 #include "esp_system.h"
 #include "esp_log.h"
 #include "driver/uart.h"
 #include "driver/gpio.h"
 #include "soc/uart_struct.h"
+#include "nvs.h"
 #include "string.h"
 #include <stdio.h>
+#include <stdlib.h>
 #include "nextion.h"
 #include "buzzer.h"
+#include "trend.h"
+#include "relay.h"
 
 #define TXD_PIN (GPIO_NUM_23)
 #define RXD_PIN (GPIO_NUM_22)
 #define nUART	(UART_NUM_2)
-#define OFF   1
-#define ON    0
 
 enum 
 {
@@ -45,14 +49,18 @@ char *CMD_STRINGS[] = {
     "ALL_OFF", 
 };
 
-bool Dev1_state = false;
-bool Dev2_state = false;
-bool Dev3_state = false;
-bool Dev4_state = false;
+// Serializes writes, a transparent data transfer must not be interleaved with commands
+static SemaphoreHandle_t txMutex = NULL;
+// Return codes (0xFE, 0xFD, errors...) picked out of the RX stream by nextion_rx_task
+static QueueHandle_t respQueue = NULL;
+// Page reported by the display's "sendme" answers, and whether one is expected
+static volatile bool pagePollPending = false;
+static volatile bool pageReloaded = false;
+static int currentPage = -1;
 
 void initNextion() {
     const uart_config_t uart_config = {
-        .baud_rate = 9600,
+        .baud_rate = NEXTION_DEFAULT_BAUD,
         .data_bits = UART_DATA_8_BITS,
         .parity = UART_PARITY_DISABLE,
         .stop_bits = UART_STOP_BITS_1,
@@ -64,42 +72,293 @@ void initNextion() {
     uart_driver_install(nUART, RX_BUFFER * 2, 0, 0, NULL, 0);
 }
 
+/*
+ * Check that the display answers at the current UART rate. "sendme" is always
+ * answered with 0x66 <page> 0xFF 0xFF 0xFF, whatever bkcmd is set to.
+ */
+static bool pingNextion(void)
+{
+    uint8_t resp[16];
+
+    uart_flush_input(nUART);
+    sendData(TX_TASK_TAG, "sendme\xFF\xFF\xFF");
+    const int rxBytes = uart_read_bytes(nUART, resp, sizeof(resp), NEXTION_PING_TIMEOUT_MS / portTICK_PERIOD_MS);
+    for (int i = 0; i + 4 < rxBytes; i++) {
+        if (resp[i] == 0x66 && resp[i+2] == 0xFF && resp[i+3] == 0xFF && resp[i+4] == 0xFF) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool probeBaud(uint32_t baud)
+{
+    uart_wait_tx_done(nUART, NEXTION_PING_TIMEOUT_MS / portTICK_PERIOD_MS);
+    uart_set_baudrate(nUART, baud);
+    // Give the display a moment, a few pings may be needed right after a switch
+    for (int i = 0; i < NEXTION_PING_RETRIES; i++) {
+        if (pingNextion()) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static uint32_t loadBaud(void)
+{
+    nvs_handle_t handle;
+    uint32_t baud = 0;
+
+    if (nvs_open(NEXTION_NVS_NAMESPACE, NVS_READONLY, &handle) == ESP_OK) {
+        nvs_get_u32(handle, NEXTION_NVS_BAUD_KEY, &baud);
+        nvs_close(handle);
+    }
+    return baud;
+}
+
+static void storeBaud(uint32_t baud)
+{
+    nvs_handle_t handle;
+
+    if (nvs_open(NEXTION_NVS_NAMESPACE, NVS_READWRITE, &handle) != ESP_OK) {
+        ESP_LOGW(TX_TASK_TAG, "Cannot open NVS to store baud rate");
+        return;
+    }
+    if (nvs_set_u32(handle, NEXTION_NVS_BAUD_KEY, baud) == ESP_OK) {
+        nvs_commit(handle);
+    }
+    nvs_close(handle);
+}
+
+/*
+ * Bring the link to CONFIG_NEXTION_BAUD_RATE. The rate set with "baud=" lives
+ * until the display is power cycled, so after a warm boot of the ESP32 the
+ * display is usually still at the rate stored in NVS and no negotiation is
+ * needed. Otherwise find the display at the default rate, ask it to switch,
+ * follow it and verify. If the display does not answer at the new rate both
+ * sides go back to the rate that worked.
+ * Returns the rate the link ends up at.
+ */
+uint32_t nextion_negotiate_baud(void)
+{
+    const uint32_t target = NEXTION_BAUD_RATE;
+    const uint32_t stored = loadBaud();
+    uint32_t current = 0;
+    char cmd[24];
+
+    if (stored != 0 && stored != NEXTION_DEFAULT_BAUD && probeBaud(stored)) {
+        current = stored;
+    } else if (probeBaud(NEXTION_DEFAULT_BAUD)) {
+        current = NEXTION_DEFAULT_BAUD;
+    } else if (target != NEXTION_DEFAULT_BAUD && probeBaud(target)) {
+        current = target;
+    } else {
+        ESP_LOGW(TX_TASK_TAG, "Nextion does not answer, staying at %d baud", NEXTION_DEFAULT_BAUD);
+        uart_set_baudrate(nUART, NEXTION_DEFAULT_BAUD);
+        return NEXTION_DEFAULT_BAUD;
+    }
+
+    if (current != target) {
+        snprintf(cmd, sizeof(cmd), "baud=%u\xFF\xFF\xFF", (unsigned)target);
+        sendData(TX_TASK_TAG, cmd);
+        if (probeBaud(target)) {
+            current = target;
+        } else {
+            // The display may or may not have switched. This is still sent at the new
+            // rate, so a display that did switch goes back to the old one.
+            ESP_LOGW(TX_TASK_TAG, "No answer at %u baud, falling back to %u", (unsigned)target, (unsigned)current);
+            snprintf(cmd, sizeof(cmd), "baud=%u\xFF\xFF\xFF", (unsigned)current);
+            sendData(TX_TASK_TAG, cmd);
+            if (!probeBaud(current)) {
+                current = NEXTION_DEFAULT_BAUD;
+                uart_set_baudrate(nUART, current);
+            }
+        }
+    }
+
+    if (current != stored) {
+        storeBaud(current);
+    }
+    ESP_LOGI(TX_TASK_TAG, "Nextion link at %u baud", (unsigned)current);
+    return current;
+}
+
 int sendData(const char* logName, const char* data)
 {
     const int len = strlen(data);
+    if (txMutex != NULL) {
+        xSemaphoreTake(txMutex, portMAX_DELAY);
+    }
     const int txBytes = uart_write_bytes(nUART, data, len);
-    ESP_LOGI(logName, "Wrote %d bytes", txBytes);
-    ESP_LOGI(logName, "Sent %s", data);
+    if (txMutex != NULL) {
+        xSemaphoreGive(txMutex);
+    }
+    ESP_LOGD(logName, "Wrote %d bytes: %s", txBytes, data);
     return txBytes;
 }
 
-static void tx_task(void* param)
+static bool isReturnCode(uint8_t code)
 {
-    esp_log_level_set(TX_TASK_TAG, ESP_LOG_INFO);
-    char *cmd = (char*)malloc(TX_BUFFER);
-    param_t data = *((param_t*)param);
-    while (1) {
+    return code <= 0x24 || code == NEXTION_RET_TRANSPARENT_END || code == NEXTION_RET_TRANSPARENT_READY;
+}
 
-    sprintf(cmd, "Monitor.power_v.txt=\"%f\"\xFF\xFF\xFF",data.power);
-    ESP_LOGI("logName", "Monitor.power_v.txt=%f", data.power);
-    sendData(TX_TASK_TAG, cmd);	
+/* Wait for the display to answer with code, any other return code is a failure. */
+static bool waitResponse(uint8_t code, uint32_t timeoutMs)
+{
+    uint8_t got;
 
-    sprintf(cmd, "Monitor.freq_v.txt=\"%f\"\xFF\xFF\xFF",data.frequency);
-    ESP_LOGI("logName", "Monitor.freq_v.txt=%f", data.frequency);
-    sendData(TX_TASK_TAG, cmd);
+    if (xQueueReceive(respQueue, &got, timeoutMs / portTICK_PERIOD_MS) != pdTRUE) {
+        return false;
+    }
+    if (got != code) {
+        ESP_LOGD(TX_TASK_TAG, "Expected %#.2x, display returned %#.2x", code, got);
+        return false;
+    }
+    return true;
+}
 
-    sprintf(cmd, "Monitor.vol_v.txt=\"%f\"\xFF\xFF\xFF",data.voltage);
-    ESP_LOGI("logName", "Monitor.vol_v.txt=%f", data.voltage);
+/*
+ * Append count points to channel ch of waveform component id with a single
+ * "addt" transparent data transfer. Needs nextion_rx_task running to see the 0xFE/0xFD
+ * handshake. Returns the number of bytes put on the wire, or -1 if the display
+ * refused the transfer (e.g. the waveform is not on the current page).
+ */
+int nextion_add_points(int id, int ch, const uint8_t *points, size_t count)
+{
+    char cmd[32];
+    int txBytes = -1;
+
+    if (count == 0 || count > NEXTION_ADDT_MAX || respQueue == NULL) {
+        return count == 0 ? 0 : -1;
+    }
+    const int len = snprintf(cmd, sizeof(cmd), "addt %d,%d,%u\xFF\xFF\xFF", id, ch, (unsigned)count);
+
+    xSemaphoreTake(txMutex, portMAX_DELAY);
+    xQueueReset(respQueue);
+    uart_write_bytes(nUART, cmd, len);
+    if (waitResponse(NEXTION_RET_TRANSPARENT_READY, NEXTION_ADDT_TIMEOUT_MS)) {
+        uart_write_bytes(nUART, (const char*)points, count);
+        if (waitResponse(NEXTION_RET_TRANSPARENT_END, NEXTION_ADDT_TIMEOUT_MS)) {
+            txBytes = len + count;
+        }
+    }
+    xSemaphoreGive(txMutex);
+    return txBytes;
+}
+
+/* Clear channel ch of waveform component id. */
+void nextion_clear_channel(int id, int ch)
+{
+    char cmd[24];
+
+    snprintf(cmd, sizeof(cmd), "cle %d,%d\xFF\xFF\xFF", id, ch);
     sendData(TX_TASK_TAG, cmd);
+}
+
+/*
+ * Display model of the Monitor page. Each entry remembers the text that is
+ * currently shown on the HMI so nextion_tx_task only sends fields whose rendered text
+ * changed. Precision follows the PZEM-004T register resolution, anything finer
+ * is noise that would cost UART time without changing what the user sees.
+ */
+typedef struct {
+    const char *component;
+    const char *format;
+    char shown[NEXTION_FIELD_LEN];
+    bool valid;
+} nextion_field_t;
+
+enum
+{
+    FIELD_POWER,
+    FIELD_FREQ,
+    FIELD_VOLTAGE,
+    FIELD_CURRENT,
+    FIELD_COUNT,
+};
+
+static nextion_field_t monitor_fields[FIELD_COUNT] = {
+    [FIELD_POWER]   = { "Monitor.power_v", "%.1f" },   // 0.1 W
+    [FIELD_FREQ]    = { "Monitor.freq_v",  "%.1f" },   // 0.1 Hz
+    [FIELD_VOLTAGE] = { "Monitor.vol_v",   "%.1f" },   // 0.1 V
+    [FIELD_CURRENT] = { "Monitor.amp_v",   "%.3f" },   // 0.001 A
+};
+
+/*
+ * Render value with the field precision and, if the text differs from what the
+ * display shows, append the assignment command to frame.
+ * Returns the new frame length.
+ */
+static size_t appendField(nextion_field_t *field, float value, char *frame, size_t len, size_t size)
+{
+    char text[NEXTION_FIELD_LEN];
+
+    snprintf(text, sizeof(text), field->format, value);
+    if (field->valid && strcmp(text, field->shown) == 0) {
+        return len;
+    }
+
+    int n = snprintf(frame + len, size - len, "%s.txt=\"%s\"\xFF\xFF\xFF", field->component, text);
+    if (n < 0 || (size_t)n >= size - len) {
+        // No room left in this frame, the field stays dirty for the next one
+        frame[len] = '\0';
+        return len;
+    }
 
-    sprintf(cmd, "Monitor.amp_v.txt=\"%f\"\xFF\xFF\xFF",data.current);
-    ESP_LOGI("logName", "Monitor.amp_v.txt=%f", data.current);
-    sendData(TX_TASK_TAG, cmd);	           
-    vTaskDelay(10000 / portTICK_PERIOD_MS); //Transmit every 10 seconds
+    strcpy(field->shown, text);
+    field->valid = true;
+    return len + n;
+}
+
+/* Drop the display model so the next refresh rewrites every field. */
+void nextion_invalidate(void)
+{
+    for (int i = 0; i < FIELD_COUNT; i++) {
+        monitor_fields[i].valid = false;
     }
 }
 
-static void rx_task()
+void nextion_tx_task(void* param)
+{
+    esp_log_level_set(TX_TASK_TAG, ESP_LOG_INFO);
+    char *frame = (char*)malloc(TX_BUFFER);
+    const param_t *live = (const param_t*)param;
+    TickType_t lastWake = xTaskGetTickCount();
+    TickType_t lastFull = lastWake;
+
+    while (1) {
+        param_t data = *live;
+        size_t len = 0;
+
+        // A page reload on the HMI resets its components, rewrite the fields now and then
+        // and ask for the page, the waveform is only sent again when the page changed
+        if (xTaskGetTickCount() - lastFull >= NEXTION_FULL_REFRESH_MS / portTICK_PERIOD_MS) {
+            nextion_invalidate();
+            pagePollPending = true;
+            sendData(TX_TASK_TAG, "sendme\xFF\xFF\xFF");
+            lastFull = xTaskGetTickCount();
+        }
+        if (pageReloaded) {
+            pageReloaded = false;
+            nextion_invalidate();
+            trend_invalidate();
+        }
+
+        len = appendField(&monitor_fields[FIELD_POWER], data.power, frame, len, TX_BUFFER);
+        len = appendField(&monitor_fields[FIELD_FREQ], data.frequency, frame, len, TX_BUFFER);
+        len = appendField(&monitor_fields[FIELD_VOLTAGE], data.voltage, frame, len, TX_BUFFER);
+        len = appendField(&monitor_fields[FIELD_CURRENT], data.current, frame, len, TX_BUFFER);
+
+        // All changed fields go out in one write, nothing at all if the screen is current
+        if (len > 0) {
+            sendData(TX_TASK_TAG, frame);
+        }
+        trend_refresh();
+        vTaskDelayUntil(&lastWake, NEXTION_REFRESH_PERIOD_MS / portTICK_PERIOD_MS);
+    }
+}
+
+void nextion_rx_task(void *arg)
 {
 	esp_log_level_set(RX_TASK_TAG, ESP_LOG_INFO);
     uint8_t* data = (uint8_t*) malloc(RX_BUFFER+1);
@@ -107,19 +366,42 @@ static void rx_task()
 
     while (1) {
         memset(dstream,0,sizeof(malloc(RX_BUFFER+1)));
-        const int rxBytes = uart_read_bytes(nUART, data, RX_BUFFER, 1000 / portTICK_RATE_MS);
-        if (rxBytes > 0) {
-            data[rxBytes] = 0;
-            snprintf(dstream, RX_BUFFER+1, "%s", data);
-            
+        // Short timeout so return codes reach a waiting transfer quickly
+        const int rxBytes = uart_read_bytes(nUART, data, RX_BUFFER, NEXTION_RX_TIMEOUT_MS / portTICK_RATE_MS);
+        if (rxBytes <= 0) {
+            continue;
+        }
+        int start = 0;
+        // The page, answering our "sendme" or sent by a page's preinit event on a reload
+        if (rxBytes >= 5 && data[0] == NEXTION_RET_SENDME && data[2] == 0xFF) {
+            if (!pagePollPending || (currentPage >= 0 && data[1] != currentPage)) {
+                ESP_LOGD(RX_TASK_TAG, "Page %d loaded", data[1]);
+                pageReloaded = true;
+            }
+            pagePollPending = false;
+            currentPage = data[1];
+            // A transfer's return code may have come in the same read
+            start = 5;
+            if (rxBytes == start) {
+                continue;
+            }
+        }
+        // Return codes are one byte followed by 0xFF 0xFF 0xFF, pass them to the writer
+        if (rxBytes - start >= 4 && isReturnCode(data[start]) && data[start+1] == 0xFF) {
+            for (int i = start; i + 3 < rxBytes; i += 4) {
+                xQueueSend(respQueue, &data[i], 0);
+            }
+            continue;
         }
+        data[rxBytes] = 0;
+        snprintf(dstream, RX_BUFFER+1, "%s", data + start);
         if(ParseCmd(dstream)==0)continue;
 
-        if (Dev1_state && Dev2_state && Dev3_state && Dev4_state) {
+        if (relay_get_mask() == RELAY_ALL_MASK) {
           sendData(TX_TASK_TAG, "Control.t9.txt=\"ON\"\xFF\xFF\xFF");	
           sendData(TX_TASK_TAG, "Control.t9.pco=2016\xFF\xFF\xFF");	
           sendData(TX_TASK_TAG, "Control.bt4.val=1\xFF\xFF\xFF");	
-        } else if (! (Dev1_state && Dev2_state && Dev3_state && Dev4_state) ) {
+        } else {
           sendData(TX_TASK_TAG, "Control.t9.txt=\"OFF\"\xFF\xFF\xFF");
           sendData(TX_TASK_TAG, "Control.t9.pco=63488\xFF\xFF\xFF");	
           sendData(TX_TASK_TAG, "Control.bt4.val=0\xFF\xFF\xFF");
@@ -131,18 +413,18 @@ static void rx_task()
 	free(dstream);
 }
 
-void nextion_main(param_t param)
+void nextion_main(void)
 {
     initNextion();
+    nextion_negotiate_baud();
+    txMutex = xSemaphoreCreateMutex();
+    respQueue = xQueueCreate(NEXTION_RESP_QUEUE_LEN, sizeof(uint8_t));
+    nextion_invalidate();
 	//Set wifi icon on the screen
 	  sendData(TX_TASK_TAG, "Monitor.wifi.pic=11\xFF\xFF\xFF");
     vTaskDelay(5 / portTICK_PERIOD_MS);
     sendData(TX_TASK_TAG, "Control.wifi.pic=11\xFF\xFF\xFF");
     vTaskDelay(5 / portTICK_PERIOD_MS);
-	
-	//create the asynchronous send and receive tasks 
-    xTaskCreate(&rx_task, "uart_rx_task", 1024*2, NULL, configMAX_PRIORITIES, NULL);
-    xTaskCreate(&tx_task, "uart_tx_task", 1024*2, (void *)&param, configMAX_PRIORITIES-1, NULL);
 }
 
 #define __NUMBER_OF_CMD_STRINGS (sizeof(CMD_STRINGS) / sizeof(*CMD_STRINGS))
@@ -162,74 +444,52 @@ int ParseCmd(char *text)
     switch (cmd_index) {
       case D1ON:
         ESP_LOGI("CMD_HMI","\nUART RX: cmd D1ON");
-        gpio_set_level(DEVICE_1, ON);
-        Dev1_state = true;
+        relay_set(0, true);
         return 0;
       break;
       case D1OFF:
         ESP_LOGI("CMD_HMI","\nUART RX: cmd D1OFF");
-        gpio_set_level(DEVICE_1, OFF);
-        Dev1_state = false;
+        relay_set(0, false);
         return 0;
       break;
       case D2ON:
         ESP_LOGI("CMD_HMI","\nUART RX: cmd D2ON");
-        gpio_set_level(DEVICE_2, ON);
-        Dev2_state = true;
+        relay_set(1, true);
         return 0;
       break;
       case D2OFF:
         ESP_LOGI("CMD_HMI","\nUART RX: cmd D2OFF");
-        gpio_set_level(DEVICE_2, OFF);
-        Dev2_state = false;
+        relay_set(1, false);
         return 0;
       break;
       case D3ON:
         ESP_LOGI("CMD_HMI","\nUART RX: cmd D3ON");
-        gpio_set_level(DEVICE_3, ON);
-        Dev3_state = true;
+        relay_set(2, true);
         return 0;
       break;
       case D3OFF:
         ESP_LOGI("CMD_HMI","\nUART RX: cmd D3OFF");
-        gpio_set_level(DEVICE_3, OFF);
-        Dev3_state = false;
+        relay_set(2, false);
         return 0;
       break;
       case D4ON:
         ESP_LOGI("CMD_HMI","\nUART RX: cmd D4ON");
-        gpio_set_level(DEVICE_4, ON);
-        Dev4_state = true;
+        relay_set(3, true);
         return 0;
       break;
       case D4OFF:
         ESP_LOGI("CMD_HMI","\nUART RX: cmd D4OFF");
-        gpio_set_level(DEVICE_4, OFF);
-        Dev4_state = false;
+        relay_set(3, false);
         return 0;
       break;
       case ALL_ON:
         ESP_LOGI("CMD_HMI","\nUART RX: cmd ALL_ON");
-        gpio_set_level(DEVICE_1, ON);
-        gpio_set_level(DEVICE_2, ON);
-        gpio_set_level(DEVICE_3, ON);
-        gpio_set_level(DEVICE_4, ON);
-        Dev1_state = true;
-        Dev2_state = true;
-        Dev3_state = true;
-        Dev4_state = true;
+        relay_set_all(true);
         return 0;
       break;
       case ALL_OFF:
         ESP_LOGI("CMD_HMI","\nUART RX: cmd ALL_OFF");
-        gpio_set_level(DEVICE_1, OFF);
-        gpio_set_level(DEVICE_2, OFF);
-        gpio_set_level(DEVICE_3, OFF);
-        gpio_set_level(DEVICE_4, OFF);
-        Dev1_state = false;
-        Dev2_state = false;
-        Dev3_state = false;
-        Dev4_state = false;
+        relay_set_all(false);
         return 0;
       break;
       case UNKNOWN_CMD:
@@ -1,18 +1,35 @@
 static const int RX_BUFFER = 1024;
 static const int TX_BUFFER = 256;
-#include "demo_config.h"
+#define NEXTION_FIELD_LEN           16
+#define NEXTION_REFRESH_PERIOD_MS   CONFIG_NEXTION_REFRESH_PERIOD_MS
+#define NEXTION_FULL_REFRESH_MS     10000
+#define NEXTION_DEFAULT_BAUD        9600
+#define NEXTION_BAUD_RATE           CONFIG_NEXTION_BAUD_RATE
+#define NEXTION_PING_TIMEOUT_MS     100
+#define NEXTION_PING_RETRIES        3
+#define NEXTION_NVS_NAMESPACE       "nextion"
+#define NEXTION_NVS_BAUD_KEY        "baud"
+#define NEXTION_RX_TIMEOUT_MS       20
+#define NEXTION_RESP_QUEUE_LEN      8
+#define NEXTION_ADDT_MAX            1024
+#define NEXTION_ADDT_TIMEOUT_MS     100
 
-#define DEVICE_1    GPIO_NUM_26
-#define DEVICE_2    GPIO_NUM_27
-#define DEVICE_3    GPIO_NUM_32
-#define DEVICE_4    GPIO_NUM_33
-#define DEVICE_ALL  GPIO_NUM_25
+#define NEXTION_RET_SENDME              0x66
+#define NEXTION_RET_TRANSPARENT_END     0xFD
+#define NEXTION_RET_TRANSPARENT_READY   0xFE
+#include "demo_config.h"
 
 static const char *TX_TASK_TAG = "TX_TASK";
 static const char *RX_TASK_TAG = "RX_TASK";
 static const char *ESP_SOFT_RESET = "espreset";
 
-void nextion_main(param_t param);
+void nextion_main(void);
+void nextion_tx_task(void *param);
+void nextion_rx_task(void *arg);
+void nextion_invalidate(void);
+uint32_t nextion_negotiate_baud(void);
+int nextion_add_points(int id, int ch, const uint8_t *points, size_t count);
+void nextion_clear_channel(int id, int ch);
 int sendData(const char* logName, const char* data);
 void initNextion();
 int ParseCmd(char *text);
@@ -0,0 +1,457 @@
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "demo_config.h"
+#include "ota.h"
+#include "ota_config.h"
+#include "ota_os_freertos.h"
+#include "ota_mqtt_interface.h"
+#include "ota_pal.h"
+#include "uplink.h"
+#include "ota_agent.h"
+#if CONFIG_OTA_DATA_OVER_HTTP
+#include "ota_http.h"
+#endif
+#include "supervisor.h"
+
+static const char *OTA_TAG = "OTA_AGENT";
+
+#define OTA_THING_TOPIC             "$aws/things/" CLIENT_IDENTIFIER
+#define OTA_JOBS_TOPIC              OTA_THING_TOPIC "/jobs/"
+#define OTA_STREAMS_TOPIC           OTA_THING_TOPIC "/streams/"
+
+#define OTA_FILE_PATH_MAX           260
+#define OTA_STREAM_NAME_MAX         128
+/* ota_0 and ota_1 in partitions.csv; the bitmap has a bit per block of the largest image. */
+#define OTA_IMAGE_MAX               0x1E0000
+#define OTA_BITMAP_SIZE             ((OTA_IMAGE_MAX / otaconfigFILE_BLOCK_SIZE + 7) / 8)
+#define OTA_AUTH_SCHEME_MAX         64
+
+/* A file block arrives as one publish, topic and CBOR map included, which has
+ * to fit the MQTT network buffer. */
+#define OTA_BLOCK_OVERHEAD          256
+#if (1 << CONFIG_LOG2_FILE_BLOCK_SIZE) + OTA_BLOCK_OVERHEAD > CONFIG_MQTT_NETWORK_BUFFER_SIZE
+#error "OTA file blocks do not fit CONFIG_MQTT_NETWORK_BUFFER_SIZE, lower CONFIG_LOG2_FILE_BLOCK_SIZE"
+#endif
+
+/* Buffers the agent works in, handed over by OTA_Init(). */
+static uint8_t updateFilePath[OTA_FILE_PATH_MAX];
+static uint8_t certFilePath[OTA_FILE_PATH_MAX];
+static uint8_t streamName[OTA_STREAM_NAME_MAX];
+static uint8_t decodeMemory[otaconfigFILE_BLOCK_SIZE];
+static uint8_t fileBitmap[OTA_BITMAP_SIZE > OTA_MAX_BLOCK_BITMAP_SIZE ? OTA_BITMAP_SIZE : OTA_MAX_BLOCK_BITMAP_SIZE];
+#if CONFIG_OTA_DATA_OVER_HTTP
+static uint8_t fileUrl[OTA_HTTP_URL_MAX];
+static uint8_t authScheme[OTA_AUTH_SCHEME_MAX];
+#endif
+static OtaAppBuffer_t otaBuffer = {
+    .pUpdateFilePath = updateFilePath,
+    .updateFilePathsize = sizeof(updateFilePath),
+    .pCertFilePath = certFilePath,
+    .certFilePathSize = sizeof(certFilePath),
+    .pStreamName = streamName,
+    .streamNameSize = sizeof(streamName),
+    .pDecodeMemory = decodeMemory,
+    .decodeMemorySize = sizeof(decodeMemory),
+    .pFileBitmap = fileBitmap,
+    .fileBitmapSize = sizeof(fileBitmap),
+#if CONFIG_OTA_DATA_OVER_HTTP
+    .pUrl = fileUrl,
+    .urlSize = sizeof(fileUrl),
+    .pAuthScheme = authScheme,
+    .authSchemeSize = sizeof(authScheme),
+#endif
+};
+static OtaInterfaces_t interfaces;
+
+/* Incoming job documents and blocks, from the MQTT task to the agent, which
+ * gives each back with OtaJobEventProcessed. */
+static OtaEventData_t eventBuffers[otaconfigMAX_NUM_OTA_DATA_BUFFERS];
+static portMUX_TYPE bufferLock = portMUX_INITIALIZER_UNLOCKED;
+#if CONFIG_OTA_DATA_OVER_HTTP
+/* Which buffers hold a block from ota_http.c, told when it is processed. */
+static bool httpBlock[otaconfigMAX_NUM_OTA_DATA_BUFFERS];
+#endif
+
+static volatile bool linkUp = false;
+static volatile bool started = false;
+
+/* Statistics and the rate limit, touched by the MQTT task and the agent. */
+static portMUX_TYPE statsLock = portMUX_INITIALIZER_UNLOCKED;
+static ota_agent_stats_t stats;
+static int64_t budgetBytes = OTA_AGENT_BURST_BYTES;     // Negative once blocks came in faster than the rate
+static int64_t budgetUs = 0;
+static uplink_stats_t uplinkAtStart;
+
+static OtaEventData_t *bufferGet(void)
+{
+    OtaEventData_t *buffer = NULL;
+
+    portENTER_CRITICAL(&bufferLock);
+    for (int i = 0; i < otaconfigMAX_NUM_OTA_DATA_BUFFERS; i++) {
+        if (!eventBuffers[i].bufferUsed) {
+            eventBuffers[i].bufferUsed = true;
+            buffer = &eventBuffers[i];
+            break;
+        }
+    }
+    portEXIT_CRITICAL(&bufferLock);
+    return buffer;
+}
+
+static void bufferFree(OtaEventData_t *buffer)
+{
+    portENTER_CRITICAL(&bufferLock);
+    buffer->bufferUsed = false;
+    portEXIT_CRITICAL(&bufferLock);
+}
+
+/* Token bucket: the budget grows at the rate up to one request's worth of blocks.
+ * Call with statsLock held. */
+static void refill(int64_t nowUs)
+{
+    budgetBytes += (nowUs - budgetUs) * OTA_AGENT_MAX_RATE_BPS / 1000000;
+    if (budgetBytes > OTA_AGENT_BURST_BYTES) {
+        budgetBytes = OTA_AGENT_BURST_BYTES;
+    }
+    budgetUs = nowUs;
+}
+
+/* Hold a block request back until the blocks already received are paid for. */
+static void throttle(void)
+{
+    int64_t waitUs = 0;
+
+    if (OTA_AGENT_MAX_RATE_BPS == 0) {
+        return;
+    }
+    portENTER_CRITICAL(&statsLock);
+    refill(esp_timer_get_time());
+    if (budgetBytes < 0) {
+        waitUs = -budgetBytes * 1000000 / OTA_AGENT_MAX_RATE_BPS;
+        if (waitUs > OTA_AGENT_MAX_THROTTLE_MS * 1000) {
+            waitUs = OTA_AGENT_MAX_THROTTLE_MS * 1000;
+        }
+        stats.throttles++;
+        stats.throttledMs += waitUs / 1000;
+    }
+    portEXIT_CRITICAL(&statsLock);
+    if (waitUs > 0) {
+        vTaskDelay(pdMS_TO_TICKS(waitUs / 1000) + 1);
+    }
+}
+
+/* Log what the download achieved and what it cost telemetry: the average time
+ * telemetry waited for the MQTT task during the download against before it. */
+static void downloadDone(const char *outcome)
+{
+    uplink_stats_t uplink;
+    int64_t startUs, durationUs = 0;
+    uint32_t bytes, throttledMs;
+
+    portENTER_CRITICAL(&statsLock);
+    startUs = stats.downloadStartUs;
+    bytes = stats.bytes;
+    throttledMs = stats.throttledMs;
+    stats.downloadStartUs = 0;
+    if (startUs != 0) {
+        durationUs = esp_timer_get_time() - startUs;
+        stats.lastDownloadUs = durationUs;
+    }
+    portEXIT_CRITICAL(&statsLock);
+    if (startUs == 0) {
+        return;
+    }
+
+    uplink_get_stats(&uplink);
+    const uint32_t ms = durationUs / 1000;
+    const uint32_t during = uplink.telemetryTaken - uplinkAtStart.telemetryTaken;
+    const int64_t duringUs = uplink.telemetryWaitUs - uplinkAtStart.telemetryWaitUs;
+    ESP_LOGI(OTA_TAG, "Download %s: %u bytes in %u ms, %u B/s, %u ms throttled", outcome,
+             (unsigned)bytes, (unsigned)ms, (unsigned)(ms > 0 ? (uint64_t)bytes * 1000 / ms : 0),
+             (unsigned)throttledMs);
+    ESP_LOGI(OTA_TAG, "Telemetry waited %u ms on average during it (%u messages), %u ms before, longest wait so far %u ms",
+             (unsigned)(during > 0 ? duringUs / during / 1000 : 0), (unsigned)during,
+             (unsigned)(uplinkAtStart.telemetryTaken > 0
+                        ? uplinkAtStart.telemetryWaitUs / uplinkAtStart.telemetryTaken / 1000 : 0),
+             (unsigned)(uplink.maxTelemetryWaitUs / 1000));
+}
+
+static void otaAppCallback(OtaJobEvent_t event, void *pData)
+{
+    switch (event) {
+    case OtaJobEventActivate:
+        downloadDone("complete");
+        ESP_LOGI(OTA_TAG, "New image received, activating it");
+        // Resets the device unless activation fails
+        OTA_ActivateNewImage();
+        ESP_LOGE(OTA_TAG, "New image could not be activated");
+        break;
+
+    case OtaJobEventFail:
+        downloadDone("failed");
+        ESP_LOGW(OTA_TAG, "Update failed");
+        break;
+
+    case OtaJobEventStartTest:
+        // This image booted, connected to the broker and got its job back
+        ESP_LOGI(OTA_TAG, "New image running, accepting it");
+        if (OTA_SetImageState(OtaImageStateAccepted) != OtaErrNone) {
+            ESP_LOGE(OTA_TAG, "New image could not be accepted");
+        }
+        break;
+
+    case OtaJobEventProcessed:
+        if (pData != NULL) {
+            OtaEventData_t *buffer = pData;
+#if CONFIG_OTA_DATA_OVER_HTTP
+            const bool fromHttp = httpBlock[buffer - eventBuffers];
+            const size_t length = buffer->dataLength;
+
+            httpBlock[buffer - eventBuffers] = false;
+            bufferFree(buffer);
+            if (fromHttp) {
+                ota_http_block_processed(length);
+            }
+#else
+            bufferFree(buffer);
+#endif
+        }
+        break;
+
+    case OtaJobEventSelfTestFailed:
+        ESP_LOGE(OTA_TAG, "Self test of the new image failed");
+        break;
+
+    default:
+        break;
+    }
+}
+
+static OtaMqttStatus_t mqttSubscribe(const char *pTopicFilter, uint16_t topicFilterLength, uint8_t qos)
+{
+    return aws_mqtt_subscribe(pTopicFilter, topicFilterLength, qos) ? OtaMqttSuccess : OtaMqttSubscribeFailed;
+}
+
+static OtaMqttStatus_t mqttUnsubscribe(const char *pTopicFilter, uint16_t topicFilterLength, uint8_t qos)
+{
+    return aws_mqtt_unsubscribe(pTopicFilter, topicFilterLength, qos) ? OtaMqttSuccess : OtaMqttUnsubscribeFailed;
+}
+
+static bool hasPrefix(const char *topic, uint16_t topicLength, const char *prefix, size_t prefixLength)
+{
+    return topicLength >= prefixLength && memcmp(topic, prefix, prefixLength) == 0;
+}
+
+static OtaMqttStatus_t mqttPublish(const char *const pTopic, uint16_t topicLength, const char *pMsg,
+                                   uint32_t msgSize, uint8_t qos)
+{
+    // Block requests go to the stream, job status updates to the jobs topics
+    if (hasPrefix(pTopic, topicLength, OTA_STREAMS_TOPIC, sizeof(OTA_STREAMS_TOPIC) - 1)) {
+        throttle();
+    }
+    return aws_mqtt_publish(pTopic, topicLength, pMsg, msgSize, qos) ? OtaMqttSuccess : OtaMqttPublishFailed;
+}
+
+static void setInterfaces(OtaInterfaces_t *pInterfaces)
+{
+    pInterfaces->os.event.init = OtaInitEvent_FreeRTOS;
+    pInterfaces->os.event.send = OtaSendEvent_FreeRTOS;
+    pInterfaces->os.event.recv = OtaReceiveEvent_FreeRTOS;
+    pInterfaces->os.event.deinit = OtaDeinitEvent_FreeRTOS;
+    pInterfaces->os.timer.start = OtaStartTimer_FreeRTOS;
+    pInterfaces->os.timer.stop = OtaStopTimer_FreeRTOS;
+    pInterfaces->os.timer.delete = OtaDeleteTimer_FreeRTOS;
+    pInterfaces->os.mem.malloc = Malloc_FreeRTOS;
+    pInterfaces->os.mem.free = Free_FreeRTOS;
+    pInterfaces->mqtt.subscribe = mqttSubscribe;
+    pInterfaces->mqtt.publish = mqttPublish;
+    pInterfaces->mqtt.unsubscribe = mqttUnsubscribe;
+    pInterfaces->pal.getPlatformImageState = otaPal_GetPlatformImageState;
+    pInterfaces->pal.setPlatformImageState = otaPal_SetPlatformImageState;
+    pInterfaces->pal.writeBlock = otaPal_WriteBlock;
+    pInterfaces->pal.activate = otaPal_ActivateNewImage;
+    pInterfaces->pal.closeFile = otaPal_CloseFile;
+    pInterfaces->pal.reset = otaPal_ResetDevice;
+    pInterfaces->pal.abort = otaPal_Abort;
+    pInterfaces->pal.createFile = otaPal_CreateFileForRx;
+#if CONFIG_OTA_DATA_OVER_HTTP
+    pInterfaces->http.init = ota_http_begin;
+    pInterfaces->http.request = ota_http_request;
+    pInterfaces->http.deinit = ota_http_end;
+#endif
+}
+
+/*
+ * The OTA agent. It has no connection of its own: it starts once aws.c has
+ * the broker connection up and publishes and subscribes through it, while
+ * aws.c hands it the messages on the jobs and streams topics.
+ */
+void ota_agent_task(void *arg)
+{
+    (void)arg;
+
+    setInterfaces(&interfaces);
+    // The agent asks for its job as soon as it starts
+    while (!linkUp) {
+        vTaskDelay(pdMS_TO_TICKS(500));
+    }
+
+    const OtaErr_t err = OTA_Init(&otaBuffer, &interfaces, (const uint8_t *)CLIENT_IDENTIFIER, otaAppCallback);
+    if (err != OtaErrNone) {
+        ESP_LOGE(OTA_TAG, "OTA_Init failed: %s", OTA_Err_strerror(err));
+        supervisor_task_exit("OTA_Init failed");
+    }
+    started = true;
+    ESP_LOGI(OTA_TAG, "Agent started, rate limit %u B/s", (unsigned)OTA_AGENT_MAX_RATE_BPS);
+
+    // Runs until OTA_Shutdown()
+    OTA_EventProcessingTask(NULL);
+    supervisor_task_exit("OTA agent shut down");
+}
+
+/* The MQTT connection is up, the agent can (re)start talking. */
+void ota_agent_connected(void)
+{
+    linkUp = true;
+    if (started && OTA_GetState() == OtaAgentStateSuspended) {
+        OTA_Resume();
+    }
+}
+
+/* The MQTT connection is down; the agent stops its timers until it is back. */
+void ota_agent_disconnected(void)
+{
+    linkUp = false;
+    if (started && OTA_GetState() != OtaAgentStateStopped) {
+        OTA_Suspend();
+    }
+}
+
+/* A file block came in: download statistics, and the rate limit is charged for it. */
+static void countBlock(size_t length)
+{
+    const int64_t nowUs = esp_timer_get_time();
+    bool first;
+
+    portENTER_CRITICAL(&statsLock);
+    first = stats.downloadStartUs == 0;
+    if (first) {
+        stats.downloadStartUs = nowUs;
+        stats.bytes = 0;
+        stats.throttledMs = 0;
+        budgetBytes = OTA_AGENT_BURST_BYTES;
+        budgetUs = nowUs;
+    }
+    refill(nowUs);
+    budgetBytes -= length;
+    stats.blocks++;
+    stats.bytes += length;
+    portEXIT_CRITICAL(&statsLock);
+    if (first) {
+        uplink_get_stats(&uplinkAtStart);
+    }
+}
+
+/*
+ * Called by the MQTT task for every incoming publish. Takes the ones on the
+ * jobs and streams topics, copied into a free event buffer for the agent, and
+ * returns false for the others.
+ */
+bool ota_agent_handle_publish(const char *topic, uint16_t topicLength, const void *payload, size_t length)
+{
+    OtaEventMsg_t event = { 0 };
+    OtaEventData_t *buffer;
+
+    if (hasPrefix(topic, topicLength, OTA_STREAMS_TOPIC, sizeof(OTA_STREAMS_TOPIC) - 1)) {
+        event.eventId = OtaAgentEventReceivedFileBlock;
+    } else if (hasPrefix(topic, topicLength, OTA_JOBS_TOPIC, sizeof(OTA_JOBS_TOPIC) - 1)) {
+        event.eventId = OtaAgentEventReceivedJobDocument;
+    } else {
+        return false;
+    }
+
+    buffer = started && length <= sizeof(buffer->data) ? bufferGet() : NULL;
+    if (buffer == NULL) {
+        portENTER_CRITICAL(&statsLock);
+        stats.dropped++;
+        portEXIT_CRITICAL(&statsLock);
+        return true;
+    }
+    memcpy(buffer->data, payload, length);
+    buffer->dataLength = length;
+    event.pEventData = buffer;
+
+    if (event.eventId == OtaAgentEventReceivedFileBlock) {
+        countBlock(length);
+    } else {
+        portENTER_CRITICAL(&statsLock);
+        stats.jobDocuments++;
+        portEXIT_CRITICAL(&statsLock);
+    }
+
+    if (!OTA_SignalEvent(&event)) {
+        bufferFree(buffer);
+        portENTER_CRITICAL(&statsLock);
+        stats.dropped++;
+        portEXIT_CRITICAL(&statsLock);
+    }
+    return true;
+}
+
+#if CONFIG_OTA_DATA_OVER_HTTP
+/*
+ * Hand a file block fetched over HTTP to the agent. Blocks carry no number,
+ * the agent takes them as the next one, so one is only handed over while the
+ * agent waits for blocks and not dropped on the way; false means try again
+ * later.
+ */
+bool ota_agent_signal_block(const void *data, size_t length)
+{
+    OtaEventMsg_t event = { .eventId = OtaAgentEventReceivedFileBlock };
+    OtaEventData_t *buffer;
+
+    if (!started || length > sizeof(buffer->data) || OTA_GetState() != OtaAgentStateWaitingForFileBlock) {
+        return false;
+    }
+    buffer = bufferGet();
+    if (buffer == NULL) {
+        return false;
+    }
+    memcpy(buffer->data, data, length);
+    buffer->dataLength = length;
+    httpBlock[buffer - eventBuffers] = true;
+    event.pEventData = buffer;
+    if (!OTA_SignalEvent(&event)) {
+        httpBlock[buffer - eventBuffers] = false;
+        bufferFree(buffer);
+        return false;
+    }
+    countBlock(length);
+    return true;
+}
+#endif
+
+/* While blocks are being fetched the MQTT task should read them promptly.
+ * Over HTTP they do not come through it. */
+bool ota_agent_is_downloading(void)
+{
+#if CONFIG_OTA_DATA_OVER_HTTP
+    return false;
+#else
+    if (!started) {
+        return false;
+    }
+    const OtaState_t state = OTA_GetState();
+    return state == OtaAgentStateRequestingFileBlock || state == OtaAgentStateWaitingForFileBlock;
+#endif
+}
+
+void ota_agent_get_stats(ota_agent_stats_t *out)
+{
+    portENTER_CRITICAL(&statsLock);
+    *out = stats;
+    portEXIT_CRITICAL(&statsLock);
+}
@@ -0,0 +1,47 @@
+#ifndef OTA_AGENT_H
+#define OTA_AGENT_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "sdkconfig.h"
+
+/* Firmware download rate in bytes per second, 0 for no limit. Blocks are
+ * requested no faster than this so telemetry keeps its share of the link. */
+#define OTA_AGENT_MAX_RATE_BPS      (CONFIG_OTA_MAX_RATE_KBPS * 1024)
+/* The rate limit lets this many bytes through back to back. */
+#define OTA_AGENT_BURST_BYTES       (CONFIG_MAX_NUM_BLOCKS_REQUEST * (1UL << CONFIG_LOG2_FILE_BLOCK_SIZE))
+/* Longest the agent waits for the rate limit before requesting blocks. The
+ * agent's request timeout, otaconfigFILE_REQUEST_WAIT_MS, is this plus the
+ * time blocks take to come, so a held back request is not sent again. */
+#define OTA_AGENT_MAX_THROTTLE_MS   otaconfigFILE_REQUEST_THROTTLE_MS
+/* How long the MQTT task waits for uplink messages while a download runs,
+ * instead of MQTT_UPLINK_WAIT_MS, so blocks are read as they arrive. */
+#define OTA_AGENT_UPLINK_WAIT_MS    10
+
+typedef struct {
+    uint32_t jobDocuments;      // Job documents handed to the agent
+    uint32_t blocks;            // File blocks handed to the agent
+    uint32_t dropped;           // Messages dropped for want of a free buffer
+    uint32_t bytes;             // File block message bytes received
+    uint32_t throttles;         // Block requests held back by the rate limit
+    uint32_t throttledMs;
+    int64_t downloadStartUs;    // esp_timer time of the first block, 0 when idle
+    int64_t lastDownloadUs;     // Duration of the last complete download
+} ota_agent_stats_t;
+
+void ota_agent_task(void *arg);
+void ota_agent_connected(void);
+void ota_agent_disconnected(void);
+bool ota_agent_handle_publish(const char *topic, uint16_t topicLength, const void *payload, size_t length);
+bool ota_agent_is_downloading(void);
+bool ota_agent_signal_block(const void *data, size_t length);
+void ota_agent_get_stats(ota_agent_stats_t *stats);
+
+/* Provided by aws.c, which owns the MQTT connection: run one operation on it
+ * from another task. They fail while the connection is down. */
+bool aws_mqtt_publish(const char *topic, uint16_t topicLength, const void *payload, size_t length, uint8_t qos);
+bool aws_mqtt_subscribe(const char *topicFilter, uint16_t length, uint8_t qos);
+bool aws_mqtt_unsubscribe(const char *topicFilter, uint16_t length, uint8_t qos);
+
+#endif // OTA_AGENT_H
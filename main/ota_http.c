@@ -0,0 +1,526 @@
+/*
+ * OTA file blocks over HTTP, for jobs whose file comes from a URL (a presigned
+ * S3 URL) instead of an MQTT stream.
+ *
+ * The OTA library asks for one block at a time and numbers the blocks it gets
+ * in the order they come. Here a request starts a stream instead: the download
+ * task fetches the file from that block to the end in ranges of
+ * OTA_HTTP_RANGE_BYTES over one keep-alive connection, and the blocks are
+ * handed to the agent in order as its event buffers free up. There are two
+ * range buffers, so the next range is on its way while the blocks of the last
+ * one go to the agent. Requests the stream already answers are ignored; one
+ * for any other block restarts the stream there.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_tls.h"
+#include "core_http_client.h"
+#include "network_transport.h"
+#include "clock.h"
+#include "ota_agent.h"
+#include "ota_http.h"
+#include "credentials.h"
+
+#if CONFIG_OTA_DATA_OVER_HTTP
+
+static const char *HTTP_TAG = "OTA_HTTP";
+
+#define RANGE_BUFFER_SIZE   (OTA_HTTP_RESPONSE_HEAD_MAX + OTA_HTTP_RANGE_BYTES)
+#define HOST_MAX            128
+
+typedef enum {
+    CMD_NONE,
+    CMD_START,          // Stream from startOffset
+    CMD_STOP            // The transfer is over, close the connection and free the buffers
+} command_t;
+
+typedef struct {
+    uint8_t *buffer;            // The whole response, the body at the end
+    const uint8_t *body;        // Blocks not handed to the agent yet
+    uint32_t length;
+} range_t;
+
+typedef struct {
+    bool plain;                 // http:// rather than https://
+    char host[HOST_MAX];
+    int port;
+    const char *path;           // Into the URL, query string included
+} endpoint_t;
+
+/* Shared between the agent (requests, processed blocks) and the download
+ * task, under lock. */
+static SemaphoreHandle_t lock;
+static SemaphoreHandle_t wake;          // A command for the download task
+static SemaphoreHandle_t rangeFreed;    // All blocks of a range handed over, or the stream is stale
+static command_t command = CMD_NONE;
+static uint32_t generation;             // Bumped on every restart and stop, a stream checks it
+static uint32_t startOffset;
+static char pendingUrl[OTA_HTTP_URL_MAX];
+static bool urlChanged;
+static bool streaming;                  // A stream is running or has fetched the whole file
+static uint32_t streamStart;
+static uint32_t streamNext;             // File offset the stream fetches next
+static uint32_t handedUpTo;             // File offset of the next block for the agent
+static uint32_t inFlight;               // Bytes handed over the agent has not processed yet
+static range_t ranges[2];
+static int handOut;                     // Range whose blocks go to the agent next
+static ota_http_stats_t stats;
+
+/* Owned by the download task. */
+static char url[OTA_HTTP_URL_MAX];
+static endpoint_t endpoint;
+static uint8_t *requestHead;
+static NetworkContext_t network;
+static TransportInterface_t transport = {
+    .pNetworkContext = &network,
+    .send = espTlsTransportSend,
+    .recv = espTlsTransportRecv,
+};
+static bool connected;
+
+static bool parseUrl(const char *text, endpoint_t *ep)
+{
+    const char *p;
+    char *end;
+
+    if (strncmp(text, "https://", 8) == 0) {
+        ep->plain = false;
+        ep->port = 443;
+        p = text + 8;
+    } else if (strncmp(text, "http://", 7) == 0) {
+        ep->plain = true;
+        ep->port = 80;
+        p = text + 7;
+    } else {
+        return false;
+    }
+    const size_t hostLen = strcspn(p, ":/?");
+    if (hostLen == 0 || hostLen >= sizeof(ep->host)) {
+        return false;
+    }
+    memcpy(ep->host, p, hostLen);
+    ep->host[hostLen] = '\0';
+    p += hostLen;
+    if (*p == ':') {
+        ep->port = strtol(p + 1, &end, 10);
+        if (end == p + 1 || ep->port <= 0 || ep->port > 65535) {
+            return false;
+        }
+        p = end;
+    }
+    ep->path = *p == '/' ? p : "/";
+    return true;
+}
+
+static void closeConnection(void)
+{
+    if (connected) {
+        xTlsDisconnect(&network);
+        connected = false;
+    }
+}
+
+/* esp-tls without the TLS, for a local test server. */
+static bool connectPlain(void)
+{
+    esp_tls_cfg_t cfg = {
+        .is_plain_tcp = true,
+        .timeout_ms = OTA_HTTP_TIMEOUT_MS,
+    };
+    esp_tls_t *tls = esp_tls_init();
+
+    if (tls == NULL) {
+        return false;
+    }
+    xSemaphoreTake(network.xTlsContextSemaphore, portMAX_DELAY);
+    network.pxTls = tls;
+    xSemaphoreGive(network.xTlsContextSemaphore);
+    return esp_tls_conn_new_sync(endpoint.host, strlen(endpoint.host), endpoint.port, &cfg, tls) > 0;
+}
+
+static bool openConnection(void)
+{
+    network.pcHostname = endpoint.host;
+    network.xPort = endpoint.port;
+    network.pxTls = NULL;
+    network.disableSni = 0;
+    network.pAlpnProtos = NULL;
+    /* The MQTT connection's. S3 serves under Amazon Root CA 1 like the AWS IoT
+     * endpoint; the client certificate is only offered, S3 does not ask for it. */
+    credentials_apply_ca(&network);
+    credentials_apply_client(&network);
+
+    connected = endpoint.plain ? connectPlain() : xTlsConnect(&network) == TLS_TRANSPORT_SUCCESS;
+    xSemaphoreTake(lock, portMAX_DELAY);
+    stats.connects++;
+    xSemaphoreGive(lock);
+    if (!connected) {
+        // Frees what the failed attempt left behind
+        xTlsDisconnect(&network);
+        ESP_LOGW(HTTP_TAG, "Could not connect to %s:%d", endpoint.host, endpoint.port);
+    }
+    return connected;
+}
+
+/* "bytes first-last/total" for the range asked for. */
+static bool checkContentRange(const HTTPResponse_t *response, uint32_t offset, uint32_t *total)
+{
+    const char *value;
+    size_t valueLen;
+    char text[48];
+    unsigned long first, last, size;
+
+    if (HTTPClient_ReadHeader(response, "Content-Range", sizeof("Content-Range") - 1, &value, &valueLen) != HTTPSuccess ||
+        valueLen >= sizeof(text)) {
+        return false;
+    }
+    memcpy(text, value, valueLen);
+    text[valueLen] = '\0';
+    if (sscanf(text, "bytes %lu-%lu/%lu", &first, &last, &size) != 3 || first != offset ||
+        last - first + 1 != response->bodyLen || last >= size) {
+        return false;
+    }
+    *total = size;
+    return true;
+}
+
+/* One range into buffer over the kept-alive connection, reconnecting as needed.
+ * The body may be shorter than asked for near the end of the file. */
+static bool fetchRange(uint8_t *buffer, uint32_t offset, const uint8_t **body, uint32_t *length, uint32_t *total)
+{
+    const HTTPRequestInfo_t request = {
+        .pMethod = HTTP_METHOD_GET,
+        .methodLen = sizeof(HTTP_METHOD_GET) - 1,
+        .pPath = endpoint.path,
+        .pathLen = strlen(endpoint.path),
+        .pHost = endpoint.host,
+        .hostLen = strlen(endpoint.host),
+        .reqFlags = HTTP_REQUEST_KEEP_ALIVE_FLAG,
+    };
+
+    for (int attempt = 0; attempt < OTA_HTTP_ATTEMPTS; attempt++) {
+        HTTPRequestHeaders_t headers = { .pBuffer = requestHead, .bufferLen = OTA_HTTP_REQUEST_HEAD_MAX };
+        HTTPResponse_t response = { .pBuffer = buffer, .bufferLen = RANGE_BUFFER_SIZE, .getTime = Clock_GetTimeMs };
+        const int64_t startUs = esp_timer_get_time();
+
+        if (attempt > 0) {
+            vTaskDelay(pdMS_TO_TICKS(500 << attempt));
+        }
+        if (!connected && !openConnection()) {
+            continue;
+        }
+        HTTPStatus_t status = HTTPClient_InitializeRequestHeaders(&headers, &request);
+        if (status == HTTPSuccess) {
+            status = HTTPClient_AddRangeHeader(&headers, offset, offset + OTA_HTTP_RANGE_BYTES - 1);
+        }
+        if (status == HTTPSuccess) {
+            status = HTTPClient_Send(&transport, &headers, NULL, 0, &response, 0);
+        }
+        if (status != HTTPSuccess) {
+            ESP_LOGW(HTTP_TAG, "Range at %u: %s", (unsigned)offset, HTTPClient_strerror(status));
+            closeConnection();
+            continue;
+        }
+        if (response.statusCode != 206 || !checkContentRange(&response, offset, total)) {
+            // A 200 with the whole file would not have fit, so this is a refusal
+            ESP_LOGW(HTTP_TAG, "Range at %u: status %u, not the range asked for", (unsigned)offset,
+                     (unsigned)response.statusCode);
+            closeConnection();
+            continue;
+        }
+        if (response.respFlags & HTTP_RESPONSE_CONNECTION_CLOSE_FLAG) {
+            closeConnection();
+        }
+
+        const uint32_t ms = (esp_timer_get_time() - startUs) / 1000;
+        *body = response.pBody;
+        *length = response.bodyLen;
+        xSemaphoreTake(lock, portMAX_DELAY);
+        stats.ranges++;
+        stats.bytes += response.bodyLen;
+        if (ms > stats.maxRangeMs) {
+            stats.maxRangeMs = ms;
+        }
+        xSemaphoreGive(lock);
+        return true;
+    }
+    return false;
+}
+
+/* Hand the agent as many blocks as it takes, in file order. Called by the
+ * download task and, through ota_http_block_processed(), by the agent. */
+static void handOver(void)
+{
+    xSemaphoreTake(lock, portMAX_DELAY);
+    range_t *r = &ranges[handOut];
+    while (r->length > 0) {
+        const uint32_t n = r->length < OTA_HTTP_BLOCK_SIZE ? r->length : OTA_HTTP_BLOCK_SIZE;
+
+        if (!ota_agent_signal_block(r->body, n)) {
+            break;
+        }
+        r->body += n;
+        r->length -= n;
+        handedUpTo += n;
+        inFlight += n;
+        if (r->length == 0) {
+            handOut ^= 1;
+            r = &ranges[handOut];
+            xSemaphoreGive(rangeFreed);
+        }
+    }
+    xSemaphoreGive(lock);
+}
+
+/* Wait until the blocks in r have all been handed over. False if the stream
+ * was restarted or stopped meanwhile. */
+static bool waitForRange(const range_t *r, uint32_t gen)
+{
+    for (;;) {
+        xSemaphoreTake(lock, portMAX_DELAY);
+        const bool stale = generation != gen;
+        const bool free = r->length == 0;
+        xSemaphoreGive(lock);
+        if (stale) {
+            return false;
+        }
+        if (free) {
+            return true;
+        }
+        // The agent may have been busy or suspended when the last block was ready
+        handOver();
+        xSemaphoreTake(rangeFreed, pdMS_TO_TICKS(OTA_HTTP_POLL_MS));
+    }
+}
+
+static void stream(uint32_t offset, uint32_t gen)
+{
+    const uint32_t from = offset;
+    const int64_t startUs = esp_timer_get_time();
+    uint32_t size = 0, count = 0;
+    int fill = 0;
+
+    ESP_LOGI(HTTP_TAG, "Fetching from %u, %u byte ranges", (unsigned)offset, (unsigned)OTA_HTTP_RANGE_BYTES);
+    while (size == 0 || offset < size) {
+        range_t *r = &ranges[fill];
+        const uint8_t *body;
+        uint32_t length, total;
+
+        if (!waitForRange(r, gen)) {
+            return;
+        }
+        if (!fetchRange(r->buffer, offset, &body, &length, &total)) {
+            xSemaphoreTake(lock, portMAX_DELAY);
+            if (generation == gen) {
+                streaming = false;
+            }
+            stats.failures++;
+            xSemaphoreGive(lock);
+            ESP_LOGW(HTTP_TAG, "Giving up at %u until the agent asks again", (unsigned)offset);
+            return;
+        }
+        // Blocks are numbered by arrival, so a short range must end on a block boundary
+        if (offset + length < total) {
+            length -= length % OTA_HTTP_BLOCK_SIZE;
+        }
+
+        xSemaphoreTake(lock, portMAX_DELAY);
+        if (generation != gen) {
+            xSemaphoreGive(lock);
+            return;
+        }
+        r->body = body;
+        r->length = length;
+        streamNext = offset + length;
+        xSemaphoreGive(lock);
+        handOver();
+
+        offset += length;
+        size = total;
+        fill ^= 1;
+        count++;
+    }
+    ESP_LOGI(HTTP_TAG, "Fetched %u bytes in %u ranges, %u ms", (unsigned)(offset - from), (unsigned)count,
+             (unsigned)((esp_timer_get_time() - startUs) / 1000));
+    // Keep at it until the agent has taken the last block
+    if (waitForRange(&ranges[0], gen)) {
+        waitForRange(&ranges[1], gen);
+    }
+}
+
+static bool allocate(void)
+{
+    if (requestHead == NULL) {
+        requestHead = malloc(OTA_HTTP_REQUEST_HEAD_MAX);
+        ranges[0].buffer = malloc(RANGE_BUFFER_SIZE);
+        ranges[1].buffer = malloc(RANGE_BUFFER_SIZE);
+    }
+    if (requestHead == NULL || ranges[0].buffer == NULL || ranges[1].buffer == NULL) {
+        ESP_LOGE(HTTP_TAG, "No memory for two %u byte ranges", (unsigned)RANGE_BUFFER_SIZE);
+        return false;
+    }
+    return true;
+}
+
+static void release(void)
+{
+    closeConnection();
+    free(requestHead);
+    free(ranges[0].buffer);
+    free(ranges[1].buffer);
+    requestHead = NULL;
+    ranges[0].buffer = NULL;
+    ranges[1].buffer = NULL;
+}
+
+/*
+ * The download task: waits for the agent to ask for a block and streams the
+ * file from there. It keeps the connection and the range buffers until the
+ * transfer is over.
+ */
+void ota_http_task(void *arg)
+{
+    (void)arg;
+
+    for (;;) {
+        xSemaphoreTake(wake, portMAX_DELAY);
+
+        xSemaphoreTake(lock, portMAX_DELAY);
+        const command_t cmd = command;
+        const uint32_t gen = generation;
+        const uint32_t offset = startOffset;
+        const bool newUrl = urlChanged;
+        command = CMD_NONE;
+        urlChanged = false;
+        if (newUrl) {
+            memcpy(url, pendingUrl, sizeof(url));
+        }
+        xSemaphoreGive(lock);
+
+        if (cmd == CMD_STOP) {
+            release();
+            continue;
+        }
+        if (cmd != CMD_START) {
+            continue;
+        }
+        if (newUrl) {
+            closeConnection();
+            parseUrl(url, &endpoint);
+        }
+        if (allocate()) {
+            stream(offset, gen);
+        } else {
+            xSemaphoreTake(lock, portMAX_DELAY);
+            if (generation == gen) {
+                streaming = false;
+            }
+            xSemaphoreGive(lock);
+        }
+    }
+}
+
+/* Drop whatever the current stream has not handed over and post cmd. Call with lock held. */
+static void post(command_t cmd)
+{
+    generation++;
+    command = cmd;
+    ranges[0].length = 0;
+    ranges[1].length = 0;
+    handOut = 0;
+    xSemaphoreGive(rangeFreed);
+    xSemaphoreGive(wake);
+}
+
+void ota_http_init(void)
+{
+    lock = xSemaphoreCreateMutex();
+    wake = xSemaphoreCreateBinary();
+    rangeFreed = xSemaphoreCreateBinary();
+    network.xTlsContextSemaphore = xSemaphoreCreateMutex();
+}
+
+OtaHttpStatus_t ota_http_begin(char *fileUrl)
+{
+    const char *chosen = CONFIG_OTA_HTTP_URL_OVERRIDE[0] != '\0' ? CONFIG_OTA_HTTP_URL_OVERRIDE : fileUrl;
+    endpoint_t check;
+
+    if (chosen == NULL || strlen(chosen) >= sizeof(pendingUrl) || !parseUrl(chosen, &check)) {
+        ESP_LOGE(HTTP_TAG, "Cannot fetch from this URL");
+        return OtaHttpInitFailed;
+    }
+    xSemaphoreTake(lock, portMAX_DELAY);
+    strcpy(pendingUrl, chosen);
+    urlChanged = true;
+    streaming = false;
+    xSemaphoreGive(lock);
+    ESP_LOGI(HTTP_TAG, "File on %s:%d%s", check.host, check.port, chosen == fileUrl ? "" : ", URL overridden");
+    return OtaHttpSuccess;
+}
+
+/*
+ * The agent asks for the block at rangeStart. While the stream is consistent
+ * with the agent, what it has processed is what was handed over less what is
+ * still queued, and that is where it asks; the stream is already on it. Any
+ * other start means the agent lost blocks (it drops them while suspended),
+ * so the stream restarts there. rangeEnd is ignored, the stream runs to the
+ * end of the file.
+ */
+OtaHttpStatus_t ota_http_request(uint32_t rangeStart, uint32_t rangeEnd)
+{
+    (void)rangeEnd;
+
+    xSemaphoreTake(lock, portMAX_DELAY);
+    if (streaming && rangeStart == handedUpTo - inFlight && rangeStart >= streamStart && rangeStart <= streamNext) {
+        xSemaphoreGive(lock);
+        // Blocks may be waiting for an agent that had no room for them
+        handOver();
+        return OtaHttpSuccess;
+    }
+    if (streaming) {
+        stats.restarts++;
+        ESP_LOGW(HTTP_TAG, "Agent asks for %u, %u handed over and %u queued: restarting", (unsigned)rangeStart,
+                 (unsigned)handedUpTo, (unsigned)inFlight);
+    }
+    streaming = true;
+    streamStart = rangeStart;
+    streamNext = rangeStart;
+    handedUpTo = rangeStart;
+    startOffset = rangeStart;
+    post(CMD_START);
+    xSemaphoreGive(lock);
+    return OtaHttpSuccess;
+}
+
+OtaHttpStatus_t ota_http_end(void)
+{
+    xSemaphoreTake(lock, portMAX_DELAY);
+    streaming = false;
+    post(CMD_STOP);
+    xSemaphoreGive(lock);
+    return OtaHttpSuccess;
+}
+
+void ota_http_block_processed(size_t length)
+{
+    xSemaphoreTake(lock, portMAX_DELAY);
+    inFlight = length < inFlight ? inFlight - length : 0;
+    xSemaphoreGive(lock);
+    // That freed an event buffer, fill it
+    handOver();
+}
+
+void ota_http_get_stats(ota_http_stats_t *out)
+{
+    xSemaphoreTake(lock, portMAX_DELAY);
+    *out = stats;
+    xSemaphoreGive(lock);
+}
+
+#endif // CONFIG_OTA_DATA_OVER_HTTP
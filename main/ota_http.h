@@ -0,0 +1,47 @@
+#ifndef OTA_HTTP_H
+#define OTA_HTTP_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "sdkconfig.h"
+#include "ota_http_interface.h"
+
+#define OTA_HTTP_BLOCK_SIZE         (1UL << CONFIG_LOG2_FILE_BLOCK_SIZE)
+/* Bytes asked for per range request, rounded up to whole file blocks. */
+#define OTA_HTTP_RANGE_BYTES        ((CONFIG_OTA_HTTP_RANGE_KB * 1024UL + OTA_HTTP_BLOCK_SIZE - 1) / \
+                                     OTA_HTTP_BLOCK_SIZE * OTA_HTTP_BLOCK_SIZE)
+/* Room for the status line and headers of a response in front of its body. */
+#define OTA_HTTP_RESPONSE_HEAD_MAX  1024
+/* The request line carries the whole path, a presigned S3 URL with its query
+ * string runs well past 1 KB. */
+#define OTA_HTTP_URL_MAX            1600
+#define OTA_HTTP_REQUEST_HEAD_MAX   (OTA_HTTP_URL_MAX + 256)
+/* Attempts at a range, reconnecting in between, before the stream is given
+ * up until the agent asks again. */
+#define OTA_HTTP_ATTEMPTS           3
+#define OTA_HTTP_TIMEOUT_MS         5000
+/* How often the download task retries handing blocks to an agent that had
+ * no room for them. */
+#define OTA_HTTP_POLL_MS            100
+
+typedef struct {
+    uint32_t ranges;            // Range responses received
+    uint32_t bytes;             // Body bytes received
+    uint32_t connects;          // Connections opened
+    uint32_t failures;          // Streams given up after OTA_HTTP_ATTEMPTS
+    uint32_t restarts;          // Streams restarted at a block the agent asked for
+    uint32_t maxRangeMs;        // Longest range request, connecting included
+} ota_http_stats_t;
+
+void ota_http_init(void);
+void ota_http_task(void *arg);
+/* The OTA library's HTTP interface: a file transfer begins with the file's
+ * URL, the agent asks for blocks, the transfer ends. */
+OtaHttpStatus_t ota_http_begin(char *url);
+OtaHttpStatus_t ota_http_request(uint32_t rangeStart, uint32_t rangeEnd);
+OtaHttpStatus_t ota_http_end(void);
+/* The agent is done with a block handed over by ota_agent_signal_block(). */
+void ota_http_block_processed(size_t length);
+void ota_http_get_stats(ota_http_stats_t *stats);
+
+#endif // OTA_HTTP_H
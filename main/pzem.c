@@ -76,6 +76,20 @@ power_meansuare_t * meansures()
 	return &_currentValues;
 }
 
+/*!
+ * PZEM004Tv30::sampleMeansures
+ *
+ * Read all registers now, for callers that keep their own schedule
+ *
+ * @return measured values, NULL if the read failed
+*/
+power_meansuare_t * sampleMeansures()
+{
+    if(!readValues())
+        return NULL;
+    return &_currentValues;
+}
+
 float voltage()
 {
     if(!updateValues()) // Update vales if necessary
@@ -180,6 +194,9 @@ bool sendCmd8(uint8_t cmd, uint16_t rAddr, uint16_t val, bool check, uint16_t sl
 
     setCRC(sendBuffer, 8);                   // Set CRC of frame
 
+    // Drop whatever is left of an earlier late or broken reply, so the
+    // response read below really belongs to this request
+    uart_flush_input(_uart_data->uart_port);
 	uart_write_bytes(_uart_data->uart_port, (const char*)sendBuffer, 8);
     if(check) {
     	if(!recieve(respBuffer, 8)){ // if check enabled, read the response
@@ -308,20 +325,34 @@ uint64_t millis()
 */
 bool updateValues()
 {
-    //static uint8_t buffer[] = {0x00, CMD_RIR, 0x00, 0x00, 0x00, 0x0A, 0x00, 0x00};
-    static uint8_t response[25];
-
     // If we read before the update time limit, do not update
     if(_lastRead + UPDATE_TIME > millis()){
         return true;
     }
 
+    return readValues();
+}
+
+/*!
+ * PZEM004Tv30::readValues
+ *
+ * Read all registers of device and update the local values, the
+ * timestamp is taken as soon as the response frame is complete
+ *
+ * @return success
+*/
+bool readValues()
+{
+    //static uint8_t buffer[] = {0x00, CMD_RIR, 0x00, 0x00, 0x00, 0x0A, 0x00, 0x00};
+    static uint8_t response[25];
+
     // Read 10 registers starting at 0x00 (no check)
     sendCmd8(CMD_RIR, 0x00, 0x0A, false,0xFFFF);
 
     if(recieve(response, 25) != 25){ // Something went wrong
         return false;
     }
+    _currentValues.timestamp = esp_timer_get_time();
     // Update the current values
     _currentValues.voltage = ((uint32_t)response[3] << 8 | // Raw voltage in 0.1V
                               (uint32_t)response[4])/10.0;
@@ -336,10 +367,11 @@ bool updateValues()
                               (uint32_t)response[11] << 24 |
                               (uint32_t)response[12] << 16) / 10.0;
 
-    _currentValues.energy =  ((uint32_t)response[13] << 8 | // Raw Energy in 1Wh
+    _currentValues.energyWh = (uint32_t)response[13] << 8 | // Raw Energy in 1Wh
                               (uint32_t)response[14] |
                               (uint32_t)response[15] << 24 |
-                              (uint32_t)response[16] << 16) / 1000.0;
+                              (uint32_t)response[16] << 16;
+    _currentValues.energy = _currentValues.energyWh / 1000.0;
 
     _currentValues.frequency =((uint32_t)response[17] << 8 | // Raw Frequency in 0.1Hz
                               (uint32_t)response[18]) / 10.0;
@@ -371,6 +403,7 @@ bool resetEnergy(){
     buffer[0] = _addr;
 
     setCRC(buffer, 4);
+    uart_flush_input(_uart_data->uart_port);
 // #ifdef CONFIG_IDF_TARGET_ESP32
     uart_write_bytes(_uart_data->uart_port, (const char*)buffer , 4);
 // #else
@@ -400,18 +433,18 @@ bool resetEnergy(){
 */
 uint16_t recieve(uint8_t *resp, uint16_t len)
 {
-    unsigned long startTime = millis(); // Start time for Timeout
-    uint8_t index = 0; // Bytes we have read
+    uint64_t startTime = millis(); // Start time for Timeout
+    uint16_t index = 0; // Bytes we have read
     while((index < len) && (millis() - startTime < READ_TIMEOUT))
     {
-    	uint8_t* c = (uint8_t*) malloc(1);
-    	int length = uart_read_bytes(_uart_data->uart_port, c, 1, READ_TIMEOUT / portTICK_RATE_MS);
+        // Block for the rest of the frame, the driver returns as soon as it is complete
+        TickType_t ticks = (READ_TIMEOUT - (millis() - startTime)) / portTICK_RATE_MS;
+        int length = uart_read_bytes(_uart_data->uart_port, resp + index, len - index, ticks > 0 ? ticks : 1);
 
 		if (length > 0)
 		{
-			resp[index++] = *c;
+			index += length;
 		}
-		taskYIELD();	// do background netw tasks while blocked for IO (prevents ESP watchdog trigger)
     }
 
     // Check CRC with the number of bytes read
@@ -25,11 +25,15 @@ typedef struct {
     float frequency;
     float pf;
     uint16_t alarms;
+    uint32_t energyWh;  // Raw meter energy counter in Wh, energy is the same in kWh
+    uint64_t totalWh;   // Ledger total in Wh, set by the sampler, which then makes energy the same in kWh
+    int64_t timestamp;  // esp_timer time in us when the response frame completed
 } power_meansuare_t; // Measured values
 
     void PZEM004Tv30_Init(uart_data_t *uart_data, uint8_t addr);
 
     power_meansuare_t* meansures();
+    power_meansuare_t* sampleMeansures(); // Read now, ignoring UPDATE_TIME
     float voltage();
     float current();
     float power();
@@ -51,6 +55,7 @@ typedef struct {
     void init(uint8_t addr); // Init common to all constructors
 
     bool updateValues();    // Get most up to date values from device registers and cache them
+    bool readValues();      // Unconditionally read the device registers
     uint16_t recieve(uint8_t *resp, uint16_t len); // Receive len bytes into a buffer
 
     bool sendCmd8(uint8_t cmd, uint16_t rAddr, uint16_t val, bool check, uint16_t slave_addr); // Send 8 byte command
@@ -0,0 +1,96 @@
+#include "freertos/FreeRTOS.h"
+#include "esp_timer.h"
+#include "esp_log.h"
+#include "relay.h"
+#include "device_shadow.h"
+
+static const char *RELAY_TAG = "relay";
+
+static const gpio_num_t relayPins[RELAY_CHANNELS] = {
+    DEVICE_1, DEVICE_2, DEVICE_3, DEVICE_4,
+};
+
+// Bit n set while channel n is energized, the only copy of the relay state
+static uint8_t relayMask = 0;
+static relay_change_t relayChanges[RELAY_CHANNELS];
+static portMUX_TYPE relayLock = portMUX_INITIALIZER_UNLOCKED;
+
+/* Configure the relay outputs, every load starts switched off. */
+void relay_init(void)
+{
+    gpio_config_t config = {
+        .mode = GPIO_MODE_OUTPUT,
+        .pull_up_en = GPIO_PULLUP_DISABLE,
+        .pull_down_en = GPIO_PULLDOWN_DISABLE,
+        .intr_type = GPIO_INTR_DISABLE,
+    };
+
+    for (int i = 0; i < RELAY_CHANNELS; i++) {
+        config.pin_bit_mask |= 1ULL << relayPins[i];
+        gpio_set_level(relayPins[i], RELAY_LEVEL_OFF);
+    }
+    gpio_config(&config);
+}
+
+void relay_set(int channel, bool on)
+{
+    if (channel < 0 || channel >= RELAY_CHANNELS) {
+        ESP_LOGW(RELAY_TAG, "No relay channel %d", channel);
+        return;
+    }
+    const int64_t now = esp_timer_get_time();
+    bool switched;
+
+    portENTER_CRITICAL(&relayLock);
+    switched = (bool)((relayMask >> channel) & 1) != on;
+    if (switched) {
+        relayChanges[channel].count++;
+        relayChanges[channel].timeUs = now;
+    }
+    if (on) {
+        relayMask |= 1U << channel;
+    } else {
+        relayMask &= ~(1U << channel);
+    }
+    portEXIT_CRITICAL(&relayLock);
+    gpio_set_level(relayPins[channel], on ? RELAY_LEVEL_ON : RELAY_LEVEL_OFF);
+    if (switched) {
+        device_shadow_notify();
+    }
+}
+
+void relay_set_all(bool on)
+{
+    for (int i = 0; i < RELAY_CHANNELS; i++) {
+        relay_set(i, on);
+    }
+}
+
+bool relay_is_on(int channel)
+{
+    return (relay_get_mask() >> channel) & 1;
+}
+
+uint8_t relay_get_mask(void)
+{
+    uint8_t mask;
+
+    portENTER_CRITICAL(&relayLock);
+    mask = relayMask;
+    portEXIT_CRITICAL(&relayLock);
+    return mask;
+}
+
+/* Copy the switching history and return the current state with it. */
+uint8_t relay_get_changes(relay_change_t changes[RELAY_CHANNELS])
+{
+    uint8_t mask;
+
+    portENTER_CRITICAL(&relayLock);
+    mask = relayMask;
+    for (int i = 0; i < RELAY_CHANNELS; i++) {
+        changes[i] = relayChanges[i];
+    }
+    portEXIT_CRITICAL(&relayLock);
+    return mask;
+}
@@ -0,0 +1,35 @@
+#ifndef RELAY_H
+#define RELAY_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "driver/gpio.h"
+
+/* The four switched load circuits, DEVICE_1..DEVICE_4 on the HMI. */
+#define DEVICE_1            GPIO_NUM_26
+#define DEVICE_2            GPIO_NUM_27
+#define DEVICE_3            GPIO_NUM_32
+#define DEVICE_4            GPIO_NUM_33
+#define DEVICE_ALL          GPIO_NUM_25
+
+#define RELAY_CHANNELS      4
+#define RELAY_ALL_MASK      ((1U << RELAY_CHANNELS) - 1)
+
+/* The relay board is active low. */
+#define RELAY_LEVEL_ON      0
+#define RELAY_LEVEL_OFF     1
+
+/* Last switching of a channel, for consumers that correlate it with power. */
+typedef struct {
+    uint32_t count;         // Times the channel changed state since boot
+    int64_t timeUs;         // esp_timer time of the last change
+} relay_change_t;
+
+void relay_init(void);
+void relay_set(int channel, bool on);
+void relay_set_all(bool on);
+bool relay_is_on(int channel);
+uint8_t relay_get_mask(void);
+uint8_t relay_get_changes(relay_change_t changes[RELAY_CHANNELS]);
+
+#endif // RELAY_H
@@ -0,0 +1,154 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_timer.h"
+#include "esp_log.h"
+#include "driver/uart.h"
+#include "driver/gpio.h"
+#include "demo_config.h"
+#include "pzem.h"
+#include "trend.h"
+#include "aggregate.h"
+#include "ledger.h"
+#include "events.h"
+#include "disagg.h"
+#include "shed.h"
+#include "flicker.h"
+#include "sampler.h"
+
+static const char *SAMPLER_TAG = "TAG_PZEM004T";
+
+extern param_t param;
+
+static TaskHandle_t samplerHandle = NULL;
+static sampler_stats_t stats;
+static portMUX_TYPE statsLock = portMUX_INITIALIZER_UNLOCKED;
+static int64_t tickTime = 0;
+static int64_t lastTimestamp = 0;      // Of the last sample, 0 when the next one starts afresh
+static int64_t jitterMean64 = 0;       // Mean jitter times 64, keeps the fraction an int64 mean would lose
+
+/*
+ * Periodic esp_timer callback. The timer runs off the hardware timer with
+ * microsecond resolution and a fixed schedule, so the period does not depend
+ * on the RTOS tick nor on how long a read or the logging took.
+ */
+static void samplerTick(void *arg)
+{
+    tickTime = esp_timer_get_time();
+    xTaskNotifyGive(samplerHandle);
+}
+
+/* Call with statsLock held. */
+static void updateStats(int64_t wakeLatency, int64_t timestamp)
+{
+    if (wakeLatency > stats.maxWakeLatencyUs) {
+        stats.maxWakeLatencyUs = wakeLatency;
+    }
+    if (lastTimestamp != 0) {
+        stats.lastPeriodUs = timestamp - lastTimestamp;
+        int64_t jitter = llabs(stats.lastPeriodUs - (int64_t)SAMPLER_PERIOD_MS * 1000);
+        if (jitter > stats.maxJitterUs) {
+            stats.maxJitterUs = jitter;
+        }
+        // Exponential mean over roughly the last 64 periods
+        jitterMean64 += jitter - jitterMean64 / 64;
+        stats.meanJitterUs = jitterMean64 / 64;
+    }
+    lastTimestamp = timestamp;
+}
+
+void sampler_get_stats(sampler_stats_t *out)
+{
+    portENTER_CRITICAL(&statsLock);
+    *out = stats;
+    portEXIT_CRITICAL(&statsLock);
+}
+
+/*
+ * Hand a fresh sample to everything that consumes the measurement stream.
+ * Downstream the energy is the ledger total, not the meter counter, so it
+ * never goes backwards when the meter is reset or wraps.
+ */
+static void publishSample(const power_meansuare_t *m)
+{
+    power_meansuare_t sample = *m;
+
+    // First, the load controller preempts this task and acts on the sample right away
+    shed_add_sample(m);
+    sample.totalWh = ledger_add_sample(m);
+    sample.energy = sample.totalWh / 1000.0;
+    param.voltage = sample.voltage;
+    param.current = sample.current;
+    param.power = sample.power;
+    param.energy = sample.energy;
+    param.frequency = sample.frequency;
+    param.pf = sample.pf;
+    trend_add_sample(sample.power, sample.voltage);
+    flicker_add_sample(sample.voltage);
+    aggregate_add_sample(&sample);
+    events_add_sample(&sample);
+    disagg_add_sample(&sample);
+}
+
+void sampler_task(void *arg)
+{
+    uart_data_t uart_data = {
+        .uart_port = UART_NUM_1,
+        .tx_io_num = GPIO_NUM_4,
+        .rx_io_num = GPIO_NUM_5,
+    };
+    PZEM004Tv30_Init(&uart_data, PZEM_DEFAULT_ADDR);
+
+    while (1) {
+        ESP_LOGI(SAMPLER_TAG, "Set address to %#.2x", SAMPLER_PZEM_ADDR);
+        setAddress(SAMPLER_PZEM_ADDR);
+        if (getAddress() == SAMPLER_PZEM_ADDR) {
+            ESP_LOGI(SAMPLER_TAG, "New Address %#.2x", getAddress());
+            break;
+        }
+        ESP_LOGI(SAMPLER_TAG, "Error to set New Address");
+        vTaskDelay(1000 / portTICK_PERIOD_MS);
+    }
+
+    // The meter counter is never reset, the ledger follows it across reboots
+    ledger_init();
+    disagg_init();
+
+    samplerHandle = xTaskGetCurrentTaskHandle();
+    const esp_timer_create_args_t timerArgs = {
+        .callback = samplerTick,
+        .name = "sampler",
+    };
+    esp_timer_handle_t timer;
+    ESP_ERROR_CHECK(esp_timer_create(&timerArgs, &timer));
+    ESP_ERROR_CHECK(esp_timer_start_periodic(timer, (uint64_t)SAMPLER_PERIOD_MS * 1000));
+
+    while (1) {
+        // More than one pending tick means the previous read overran its period
+        const uint32_t ticks = ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        const int64_t wakeLatency = esp_timer_get_time() - tickTime;
+
+        power_meansuare_t *m = sampleMeansures();
+        portENTER_CRITICAL(&statsLock);
+        if (ticks > 1) {
+            stats.overruns += ticks - 1;
+        }
+        if (m == NULL) {
+            stats.errors++;
+            // The next period spans the failed read, it says nothing about the timer
+            lastTimestamp = 0;
+        } else {
+            stats.samples++;
+            updateStats(wakeLatency, m->timestamp);
+        }
+        portEXIT_CRITICAL(&statsLock);
+        if (m == NULL) {
+            continue;
+        }
+        publishSample(m);
+
+        ESP_LOGD(SAMPLER_TAG, "U %.1f V, I %.3f A, P %.1f W, E %.3f kWh, F %.1f Hz, PF %.2f",
+                 m->voltage, m->current, m->power, m->energy, m->frequency, m->pf);
+    }
+}
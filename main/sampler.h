@@ -0,0 +1,24 @@
+#ifndef SAMPLER_H
+#define SAMPLER_H
+
+#include <stdint.h>
+#include "sdkconfig.h"
+#include "pzem.h"
+
+#define SAMPLER_PERIOD_MS       CONFIG_PZEM_SAMPLE_PERIOD_MS
+#define SAMPLER_PZEM_ADDR       0x42
+
+typedef struct {
+    uint32_t samples;           // Successful reads
+    uint32_t errors;            // Reads that failed (timeout, CRC)
+    uint32_t overruns;          // Periods skipped because a read took too long
+    int64_t lastPeriodUs;       // Time between the last two frame completions
+    int64_t maxJitterUs;        // Largest |period - nominal| seen
+    int64_t meanJitterUs;       // Running mean of |period - nominal|
+    int64_t maxWakeLatencyUs;   // Largest delay between timer tick and read start
+} sampler_stats_t;
+
+void sampler_task(void *arg);
+void sampler_get_stats(sampler_stats_t *stats);
+
+#endif // SAMPLER_H
@@ -0,0 +1,230 @@
+#include <stdio.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "esp_timer.h"
+#include "esp_log.h"
+#include "sampler.h"
+#include "relay.h"
+#include "disagg.h"
+#include "uplink.h"
+#include "timesync.h"
+#include "device_shadow.h"
+#include "shed.h"
+
+static const char *SHED_TAG = "SHED";
+
+/* What the controller needs from a sample, passed through a one slot mailbox. */
+typedef struct {
+    float power;
+    int64_t timestamp;
+} shed_sample_t;
+
+static StaticQueue_t mailboxBuffer;
+static uint8_t mailboxStorage[sizeof(shed_sample_t)];
+static QueueHandle_t mailbox = NULL;
+
+static float capW = SHED_POWER_CAP_W;
+static portMUX_TYPE capLock = portMUX_INITIALIZER_UNLOCKED;
+
+static int order[RELAY_CHANNELS];
+static int orderCount = 0;
+static uint8_t shedMask = 0;        // Channels this controller switched off
+static int64_t overSince = 0;
+static int64_t underSince = 0;
+static shed_stats_t stats;
+static portMUX_TYPE statsLock = portMUX_INITIALIZER_UNLOCKED;
+static char payload[UPLINK_PAYLOAD_MAX];
+
+/* Channels of SHED_ORDER, each once; all channels from the last one down if it is unusable. */
+static void parseOrder(void)
+{
+    uint8_t used = 0;
+
+    for (const char *p = SHED_ORDER; *p != '\0' && orderCount < RELAY_CHANNELS; p++) {
+        const int channel = *p - '1';
+        if (channel >= 0 && channel < RELAY_CHANNELS && !(used & (1U << channel))) {
+            used |= 1U << channel;
+            order[orderCount++] = channel;
+        }
+    }
+    if (orderCount == 0) {
+        ESP_LOGW(SHED_TAG, "Shed order \"%s\" unusable, shedding channel 4 first", SHED_ORDER);
+        for (int i = RELAY_CHANNELS - 1; i >= 0; i--) {
+            order[orderCount++] = i;
+        }
+    }
+}
+
+/* Learned draw of a channel, 0 while it is unknown. */
+static float channelDraw(int channel)
+{
+    static disagg_state_t model;
+
+    disagg_get_state(&model);
+    return model.model[channel].steps > 0 ? model.model[channel].nominalW : 0;
+}
+
+/*
+ * One control step. Over the cap for SHED_DEBOUNCE_MS sheds the next channel
+ * in order that is on; the debounce then starts over so the meter can show
+ * the effect before another channel goes. The last channel shed comes back
+ * once power plus its draw has stayed SHED_HYSTERESIS_W under the cap for
+ * SHED_RESTORE_DELAY_S. Returns the channel switched, or -1.
+ */
+static int decide(const shed_sample_t *s, float cap, bool *on)
+{
+    const uint8_t mask = relay_get_mask();
+
+    // A shed channel switched back on by hand belongs to the user again
+    shedMask &= ~mask;
+
+    if (cap > 0 && s->power > cap) {
+        underSince = 0;
+        if (overSince == 0) {
+            overSince = s->timestamp;
+        }
+        if (s->timestamp - overSince < (int64_t)SHED_DEBOUNCE_MS * 1000) {
+            return -1;
+        }
+        overSince = s->timestamp;
+        for (int i = 0; i < orderCount; i++) {
+            const int channel = order[i];
+            if (mask & (1U << channel)) {
+                relay_set(channel, false);
+                shedMask |= 1U << channel;
+                *on = false;
+                return channel;
+            }
+        }
+        return -1;
+    }
+
+    overSince = 0;
+    for (int i = orderCount - 1; i >= 0; i--) {
+        const int channel = order[i];
+        if (!(shedMask & (1U << channel))) {
+            continue;
+        }
+        // No cap any more, or room for the channel: restore after the delay
+        if (cap <= 0 || s->power + channelDraw(channel) < cap - SHED_HYSTERESIS_W) {
+            if (underSince == 0) {
+                underSince = s->timestamp;
+            }
+            if (s->timestamp - underSince >= (int64_t)SHED_RESTORE_DELAY_S * 1000000) {
+                underSince = s->timestamp;
+                relay_set(channel, true);
+                shedMask &= ~(1U << channel);
+                *on = true;
+                return channel;
+            }
+        } else {
+            underSince = 0;
+        }
+        return -1;
+    }
+    underSince = 0;
+    return -1;
+}
+
+static void publishAction(int channel, bool on, const shed_sample_t *s, float cap, int64_t latency)
+{
+    const int len = snprintf(payload, sizeof(payload),
+                             "{\"event\":\"shed\",\"state\":\"%s\",\"channel\":%d,\"t_ms\":%lld,"
+                             "\"power_w\":%.1f,\"cap_w\":%.0f,\"latency_us\":%lld}",
+                             on ? "restore" : "shed", channel + 1, (long long)timesync_epoch_ms(s->timestamp),
+                             s->power, cap, (long long)latency);
+
+    ESP_LOGI(SHED_TAG, "%s", payload);
+    if (len > 0 && (size_t)len < sizeof(payload)) {
+        uplink_send(UPLINK_EVENT, payload, len);
+    }
+}
+
+/*
+ * Controller task. It runs above the sampler, so it takes over as soon as a
+ * sample is posted and the time from the meter frame to the GPIO write is
+ * only the decision itself; it is measured and must stay under a period.
+ */
+void shed_task(void *arg)
+{
+    shed_sample_t s;
+
+    parseOrder();
+    mailbox = xQueueCreateStatic(1, sizeof(shed_sample_t), mailboxStorage, &mailboxBuffer);
+
+    while (1) {
+        if (xQueueReceive(mailbox, &s, portMAX_DELAY) != pdTRUE) {
+            continue;
+        }
+        const float cap = shed_get_cap();
+        bool on = false;
+        const int channel = decide(&s, cap, &on);
+        const int64_t latency = esp_timer_get_time() - s.timestamp;
+
+        const bool overBudget = latency > (int64_t)SAMPLER_PERIOD_MS * 1000;
+
+        portENTER_CRITICAL(&statsLock);
+        stats.decisions++;
+        stats.lastLatencyUs = latency;
+        if (latency > stats.maxLatencyUs) {
+            stats.maxLatencyUs = latency;
+        }
+        if (overBudget) {
+            stats.overBudget++;
+        }
+        if (channel >= 0) {
+            if (on) {
+                stats.restores++;
+            } else {
+                stats.sheds++;
+            }
+        }
+        portEXIT_CRITICAL(&statsLock);
+
+        if (overBudget) {
+            ESP_LOGW(SHED_TAG, "Decision took %lld us, more than a sample period", (long long)latency);
+        }
+        if (channel >= 0) {
+            publishAction(channel, on, &s, cap, latency);
+        }
+    }
+}
+
+/* Hand a sample to the controller, from the sampler task. Never blocks, a
+ * sample the controller has not taken yet is replaced by the newer one. */
+void shed_add_sample(const power_meansuare_t *m)
+{
+    const shed_sample_t s = { .power = m->power, .timestamp = m->timestamp };
+
+    if (mailbox != NULL) {
+        xQueueOverwrite(mailbox, &s);
+    }
+}
+
+/* Change the cap at run time, e.g. on a demand-response signal. Not stored,
+ * SHED_POWER_CAP_W applies again after a reboot. */
+void shed_set_cap(float newCapW)
+{
+    portENTER_CRITICAL(&capLock);
+    capW = newCapW;
+    portEXIT_CRITICAL(&capLock);
+    ESP_LOGI(SHED_TAG, "Power cap %.0f W", newCapW);
+    device_shadow_notify();
+}
+
+float shed_get_cap(void)
+{
+    float cap;
+
+    portENTER_CRITICAL(&capLock);
+    cap = capW;
+    portEXIT_CRITICAL(&capLock);
+    return cap;
+}
+
+void shed_get_stats(shed_stats_t *out)
+{
+    portENTER_CRITICAL(&statsLock);
+    *out = stats;
+    portEXIT_CRITICAL(&statsLock);
+}
@@ -0,0 +1,35 @@
+#ifndef SHED_H
+#define SHED_H
+
+#include <stdint.h>
+#include "sdkconfig.h"
+#include "pzem.h"
+
+/* Site power cap in watts, 0 disables load shedding. */
+#define SHED_POWER_CAP_W        CONFIG_SHED_POWER_CAP_W
+/* Power must stay this far under the cap, with the channel's learned draw
+ * added, before a shed channel is switched back on. */
+#define SHED_HYSTERESIS_W       CONFIG_SHED_HYSTERESIS_W
+/* Time over the cap before a channel is shed, and between two sheds. */
+#define SHED_DEBOUNCE_MS        CONFIG_SHED_DEBOUNCE_MS
+/* Time under the cap before a shed channel is restored. */
+#define SHED_RESTORE_DELAY_S    CONFIG_SHED_RESTORE_DELAY_S
+/* Channels in the order they are shed, e.g. "4321"; restored in reverse. */
+#define SHED_ORDER              CONFIG_SHED_ORDER
+
+typedef struct {
+    uint32_t decisions;         // Samples evaluated
+    uint32_t sheds;             // Channels switched off
+    uint32_t restores;          // Channels switched back on
+    uint32_t overBudget;        // Decisions that took longer than a sample period
+    int64_t lastLatencyUs;      // Sample frame complete to decision done
+    int64_t maxLatencyUs;
+} shed_stats_t;
+
+void shed_task(void *arg);
+void shed_add_sample(const power_meansuare_t *m);
+void shed_set_cap(float capW);
+float shed_get_cap(void);
+void shed_get_stats(shed_stats_t *stats);
+
+#endif // SHED_H
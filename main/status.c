@@ -0,0 +1,67 @@
+/*
+ * The figures the modules measure about themselves, logged together by the
+ * supervisor every STATUS_LOG_PERIOD_S.
+ */
+#include "sdkconfig.h"
+#include "esp_log.h"
+#include "sampler.h"
+#include "shed.h"
+#include "timesync.h"
+#include "device_shadow.h"
+#include "trend.h"
+#if CONFIG_OTA_DATA_OVER_HTTP
+#include "ota_http.h"
+#endif
+#include "status.h"
+
+static const char *STATUS_TAG = "STATUS";
+
+void status_log(void)
+{
+    sampler_stats_t sampler;
+    shed_stats_t shed;
+    timesync_state_t time;
+    shadow_stats_t shadow;
+    trend_stats_t trend;
+#if CONFIG_OTA_DATA_OVER_HTTP
+    ota_http_stats_t http;
+#endif
+
+    sampler_get_stats(&sampler);
+    ESP_LOGI(STATUS_TAG, "Sampler: %u samples, %u errors, %u overruns, period %lld us, jitter mean %lld us, "
+             "max %lld us, wake latency max %lld us",
+             (unsigned)sampler.samples, (unsigned)sampler.errors, (unsigned)sampler.overruns,
+             (long long)sampler.lastPeriodUs, (long long)sampler.meanJitterUs, (long long)sampler.maxJitterUs,
+             (long long)sampler.maxWakeLatencyUs);
+
+    shed_get_stats(&shed);
+    ESP_LOGI(STATUS_TAG, "Shed: %u decisions, %u sheds, %u restores, %u over budget, latency %lld us, max %lld us",
+             (unsigned)shed.decisions, (unsigned)shed.sheds, (unsigned)shed.restores, (unsigned)shed.overBudget,
+             (long long)shed.lastLatencyUs, (long long)shed.maxLatencyUs);
+
+    timesync_get_state(&time);
+    ESP_LOGI(STATUS_TAG, "Time: %s, %u syncs, %u failures, %u steps, last at %lld s, offset %lld us, "
+             "delay %lld us, drift %d ppb",
+             time.synced ? "synced" : "not synced", (unsigned)time.syncs, (unsigned)time.failures,
+             (unsigned)time.steps, (long long)(time.lastSyncUs / 1000000),
+             (long long)time.lastOffsetUs, (long long)time.lastDelayUs, (int)time.driftPpb);
+
+    device_shadow_get_stats(&shadow);
+    ESP_LOGI(STATUS_TAG, "Shadow: %u changes, %u reports, %u accepted, %u rejected, %u timeouts, "
+             "%u deltas, %u stale, relays %u written, %u already set",
+             (unsigned)shadow.changes, (unsigned)shadow.reports, (unsigned)shadow.accepted,
+             (unsigned)shadow.rejected, (unsigned)shadow.timeouts, (unsigned)shadow.deltas,
+             (unsigned)shadow.staleDeltas, (unsigned)shadow.relayWrites, (unsigned)shadow.relaySkips);
+
+#if CONFIG_OTA_DATA_OVER_HTTP
+    ota_http_get_stats(&http);
+    ESP_LOGI(STATUS_TAG, "OTA HTTP: %u ranges, %u bytes, %u connects, %u failures, %u restarts, longest range %u ms",
+             (unsigned)http.ranges, (unsigned)http.bytes, (unsigned)http.connects, (unsigned)http.failures,
+             (unsigned)http.restarts, (unsigned)http.maxRangeMs);
+#endif
+
+    trend_get_stats(&trend);
+    ESP_LOGI(STATUS_TAG, "Trend: %u frames, %u bytes last, %u max, %lld us last, %lld us max, %u points dropped",
+             (unsigned)trend.frames, (unsigned)trend.lastBytes, (unsigned)trend.maxBytes,
+             (long long)trend.lastTimeUs, (long long)trend.maxTimeUs, (unsigned)trend.dropped);
+}
@@ -0,0 +1,12 @@
+#ifndef STATUS_H
+#define STATUS_H
+
+#include "sdkconfig.h"
+
+/* How often the supervisor logs the figures each module measures, 0 never. */
+#define STATUS_LOG_PERIOD_S     CONFIG_STATUS_LOG_PERIOD_S
+
+/* One INFO line per module with what it measured since boot. */
+void status_log(void);
+
+#endif // STATUS_H
@@ -0,0 +1,104 @@
+#include <stdio.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "esp_system.h"
+#include "esp_log.h"
+#include "status.h"
+#include "supervisor.h"
+
+static const char *SUPERVISOR_TAG = "SUPERVISOR";
+
+static supervisor_task_t *supervised = NULL;
+static size_t supervisedCount = 0;
+// Held while the table's handles are used, so a task cannot be deleted under the monitor
+static StaticSemaphore_t tableLockBuffer;
+static SemaphoreHandle_t tableLock = NULL;
+
+static StackType_t monitorStack[SUPERVISOR_STACK];
+static StaticTask_t monitorTcb;
+
+/* Track stack high-water marks and heap of everything started from the table,
+ * and log what the modules measured now and then. */
+static void supervisor_task(void *arg)
+{
+    uint32_t minHeap = esp_get_minimum_free_heap_size();
+    TickType_t lastStatus = xTaskGetTickCount();
+
+    while (1) {
+        xSemaphoreTake(tableLock, portMAX_DELAY);
+        for (size_t i = 0; i < supervisedCount; i++) {
+            supervisor_task_t *t = &supervised[i];
+            if (t->handle == NULL) {
+                continue;
+            }
+            const UBaseType_t free = uxTaskGetStackHighWaterMark(t->handle);
+            if (free < t->minFree) {
+                t->minFree = free;
+                if (free < SUPERVISOR_STACK_WARN) {
+                    ESP_LOGW(SUPERVISOR_TAG, "%s: only %u of %u stack bytes left",
+                             t->name, (unsigned)free, (unsigned)t->stackSize);
+                } else {
+                    ESP_LOGD(SUPERVISOR_TAG, "%s: %u of %u stack bytes left",
+                             t->name, (unsigned)free, (unsigned)t->stackSize);
+                }
+            }
+        }
+        xSemaphoreGive(tableLock);
+        if (esp_get_minimum_free_heap_size() < minHeap) {
+            minHeap = esp_get_minimum_free_heap_size();
+            ESP_LOGI(SUPERVISOR_TAG, "Free heap low water mark %u bytes", (unsigned)minHeap);
+        }
+        if (STATUS_LOG_PERIOD_S > 0
+            && xTaskGetTickCount() - lastStatus >= (TickType_t)STATUS_LOG_PERIOD_S * 1000 / portTICK_PERIOD_MS) {
+            lastStatus = xTaskGetTickCount();
+            status_log();
+        }
+        vTaskDelay(SUPERVISOR_PERIOD_MS / portTICK_PERIOD_MS);
+    }
+}
+
+/*
+ * Create every task of the table, in order, with static stacks pinned to the
+ * requested core, then start the monitor. The table must outlive the tasks.
+ */
+void supervisor_start(supervisor_task_t *tasks, size_t count)
+{
+    tableLock = xSemaphoreCreateMutexStatic(&tableLockBuffer);
+    supervised = tasks;
+    supervisedCount = count;
+
+    // A task that exits right away waits for its handle to be in the table
+    xSemaphoreTake(tableLock, portMAX_DELAY);
+    for (size_t i = 0; i < count; i++) {
+        supervisor_task_t *t = &tasks[i];
+        t->minFree = t->stackSize;
+        t->handle = xTaskCreateStaticPinnedToCore(t->entry, t->name, t->stackSize, t->arg,
+                                                  t->priority, t->stack, t->tcb, t->core);
+        ESP_LOGI(SUPERVISOR_TAG, "Started %s on core %d, priority %u, %u byte stack",
+                 t->name, (int)t->core, (unsigned)t->priority, (unsigned)t->stackSize);
+    }
+    xSemaphoreGive(tableLock);
+
+    xTaskCreateStaticPinnedToCore(supervisor_task, "supervisor", SUPERVISOR_STACK, NULL,
+                                  SUPERVISOR_PRIORITY, monitorStack, &monitorTcb, tskNO_AFFINITY);
+}
+
+/*
+ * End the calling task, which has given up. Its entry is cleared and the exit
+ * logged, so the monitor stops looking at it and the loss shows in the log.
+ */
+void supervisor_task_exit(const char *reason)
+{
+    const TaskHandle_t self = xTaskGetCurrentTaskHandle();
+
+    xSemaphoreTake(tableLock, portMAX_DELAY);
+    for (size_t i = 0; i < supervisedCount; i++) {
+        if (supervised[i].handle == self) {
+            supervised[i].handle = NULL;
+            ESP_LOGE(SUPERVISOR_TAG, "%s exited: %s", supervised[i].name, reason);
+        }
+    }
+    xSemaphoreGive(tableLock);
+    vTaskDelete(NULL);
+}
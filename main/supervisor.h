@@ -0,0 +1,56 @@
+#ifndef SUPERVISOR_H
+#define SUPERVISOR_H
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+/* Cores used for task placement. Wi-Fi and lwIP run on core 0, so the TLS/MQTT
+ * stack stays next to them and metering/HMI get core 1 to themselves. */
+#if CONFIG_FREERTOS_UNICORE
+#define NET_CORE        0
+#define METER_CORE      0
+#else
+#define NET_CORE        0
+#define METER_CORE      1
+#endif
+
+#define SUPERVISOR_PERIOD_MS        10000
+#define SUPERVISOR_STACK            2560
+#define SUPERVISOR_PRIORITY         1
+/* Warn when a task has less than this many stack bytes left. */
+#define SUPERVISOR_STACK_WARN       512
+
+typedef struct {
+    const char *name;
+    TaskFunction_t entry;
+    void *arg;
+    uint32_t stackSize;         // In bytes, like every stack size on ESP-IDF
+    UBaseType_t priority;
+    BaseType_t core;
+    StackType_t *stack;
+    StaticTask_t *tcb;
+    TaskHandle_t handle;
+    UBaseType_t minFree;        // Lowest stack high-water mark seen, in bytes
+} supervisor_task_t;
+
+/*
+ * Table entry with its own statically allocated stack and TCB, e.g.
+ *   SUPERVISED_TASK(pzem_task, "pzem_task", 4096, 6, METER_CORE, NULL)
+ */
+#define SUPERVISED_TASK(fn, taskName, stackBytes, prio, coreId, taskArg)    \
+    {                                                                       \
+        .name = (taskName),                                                 \
+        .entry = (fn),                                                      \
+        .arg = (taskArg),                                                   \
+        .stackSize = (stackBytes),                                          \
+        .priority = (prio),                                                 \
+        .core = (coreId),                                                   \
+        .stack = (StackType_t[(stackBytes)]){ 0 },                          \
+        .tcb = &(StaticTask_t){ 0 },                                        \
+    }
+
+void supervisor_start(supervisor_task_t *tasks, size_t count);
+/* Instead of vTaskDelete(NULL) in a task of the table. Does not return. */
+void supervisor_task_exit(const char *reason);
+
+#endif // SUPERVISOR_H
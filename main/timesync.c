@@ -0,0 +1,328 @@
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netdb.h>
+#include <unistd.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_timer.h"
+#include "esp_log.h"
+#include "nvs.h"
+#include "timesync.h"
+
+static const char *TIMESYNC_TAG = "TIMESYNC";
+
+#define NTP_PACKET_LEN          48
+#define NTP_UNIX_OFFSET_S       2208988800LL    // 1900 to 1970
+#define NTP_MODE_CLIENT         3
+#define NTP_MODE_SERVER         4
+
+/*
+ * UTC as a linear function of the esp_timer time, rebased at every
+ * synchronisation. An offset found at a synchronisation is slewed out at
+ * TIMESYNC_SLEW_PPB over the following slewUs, so mapped times never jump
+ * and samples stay in order.
+ */
+typedef struct {
+    int64_t baseMonoUs;
+    int64_t baseUtcUs;
+    int32_t driftPpb;
+    int32_t slewPpb;
+    int64_t slewUs;
+} clock_map_t;
+
+/* One request/reply exchange, as a point of the mapping. */
+typedef struct {
+    int64_t monoUs;         // Middle of the round trip on our clock
+    int64_t utcUs;          // Middle of the server's receive and transmit times
+    int64_t delayUs;        // Round trip minus the server's processing time
+} ntp_sample_t;
+
+static clock_map_t map;
+static timesync_state_t state;
+static portMUX_TYPE lock = portMUX_INITIALIZER_UNLOCKED;
+static bool driftKnown = false;
+static int32_t savedDriftPpb = 0;
+static int64_t pendingOffsetUs = 0;     // Offset being slewed out since the last synchronisation
+
+static int64_t mapUs(const clock_map_t *c, int64_t monoUs)
+{
+    const int64_t d = monoUs - c->baseMonoUs;
+    const int64_t slewed = d <= 0 ? 0 : d < c->slewUs ? d : c->slewUs;
+
+    return c->baseUtcUs + d + (d * c->driftPpb + slewed * c->slewPpb) / 1000000000;
+}
+
+/*
+ * Wall-clock time of an esp_timer timestamp, e.g. of a sample, in ms since
+ * 1970. Before the first synchronisation the time since boot is returned
+ * instead, which is told apart by being far below 10^12.
+ */
+int64_t timesync_epoch_ms(int64_t monoUs)
+{
+    clock_map_t c;
+    bool synced;
+
+    portENTER_CRITICAL(&lock);
+    c = map;
+    synced = state.synced;
+    portEXIT_CRITICAL(&lock);
+    return synced ? mapUs(&c, monoUs) / 1000 : monoUs / 1000;
+}
+
+bool timesync_is_synced(void)
+{
+    bool synced;
+
+    portENTER_CRITICAL(&lock);
+    synced = state.synced;
+    portEXIT_CRITICAL(&lock);
+    return synced;
+}
+
+void timesync_get_state(timesync_state_t *out)
+{
+    portENTER_CRITICAL(&lock);
+    *out = state;
+    portEXIT_CRITICAL(&lock);
+}
+
+/* The crystal drift changes little, start from the one learned before. */
+static void loadDrift(void)
+{
+    nvs_handle_t handle;
+    int32_t drift;
+    size_t len = sizeof(drift);
+
+    if (nvs_open(TIMESYNC_NVS_NAMESPACE, NVS_READONLY, &handle) != ESP_OK) {
+        return;
+    }
+    if (nvs_get_blob(handle, TIMESYNC_NVS_KEY, &drift, &len) == ESP_OK && len == sizeof(drift)
+        && drift >= -TIMESYNC_MAX_DRIFT_PPB && drift <= TIMESYNC_MAX_DRIFT_PPB) {
+        map.driftPpb = drift;
+        state.driftPpb = drift;
+        savedDriftPpb = drift;
+        driftKnown = true;
+        ESP_LOGI(TIMESYNC_TAG, "Drift %+.3f ppm loaded from NVS", drift / 1000.0);
+    }
+    nvs_close(handle);
+}
+
+static void saveDrift(int32_t drift)
+{
+    nvs_handle_t handle;
+
+    if (nvs_open(TIMESYNC_NVS_NAMESPACE, NVS_READWRITE, &handle) != ESP_OK) {
+        return;
+    }
+    if (nvs_set_blob(handle, TIMESYNC_NVS_KEY, &drift, sizeof(drift)) == ESP_OK) {
+        nvs_commit(handle);
+        savedDriftPpb = drift;
+    }
+    nvs_close(handle);
+}
+
+static void putBe64(uint8_t *p, uint64_t v)
+{
+    for (int i = 7; i >= 0; i--) {
+        p[i] = v & 0xFF;
+        v >>= 8;
+    }
+}
+
+static uint64_t getBe64(const uint8_t *p)
+{
+    uint64_t v = 0;
+
+    for (int i = 0; i < 8; i++) {
+        v = (v << 8) | p[i];
+    }
+    return v;
+}
+
+/* NTP timestamp to µs since 1970. Seconds below 2^31 are taken as era 1, from 2036 on. */
+static int64_t ntpToUnixUs(const uint8_t *p)
+{
+    const uint64_t ts = getBe64(p);
+    int64_t seconds = (int64_t)(ts >> 32);
+
+    if (seconds < 0x80000000LL) {
+        seconds += 0x100000000LL;
+    }
+    return (seconds - NTP_UNIX_OFFSET_S) * 1000000 + (int64_t)(((ts & 0xFFFFFFFFULL) * 1000000) >> 32);
+}
+
+/*
+ * One SNTP exchange. The transmit timestamp of the request carries our own
+ * send time, which a server copies into the originate field of its reply, so
+ * late replies to an earlier request are recognised and skipped.
+ */
+static bool exchange(int sock, const struct addrinfo *server, ntp_sample_t *out)
+{
+    uint8_t packet[NTP_PACKET_LEN] = { 0 };
+    uint8_t cookie[8];
+    const int64_t t1 = esp_timer_get_time();
+
+    packet[0] = (4 << 3) | NTP_MODE_CLIENT;     // Version 4
+    putBe64(cookie, (uint64_t)t1);
+    memcpy(packet + 40, cookie, sizeof(cookie));
+    if (sendto(sock, packet, sizeof(packet), 0, server->ai_addr, server->ai_addrlen) != sizeof(packet)) {
+        ESP_LOGD(TIMESYNC_TAG, "Request not sent");
+        return false;
+    }
+
+    while (esp_timer_get_time() - t1 < (int64_t)TIMESYNC_REPLY_TIMEOUT_MS * 1000) {
+        const int len = recv(sock, packet, sizeof(packet), 0);
+        const int64_t t4 = esp_timer_get_time();
+
+        if (len < 0) {
+            return false;   // Timed out
+        }
+        if (len < NTP_PACKET_LEN || (packet[0] & 0x07) != NTP_MODE_SERVER
+            || memcmp(packet + 24, cookie, sizeof(cookie)) != 0) {
+            continue;
+        }
+        if (packet[1] == 0 || (packet[0] >> 6) == 3) {
+            ESP_LOGW(TIMESYNC_TAG, "Server not synchronised");
+            return false;
+        }
+        const int64_t t2 = ntpToUnixUs(packet + 32);
+        const int64_t t3 = ntpToUnixUs(packet + 40);
+        out->monoUs = t1 + (t4 - t1) / 2;
+        out->utcUs = t2 + (t3 - t2) / 2;
+        out->delayUs = (t4 - t1) - (t3 - t2);
+        return out->delayUs >= 0;
+    }
+    return false;
+}
+
+/* A burst of exchanges; the shortest round trip has the least asymmetry in it. */
+static bool measure(ntp_sample_t *best)
+{
+    struct addrinfo hints = { .ai_family = AF_INET, .ai_socktype = SOCK_DGRAM };
+    struct addrinfo *server = NULL;
+    const struct timeval timeout = {
+        .tv_sec = TIMESYNC_REPLY_TIMEOUT_MS / 1000,
+        .tv_usec = (TIMESYNC_REPLY_TIMEOUT_MS % 1000) * 1000,
+    };
+    char port[8];
+    bool found = false;
+
+    snprintf(port, sizeof(port), "%d", TIMESYNC_PORT);
+    if (getaddrinfo(TIMESYNC_SERVER, port, &hints, &server) != 0 || server == NULL) {
+        ESP_LOGW(TIMESYNC_TAG, "Cannot resolve %s", TIMESYNC_SERVER);
+        return false;
+    }
+    const int sock = socket(server->ai_family, server->ai_socktype, server->ai_protocol);
+    if (sock < 0) {
+        freeaddrinfo(server);
+        return false;
+    }
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    for (int i = 0; i < TIMESYNC_BURST; i++) {
+        ntp_sample_t sample;
+        if (exchange(sock, server, &sample) && (!found || sample.delayUs < best->delayUs)) {
+            *best = sample;
+            found = true;
+        }
+    }
+    close(sock);
+    freeaddrinfo(server);
+    return found;
+}
+
+/*
+ * Fold a measurement into the mapping. What is left of the offset after the
+ * slew started at the last synchronisation is put down to drift, which
+ * follows it with a gain of 1/4 once known. Small offsets are then slewed out
+ * from the current mapped time, large ones stepped.
+ */
+static void update(const ntp_sample_t *s)
+{
+    clock_map_t c;
+    bool synced;
+    int64_t lastSyncUs;
+
+    portENTER_CRITICAL(&lock);
+    c = map;
+    synced = state.synced;
+    lastSyncUs = state.lastSyncUs;
+    portEXIT_CRITICAL(&lock);
+
+    const int64_t predicted = mapUs(&c, s->monoUs);
+    const int64_t offset = synced ? s->utcUs - predicted : 0;
+    const int64_t interval = s->monoUs - lastSyncUs;
+
+    if (synced && interval >= (int64_t)TIMESYNC_DRIFT_MIN_INTERVAL_S * 1000000) {
+        const int64_t slewed = (interval < c.slewUs ? interval : c.slewUs) * c.slewPpb / 1000000000;
+        const int64_t freqErrorPpb = (offset - (pendingOffsetUs - slewed)) * 1000000000 / interval;
+        int64_t drift = c.driftPpb + (driftKnown ? freqErrorPpb / 4 : freqErrorPpb);
+
+        if (drift > TIMESYNC_MAX_DRIFT_PPB) {
+            drift = TIMESYNC_MAX_DRIFT_PPB;
+        } else if (drift < -TIMESYNC_MAX_DRIFT_PPB) {
+            drift = -TIMESYNC_MAX_DRIFT_PPB;
+        }
+        c.driftPpb = (int32_t)drift;
+        driftKnown = true;
+    }
+
+    c.baseMonoUs = s->monoUs;
+    c.slewPpb = 0;
+    c.slewUs = 0;
+    pendingOffsetUs = 0;
+    const bool step = offset > TIMESYNC_STEP_US || offset < -TIMESYNC_STEP_US;
+    if (!synced || step) {
+        c.baseUtcUs = s->utcUs;
+    } else {
+        c.baseUtcUs = predicted;
+        c.slewPpb = offset >= 0 ? TIMESYNC_SLEW_PPB : -TIMESYNC_SLEW_PPB;
+        c.slewUs = (offset >= 0 ? offset : -offset) * 1000000000 / TIMESYNC_SLEW_PPB;
+        pendingOffsetUs = offset;
+    }
+
+    portENTER_CRITICAL(&lock);
+    map = c;
+    if (synced && step) {
+        state.steps++;
+    }
+    state.synced = true;
+    state.syncs++;
+    state.lastSyncUs = s->monoUs;
+    state.lastOffsetUs = offset;
+    state.lastDelayUs = s->delayUs;
+    state.driftPpb = c.driftPpb;
+    portEXIT_CRITICAL(&lock);
+
+    ESP_LOGI(TIMESYNC_TAG, "%s: offset %+lld us, delay %lld us, drift %+.3f ppm", synced ? "Synced" : "Clock set",
+             (long long)offset, (long long)s->delayUs, c.driftPpb / 1000.0);
+    if (c.driftPpb - savedDriftPpb >= TIMESYNC_SAVE_DRIFT_PPB || savedDriftPpb - c.driftPpb >= TIMESYNC_SAVE_DRIFT_PPB) {
+        saveDrift(c.driftPpb);
+    }
+}
+
+/* Keeps the mapping synced, on the network core next to lwIP. */
+void timesync_task(void *arg)
+{
+    int retryS = TIMESYNC_RETRY_S;
+
+    loadDrift();
+    while (1) {
+        ntp_sample_t sample;
+
+        if (measure(&sample)) {
+            update(&sample);
+            retryS = TIMESYNC_RETRY_S;
+            vTaskDelay((uint32_t)TIMESYNC_INTERVAL_S * 1000 / portTICK_PERIOD_MS);
+            continue;
+        }
+        portENTER_CRITICAL(&lock);
+        state.failures++;
+        portEXIT_CRITICAL(&lock);
+        ESP_LOGW(TIMESYNC_TAG, "No reply from %s:%d, retrying in %d s", TIMESYNC_SERVER, TIMESYNC_PORT, retryS);
+        vTaskDelay((uint32_t)retryS * 1000 / portTICK_PERIOD_MS);
+        retryS = retryS * 2 < TIMESYNC_INTERVAL_S ? retryS * 2 : TIMESYNC_INTERVAL_S;
+    }
+}
@@ -0,0 +1,46 @@
+#ifndef TIMESYNC_H
+#define TIMESYNC_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "sdkconfig.h"
+
+#define TIMESYNC_NVS_NAMESPACE      "timesync"
+#define TIMESYNC_NVS_KEY            "drift"
+
+#define TIMESYNC_SERVER             CONFIG_TIMESYNC_SERVER
+#define TIMESYNC_PORT               CONFIG_TIMESYNC_PORT
+/* Time between two synchronisations once the clock is synced. */
+#define TIMESYNC_INTERVAL_S         CONFIG_TIMESYNC_INTERVAL_S
+
+/* Requests per synchronisation; the one with the shortest round trip is used. */
+#define TIMESYNC_BURST              4
+#define TIMESYNC_REPLY_TIMEOUT_MS   1000
+/* First retry after a failed synchronisation, doubled up to the interval. */
+#define TIMESYNC_RETRY_S            4
+/* Offsets larger than this are stepped, smaller ones slewed like adjtime(). */
+#define TIMESYNC_STEP_US            128000
+#define TIMESYNC_SLEW_PPB           500000
+/* Crystal drift is only estimated over at least this long, and never beyond
+ * TIMESYNC_MAX_DRIFT_PPB; a change of TIMESYNC_SAVE_DRIFT_PPB is stored. */
+#define TIMESYNC_DRIFT_MIN_INTERVAL_S   10
+#define TIMESYNC_MAX_DRIFT_PPB      500000
+#define TIMESYNC_SAVE_DRIFT_PPB     1000
+
+typedef struct {
+    bool synced;
+    uint32_t syncs;             // Successful synchronisations
+    uint32_t failures;          // Synchronisations without a usable reply
+    uint32_t steps;             // Offsets too large to slew
+    int64_t lastSyncUs;         // esp_timer time of the last synchronisation
+    int64_t lastOffsetUs;       // Server minus our mapped time at the last synchronisation
+    int64_t lastDelayUs;        // Round trip of the reply used
+    int32_t driftPpb;           // How much faster the UTC clock runs than esp_timer
+} timesync_state_t;
+
+void timesync_task(void *arg);
+int64_t timesync_epoch_ms(int64_t monoUs);
+bool timesync_is_synced(void);
+void timesync_get_state(timesync_state_t *state);
+
+#endif // TIMESYNC_H
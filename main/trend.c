@@ -0,0 +1,159 @@
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_timer.h"
+#include "esp_log.h"
+#include "string.h"
+#include "trend.h"
+#include "nextion.h"
+
+static const char *TREND_TAG = "TREND";
+
+/*
+ * History ring of downsampled points, already scaled to waveform rows.
+ * Points are numbered by a free running sequence; the display holds every
+ * point up to sentSeq, so each refresh only streams [sentSeq, headSeq).
+ */
+static uint8_t powerRing[TREND_WINDOW_POINTS];
+static uint8_t voltageRing[TREND_WINDOW_POINTS];
+static uint32_t headSeq = 0;
+static uint32_t sentSeq = 0;
+static bool synced = false;
+static uint32_t retryFrames = 0;
+static trend_stats_t stats;
+static portMUX_TYPE trendLock = portMUX_INITIALIZER_UNLOCKED;
+
+// Accumulator for the point being built
+static float powerSum = 0;
+static float voltageSum = 0;
+static uint32_t accCount = 0;
+
+static uint8_t scale(float value, float min, float max)
+{
+    if (value <= min) {
+        return 0;
+    }
+    if (value >= max) {
+        return 255;
+    }
+    return (uint8_t)((value - min) * 255.0f / (max - min) + 0.5f);
+}
+
+/* Feed one meter sample, a point is pushed every TREND_DECIMATION samples. */
+void trend_add_sample(float power, float voltage)
+{
+    powerSum += power;
+    voltageSum += voltage;
+    if (++accCount < TREND_DECIMATION) {
+        return;
+    }
+
+    const uint8_t p = scale(powerSum / accCount, 0.0f, TREND_POWER_FULL_SCALE_W);
+    const uint8_t v = scale(voltageSum / accCount, TREND_VOLTAGE_MIN_V, TREND_VOLTAGE_MAX_V);
+    powerSum = 0;
+    voltageSum = 0;
+    accCount = 0;
+
+    portENTER_CRITICAL(&trendLock);
+    powerRing[headSeq % TREND_WINDOW_POINTS] = p;
+    voltageRing[headSeq % TREND_WINDOW_POINTS] = v;
+    headSeq++;
+    portEXIT_CRITICAL(&trendLock);
+}
+
+/* The waveform lost its content (page reload), resend the whole window. */
+void trend_invalidate(void)
+{
+    synced = false;
+}
+
+void trend_get_stats(trend_stats_t *out)
+{
+    portENTER_CRITICAL(&trendLock);
+    *out = stats;
+    portEXIT_CRITICAL(&trendLock);
+}
+
+/*
+ * Copy count points starting at seq out of ring. The ring is small, copying
+ * lets the transfer run without holding the lock.
+ */
+static void copyPoints(const uint8_t *ring, uint32_t seq, uint8_t *out, uint32_t count)
+{
+    for (uint32_t i = 0; i < count; i++) {
+        out[i] = ring[(seq + i) % TREND_WINDOW_POINTS];
+    }
+}
+
+/*
+ * Stream pending points to the waveform, called from the HMI refresh task.
+ * Both channels are sent with one addt transfer each. A frame never exceeds
+ * TREND_FRAME_BUDGET_BYTES; what does not fit is sent on the next refresh.
+ */
+void trend_refresh(void)
+{
+    static uint8_t powerPts[TREND_WINDOW_POINTS];
+    static uint8_t voltagePts[TREND_WINDOW_POINTS];
+
+    if (retryFrames > 0) {
+        retryFrames--;
+        return;
+    }
+
+    // A resync also pays for the two "cle" commands
+    const uint32_t overhead = synced ? 2 * TREND_ADDT_OVERHEAD_BYTES : 4 * TREND_ADDT_OVERHEAD_BYTES;
+    const uint32_t perChannel = (TREND_FRAME_BUDGET_BYTES - overhead) / 2;
+
+    portENTER_CRITICAL(&trendLock);
+    const uint32_t head = headSeq;
+    const uint32_t oldest = head > TREND_WINDOW_POINTS ? head - TREND_WINDOW_POINTS : 0;
+    if (!synced || sentSeq < oldest) {
+        if (synced) {
+            stats.dropped += oldest - sentSeq;
+        }
+        sentSeq = oldest;
+    }
+    uint32_t count = head - sentSeq;
+    if (count > perChannel) {
+        count = perChannel;
+    }
+    copyPoints(powerRing, sentSeq, powerPts, count);
+    copyPoints(voltageRing, sentSeq, voltagePts, count);
+    portEXIT_CRITICAL(&trendLock);
+
+    if (count == 0 && synced) {
+        return;
+    }
+
+    const int64_t start = esp_timer_get_time();
+    int bytes = 0;
+    if (!synced) {
+        nextion_clear_channel(TREND_WAVEFORM_ID, TREND_CH_POWER);
+        nextion_clear_channel(TREND_WAVEFORM_ID, TREND_CH_VOLTAGE);
+        bytes += 2 * TREND_ADDT_OVERHEAD_BYTES;
+    }
+    const int p = nextion_add_points(TREND_WAVEFORM_ID, TREND_CH_POWER, powerPts, count);
+    const int v = p < 0 ? -1 : nextion_add_points(TREND_WAVEFORM_ID, TREND_CH_VOLTAGE, voltagePts, count);
+    if (p < 0 || v < 0) {
+        // Most likely the Trend page is not shown, try again later from scratch
+        synced = false;
+        retryFrames = TREND_RETRY_FRAMES;
+        return;
+    }
+    bytes += p + v;
+    synced = true;
+    sentSeq += count;
+
+    const int64_t timeUs = esp_timer_get_time() - start;
+    portENTER_CRITICAL(&trendLock);
+    stats.frames++;
+    stats.lastBytes = bytes;
+    stats.lastTimeUs = timeUs;
+    if (stats.lastBytes > stats.maxBytes) {
+        stats.maxBytes = stats.lastBytes;
+    }
+    if (stats.lastTimeUs > stats.maxTimeUs) {
+        stats.maxTimeUs = stats.lastTimeUs;
+    }
+    portEXIT_CRITICAL(&trendLock);
+    ESP_LOGD(TREND_TAG, "%u points, %u bytes in %lld us", (unsigned)count, (unsigned)bytes, (long long)timeUs);
+}
@@ -0,0 +1,43 @@
+#ifndef TREND_H
+#define TREND_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "sdkconfig.h"
+
+/* Waveform component on the Trend page and its channels. */
+#define TREND_WAVEFORM_ID           CONFIG_TREND_WAVEFORM_ID
+#define TREND_CH_POWER              0
+#define TREND_CH_VOLTAGE            1
+
+/* History kept in RAM, one point per waveform pixel column. */
+#define TREND_WINDOW_POINTS         CONFIG_TREND_WINDOW_POINTS
+/* Number of meter samples averaged into one point. */
+#define TREND_DECIMATION            CONFIG_TREND_DECIMATION
+/* UART bytes one refresh may spend on the waveform, both channels included. */
+#define TREND_FRAME_BUDGET_BYTES    CONFIG_TREND_FRAME_BUDGET_BYTES
+/* Approximate size of an addt command, used to plan a frame. */
+#define TREND_ADDT_OVERHEAD_BYTES   16
+/* Frames to wait before retrying after the display refused a transfer. */
+#define TREND_RETRY_FRAMES          10
+
+/* Full scale of the waveform (0..255 pixel rows). */
+#define TREND_POWER_FULL_SCALE_W    CONFIG_TREND_POWER_FULL_SCALE_W
+#define TREND_VOLTAGE_MIN_V         180.0f
+#define TREND_VOLTAGE_MAX_V         260.0f
+
+typedef struct {
+    uint32_t frames;        // Frames that sent something
+    uint32_t lastBytes;     // UART bytes of the last frame
+    uint32_t maxBytes;      // Largest frame seen
+    int64_t lastTimeUs;     // Time spent in the last frame, handshakes included
+    int64_t maxTimeUs;      // Slowest frame seen
+    uint32_t dropped;       // Points that fell out of the ring before being sent
+} trend_stats_t;
+
+void trend_add_sample(float power, float voltage);
+void trend_refresh(void);
+void trend_invalidate(void);
+void trend_get_stats(trend_stats_t *stats);
+
+#endif // TREND_H
@@ -0,0 +1,105 @@
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "uplink.h"
+
+static const char *UPLINK_TAG = "UPLINK";
+
+static StaticQueue_t queueBuffer;
+static uint8_t queueStorage[UPLINK_QUEUE_LEN * sizeof(uplink_message_t)];
+static QueueHandle_t queue = NULL;
+static StaticQueue_t eventQueueBuffer;
+static uint8_t eventQueueStorage[UPLINK_EVENT_QUEUE_LEN * sizeof(uplink_message_t)];
+static QueueHandle_t eventQueue = NULL;
+// Counts the messages in both queues, what the MQTT task blocks on
+static StaticSemaphore_t pendingBuffer;
+static SemaphoreHandle_t pending = NULL;
+static StaticSemaphore_t sendLockBuffer;
+static SemaphoreHandle_t sendLock = NULL;
+// Staging buffers for uplink_send, guarded by sendLock and kept off the producers' stacks
+static uplink_message_t staged;
+static uplink_message_t discarded;
+static uplink_stats_t stats;
+
+/* Create the outbound queue, before any producer or the MQTT task starts. */
+void uplink_init(void)
+{
+    queue = xQueueCreateStatic(UPLINK_QUEUE_LEN, sizeof(uplink_message_t), queueStorage, &queueBuffer);
+    eventQueue = xQueueCreateStatic(UPLINK_EVENT_QUEUE_LEN, sizeof(uplink_message_t), eventQueueStorage,
+                                    &eventQueueBuffer);
+    pending = xSemaphoreCreateCountingStatic(UPLINK_QUEUE_LEN + UPLINK_EVENT_QUEUE_LEN, 0, &pendingBuffer);
+    sendLock = xSemaphoreCreateMutexStatic(&sendLockBuffer);
+}
+
+/*
+ * Queue a payload for the MQTT task. Never waits for the consumer: if the
+ * queue is full the oldest message makes room. The payload is copied, the
+ * caller can reuse its buffer right away.
+ */
+bool uplink_send(uplink_topic_t topic, const char *payload, size_t length)
+{
+    QueueHandle_t target = topic == UPLINK_TELEMETRY ? queue : eventQueue;
+
+    if (target == NULL) {
+        return false;
+    }
+    if (length > UPLINK_PAYLOAD_MAX) {
+        ESP_LOGW(UPLINK_TAG, "Payload of %u bytes truncated", (unsigned)length);
+    }
+
+    xSemaphoreTake(sendLock, portMAX_DELAY);
+    if (length > UPLINK_PAYLOAD_MAX) {
+        length = UPLINK_PAYLOAD_MAX;
+        stats.truncated++;
+    }
+    staged.topic = topic;
+    staged.length = length;
+    staged.queuedUs = esp_timer_get_time();
+    memcpy(staged.payload, payload, length);
+    if (xQueueSend(target, &staged, 0) == pdTRUE) {
+        xSemaphoreGive(pending);
+    } else {
+        // Replacing the oldest message leaves the pending count as it is
+        xQueueReceive(target, &discarded, 0);
+        xQueueSend(target, &staged, 0);
+        stats.dropped++;
+    }
+    stats.queued++;
+    xSemaphoreGive(sendLock);
+    return true;
+}
+
+/* Take the oldest event or shadow message, or the oldest telemetry message
+ * if there is none, for the MQTT task. Returns as soon as either queue has something. */
+bool uplink_receive(uplink_message_t *message, TickType_t ticksToWait)
+{
+    if (pending == NULL || xSemaphoreTake(pending, ticksToWait) != pdTRUE) {
+        return false;
+    }
+    if (xQueueReceive(eventQueue, message, 0) == pdTRUE) {
+        return true;
+    }
+    if (xQueueReceive(queue, message, 0) != pdTRUE) {
+        return false;
+    }
+    // How long telemetry waits shows what else keeps the MQTT task busy
+    const int64_t waitUs = esp_timer_get_time() - message->queuedUs;
+    xSemaphoreTake(sendLock, portMAX_DELAY);
+    stats.telemetryTaken++;
+    stats.telemetryWaitUs += waitUs;
+    if (waitUs > stats.maxTelemetryWaitUs) {
+        stats.maxTelemetryWaitUs = waitUs;
+    }
+    xSemaphoreGive(sendLock);
+    return true;
+}
+
+void uplink_get_stats(uplink_stats_t *out)
+{
+    xSemaphoreTake(sendLock, portMAX_DELAY);
+    *out = stats;
+    xSemaphoreGive(sendLock);
+}
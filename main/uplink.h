@@ -0,0 +1,46 @@
+#ifndef UPLINK_H
+#define UPLINK_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "freertos/FreeRTOS.h"
+
+/* Messages waiting for the MQTT task. When the broker is unreachable the
+ * oldest message is dropped to make room for the newest. Events and device
+ * shadow messages have their own queue and are handed out before telemetry. */
+#define UPLINK_QUEUE_LEN        8
+#define UPLINK_EVENT_QUEUE_LEN  4
+#define UPLINK_PAYLOAD_MAX      640
+
+/* Which topic a message goes to, aws.c maps these to topic names. */
+typedef enum {
+    UPLINK_TELEMETRY,
+    UPLINK_EVENT,
+    UPLINK_SHADOW_UPDATE,
+    UPLINK_SHADOW_GET,
+    UPLINK_TOPICS
+} uplink_topic_t;
+
+typedef struct {
+    uplink_topic_t topic;
+    uint16_t length;
+    int64_t queuedUs;       // esp_timer time uplink_send() was called
+    char payload[UPLINK_PAYLOAD_MAX];
+} uplink_message_t;
+
+typedef struct {
+    uint32_t queued;        // Messages accepted
+    uint32_t dropped;       // Oldest messages discarded because the queue was full
+    uint32_t truncated;     // Payloads that did not fit UPLINK_PAYLOAD_MAX
+    uint32_t telemetryTaken;        // Telemetry messages handed to the MQTT task
+    int64_t telemetryWaitUs;        // Their total time in the queue
+    int64_t maxTelemetryWaitUs;
+} uplink_stats_t;
+
+void uplink_init(void);
+bool uplink_send(uplink_topic_t topic, const char *payload, size_t length);
+bool uplink_receive(uplink_message_t *message, TickType_t ticksToWait);
+void uplink_get_stats(uplink_stats_t *stats);
+
+#endif // UPLINK_H